@@ -0,0 +1,44 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#ifndef __NK_AHCI
+#define __NK_AHCI
+
+
+/*
+  AHCI (SATA) host controllers, found as PCI class 01h/06h/01h.
+
+  Each SATA disk that is present at boot becomes a block device
+  named ahci<controller>-<port>.   Transfers are DMA via the
+  command table's PRD list, completion is interrupt driven
+  (MSI-X, MSI, or the legacy line, in that order of preference),
+  and requests are asynchronous - the callback is invoked from
+  the interrupt handler.   On disks that support it, up to 32
+  commands are kept in flight using native command queuing.
+
+  Buffers must be word aligned.  ATAPI devices and port multipliers
+  are not supported.
+*/
+
+int  nk_ahci_init(struct naut_info *naut);
+void nk_ahci_deinit();
+
+
+#endif
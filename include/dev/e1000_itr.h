@@ -0,0 +1,276 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#ifndef __E1000_ITR
+#define __E1000_ITR
+
+#include <nautilus/scheduler.h>    // nk_sched_get_realtime
+
+/*
+  Interrupt moderation policy shared by the e1000 and e1000e drivers.
+
+  The driver feeds in the packets and bytes it reaped on each
+  interrupt.  From those, each direction is put in one of three
+  latency classes, and the device is programmed for the more
+  latency-sensitive of the two:
+
+    lowest latency  - light or interactive traffic, 70000 ints/s,
+                      receive timers off
+    low latency     - moderate traffic, 20000 ints/s,
+                      receive timers off
+    bulk            - heavy traffic or large frames, 4000 ints/s,
+                      and the receive timers (RDTR/RADV) hold off the
+                      interrupt until a burst ends
+
+  Since packets-per-interrupt at a known interrupt rate is a packet
+  rate, this is effectively driven by measured packet rate and size.
+  Moving to a slower interrupt rate is smoothed so that a single
+  big interrupt does not throw a latency-bound flow into bulk mode.
+
+  The mode can instead be pinned to a fixed rate, or moderation
+  turned off entirely (an interrupt per packet, the old behavior).
+*/
+
+// register units
+#define E1000_ITR_UNIT_NS      256    // ITR interval
+#define E1000_RDT_UNIT_NS      1024   // RDTR / RADV
+
+#define E1000_ITR_REG_OFFSET   0x000C4
+#define E1000_RADV_REG_OFFSET  0x0282C
+
+#define E1000_ITR_LOWEST_LATENCY_RATE 70000
+#define E1000_ITR_LOW_LATENCY_RATE    20000
+#define E1000_ITR_BULK_RATE           4000
+
+// bulk mode receive timers, in 1.024 us units
+#define E1000_ITR_BULK_RDTR    16
+#define E1000_ITR_BULK_RADV    64
+
+typedef enum { E1000_ITR_ADAPTIVE=0, E1000_ITR_FIXED, E1000_ITR_OFF } e1000_itr_mode_t;
+typedef enum { E1000_ITR_LOWEST_LATENCY=0, E1000_ITR_LOW_LATENCY, E1000_ITR_BULK } e1000_itr_class_t;
+
+struct e1000_itr {
+    e1000_itr_mode_t  mode;
+    uint32_t          fixed_rate;   // ints/s in fixed mode
+
+    e1000_itr_class_t tx_class;
+    e1000_itr_class_t rx_class;
+    e1000_itr_class_t cur_class;
+    uint32_t          rate;         // ints/s currently programmed, 0 = unthrottled
+
+    // reaped during the current interrupt
+    uint32_t          tx_pkts, tx_bytes;
+    uint32_t          rx_pkts, rx_bytes;
+
+    // statistics
+    uint64_t          interrupts;
+    uint64_t          tx_packets, tx_octets;
+    uint64_t          rx_packets, rx_octets;
+    uint64_t          class_changes;
+    uint64_t          class_ints[3];
+
+    // rates over the last completed one second window
+    uint64_t          win_start_ns;
+    uint64_t          win_ints, win_pkts;
+    uint64_t          ints_per_sec, pkts_per_sec;
+};
+
+static inline uint32_t e1000_itr_class_rate(e1000_itr_class_t c)
+{
+    return c==E1000_ITR_LOWEST_LATENCY ? E1000_ITR_LOWEST_LATENCY_RATE :
+	c==E1000_ITR_LOW_LATENCY ? E1000_ITR_LOW_LATENCY_RATE : E1000_ITR_BULK_RATE;
+}
+
+static inline const char *e1000_itr_class_name(e1000_itr_class_t c)
+{
+    return c==E1000_ITR_LOWEST_LATENCY ? "lowest-latency" :
+	c==E1000_ITR_LOW_LATENCY ? "low-latency" : "bulk";
+}
+
+// ITR register value for a rate in ints/s
+static inline uint32_t e1000_itr_reg(uint32_t rate)
+{
+    return rate ? 1000000000UL/(rate*E1000_ITR_UNIT_NS) : 0;
+}
+
+static inline void e1000_itr_init(struct e1000_itr *itr)
+{
+    memset(itr,0,sizeof(*itr));
+    itr->mode = E1000_ITR_ADAPTIVE;
+    itr->tx_class = itr->rx_class = itr->cur_class = E1000_ITR_LOW_LATENCY;
+    itr->rate = E1000_ITR_LOW_LATENCY_RATE;
+    itr->win_start_ns = nk_sched_get_realtime();
+}
+
+static inline void e1000_itr_tx(struct e1000_itr *itr, uint32_t bytes)
+{
+    itr->tx_pkts++;
+    itr->tx_bytes += bytes;
+}
+
+static inline void e1000_itr_rx(struct e1000_itr *itr, uint32_t bytes)
+{
+    itr->rx_pkts++;
+    itr->rx_bytes += bytes;
+}
+
+static inline e1000_itr_class_t e1000_itr_classify(e1000_itr_class_t c, uint32_t pkts, uint32_t bytes)
+{
+    if (!pkts) {
+	return c;
+    }
+
+    uint32_t avg = bytes/pkts;
+
+    switch (c) {
+    case E1000_ITR_LOWEST_LATENCY:
+	if (avg > 8000) {
+	    return E1000_ITR_BULK;           // jumbo frames
+	} else if (pkts < 5 && bytes > 512) {
+	    return E1000_ITR_LOW_LATENCY;
+	}
+	break;
+    case E1000_ITR_LOW_LATENCY:
+	if (bytes > 10000) {
+	    if (avg > 8000 || pkts < 10 || avg > 1200) {
+		return E1000_ITR_BULK;
+	    } else if (pkts > 35) {
+		return E1000_ITR_LOWEST_LATENCY;
+	    }
+	} else if (avg > 2000) {
+	    return E1000_ITR_BULK;
+	} else if (pkts <= 2 && bytes < 512) {
+	    return E1000_ITR_LOWEST_LATENCY;
+	}
+	break;
+    case E1000_ITR_BULK:
+	if (bytes > 25000) {
+	    if (pkts > 35) {
+		return E1000_ITR_LOW_LATENCY;
+	    }
+	} else if (bytes < 6000) {
+	    return E1000_ITR_LOWEST_LATENCY;
+	}
+	break;
+    }
+    return c;
+}
+
+// call at the end of each interrupt, after reaping
+// returns nonzero if the device needs to be reprogrammed
+static inline int e1000_itr_update(struct e1000_itr *itr)
+{
+    uint64_t now = nk_sched_get_realtime();
+    int changed = 0;
+
+    itr->interrupts++;
+    itr->tx_packets += itr->tx_pkts;
+    itr->tx_octets += itr->tx_bytes;
+    itr->rx_packets += itr->rx_pkts;
+    itr->rx_octets += itr->rx_bytes;
+
+    itr->win_ints++;
+    itr->win_pkts += itr->tx_pkts + itr->rx_pkts;
+    if (now - itr->win_start_ns >= 1000000000UL) {
+	uint64_t dt = now - itr->win_start_ns;
+	itr->ints_per_sec = itr->win_ints*1000000000UL/dt;
+	itr->pkts_per_sec = itr->win_pkts*1000000000UL/dt;
+	itr->win_ints = itr->win_pkts = 0;
+	itr->win_start_ns = now;
+    }
+
+    if (itr->mode==E1000_ITR_ADAPTIVE) {
+	itr->tx_class = e1000_itr_classify(itr->tx_class,itr->tx_pkts,itr->tx_bytes);
+	itr->rx_class = e1000_itr_classify(itr->rx_class,itr->rx_pkts,itr->rx_bytes);
+
+	e1000_itr_class_t c = itr->tx_class < itr->rx_class ? itr->tx_class : itr->rx_class;
+	uint32_t target = e1000_itr_class_rate(c);
+
+	if (c!=itr->cur_class) {
+	    itr->cur_class = c;
+	    itr->class_changes++;
+	}
+
+	if (target!=itr->rate) {
+	    // speed up at once, slow down gradually
+	    if (target < itr->rate) {
+		uint32_t step = (itr->rate - target)/4;
+		target = itr->rate - (step ? step : itr->rate - target);
+	    }
+	    itr->rate = target;
+	    changed = 1;
+	}
+	itr->class_ints[itr->cur_class]++;
+    }
+
+    itr->tx_pkts = itr->tx_bytes = 0;
+    itr->rx_pkts = itr->rx_bytes = 0;
+
+    return changed;
+}
+
+// receive timers go with the class, not the rate, so that
+// they engage only when we have committed to bulk mode
+static inline uint32_t e1000_itr_rdtr(struct e1000_itr *itr)
+{
+    return itr->mode==E1000_ITR_ADAPTIVE && itr->cur_class==E1000_ITR_BULK ? E1000_ITR_BULK_RDTR : 0;
+}
+
+static inline uint32_t e1000_itr_radv(struct e1000_itr *itr)
+{
+    return itr->mode==E1000_ITR_ADAPTIVE && itr->cur_class==E1000_ITR_BULK ? E1000_ITR_BULK_RADV : 0;
+}
+
+// returns -1 if the argument makes no sense
+static inline int e1000_itr_set_mode(struct e1000_itr *itr, char *arg)
+{
+    uint32_t rate;
+
+    if (!strcmp(arg,"adaptive")) {
+	itr->mode = E1000_ITR_ADAPTIVE;
+	itr->rate = e1000_itr_class_rate(itr->cur_class);
+    } else if (!strcmp(arg,"off")) {
+	itr->mode = E1000_ITR_OFF;
+	itr->rate = 0;
+    } else if (sscanf(arg,"%u",&rate)==1 && rate>=100 && rate<=1000000) {
+	itr->mode = E1000_ITR_FIXED;
+	itr->fixed_rate = rate;
+	itr->rate = rate;
+    } else {
+	return -1;
+    }
+    return 0;
+}
+
+static inline void e1000_itr_dump(struct e1000_itr *itr, char *name)
+{
+    nk_vc_printf("%s: %s, %s, %u ints/s programmed\n", name,
+		 itr->mode==E1000_ITR_ADAPTIVE ? "adaptive" :
+		 itr->mode==E1000_ITR_FIXED ? "fixed" : "off",
+		 e1000_itr_class_name(itr->cur_class), itr->rate);
+    nk_vc_printf("   %lu interrupts, %lu ints/s, %lu pkts/s over the last second\n",
+		 itr->interrupts, itr->ints_per_sec, itr->pkts_per_sec);
+    nk_vc_printf("   tx %lu packets %lu bytes, rx %lu packets %lu bytes\n",
+		 itr->tx_packets, itr->tx_octets, itr->rx_packets, itr->rx_octets);
+    nk_vc_printf("   %lu class changes, interrupts in lowest/low/bulk = %lu/%lu/%lu\n",
+		 itr->class_changes, itr->class_ints[0], itr->class_ints[1], itr->class_ints[2]);
+}
+
+#endif
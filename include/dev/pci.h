@@ -25,6 +25,7 @@
 #define __PCI_H__
 
 #include <nautilus/list.h>
+#include <nautilus/idt.h>
 
 #define PCI_CFG_ADDR_PORT 0xcf8
 #define PCI_CFG_DATA_PORT 0xcfc
@@ -374,9 +375,25 @@ int pci_dev_is_pending_msi_x(struct pci_dev *dev, int num);
 
 void pci_dev_dump_msi_x(struct pci_dev *dev);
 
+// MSI-X vector allocation
+//
+// cpu is a logical cpu here (-1 => the calling cpu), not an APIC id
+//
+// alloc finds and reserves a free IDT vector, registers the handler
+// on it, points table entry num at it, and unmasks the entry.  The
+// vector is returned in *vec if vec is not NULL.  Nothing is
+// delivered until MSI-X is enabled and the function is unmasked.
+int pci_dev_msi_x_alloc_vector(struct pci_dev *dev, int num, int cpu,
+			       int (*handler)(excp_entry_t *, excp_vec_t, void *),
+			       void *priv, int *vec);
+// steer entry num's interrupts to another cpu
+int pci_dev_msi_x_set_affinity(struct pci_dev *dev, int num, int cpu);
+// mask entry num and release its IDT vector
+int pci_dev_msi_x_free_vector(struct pci_dev *dev, int num);
+
 /*
-  There is currently no specific support for registering MSI-X interrupt handlers,
-  You want to follow roughly these steps:
+  pci_dev_msi_x_alloc_vector (above) does the per-entry steps of this
+  for you.  By hand, you want to follow roughly these steps:
 
   struct pci_dev *d = ... find the device... - it must have MSI-X...
 
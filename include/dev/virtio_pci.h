@@ -31,7 +31,7 @@
 #include <dev/virtqueue.h>
 #include <nautilus/nautilus.h>
 
-#define MAX_VIRTQS 4
+#define MAX_VIRTQS 16   // enough for a multiqueue device on a modest machine
 #define VIRTIO_MSI_NO_VECTOR 0xffff
 
 enum virtio_pci_dev_model {
@@ -88,6 +88,11 @@ struct virtio_pci_virtq {
     uint16_t nfree;
     uint16_t head;
     spinlock_t lock;
+
+    // MSI-X delivery of this virtq's used buffer notifications
+    uint16_t msix_entry;  // table entry, VIRTIO_MSI_NO_VECTOR if none
+    int      msix_vec;    // IDT vector, 0 until virtio_pci_msi_x_setup
+    int      msix_cpu;    // cpu that vector is delivered to
 };
 
 // Generic info for a PCI_device
@@ -154,6 +159,9 @@ struct virtio_pci_dev {
     //
     
     // Virtqs, common across legacy and modern, if there is a god
+    // a driver may set virtqs_wanted before virtqueue init to
+    // set up only the first that many (0 => all of them)
+    uint8_t virtqs_wanted;
     uint8_t num_virtqs;
     struct virtio_pci_virtq virtq[MAX_VIRTQS];
 
@@ -183,6 +191,23 @@ int virtio_pci_desc_chain_free(struct virtio_pci_dev *dev, uint16_t qidx, uint16
 // notify a device's virtqueue
 int virtio_pci_virtqueue_notify(struct virtio_pci_dev *dev, uint16_t qidx);
 
+// MSI-X delivery (itype==VIRTIO_PCI_MSI_X_INTERRUPT)
+//
+// Virtqueue init maps virtq i to MSI-X table entry i, or to the
+// last entry if the device has fewer entries than virtqs.  Setup
+// then gives each entry its own vector with the handler on it,
+// delivered to cpus[i] for virtq i (cpus==NULL or cpus[i]<0 => cpu 0),
+// and unmasks the function.  A handler can tell which virtqs it is
+// being called for by comparing its vector to their msix_vec.
+// Configuration change interrupts are not used.
+int virtio_pci_msi_x_setup(struct virtio_pci_dev *dev,
+			   int (*handler)(excp_entry_t *, excp_vec_t, void *),
+			   void *priv, const int *cpus);
+// steer a virtq's completions to another cpu
+// (virtqs that share an entry move together)
+int virtio_pci_msi_x_set_affinity(struct virtio_pci_dev *dev, uint16_t qidx, int cpu);
+int virtio_pci_msi_x_teardown(struct virtio_pci_dev *dev);
+
 /******************************************************************
       LEGACY/TRANSITIONAL INTERFACE TO DEVICE REGISTERS
  *****************************************************************/
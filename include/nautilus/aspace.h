@@ -25,6 +25,7 @@
 #define __NK_ASPACE
 
 #include <nautilus/idt.h>
+#include <nautilus/rcu.h>
 
 typedef struct nk_aspace_characteristics {
     uint64_t   granularity;     // smallest unit of control (bytes)
@@ -125,6 +126,8 @@ typedef struct nk_aspace {
     nk_aspace_interface_t    *interface;
     
     struct list_head          aspace_list_node;         // for system-wide address space list
+
+    struct nk_rcu_head        rcu;
     
 } nk_aspace_t;
 
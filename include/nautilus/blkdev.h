@@ -48,6 +48,9 @@ struct nk_block_dev_int {
     int (*get_characteristics)(void *state, struct nk_block_dev_characteristics *c);
     int (*read_blocks)(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest, void (*callback)(nk_block_dev_status_t status, void *context), void *context);
     int (*write_blocks)(void *state, uint64_t blocknum, uint64_t count, uint8_t *src, void (*callback)(nk_block_dev_status_t status, void *context), void *context);
+    // direct access - a pointer to the blocks themselves, for devices
+    // that are memory (e.g., ramdisks), or zero if out of range
+    void *(*get_block_ptr)(void *state, uint64_t blocknum, uint64_t count);
 };
 
 
@@ -83,6 +86,12 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 		       void (*callback)(nk_block_dev_status_t status, void *state), 
 		       void *state);
 
+// returns a pointer through which blocks [blocknum,blocknum+count)
+// can be read (and written) in place, or NULL if the device does
+// not support direct access.  Callers must fall back to
+// nk_block_dev_read/write in that case.
+void *nk_block_dev_get_block_ptr(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count);
+
 
 
 #endif
@@ -25,6 +25,7 @@
 #define __DEV
 
 #include <nautilus/list.h>
+#include <nautilus/rcu.h>
 
 
 #define DEV_NAME_LEN 32
@@ -63,6 +64,8 @@ struct nk_dev {
     struct nk_dev_int *interface;
     
     nk_wait_queue_t *waiting_threads;
+
+    struct nk_rcu_head rcu;
 };
 
 // Not all request types apply to all device types
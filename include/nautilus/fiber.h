@@ -51,6 +51,8 @@ typedef struct nk_thread nk_thread_t;
 #define FSTACK_DEFAULT 0 // will be 4K
 #define FSTACK_4KB 0x001000
 #define FSTACK_16KB 0x004000
+#define FSTACK_64KB 0x010000
+#define FSTACK_256KB 0x040000
 #define FSTACK_1MB 0x100000
 #define FSTACK_2MB 0x200000
 
@@ -79,8 +81,11 @@ typedef struct nk_fiber {
   uint64_t rsp;                /* +0  SHOULD NOT CHANGE POSITION */
   void *stack;                 /* +8  SHOULD NOT CHANGE POSITION */
   uint64_t fpu_state_offset;   /* +16 SHOULD NOT CHANGE POSITION */
+  volatile uint64_t switching; /* +24 SHOULD NOT CHANGE POSITION */
+                               /* nonzero while a CPU is still switching off this fiber's stack */
   
   nk_stack_size_t stack_size;
+  int stack_class; // stack pool size class, -1 => allocated on its own
     
   spinlock_t lock; /* allows us to lock the fiber */
   nk_fiber_status f_status;
@@ -99,7 +104,7 @@ typedef struct nk_fiber {
   struct list_head child_node;
   int num_children;
   
-  struct list_head sched_node; // sched queue node
+  uint32_t refs; // held by the fiber while alive and by each run queue entry for it
   int curr_cpu;  // current cpu the fiber is on
 
   nk_fiber_fun_t fun; // routine the fiber will execute
@@ -27,6 +27,106 @@
 extern "C" {
 #endif
 
+/*
+ * How thread and fiber switches save the FP/SIMD state.  fpu_init
+ * picks one at boot from what CPUID reports and what XCR0 enables.
+ */
+#define NK_FPU_SAVE_FXSAVE   0   // x87/SSE only
+#define NK_FPU_SAVE_XSAVE    1   // standard form, everything in XCR0
+#define NK_FPU_SAVE_XSAVEOPT 2   // standard form, skips unmodified components
+#define NK_FPU_SAVE_XSAVEC   3   // compacted form, skips init components
+
+#define NK_FPU_XSAVE_HDR  512    // offset of the XSAVE header
+#define NK_FPU_MXCSR      24     // offset of MXCSR in the legacy region
+
+#ifdef __ASSEMBLER__
+
+/*
+ * Save the FP state to the 64 byte aligned area at \area, or restore
+ * it from there.  \mode is nk_fpu_save_mode or nk_fpu_save_mode_noopt.
+ * Both clobber rax, rcx, and rdx.
+ *
+ * If the CPU reports through XINUSE that every component is still in
+ * its initial configuration, which is the case for threads that never
+ * touched a vector register, the save writes only the header XSAVE
+ * would have written, and the restore of such an image into a CPU that
+ * is also in the initial configuration reloads only MXCSR.
+ */
+.macro FPU_SAVE area, mode
+    movq \mode, %rcx
+    testq %rcx, %rcx
+    jnz 1f
+    fxsave (\area)
+    jmp 9f
+1:
+    cmpq $0, nk_fpu_xinuse
+    je 3f
+    movl $1, %ecx
+    xgetbv                       // edx:eax = XINUSE & XCR0
+    orl %edx, %eax
+    jnz 2f
+    stmxcsr NK_FPU_MXCSR(\area)
+    movq %rax, NK_FPU_XSAVE_HDR(\area)      // XSTATE_BV = 0
+    movq %rax, NK_FPU_XSAVE_HDR+8(\area)
+    movq %rax, NK_FPU_XSAVE_HDR+16(\area)
+    movq %rax, NK_FPU_XSAVE_HDR+24(\area)
+    movq %rax, NK_FPU_XSAVE_HDR+32(\area)
+    movq %rax, NK_FPU_XSAVE_HDR+40(\area)
+    movq %rax, NK_FPU_XSAVE_HDR+48(\area)
+    movq %rax, NK_FPU_XSAVE_HDR+56(\area)
+    cmpq $NK_FPU_SAVE_XSAVEC, \mode
+    jne 9f
+    movq nk_fpu_xcomp_bv, %rax
+    movq %rax, NK_FPU_XSAVE_HDR+8(\area)    // XCOMP_BV
+    jmp 9f
+2:
+    movq \mode, %rcx
+3:
+    movq $-1, %rax
+    movq $-1, %rdx
+    cmpq $NK_FPU_SAVE_XSAVEC, %rcx
+    je 5f
+    cmpq $NK_FPU_SAVE_XSAVEOPT, %rcx
+    je 4f
+    movq $0, NK_FPU_XSAVE_HDR+8(\area)      // XSAVE leaves XCOMP_BV alone
+    movq $0, NK_FPU_XSAVE_HDR+16(\area)
+    xsave64 (\area)
+    jmp 9f
+4:
+    xsaveopt64 (\area)
+    jmp 9f
+5:
+    xsavec64 (\area)
+9:
+.endm
+
+.macro FPU_RESTORE area, mode
+    cmpq $NK_FPU_SAVE_FXSAVE, \mode
+    jne 1f
+    fxrstor (\area)
+    jmp 9f
+1:
+    cmpq $0, nk_fpu_xinuse
+    je 2f
+    cmpq $0, NK_FPU_XSAVE_HDR(\area)
+    jne 2f
+    movl $1, %ecx
+    xgetbv
+    orl %edx, %eax
+    jnz 2f
+    ldmxcsr NK_FPU_MXCSR(\area)
+    jmp 9f
+2:
+    movq $-1, %rax
+    movq $-1, %rdx
+    xrstor64 (\area)
+9:
+.endm
+
+#else
+
+#include <nautilus/naut_types.h>
+
 #define FPU_BSP_INIT 0
 #define FPU_AP_INIT  1
 
@@ -50,6 +150,15 @@ struct naut_info;
 
 void fpu_init(struct naut_info *, int is_ap);
 
+// read by the FPU_SAVE/FPU_RESTORE macros
+extern uint64_t nk_fpu_save_mode;        // for thread switches
+extern uint64_t nk_fpu_save_mode_noopt;  // same, but never XSAVEOPT
+extern uint64_t nk_fpu_xinuse;           // nonzero if XGETBV(1) reports XINUSE
+extern uint64_t nk_fpu_xcomp_bv;         // XCOMP_BV of a compacted image
+extern uint64_t nk_fpu_save_size;        // bytes a save writes at most
+
+#endif /* !__ASSEMBLER__ */
+
 #ifdef __cplusplus
 }
 #endif
@@ -30,6 +30,7 @@
 #include <nautilus/printk.h>
 #include <nautilus/list.h>
 #include <nautilus/spinlock.h>
+#include <nautilus/rcu.h>
 
 #include <fs/ext2/ext2.h>
 
@@ -56,6 +57,9 @@ struct nk_fs_int {
     ssize_t  (*read_file)(void *state, void *file, void *dest, off_t offset, size_t n);
     ssize_t  (*write_file)(void *state, void *file, void *src, off_t offset, size_t n);
     void  (*close_file)(void *state, void *file);
+    // optional - pointer to n bytes of the file at offset, in place,
+    // or zero if the filesystem or underlying device cannot do this
+    void *(*get_file_ptr)(void *state, void *file, off_t offset, size_t n);
 };
 
 // This is the class for a filesystem.  It should be the first
@@ -70,7 +74,8 @@ struct nk_fs {
 
     void             *state;  // internal FS state
     struct nk_fs_int *interface;
-    
+
+    struct nk_rcu_head rcu;
 };
 
 int nk_fs_init();
@@ -118,6 +123,15 @@ ssize_t    nk_fs_read(nk_fs_fd_t fd, void *buf, size_t len);
 ssize_t    nk_fs_write(nk_fs_fd_t fd, void *buf, size_t len);
 int        nk_fs_close(nk_fs_fd_t fd);
 
+// Direct access: returns a pointer to len bytes of the file starting
+// at the current position, without copying, or NULL if this is not
+// possible (the device is not memory, the range is not contiguous on
+// the device, etc).   The position is not changed.   The pointer
+// refers to the file's storage itself, so it must be treated as
+// read-only, and is only valid while the file is open and unmodified.
+// Callers must fall back to nk_fs_read on NULL.
+void      *nk_fs_get_ptr(nk_fs_fd_t fd, size_t len);
+
 
 void test_fs(void);
 void init_fs(void);
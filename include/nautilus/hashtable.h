@@ -172,9 +172,9 @@ int nk_htable_dec(struct nk_hashtable * htable, addr_t key, addr_t value);
  * accessor functions. */
 struct nk_hashtable_iter {
     struct nk_hashtable * htable;
-    struct nk_hash_entry * entry;
-    struct nk_hash_entry * parent;
-    uint_t index;
+    struct nk_hash_entry * entry;    // chained tables only
+    struct nk_hash_entry * parent;   // chained tables only
+    uint_t index;                    // bucket, or slot for swiss tables
 };
 
 
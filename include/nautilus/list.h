@@ -154,6 +154,54 @@ static inline void list_del_init(struct list_head *entry)
 	INIT_LIST_HEAD(entry);
 }
 
+/*
+ * RCU variants.  Writers must still exclude each other; readers
+ * traverse with list_for_each_rcu inside nk_rcu_read_lock().
+ */
+static inline void __list_add_rcu(struct list_head *nelm,
+				  struct list_head *prev,
+				  struct list_head *next)
+{
+	nelm->next = next;
+	nelm->prev = prev;
+	// the entry must be complete before readers can reach it
+	__atomic_store_n(&prev->next, nelm, __ATOMIC_RELEASE);
+	next->prev = nelm;
+}
+
+/**
+ * list_add_rcu - add a nelm entry, visible to concurrent RCU readers
+ * @nelm: new entry to be added
+ * @head: list head to add it after
+ */
+static inline void list_add_rcu(struct list_head *nelm, struct list_head *head)
+{
+	__list_add_rcu(nelm, head, head->next);
+}
+
+/**
+ * list_add_tail_rcu - add a nelm entry, visible to concurrent RCU readers
+ * @nelm: new entry to be added
+ * @head: list head to add it before
+ */
+static inline void list_add_tail_rcu(struct list_head *nelm, struct list_head *head)
+{
+	__list_add_rcu(nelm, head->prev, head);
+}
+
+/**
+ * list_del_rcu - deletes entry from list without disturbing RCU readers
+ * @entry: the element to delete from the list.
+ * Note: the entry's next pointer is left intact so a reader standing
+ * on it can continue.  It must not be freed or reused until a grace
+ * period has passed.
+ */
+static inline void list_del_rcu(struct list_head *entry)
+{
+	__list_del(entry->prev, entry->next);
+	entry->prev = (struct list_head*)LIST_POISON2;
+}
+
 /**
  * list_move - delete from one list and add as another's head
  * @list: the entry to move
@@ -323,6 +371,18 @@ static inline void list_splice_init(struct list_head *list,
 #define __list_for_each(pos, head) \
 	for (pos = (head)->next; pos != (head); pos = pos->next)
 
+/**
+ * list_for_each_rcu	-	iterate over an RCU-protected list
+ * @pos:	the &struct list_head to use as a loop counter.
+ * @head:	the head for your list.
+ *
+ * Must be used inside nk_rcu_read_lock().  Only forward traversal
+ * is safe against concurrent list_add_rcu / list_del_rcu.
+ */
+#define list_for_each_rcu(pos, head) \
+	for (pos = __atomic_load_n(&(head)->next, __ATOMIC_CONSUME); pos != (head); \
+	     pos = __atomic_load_n(&pos->next, __ATOMIC_CONSUME))
+
 /**
  * list_for_each_prev	-	iterate over a list backwards
  * @pos:	the &struct list_head to use as a loop counter.
@@ -0,0 +1,90 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __LOCKSTAT_H__
+#define __LOCKSTAT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+  Lock contention statistics
+
+  When NAUT_CONFIG_LOCKSTAT is on, every blocking acquisition of a
+  spinlock, MCS lock, or rwlock is attributed to its call site and
+  counted in per-CPU tables: acquisitions, contended acquisitions,
+  total/max cycles spent waiting, and total/max cycles held.  Try-lock
+  acquisitions are not tracked.  The "lockstat" shell command merges
+  the per-CPU tables and prints the worst sites.
+
+  Acquisition paths are written as
+
+     NK_LOCKSTAT_ACQUIRE(lock, <first attempt fails>, <spin until acquired>);
+
+  which, with lockstat off, is just "if (fail) { spin; }".
+*/
+
+#ifdef NAUT_CONFIG_LOCKSTAT
+
+#include <nautilus/naut_types.h>
+#include <nautilus/cpu.h>
+
+// address of the code that expands this; distinct for each inlined copy
+#define NK_LOCKSTAT_SITE() ({ __label__ __here; __here: (uint64_t)&&__here; })
+#define NK_LOCKSTAT_CALLER() ((uint64_t)__builtin_return_address(0))
+// keeps the compiler from sharing one out-of-line copy (and site) per file
+#define NK_LOCKSTAT_INLINE __attribute__((always_inline))
+
+void nk_lockstat_acquire(void *lock, uint64_t site, uint64_t wait_cycles, int contended);
+void nk_lockstat_release(void *lock);
+
+int  nk_lockstat_init(void);   // bsp only, once all cpus are known
+void nk_lockstat_reset(void);
+void nk_lockstat_dump(int max_sites);
+
+#define NK_LOCKSTAT_ACQUIRE_AT(l, site, fail, spin)			\
+    do {								\
+	uint64_t __ls_site = (site);					\
+	if (fail) {							\
+	    uint64_t __ls_start = rdtsc();				\
+	    spin;							\
+	    nk_lockstat_acquire((void*)(l), __ls_site, rdtsc() - __ls_start, 1); \
+	} else {							\
+	    nk_lockstat_acquire((void*)(l), __ls_site, 0, 0);		\
+	}								\
+    } while (0)
+
+#define NK_LOCKSTAT_ACQUIRE(l, fail, spin) NK_LOCKSTAT_ACQUIRE_AT(l, NK_LOCKSTAT_SITE(), fail, spin)
+#define NK_LOCKSTAT_RELEASE(l) nk_lockstat_release((void*)(l))
+
+#else
+
+#define NK_LOCKSTAT_INLINE
+#define NK_LOCKSTAT_ACQUIRE_AT(l, site, fail, spin) do { if (fail) { spin; } } while (0)
+#define NK_LOCKSTAT_ACQUIRE(l, fail, spin) NK_LOCKSTAT_ACQUIRE_AT(l, 0, fail, spin)
+#define NK_LOCKSTAT_RELEASE(l)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
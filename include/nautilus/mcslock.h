@@ -26,6 +26,7 @@
 #include <nautilus/cpu.h>
 #include <nautilus/atomic.h>
 #include <nautilus/smp.h>
+#include <nautilus/lockstat.h>
 
 struct nk_mcs_lock {
     struct nk_mcs_lock * next;
@@ -38,7 +39,7 @@ typedef struct nk_mcs_lock nk_mcs_lock_t;
 //void nk_mcs_unlock(nk_mcs_lock_t * l, nk_mcs_lock_t * me);
 //int nk_mcs_trylock(nk_mcs_lock_t * l, nk_mcs_lock_t * me);
 
-static inline void 
+static inline NK_LOCKSTAT_INLINE void 
 nk_mcs_lock (nk_mcs_lock_t * l, nk_mcs_lock_t * me)
 {
     nk_mcs_lock_t * last;
@@ -46,19 +47,13 @@ nk_mcs_lock (nk_mcs_lock_t * l, nk_mcs_lock_t * me)
     me->next   = NULL;
     me->locked = 0;
 
-    last = xchg64((void**)&(l->next), me);
-
-    /* did we get it? */
-    if (likely(!last)) {
-        return;
-
-    /* someone else locked it */
-    } else {
+    /* if we did not get it, someone else locked it */
+    NK_LOCKSTAT_ACQUIRE(l, unlikely((last = xchg64((void**)&(l->next), me)) != NULL),
+			{
+			    *(volatile nk_mcs_lock_t**)(&(last->next)) = me;
 
-        *(volatile nk_mcs_lock_t**)(&(last->next)) = me;
-
-        PAUSE_WHILE(me->locked != 1);
-    }
+			    PAUSE_WHILE(me->locked != 1);
+			});
 }
 
 
@@ -67,6 +62,8 @@ nk_mcs_unlock (nk_mcs_lock_t * l, nk_mcs_lock_t * me)
 {
     nk_mcs_lock_t * next = me->next;
 
+    NK_LOCKSTAT_RELEASE(l);
+
     if (likely(!me->next)) {
 
         if (likely(atomic_cmpswap(l->next, me, NULL) == me)) {
@@ -0,0 +1,62 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __MEMOPS_H__
+#define __MEMOPS_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+  The kernels behind memcpy, memset, and memcmp.  Until
+  nk_memops_init runs, these are rep movsb/stosb and a byte loop,
+  which need nothing but the base ISA.  nk_memops_init then picks
+  SSE2 or AVX2 kernels from CPUID, which fall back to rep movsb/stosb
+  for large sizes on CPUs with ERMS and to non-temporal stores for
+  sizes that would not fit in the last level cache.
+*/
+
+struct nk_memops {
+    char   *name;
+    void *(*copy)(void *dst, const void *src, size_t n);
+    void *(*fill)(void *dst, int c, size_t n);
+    int   (*compare)(const void *s1, const void *s2, size_t n);
+    size_t  rep_threshold;   // at least this many bytes => rep movsb/stosb
+    size_t  nt_threshold;    // at least this many bytes => non-temporal stores
+};
+
+extern struct nk_memops nk_memops;
+
+int nk_memops_init(void);   // bsp, once the FPU is set up
+
+// The base ISA kernels.  Interrupt entry saves only the general purpose
+// registers, so memcpy, memset, and memcmp use these in interrupt context
+// rather than clobbering the SSE/AVX state of the thread they interrupted.
+void *nk_memops_copy_rep(void *dst, const void *src, size_t n);
+void *nk_memops_fill_rep(void *dst, int c, size_t n);
+int   nk_memops_compare_bytes(const void *s1, const void *s2, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -59,6 +59,15 @@ void  nk_msg_queue_pull(struct nk_msg_queue *queue, void **msg);
 int  nk_msg_queue_try_push(struct nk_msg_queue *queue, void *msg);
 int  nk_msg_queue_try_pull(struct nk_msg_queue *queue, void **msg);
 
+// batch variants - move n messages, in order
+// blocks until all n have been moved
+void  nk_msg_queue_push_n(struct nk_msg_queue *queue, void **msgs, uint64_t n);
+void  nk_msg_queue_pull_n(struct nk_msg_queue *queue, void **msgs, uint64_t n);
+
+// does not block - returns the number of messages moved (0..n)
+uint64_t nk_msg_queue_try_push_n(struct nk_msg_queue *queue, void **msgs, uint64_t n);
+uint64_t nk_msg_queue_try_pull_n(struct nk_msg_queue *queue, void **msgs, uint64_t n);
+
 // returns 0 on success, >0 on timeout
 // blocks for up to timeout_ns
 int  nk_msg_queue_push_timeout(struct nk_msg_queue *queue, void *msg, uint64_t timeout_ns);
@@ -28,14 +28,40 @@
 
 #define ETHER_MAC_LEN 6
 
+// offloads a device may advertise
+// TX_CSUM: the device fills in IPv4 TCP/UDP checksums on request
+// RX_CSUM: received IPv4 TCP/UDP packets have already been checked
+//          (bad ones are completed with an error status)
+// TSO4:    the device cuts oversized IPv4 TCP frames on request
+#define NK_NET_DEV_OFFLOAD_TX_CSUM 0x1
+#define NK_NET_DEV_OFFLOAD_RX_CSUM 0x2
+#define NK_NET_DEV_OFFLOAD_TSO4    0x4
+
 struct nk_net_dev_characteristics {
     uint8_t  mac[ETHER_MAC_LEN];
     uint64_t min_tu;
     uint64_t max_tu;
     uint64_t (*packet_size_to_buffer_size)(uint64_t packet_size);
+    uint64_t offloads;   // NK_NET_DEV_OFFLOAD_*, zero if none
+    uint64_t max_tso;    // largest frame accepted for TSO4
 };
 
 
+// a scatter-gather send describes one packet as a list of fragments
+// that the device gathers itself, avoiding a copy into a flat buffer
+#define NK_NET_DEV_MAX_SG 16
+
+struct nk_net_dev_sg {
+    uint8_t  *addr;
+    uint64_t len;
+};
+
+// per-packet offload request for a scatter-gather send
+struct nk_net_dev_tx_offload {
+    uint64_t flags;  // NK_NET_DEV_OFFLOAD_TX_CSUM and/or NK_NET_DEV_OFFLOAD_TSO4
+    uint64_t mss;    // payload bytes per frame for TSO4
+};
+
 typedef enum {
     NK_NET_DEV_STATUS_SUCCESS=0,
     NK_NET_DEV_STATUS_ERROR
@@ -53,6 +79,10 @@ struct nk_net_dev_int {
     // callback can be null
     int (*post_receive)(void *state, uint8_t *dest, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context);
     int (*post_send)(void *state, uint8_t *src, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context);
+    // optional: send a single packet made of num fragments (<= NK_NET_DEV_MAX_SG)
+    // the fragments must remain valid until the callback is invoked
+    // offload may be null, and may only ask for advertised offloads
+    int (*post_send_sg)(void *state, struct nk_net_dev_sg *frags, uint32_t num, struct nk_net_dev_tx_offload *offload, void (*callback)(nk_net_dev_status_t status, void *context), void *context);
 };
 
 
@@ -88,6 +118,19 @@ int nk_net_dev_send_packet(struct nk_net_dev *dev,
                                             void *state),  // for callback reqs
 			   void *state);                  // for callback reqs
 
+// scatter-gather send; devices without post_send_sg fail with -1
+// so the caller can fall back to copying into a flat buffer
+int nk_net_dev_send_packet_sg(struct nk_net_dev *dev, 
+			      struct nk_net_dev_sg *frags,
+			      uint32_t num,
+			      struct nk_net_dev_tx_offload *offload,
+			      nk_dev_request_type_t type,
+			      void (*callback)(nk_net_dev_status_t status, 
+					       void *state),  // for callback reqs
+			      void *state);                  // for callback reqs
+
+int nk_net_dev_supports_sg(struct nk_net_dev *dev);
+
 
 #endif
 
@@ -0,0 +1,74 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __QSPINLOCK_H__
+#define __QSPINLOCK_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+  Queued spinlock
+
+  A 4 byte lock word, zero when free, so it can stand in for
+  spinlock_t.  Byte 0 is the locked byte.  The upper 16 bits name the
+  tail of an MCS queue of waiters, built from per-CPU nodes.
+
+  Uncontended acquire and release are a single cmpxchg and a byte
+  store.  A contended acquirer first does test-and-test-and-set with
+  exponential backoff for a while, as long as nobody is queued.  After
+  that it queues.  Only the head of the queue polls the lock word; the
+  others each spin on their own node.  Once a queue exists, new
+  arrivals cannot jump it, so handoff is FIFO.
+*/
+
+#define NK_QSPIN_LOCKED      0x000000ffU
+#define NK_QSPIN_TAIL_MASK   0xffff0000U
+
+typedef uint32_t nk_qspinlock_t;
+
+void nk_qspin_lock_slow(volatile nk_qspinlock_t *l);
+
+// returns zero on successful lock acquisition, -1 otherwise
+static inline int nk_qspin_trylock(volatile nk_qspinlock_t *l)
+{
+    return __sync_bool_compare_and_swap(l, 0, 1) ? 0 : -1;
+}
+
+static inline void nk_qspin_lock(volatile nk_qspinlock_t *l)
+{
+    if (nk_qspin_trylock(l)) {
+	nk_qspin_lock_slow(l);
+    }
+}
+
+static inline void nk_qspin_unlock(volatile nk_qspinlock_t *l)
+{
+    // only the locked byte; the tail belongs to the waiters
+    __atomic_store_n((volatile uint8_t *)l, 0, __ATOMIC_RELEASE);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __RCU_H__
+#define __RCU_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+  Read-copy-update, quiescent state based
+
+  A reader brackets its traversal with nk_rcu_read_lock/unlock, which
+  only disable preemption.  Readers never spin, never take a lock, and
+  never touch interrupts.  A reader must not block or yield inside its
+  read section.
+
+  A CPU passes through a quiescent state whenever the scheduler is
+  entered with preemption enabled (timer interrupts, yields, sleeps,
+  context switches) and on every trip around the idle loop.  Since a
+  reader holds off preemption, no read section can span a quiescent
+  state.  A grace period ends once every CPU has passed one.
+
+  Writers still serialize among themselves with whatever lock they
+  already had, publish with nk_rcu_assign_pointer / list_add_rcu,
+  unpublish with list_del_rcu, and then either wait for the grace
+  period (nk_rcu_synchronize) or defer the free (nk_call_rcu).
+  nk_rcu_synchronize must not be called while holding a spinlock, with
+  preemption or interrupts off, or from an interrupt handler.
+  nk_call_rcu can be called from anywhere.
+*/
+
+struct nk_rcu_head {
+    struct nk_rcu_head *next;
+    void (*func)(struct nk_rcu_head *head);
+};
+
+// these need <nautilus/cpu_state.h>, which spinlock.h and irq.h bring in
+#define nk_rcu_read_lock()   preempt_disable()
+#define nk_rcu_read_unlock() preempt_enable()
+
+// order the initialization of *v before the store that publishes it
+#define nk_rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define nk_rcu_dereference(p)       __atomic_load_n(&(p), __ATOMIC_CONSUME)
+
+// called by the scheduler and the idle loop
+void nk_rcu_quiescent(void);
+
+void nk_rcu_synchronize(void);
+void nk_call_rcu(struct nk_rcu_head *head, void (*func)(struct nk_rcu_head *head));
+
+int  nk_rcu_init(void);   // bsp only, once the scheduler is running
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
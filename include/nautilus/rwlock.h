@@ -46,6 +46,42 @@ int nk_rwlock_wr_unlock_irq_restore(nk_rwlock_t * l, uint8_t flags);
 
 void nk_rwlock_test(void);
 
+
+/*
+ * Big-reader lock
+ *
+ * For read-mostly data.  Each CPU has its own reader count on its own
+ * cache line, so readers on different CPUs never write a shared line.
+ * A writer raises a flag that stops new readers and then sweeps all
+ * the counts until they drain.  New readers defer to a waiting
+ * writer, so writers cannot be starved.
+ *
+ * Readers run with preemption disabled, since a writer spins with
+ * interrupts off until they drain.  A read section must therefore be
+ * short and must not block or sleep - copy out what is needed and do
+ * any printing or waiting after the unlock.  The reader hands the
+ * slot it counted itself in back to the unlock.
+ */
+struct nk_brlock_slot {
+    volatile uint32_t readers;
+} __attribute__((aligned(64)));
+
+struct nk_brlock {
+    spinlock_t            wlock;   // serializes writers
+    volatile uint32_t     writer;  // a writer holds or wants the lock
+    struct nk_brlock_slot slot[NAUT_CONFIG_MAX_CPUS];
+};
+
+typedef struct nk_brlock nk_brlock_t;
+
+int     nk_brlock_init(nk_brlock_t * l);
+int     nk_brlock_rd_lock(nk_brlock_t * l);          // returns slot for unlock
+void    nk_brlock_rd_unlock(nk_brlock_t * l, int slot);
+void    nk_brlock_wr_lock(nk_brlock_t * l);
+void    nk_brlock_wr_unlock(nk_brlock_t * l);
+uint8_t nk_brlock_wr_lock_irq_save(nk_brlock_t * l);
+void    nk_brlock_wr_unlock_irq_restore(nk_brlock_t * l, uint8_t flags);
+
 #ifdef __cplusplus
 }
 #endif
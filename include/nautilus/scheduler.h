@@ -102,6 +102,7 @@ void nk_sched_thread_state_deinit(struct nk_thread *thread);
 
 // call at thread creation time to determine where the scheduler
 // would like to put the thread, if it can choose
+// the choice is the least loaded cpu nearest the calling cpu
 // returns a CPU id [0, num_cpus)
 // negative number indicates error
 int nk_sched_initial_placement();
@@ -131,6 +132,13 @@ int    nk_sched_thread_move(struct nk_thread *thread, int new_cpu, int block);
 // any threads are stolen
 int    nk_sched_cpu_mug(int cpu, uint64_t max, uint64_t *actual);
 
+//
+// Run a load balancing pass on this CPU - steal from the nearest
+// sufficiently more loaded CPU (SMT sibling, then socket, then remote)
+// Passes are rate limited, so this can be called frequently
+// (the idle and interrupt threads do so)
+int    nk_sched_balance(uint64_t *actual);
+
 // Make the thread schedulable - generally only called by thread.c
 // When the thread is first launched admit=1 is used to do admisson on the 
 // designated CPU
@@ -166,6 +174,9 @@ void    nk_sched_exit(spinlock_t *lock_to_release);
 // clean up after detached threads
 // normally will only execute if we have too many threads active
 void    nk_sched_reap(int unconditional);
+// clean up after detached threads that were created on the given cpu
+// conditional reaps here skip the work if the cpu has no exited threads
+void    nk_sched_reap_cpu(int cpu, int unconditional);
 
 // find a dead thread that matches the criteria, if possible
 // the caller can then avoid the cost of allocating a new
@@ -216,5 +227,7 @@ uint64_t nk_sched_get_runtime(struct nk_thread *t);
 // what are the threads scheduling constraints
 int nk_sched_thread_get_constraints(struct nk_thread *t, struct nk_sched_constraints *c);
 
+// lock-free; the result is only guaranteed to stay allocated
+// until the caller's nk_rcu_read_unlock()
 struct nk_thread *nk_find_thread_by_tid(uint64_t tid);
 #endif /* _SCHEDULER_H */
@@ -33,25 +33,39 @@ extern "C" {
 #include <nautilus/cpu.h>
 #include <nautilus/cpu_state.h>
 #include <nautilus/instrument.h>
+#include <nautilus/lockstat.h>
+#include <nautilus/qspinlock.h>
 
 #define SPINLOCK_INITIALIZER 0
 
 typedef uint32_t spinlock_t;
 
+// The raw lock word operations behind the functions below.
+// __spin_try() returns nonzero if the lock was not acquired.
+#ifdef NAUT_CONFIG_USE_QSPINLOCKS
+#define __spin_try(l)        nk_qspin_trylock(l)
+#define __spin_wait(l)       nk_qspin_lock_slow(l)
+#define __spin_wait_pause(l) nk_qspin_lock_slow(l)
+#define __spin_release(l)    nk_qspin_unlock(l)
+#else
+#define __spin_try(l)        __sync_lock_test_and_set(l, 1)
+#define __spin_wait(l)       while (__sync_lock_test_and_set(l, 1)) { /* spin away */ }
+#define __spin_wait_pause(l) PAUSE_WHILE(__sync_lock_test_and_set(l, 1))
+#define __spin_release(l)    __sync_lock_release(l)
+#endif
+
 void 
 spinlock_init (volatile spinlock_t * lock);
 
 void
 spinlock_deinit (volatile spinlock_t * lock);
 
-static inline void
+static inline NK_LOCKSTAT_INLINE void
 spin_lock (volatile spinlock_t * lock) 
 {
     NK_PROFILE_ENTRY();
     
-    while (__sync_lock_test_and_set(lock, 1)) {
-	// spin away
-    }
+    NK_LOCKSTAT_ACQUIRE(lock, __spin_try(lock), __spin_wait(lock));
 
     NK_PROFILE_EXIT();
 }
@@ -60,14 +74,14 @@ spin_lock (volatile spinlock_t * lock)
 static inline int
 spin_try_lock(volatile spinlock_t *lock)
 {
-    return  __sync_lock_test_and_set(lock,1) ? -1 : 0 ;
+    return  __spin_try(lock) ? -1 : 0 ;
 }
 
-static inline uint8_t
+static inline NK_LOCKSTAT_INLINE uint8_t
 spin_lock_irq_save (volatile spinlock_t * lock)
 {
     uint8_t flags = irq_disable_save();
-    PAUSE_WHILE(__sync_lock_test_and_set(lock, 1));
+    NK_LOCKSTAT_ACQUIRE(lock, __spin_try(lock), __spin_wait_pause(lock));
     return flags;
 }
 
@@ -75,7 +89,7 @@ static inline int
 spin_try_lock_irq_save(volatile spinlock_t *lock, uint8_t *flags)
 {
     *flags = irq_disable_save();
-    if (__sync_lock_test_and_set(lock,1)) {
+    if (__spin_try(lock)) {
 	irq_enable_restore(*flags);
 	return -1;
     } else {
@@ -93,14 +107,16 @@ static inline void
 spin_unlock (volatile spinlock_t * lock) 
 {
     NK_PROFILE_ENTRY();
-    __sync_lock_release(lock);
+    NK_LOCKSTAT_RELEASE(lock);
+    __spin_release(lock);
     NK_PROFILE_EXIT();
 }
 
 static inline void
 spin_unlock_irq_restore (volatile spinlock_t * lock, uint8_t flags)
 {
-    __sync_lock_release(lock);
+    NK_LOCKSTAT_RELEASE(lock);
+    __spin_release(lock);
     irq_enable_restore(flags);
 }
 
@@ -37,6 +37,7 @@ extern "C" {
 // Always included so we get the necessary type
 #include <nautilus/cachepart.h>
 #include <nautilus/aspace.h>
+#include <nautilus/rcu.h>
 
 typedef uint64_t nk_stack_size_t;
     
@@ -140,11 +141,10 @@ int nk_tls_set(nk_tls_key_t key, const void * val);
 /********* INTERNALS ***********/
 
 // Support both fxsave and xsave for FP state
-// The specific instruction used is determined in thread_lowlevel.S
-#define XSAVE_SIZE 4096           // guess - actually is extensible format
-                                  // current reasoning: 512 bytes for legacy
-                                  // 1KB + for AVX2 (32*512 bit)
-                                  // extra space
+// The specific instruction used is chosen by fpu_init (see fpu.h)
+#define XSAVE_SIZE 4096           // x87/SSE/AVX/AVX-512 need at most ~2.7KB
+                                  // fpu_init leaves out AVX-512 from XCR0
+                                  // if the CPU's layout would not fit
 #define XSAVE_ALIGN 64            // per Intel docs
 #define FXSAVE_SIZE 512           // per Intel docs
 #define FXSAVE_ALIGN 16           // per Intel docs
@@ -173,6 +173,18 @@ typedef enum {
 
 typedef struct nk_wait_queue nk_wait_queue_t;
 
+// A thread can wait on a few queues at once (e.g., a message queue's
+// push and pull queues).  The nodes that link it onto those queues
+// live here, in the thread, instead of in the queues, so a wait queue
+// costs only its header and enqueue/dequeue never scan for a free slot.
+#define NK_THREAD_MAX_WAIT_QUEUES 4
+
+typedef struct nk_wait_queue_entry {
+    struct list_head  node;
+    struct nk_thread *thread;
+    nk_wait_queue_t  *queue;    // 0 = unused
+} nk_wait_queue_entry_t;
+
 struct nk_thread {
     uint64_t rsp;                /* +0  SHOULD NOT CHANGE POSITION */
     void * stack;                /* +8  SHOULD NOT CHANGE POSITION */
@@ -196,6 +208,7 @@ struct nk_thread {
     nk_wait_queue_t * waitq;             // wait queue for threads waiting on this thread
     
     int               num_wait;          // how many wait queues this thread is currently on
+    nk_wait_queue_entry_t wait_entries[NK_THREAD_MAX_WAIT_QUEUES]; // its nodes on those queues
 
     // the per-thread default timer is allocated on first use
     struct nk_timer  *timer;
@@ -218,6 +231,8 @@ struct nk_thread {
 
     struct nk_virtual_console *vc;
 
+    struct nk_rcu_head rcu;  // the free is deferred past tid lookups
+
 #ifdef NAUT_CONFIG_GARBAGE_COLLECTION
     void  *gc_state;
 #endif
@@ -66,21 +66,12 @@
 // A wait queue contains pointers to the threads on it, allowing one
 // thread to be in multiple wait queues at once.  A thread has a count
 // of the number of wait queues it is currently on.  
-// 
-typedef struct nk_wait_queue_entry {
-   struct list_head  node;
-   struct nk_thread *thread;   // 0 = unused
-} nk_wait_queue_entry_t;
-
-
 //
-// A wait queue includes not the list of pointer nodes, but also an
-// allocator for these nodes.  Since the maximum number of threads is
-// known at compile time, the allocator cannot fail and we need not
-// use malloc except when the wait queue is created.
-//
-// Also, when the number of threads per wait queue is small
-// the allocator should require very few steps in its scan
+// The list nodes (nk_wait_queue_entry_t) are embedded in the waiting
+// thread (see thread.h), one per queue it is on, so the wait queue
+// itself holds no per-thread storage.  A thread only ever waits on a
+// handful of queues, so finding its node for a queue is a short,
+// fixed-length scan regardless of how many threads are waiting.
 //
 typedef struct nk_wait_queue {
     char       name[NK_WAIT_QUEUE_NAME_LEN];
@@ -88,7 +79,6 @@ typedef struct nk_wait_queue {
     struct list_head node; // for list of wait queues
     uint64_t   num_wait;
     struct list_head list;
-    struct nk_wait_queue_entry slots[NAUT_CONFIG_MAX_THREADS];
 } nk_wait_queue_t;
 
 // Queue creation/destruction are defined separately since they are unlikely
@@ -101,18 +91,19 @@ void             nk_wait_queue_destroy(nk_wait_queue_t *q);
 static inline nk_wait_queue_entry_t *nk_wait_queue_alloc_entry(nk_wait_queue_t *q, nk_thread_t *t)
 {
     int i;
-    for (i=0;i<NAUT_CONFIG_MAX_THREADS;i++) {
-	if (__sync_bool_compare_and_swap(&q->slots[i].thread,0,t)) {
-	    INIT_LIST_HEAD(&q->slots[i].node);
-	    return &q->slots[i];
+    for (i=0;i<NK_THREAD_MAX_WAIT_QUEUES;i++) {
+	if (__sync_bool_compare_and_swap(&t->wait_entries[i].queue,0,q)) {
+	    INIT_LIST_HEAD(&t->wait_entries[i].node);
+	    t->wait_entries[i].thread = t;
+	    return &t->wait_entries[i];
 	}
     }
-    return 0; // should never happen
+    return 0; // thread is already on too many queues
 }
 
 static inline void nk_wait_queue_free_entry(nk_wait_queue_t *q, nk_wait_queue_entry_t *e)
 {
-    (void)__sync_fetch_and_and(&e->thread,0);
+    (void)__sync_fetch_and_and(&e->queue,0);
 }
 
 
@@ -171,14 +162,14 @@ static inline void nk_wait_queue_remove_specific_extended(nk_wait_queue_t *q, nk
 {
     uint8_t flags=0;
     nk_wait_queue_entry_t *e=0;
-    struct list_head *cur, *temp;
+    int i;
     if (!havelock) {
 	flags = spin_lock_irq_save(&q->lock);
     }
-    list_for_each_safe(cur,temp,&q->list) {
-        e  = list_entry(cur, nk_wait_queue_entry_t, node);
-	if (e->thread == t) {
-	    list_del_init(cur);
+    for (i=0;i<NK_THREAD_MAX_WAIT_QUEUES;i++) {
+	e = &t->wait_entries[i];
+	if (e->queue == q) {
+	    list_del_init(&e->node);
 	    __sync_fetch_and_add(&t->num_wait,-1);
 	    __sync_fetch_and_add(&q->num_wait,-1);
 	    nk_wait_queue_free_entry(q,e);
@@ -211,7 +202,7 @@ static inline int nk_wait_queue_enqueue_multiple_extended(int count, nk_wait_que
     if (fail) {
 	// fail out gracefully
 	for (j=0;j<i;j++) {
-	    nk_wait_queue_remove_specific_extended(q[i],t,1);
+	    nk_wait_queue_remove_specific_extended(q[j],t,1);
 	}
     }
 
@@ -35,4 +35,31 @@
 #define DEFAULT_UDP_RECVMBOX_SIZE 128
 #define DEFAULT_TCP_RECVMBOX_SIZE 128
 #define DEFAULT_ACCEPTMBOX_SIZE   128
+
+// ethernetif wraps received NIC packets in custom pbufs (zero-copy RX)
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
+
+// Checksums are generated and checked in software by default, but
+// ethernetif turns TCP/UDP checksumming off per netif when the NIC
+// advertises checksum offload
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
+#define CHECKSUM_GEN_IP     1
+#define CHECKSUM_GEN_UDP    1
+#define CHECKSUM_GEN_TCP    1
+#define CHECKSUM_GEN_ICMP   1
+#define CHECKSUM_CHECK_IP   1
+#define CHECKSUM_CHECK_UDP  1
+#define CHECKSUM_CHECK_TCP  1
+#define CHECKSUM_CHECK_ICMP 1
+
+// Full-size ethernet segments and a window to match - the defaults
+// (536 byte MSS, 2*MSS send buffer) throttle bulk TCP
+#define TCP_MSS          1460
+#define TCP_WND          (44*TCP_MSS)
+#define TCP_SND_BUF      (44*TCP_MSS)
+#define MEMP_NUM_TCP_SEG 256
+#define PBUF_POOL_SIZE   64
+
+// Build large TCP segments for NICs that can do TSO
+#define LWIP_TCP_TSO     1
 #endif
@@ -99,6 +99,9 @@ extern "C" {
 /** If set, the netif has MLD6 capability.
  * Set by the netif driver in its init function. */
 #define NETIF_FLAG_MLD6         0x40U
+/** If set, the netif can segment oversized TCP segments itself (TSO).
+ * Set by the netif driver in its init function. */
+#define NETIF_FLAG_TSO          0x80U
 
 /**
  * @}
@@ -330,6 +333,11 @@ struct netif {
 #if LWIP_NETIF_HWADDRHINT
   u8_t *addr_hint;
 #endif /* LWIP_NETIF_HWADDRHINT */
+#if LWIP_TCP_TSO
+  /** Frame payload size for the TCP segment currently being output, or 0 if
+      it needs no segmentation. Only valid within netif->linkoutput. */
+  u16_t tso_mss;
+#endif /* LWIP_TCP_TSO */
 #if ENABLE_LOOPBACK
   /* List of packets to be queued for ourselves. */
   struct pbuf *loop_first;
@@ -467,6 +475,14 @@ err_t netif_add_ip6_address(struct netif *netif, const ip6_addr_t *ip6addr, s8_t
 #define NETIF_SET_HWADDRHINT(netif, hint)
 #endif /* LWIP_NETIF_HWADDRHINT */
 
+#if LWIP_TCP_TSO
+#define NETIF_SET_TSO_MSS(netif, mss) ((netif)->tso_mss = (mss))
+#define NETIF_TSO_MSS(netif) ((netif)->tso_mss)
+#else /* LWIP_TCP_TSO */
+#define NETIF_SET_TSO_MSS(netif, mss)
+#define NETIF_TSO_MSS(netif) 0
+#endif /* LWIP_TCP_TSO */
+
 #ifdef __cplusplus
 }
 #endif
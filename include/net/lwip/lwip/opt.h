@@ -1449,6 +1449,24 @@
 #define LWIP_NETIF_TX_SINGLE_PBUF             0
 #endif /* LWIP_NETIF_TX_SINGLE_PBUF */
 
+/**
+ * LWIP_TCP_TSO==1: Build TCP segments of up to TCP_TSO_MAX_SIZE bytes for
+ * netifs that set NETIF_FLAG_TSO and let the MAC cut them into MSS-sized
+ * frames (TCP segmentation offload). While such a segment is being output,
+ * netif->tso_mss holds the payload size of each frame to be cut.
+ */
+#if !defined LWIP_TCP_TSO || defined __DOXYGEN__
+#define LWIP_TCP_TSO                          0
+#endif /* LWIP_TCP_TSO */
+
+/**
+ * TCP_TSO_MAX_SIZE: Largest TCP segment built for a TSO netif. Together
+ * with the headers, this must fit in the 16-bit IP total length.
+ */
+#if !defined TCP_TSO_MAX_SIZE || defined __DOXYGEN__
+#define TCP_TSO_MAX_SIZE                      0xF000
+#endif /* TCP_TSO_MAX_SIZE */
+
 /**
  * LWIP_NUM_NETIF_CLIENT_DATA: Number of clients that may store
  * data in client_data member array of struct netif.
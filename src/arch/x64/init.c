@@ -31,6 +31,7 @@
 #include <nautilus/msr.h>
 #include <nautilus/mtrr.h>
 #include <nautilus/cpuid.h>
+#include <nautilus/memops.h>
 #include <nautilus/smp.h>
 #include <nautilus/irq.h>
 #include <nautilus/thread.h>
@@ -53,6 +54,7 @@
 #include <nautilus/mm.h>
 #include <nautilus/libccompat.h>
 #include <nautilus/barrier.h>
+#include <nautilus/rcu.h>
 #include <nautilus/vc.h>
 #include <nautilus/dev.h>
 #ifdef NAUT_CONFIG_PARTITION_SUPPORT
@@ -122,6 +124,9 @@
 #ifdef NAUT_CONFIG_ATA
 #include <dev/ata.h>
 #endif
+#ifdef NAUT_CONFIG_AHCI
+#include <dev/ahci.h>
+#endif
 #ifdef NAUT_CONFIG_EXT2_FILESYSTEM_DRIVER
 #include <fs/ext2/ext2.h>
 #endif
@@ -311,6 +316,8 @@ init (unsigned long mbd,
     // Now we are safe to use optimized code that relies
     // on SSE
 
+    nk_memops_init();
+
     spinlock_init(&printk_lock);
 
     setup_idt();
@@ -449,6 +456,10 @@ init (unsigned long mbd,
     nk_instrument_init();
 #endif
 
+#ifdef NAUT_CONFIG_LOCKSTAT
+    nk_lockstat_init();
+#endif
+
 #ifdef NAUT_CONFIG_REAL_MODE_INTERFACE 
     nk_real_mode_init();
 #endif
@@ -493,6 +504,8 @@ init (unsigned long mbd,
 
     /* interrupts are now on */
 
+    nk_rcu_init();
+
     nk_vc_init();
 
     
@@ -513,6 +526,10 @@ init (unsigned long mbd,
     nk_ata_init(naut);
 #endif
 
+#ifdef NAUT_CONFIG_AHCI
+    nk_ahci_init(naut);
+#endif
+
 #ifdef NAUT_CONFIG_VIRTIO_PCI
     virtio_pci_init(naut);
 #endif
@@ -0,0 +1,961 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/blkdev.h>
+#include <nautilus/irq.h>
+#include <nautilus/cpu.h>
+#include <nautilus/thread.h>
+#include <nautilus/waitqueue.h>
+#include <dev/pci.h>
+#include <dev/ahci.h>
+
+#ifndef NAUT_CONFIG_DEBUG_AHCI
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("ahci: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("ahci: " fmt, ##args)
+#define INFO(fmt, args...) INFO_PRINT("ahci: " fmt, ##args)
+
+
+#define STATE_LOCK_CONF uint8_t _state_lock_flags
+#define STATE_LOCK(state) _state_lock_flags = spin_lock_irq_save(&state->lock)
+#define STATE_UNLOCK(state) spin_unlock_irq_restore(&(state->lock), _state_lock_flags)
+
+
+// PCI class/subclass/interface of an AHCI controller
+#define AHCI_CLASS    0x01
+#define AHCI_SUBCLASS 0x06
+#define AHCI_PROGIF   0x01
+#define AHCI_ABAR     5
+
+// generic host control registers
+#define HBA_CAP   0x00
+#define HBA_GHC   0x04
+#define HBA_IS    0x08
+#define HBA_PI    0x0c
+#define HBA_VS    0x10
+#define HBA_CAP2  0x24
+#define HBA_BOHC  0x28
+
+#define CAP_S64A       (1U<<31)
+#define CAP_SNCQ       (1U<<30)
+#define CAP_NCS(c)     ((((c)>>8)&0x1f)+1)
+
+#define CAP2_BOH       (1U<<0)
+#define BOHC_BOS       (1U<<0)
+#define BOHC_OOS       (1U<<1)
+#define BOHC_BB        (1U<<4)
+
+#define GHC_IE         (1U<<1)
+#define GHC_AE         (1U<<31)
+
+// port registers
+#define PORT_BASE(n) (0x100 + (n)*0x80)
+#define PX_CLB   0x00
+#define PX_CLBU  0x04
+#define PX_FB    0x08
+#define PX_FBU   0x0c
+#define PX_IS    0x10
+#define PX_IE    0x14
+#define PX_CMD   0x18
+#define PX_TFD   0x20
+#define PX_SIG   0x24
+#define PX_SSTS  0x28
+#define PX_SCTL  0x2c
+#define PX_SERR  0x30
+#define PX_SACT  0x34
+#define PX_CI    0x38
+
+#define PXCMD_ST   (1U<<0)
+#define PXCMD_SUD  (1U<<1)
+#define PXCMD_POD  (1U<<2)
+#define PXCMD_FRE  (1U<<4)
+#define PXCMD_FR   (1U<<14)
+#define PXCMD_CR   (1U<<15)
+
+#define PXTFD_ERR  (1U<<0)
+#define PXTFD_DRQ  (1U<<3)
+#define PXTFD_BSY  (1U<<7)
+
+#define PXSSTS_DET(s)    ((s)&0xf)
+#define PXSSTS_DET_PHY   3
+
+#define PXSIG_ATA  0x00000101
+
+// D2H register, PIO setup, DMA setup, set device bits, descriptor processed
+#define PXIS_DONE  0x0000002f
+// overflow, interface non-fatal, interface fatal, host bus data,
+// host bus fatal, task file error
+#define PXIS_ERR   0x7d000000
+
+// ATA commands
+#define ATA_IDENTIFY          0xec
+#define ATA_READ_DMA_EXT      0x25
+#define ATA_WRITE_DMA_EXT     0x35
+#define ATA_READ_FPDMA_QUEUED 0x60
+#define ATA_WRITE_FPDMA_QUEUED 0x61
+
+#define FIS_TYPE_REG_H2D 0x27
+
+#define AHCI_MAX_SLOTS  32
+// each PRD covers at most 4 MB, so this bounds a command at 32 MB,
+// which is also about as much as a 16 bit sector count can describe
+#define AHCI_PRDS       8
+#define AHCI_PRD_MAX    (4UL*1024*1024)
+
+// all in ms
+#define TIMEOUT_STOP     500
+#define TIMEOUT_CMD      1000
+#define TIMEOUT_BOH      2000
+
+struct ahci_cmd_header {
+    uint16_t flags;            // CFL in 4:0, write in 6
+    uint16_t prdtl;
+    volatile uint32_t prdbc;
+    uint32_t ctba;
+    uint32_t ctbau;
+    uint32_t rsvd[4];
+} __packed;
+
+#define CMDH_CFL(dwords) ((dwords)&0x1f)
+#define CMDH_WRITE       (1U<<6)
+
+struct ahci_prd {
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t rsvd;
+    uint32_t dbc;              // byte count - 1 in 21:0, interrupt in 31
+} __packed;
+
+struct ahci_cmd_table {
+    uint8_t         cfis[64];
+    uint8_t         acmd[16];
+    uint8_t         rsvd[48];
+    struct ahci_prd prdt[AHCI_PRDS];
+} __packed;
+
+// command list (1 KB aligned), then received FIS area (256 byte
+// aligned), then the command tables (128 byte aligned)
+#define CL_SIZE      (sizeof(struct ahci_cmd_header)*AHCI_MAX_SLOTS)
+#define FIS_SIZE     256
+#define CT_SIZE      ((sizeof(struct ahci_cmd_table)+127UL) & ~127UL)
+#define PORT_MEM     (CL_SIZE + FIS_SIZE + CT_SIZE*AHCI_MAX_SLOTS)
+
+struct ahci_hba;
+
+struct ahci_port {
+    struct nk_block_dev *blkdev;
+    char                name[32];
+
+    spinlock_t          lock;
+
+    struct ahci_hba    *hba;
+    int                 num;
+
+    void                   *mem;     // unaligned allocation
+    struct ahci_cmd_header *cl;
+    uint8_t                *fis;
+    uint8_t                *ct;
+
+    int                 ncq;         // use FPDMA QUEUED commands
+    uint32_t            slots;       // slots we may use
+    uint32_t            busy;        // slots allocated to a request
+    uint32_t            outstanding; // slots issued to the port
+
+    // error recovery resets the port, which can take seconds, so it
+    // is done by a thread of its own rather than in the interrupt
+    // handler.  No commands are issued while it is in progress.
+    volatile int        recovering;
+    volatile int        stopping;
+    volatile int        recovery_exited;
+    nk_wait_queue_t    *recovery_wq;
+
+    struct {
+	void (*callback)(nk_block_dev_status_t, void *);
+	void *context;
+    } req[AHCI_MAX_SLOTS];
+
+    uint64_t            block_size;
+    uint64_t            num_blocks;
+    uint64_t            max_blocks;  // per command
+};
+
+struct ahci_hba {
+    struct pci_dev     *pci_dev;
+    int                 num;
+    volatile uint8_t   *abar;
+    uint32_t            cap;
+    int                 num_slots;
+    enum {AHCI_LEGACY=0, AHCI_MSI, AHCI_MSI_X} itype;
+    int                 vec;
+    struct ahci_port   *ports[32];
+};
+
+static int num_hbas = 0;
+static struct ahci_hba *hbas[8];
+
+
+#define HBA_READ(h,o)      (*((volatile uint32_t *)((h)->abar+(o))))
+#define HBA_WRITE(h,o,v)   ((*((volatile uint32_t *)((h)->abar+(o))))=(v))
+#define PORT_READ(p,o)     HBA_READ((p)->hba,PORT_BASE((p)->num)+(o))
+#define PORT_WRITE(p,o,v)  HBA_WRITE((p)->hba,PORT_BASE((p)->num)+(o),(v))
+
+#define CMD_TABLE(p,slot)  ((struct ahci_cmd_table *)((p)->ct + (slot)*CT_SIZE))
+
+
+// wait up to ms for (PORT_READ(p,reg) & mask) == val
+static int port_wait(struct ahci_port *p, uint32_t reg, uint32_t mask, uint32_t val, int ms)
+{
+    int i;
+    for (i=0;i<ms*10;i++) {
+	if ((PORT_READ(p,reg) & mask) == val) {
+	    return 0;
+	}
+	udelay(100);
+    }
+    return -1;
+}
+
+static int port_stop(struct ahci_port *p)
+{
+    PORT_WRITE(p,PX_CMD,PORT_READ(p,PX_CMD) & ~PXCMD_ST);
+    if (port_wait(p,PX_CMD,PXCMD_CR,0,TIMEOUT_STOP)) {
+	ERROR("%s: command list engine did not stop\n",p->name);
+	return -1;
+    }
+    PORT_WRITE(p,PX_CMD,PORT_READ(p,PX_CMD) & ~PXCMD_FRE);
+    if (port_wait(p,PX_CMD,PXCMD_FR,0,TIMEOUT_STOP)) {
+	ERROR("%s: FIS receive engine did not stop\n",p->name);
+	return -1;
+    }
+    return 0;
+}
+
+static int port_start(struct ahci_port *p)
+{
+    PORT_WRITE(p,PX_CMD,PORT_READ(p,PX_CMD) | PXCMD_FRE | PXCMD_SUD | PXCMD_POD);
+    PORT_WRITE(p,PX_SERR,0xffffffff);
+    PORT_WRITE(p,PX_IS,0xffffffff);
+    if (port_wait(p,PX_TFD,PXTFD_BSY | PXTFD_DRQ,0,TIMEOUT_CMD)) {
+	ERROR("%s: device stays busy (tfd=0x%x)\n",p->name,PORT_READ(p,PX_TFD));
+	return -1;
+    }
+    PORT_WRITE(p,PX_CMD,PORT_READ(p,PX_CMD) | PXCMD_ST);
+    return 0;
+}
+
+// COMRESET, for when the device is wedged after an error
+static void port_reset(struct ahci_port *p)
+{
+    uint32_t sctl = PORT_READ(p,PX_SCTL) & ~0xfU;
+    PORT_WRITE(p,PX_SCTL,sctl | 1);
+    udelay(1000);
+    PORT_WRITE(p,PX_SCTL,sctl);
+    if (port_wait(p,PX_SSTS,0xf,PXSSTS_DET_PHY,TIMEOUT_CMD)) {
+	ERROR("%s: link did not come back after reset\n",p->name);
+    }
+}
+
+
+static void build_prdt(struct ahci_cmd_table *t, uint8_t *buf, uint64_t len, uint16_t *prdtl)
+{
+    uint64_t addr = (uint64_t)buf;   // identity mapped
+    int i = 0;
+
+    while (len) {
+	uint64_t n = len < AHCI_PRD_MAX ? len : AHCI_PRD_MAX;
+	t->prdt[i].dba = (uint32_t)addr;
+	t->prdt[i].dbau = (uint32_t)(addr>>32);
+	t->prdt[i].rsvd = 0;
+	t->prdt[i].dbc = (uint32_t)(n-1);
+	addr += n;
+	len -= n;
+	i++;
+    }
+    *prdtl = i;
+}
+
+static void build_fis(uint8_t *f, uint8_t cmd, uint64_t lba, uint16_t count, int tag, int ncq)
+{
+    memset(f,0,20);
+    f[0] = FIS_TYPE_REG_H2D;
+    f[1] = 0x80;               // command, not control
+    f[2] = cmd;
+    f[4] = lba;
+    f[5] = lba>>8;
+    f[6] = lba>>16;
+    f[8] = lba>>24;
+    f[9] = lba>>32;
+    f[10] = lba>>40;
+    if (cmd==ATA_IDENTIFY) {
+	return;
+    }
+    f[7] = 0x40;               // LBA mode
+    if (ncq) {
+	// sector count goes in the features field, the tag in count
+	f[3] = count;
+	f[11] = count>>8;
+	f[12] = tag<<3;
+    } else {
+	f[12] = count;
+	f[13] = count>>8;
+    }
+}
+
+static void build_command(struct ahci_port *p, int slot, uint8_t cmd, uint64_t lba,
+			  uint64_t count, uint8_t *buf, uint64_t len, int write)
+{
+    struct ahci_cmd_table *t = CMD_TABLE(p,slot);
+    struct ahci_cmd_header *h = &p->cl[slot];
+    uint16_t prdtl;
+
+    build_fis(t->cfis,cmd,lba,count,slot,p->ncq && cmd!=ATA_IDENTIFY);
+    build_prdt(t,buf,len,&prdtl);
+
+    h->flags = CMDH_CFL(5) | (write ? CMDH_WRITE : 0);
+    h->prdtl = prdtl;
+    h->prdbc = 0;
+}
+
+
+// reap finished commands, either from the interrupt handler
+// or from a submitter that is waiting for a slot
+static void port_complete(struct ahci_port *p)
+{
+    STATE_LOCK_CONF;
+    void (*cb[AHCI_MAX_SLOTS])(nk_block_dev_status_t, void *);
+    void *ctx[AHCI_MAX_SLOTS];
+    uint32_t done, failed=0;
+    int i;
+
+    STATE_LOCK(p);
+
+    uint32_t is = PORT_READ(p,PX_IS);
+    PORT_WRITE(p,PX_IS,is);
+
+    if (p->recovering) {
+	// nothing is in flight, and the reset raises its own status
+	STATE_UNLOCK(p);
+	return;
+    }
+
+    if (is & PXIS_ERR) {
+	// on a queued error the device aborts everything in flight,
+	// so we fail everything and have the port recovered
+	ERROR("%s: error (is=0x%x tfd=0x%x serr=0x%x sact=0x%x ci=0x%x)\n",
+	      p->name,is,PORT_READ(p,PX_TFD),PORT_READ(p,PX_SERR),
+	      PORT_READ(p,PX_SACT),PORT_READ(p,PX_CI));
+	failed = p->outstanding;
+	p->recovering = 1;
+	nk_wait_queue_wake_all(p->recovery_wq);
+	done = 0;
+    } else {
+	done = p->outstanding & ~(PORT_READ(p,PX_SACT) | PORT_READ(p,PX_CI));
+    }
+
+    uint32_t finished = done | failed;
+
+    for (i=0;i<AHCI_MAX_SLOTS;i++) {
+	if (finished & (1U<<i)) {
+	    cb[i] = p->req[i].callback;
+	    ctx[i] = p->req[i].context;
+	}
+    }
+
+    p->outstanding &= ~finished;
+    p->busy &= ~finished;
+
+    STATE_UNLOCK(p);
+
+    for (i=0;i<AHCI_MAX_SLOTS;i++) {
+	if ((finished & (1U<<i)) && cb[i]) {
+	    DEBUG("%s: slot %d %s\n",p->name,i,failed & (1U<<i) ? "failed" : "done");
+	    cb[i](failed & (1U<<i) ? NK_BLOCK_DEV_STATUS_ERROR : NK_BLOCK_DEV_STATUS_SUCCESS, ctx[i]);
+	}
+    }
+}
+
+static inline int can_sleep(void)
+{
+    return !in_interrupt_context() && irqs_enabled() && !preempt_is_disabled();
+}
+
+// returns -1 if the port is being recovered and we cannot wait for it
+static int alloc_slot(struct ahci_port *p)
+{
+    STATE_LOCK_CONF;
+
+    while (1) {
+	STATE_LOCK(p);
+	if (p->recovering) {
+	    STATE_UNLOCK(p);
+	    if (!can_sleep()) {
+		return -1;
+	    }
+	    nk_yield();
+	    continue;
+	}
+	uint32_t free = p->slots & ~p->busy;
+	if (free) {
+	    int slot = __builtin_ctz(free);
+	    p->busy |= 1U<<slot;
+	    STATE_UNLOCK(p);
+	    return slot;
+	}
+	STATE_UNLOCK(p);
+
+	// all slots are in flight - reap directly, since we
+	// may be running with interrupts off
+	port_complete(p);
+
+	if (can_sleep()) {
+	    nk_yield();
+	} else {
+	    asm volatile ("pause");
+	}
+    }
+}
+
+static int submit(struct ahci_port *p, uint64_t blocknum, uint64_t count, uint8_t *buf, int write,
+		  void (*callback)(nk_block_dev_status_t, void *), void *context)
+{
+    STATE_LOCK_CONF;
+    uint64_t len = count*p->block_size;
+
+    DEBUG("%s: %s %lu blocks at %lu (buf=%p)\n",p->name,write ? "write" : "read",count,blocknum,buf);
+
+    if (blocknum+count > p->num_blocks) {
+	ERROR("%s: illegal access past end of disk\n",p->name);
+	return -1;
+    }
+    if (count > p->max_blocks) {
+	ERROR("%s: request of %lu blocks exceeds limit of %lu\n",p->name,count,p->max_blocks);
+	return -1;
+    }
+    if ((uint64_t)buf & 1) {
+	ERROR("%s: buffer %p is not word aligned\n",p->name,buf);
+	return -1;
+    }
+    if (!(p->hba->cap & CAP_S64A) && ((uint64_t)buf+len) > 0x100000000ULL) {
+	ERROR("%s: buffer %p is beyond the controller's 32 bit reach\n",p->name,buf);
+	return -1;
+    }
+
+    if (!count) {
+	if (callback) {
+	    callback(NK_BLOCK_DEV_STATUS_SUCCESS,context);
+	}
+	return 0;
+    }
+
+    int slot;
+    uint8_t cmd = p->ncq ?
+	(write ? ATA_WRITE_FPDMA_QUEUED : ATA_READ_FPDMA_QUEUED) :
+	(write ? ATA_WRITE_DMA_EXT : ATA_READ_DMA_EXT);
+
+ again:
+    slot = alloc_slot(p);
+    if (slot<0) {
+	ERROR("%s: port is recovering from an error\n",p->name);
+	return -1;
+    }
+
+    build_command(p,slot,cmd,blocknum,count,buf,len,write);
+
+    STATE_LOCK(p);
+    if (p->recovering) {
+	// an error came in after we got the slot
+	p->busy &= ~(1U<<slot);
+	STATE_UNLOCK(p);
+	goto again;
+    }
+    p->req[slot].callback = callback;
+    p->req[slot].context = context;
+    p->outstanding |= 1U<<slot;
+    mbarrier();
+    if (p->ncq) {
+	PORT_WRITE(p,PX_SACT,1U<<slot);
+    }
+    PORT_WRITE(p,PX_CI,1U<<slot);
+    STATE_UNLOCK(p);
+
+    DEBUG("%s: issued slot %d\n",p->name,slot);
+
+    return 0;
+}
+
+
+static int get_characteristics(void *state, struct nk_block_dev_characteristics *c)
+{
+    struct ahci_port *p = (struct ahci_port *)state;
+
+    c->block_size = p->block_size;
+    c->num_blocks = p->num_blocks;
+    return 0;
+}
+
+static int read_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest,void (*callback)(nk_block_dev_status_t, void *), void *context)
+{
+    return submit((struct ahci_port *)state,blocknum,count,dest,0,callback,context);
+}
+
+static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *src,void (*callback)(nk_block_dev_status_t, void *), void *context)
+{
+    return submit((struct ahci_port *)state,blocknum,count,src,1,callback,context);
+}
+
+static struct nk_block_dev_int inter =
+{
+    .get_characteristics = get_characteristics,
+    .read_blocks = read_blocks,
+    .write_blocks = write_blocks,
+};
+
+
+static int irq_handler(excp_entry_t *excp, excp_vec_t vec, void *priv)
+{
+    struct ahci_hba *h = (struct ahci_hba *)priv;
+    uint32_t is = HBA_READ(h,HBA_IS);
+    int i;
+
+    for (i=0;i<32;i++) {
+	if (is & (1U<<i)) {
+	    if (h->ports[i]) {
+		port_complete(h->ports[i]);
+	    } else {
+		HBA_WRITE(h,PORT_BASE(i)+PX_IS,0xffffffff);
+	    }
+	}
+    }
+
+    // port status must be cleared before the global bit
+    HBA_WRITE(h,HBA_IS,is);
+
+    IRQ_HANDLER_END();
+
+    return 0;
+}
+
+
+static int recovery_wanted(void *state)
+{
+    struct ahci_port *p = (struct ahci_port *)state;
+    return p->recovering || p->stopping;
+}
+
+// Everything in flight was failed when the error was seen, so the
+// port is idle here.  A device that reported a queued error aborts
+// every later queued command until it is reset or its NCQ error log
+// is read, so after a queued error we always reset the link.
+static void port_recover(struct ahci_port *p)
+{
+    STATE_LOCK_CONF;
+
+    port_stop(p);
+    if (p->ncq || (PORT_READ(p,PX_TFD) & (PXTFD_BSY | PXTFD_DRQ))) {
+	port_reset(p);
+    }
+    if (port_start(p)) {
+	ERROR("%s: port did not restart after error recovery\n",p->name);
+    }
+
+    STATE_LOCK(p);
+    PORT_WRITE(p,PX_IS,0xffffffff);
+    p->recovering = 0;
+    STATE_UNLOCK(p);
+
+    INFO("%s: recovered from error\n",p->name);
+}
+
+static void recovery_thread(void *in, void **out)
+{
+    struct ahci_port *p = (struct ahci_port *)in;
+
+    nk_thread_name(get_cur_thread(),p->name);
+
+    while (1) {
+	nk_wait_queue_sleep_extended(p->recovery_wq,recovery_wanted,p);
+	if (p->stopping) {
+	    break;
+	}
+	port_recover(p);
+    }
+
+    p->recovery_exited = 1;
+}
+
+
+// polled, used only before the port's interrupts are on
+static int identify(struct ahci_port *p, uint16_t *id)
+{
+    build_command(p,0,ATA_IDENTIFY,0,0,(uint8_t *)id,512,0);
+
+    PORT_WRITE(p,PX_IS,0xffffffff);
+    mbarrier();
+    PORT_WRITE(p,PX_CI,1);
+
+    int i;
+    for (i=0;i<TIMEOUT_CMD*10;i++) {
+	if (PORT_READ(p,PX_IS) & PXIS_ERR) {
+	    ERROR("%s: identify failed (tfd=0x%x)\n",p->name,PORT_READ(p,PX_TFD));
+	    return -1;
+	}
+	if (!(PORT_READ(p,PX_CI) & 1)) {
+	    PORT_WRITE(p,PX_IS,0xffffffff);
+	    return 0;
+	}
+	udelay(100);
+    }
+
+    ERROR("%s: identify timed out\n",p->name);
+    return -1;
+}
+
+static void free_port(struct ahci_port *p)
+{
+    if (p) {
+	if (p->recovery_wq) {
+	    nk_wait_queue_destroy(p->recovery_wq);
+	}
+	free(p->mem);
+	free(p);
+    }
+}
+
+static struct ahci_port *bringup_port(struct ahci_hba *h, int num)
+{
+    struct ahci_port *p;
+    uint16_t *id = 0;
+
+    p = malloc(sizeof(*p));
+    if (!p) {
+	ERROR("Cannot allocate port state\n");
+	return 0;
+    }
+    memset(p,0,sizeof(*p));
+    spinlock_init(&p->lock);
+    p->hba = h;
+    p->num = num;
+    snprintf(p->name,32,"ahci%d-%d",h->num,num);
+
+    p->mem = malloc(PORT_MEM + 1024);
+    id = malloc(512);
+    if (!p->mem || !id) {
+	ERROR("%s: cannot allocate command memory\n",p->name);
+	goto out_bad;
+    }
+    memset(p->mem,0,PORT_MEM + 1024);
+
+    uint64_t base = ((uint64_t)p->mem + 1023) & ~1023UL;
+    if (!(h->cap & CAP_S64A) && base + PORT_MEM > 0x100000000ULL) {
+	ERROR("%s: command memory is beyond the controller's 32 bit reach\n",p->name);
+	goto out_bad;
+    }
+    p->cl = (struct ahci_cmd_header *)base;
+    p->fis = (uint8_t *)(base + CL_SIZE);
+    p->ct = (uint8_t *)(base + CL_SIZE + FIS_SIZE);
+
+    int i;
+    for (i=0;i<AHCI_MAX_SLOTS;i++) {
+	uint64_t ct = (uint64_t)CMD_TABLE(p,i);
+	p->cl[i].ctba = (uint32_t)ct;
+	p->cl[i].ctbau = (uint32_t)(ct>>32);
+    }
+
+    if (port_stop(p)) {
+	goto out_bad;
+    }
+
+    PORT_WRITE(p,PX_IE,0);
+    PORT_WRITE(p,PX_CLB,(uint32_t)(uint64_t)p->cl);
+    PORT_WRITE(p,PX_CLBU,(uint32_t)((uint64_t)p->cl>>32));
+    PORT_WRITE(p,PX_FB,(uint32_t)(uint64_t)p->fis);
+    PORT_WRITE(p,PX_FBU,(uint32_t)((uint64_t)p->fis>>32));
+
+    if (port_start(p)) {
+	goto out_bad;
+    }
+
+    if (PORT_READ(p,PX_SIG)!=PXSIG_ATA) {
+	DEBUG("%s: signature 0x%x is not a SATA disk\n",p->name,PORT_READ(p,PX_SIG));
+	goto out_stop;
+    }
+
+    if (identify(p,id)) {
+	goto out_stop;
+    }
+
+    if (!(id[83] & (1U<<10))) {
+	ERROR("%s: disk does not support LBA48\n",p->name);
+	goto out_stop;
+    }
+
+    p->num_blocks = ((uint64_t)id[103]<<48) | ((uint64_t)id[102]<<32) |
+	((uint64_t)id[101]<<16) | id[100];
+    p->block_size = 512;
+    if ((id[106] & 0xc000)==0x4000 && (id[106] & (1U<<12))) {
+	p->block_size = 2 * (((uint64_t)id[118]<<16) | id[117]);
+    }
+    p->max_blocks = (AHCI_PRDS*AHCI_PRD_MAX)/p->block_size;
+    if (p->max_blocks > 0xffff) {
+	p->max_blocks = 0xffff;
+    }
+
+    int depth = h->num_slots;
+    if ((h->cap & CAP_SNCQ) && (id[76] & (1U<<8))) {
+	p->ncq = 1;
+	if ((id[75] & 0x1f)+1 < depth) {
+	    depth = (id[75] & 0x1f)+1;
+	}
+    }
+    p->slots = depth==32 ? 0xffffffff : ((1U<<depth)-1);
+
+    free(id);
+
+    PORT_WRITE(p,PX_IS,0xffffffff);
+    PORT_WRITE(p,PX_IE,PXIS_DONE | PXIS_ERR);
+
+    return p;
+
+ out_stop:
+    port_stop(p);
+ out_bad:
+    free(id);
+    free_port(p);
+    return 0;
+}
+
+
+static int setup_interrupts(struct ahci_hba *h)
+{
+    struct pci_dev *d = h->pci_dev;
+
+    if (d->msix.type==PCI_MSI_X) {
+	if (!pci_dev_enable_msi_x(d) &&
+	    !pci_dev_msi_x_alloc_vector(d,0,0,irq_handler,h,&h->vec) &&
+	    !pci_dev_unmask_msi_x_all(d)) {
+	    h->itype = AHCI_MSI_X;
+	    return 0;
+	}
+	ERROR("Cannot set up MSI-X, trying MSI\n");
+	pci_dev_disable_msi_x(d);
+    }
+
+    if (d->msi.type!=PCI_MSI_NONE) {
+	uint64_t vec;
+	// the controller uses only the first vector unless told otherwise
+	if (idt_find_and_reserve_range(1,1,&vec)) {
+	    ERROR("Cannot find a vector for MSI\n");
+	} else if (pci_dev_enable_msi(d,vec,1,0) ||
+		   register_int_handler(vec,irq_handler,h) ||
+		   pci_dev_unmask_msi(d,vec)) {
+	    ERROR("Cannot set up MSI, trying legacy interrupts\n");
+	    idt_assign_entry(vec,(ulong_t)null_irq_handler,0);
+	} else {
+	    h->itype = AHCI_MSI;
+	    h->vec = vec;
+	    return 0;
+	}
+    }
+
+    uint8_t line = d->cfg.dev_cfg.intr_line;
+    if (!line || line==0xff) {
+	ERROR("No interrupt line assigned\n");
+	return -1;
+    }
+    h->itype = AHCI_LEGACY;
+    h->vec = line;
+    register_irq_handler(line,irq_handler,h);
+    nk_unmask_irq(line);
+    return 0;
+}
+
+// take the controller from the firmware if it has a handoff protocol
+static void bios_handoff(struct ahci_hba *h)
+{
+    int i;
+
+    if (!(HBA_READ(h,HBA_CAP2) & CAP2_BOH)) {
+	return;
+    }
+    HBA_WRITE(h,HBA_BOHC,HBA_READ(h,HBA_BOHC) | BOHC_OOS);
+    for (i=0;i<TIMEOUT_BOH*10;i++) {
+	uint32_t bohc = HBA_READ(h,HBA_BOHC);
+	if (!(bohc & (BOHC_BOS | BOHC_BB))) {
+	    return;
+	}
+	udelay(100);
+    }
+    ERROR("Firmware did not release the controller - continuing anyway\n");
+}
+
+static int bringup_hba(struct pci_dev *d, void *state)
+{
+    struct pci_cfg_space *cfg = &d->cfg;
+    struct ahci_hba *h;
+    int i, count=0;
+
+    if (cfg->class_code!=AHCI_CLASS ||
+	cfg->subclass!=AHCI_SUBCLASS ||
+	cfg->prog_if!=AHCI_PROGIF) {
+	return 0;
+    }
+
+    if (num_hbas==sizeof(hbas)/sizeof(hbas[0])) {
+	ERROR("Too many controllers, ignoring %u:%u.%u\n",d->bus->num,d->num,d->fun);
+	return 0;
+    }
+
+    h = malloc(sizeof(*h));
+    if (!h) {
+	ERROR("Cannot allocate controller state\n");
+	return -1;
+    }
+    memset(h,0,sizeof(*h));
+    h->pci_dev = d;
+    h->num = num_hbas;
+    h->abar = (volatile uint8_t *)pci_dev_get_bar_addr(d,AHCI_ABAR);
+
+    if (!h->abar) {
+	ERROR("Controller %u:%u.%u has no ABAR\n",d->bus->num,d->num,d->fun);
+	free(h);
+	return 0;
+    }
+
+    pci_dev_enable_mmio(d);
+    pci_dev_enable_master(d);
+
+    bios_handoff(h);
+
+    HBA_WRITE(h,HBA_GHC,HBA_READ(h,HBA_GHC) | GHC_AE);
+    HBA_WRITE(h,HBA_GHC,HBA_READ(h,HBA_GHC) & ~GHC_IE);
+
+    h->cap = HBA_READ(h,HBA_CAP);
+    h->num_slots = CAP_NCS(h->cap);
+
+    INFO("Found controller %u:%u.%u: version 0x%x abar=%p slots=%d ncq=%s 64bit=%s ports=0x%x\n",
+	 d->bus->num,d->num,d->fun,HBA_READ(h,HBA_VS),h->abar,h->num_slots,
+	 h->cap & CAP_SNCQ ? "yes" : "no", h->cap & CAP_S64A ? "yes" : "no",
+	 HBA_READ(h,HBA_PI));
+
+    uint32_t pi = HBA_READ(h,HBA_PI);
+
+    for (i=0;i<32;i++) {
+	if (!(pi & (1U<<i))) {
+	    continue;
+	}
+	if (PXSSTS_DET(HBA_READ(h,PORT_BASE(i)+PX_SSTS))!=PXSSTS_DET_PHY) {
+	    DEBUG("Port %d has no device\n",i);
+	    continue;
+	}
+	h->ports[i] = bringup_port(h,i);
+	if (h->ports[i]) {
+	    count++;
+	}
+    }
+
+    if (!count) {
+	INFO("No usable disks on controller %d\n",h->num);
+	free(h);
+	return 0;
+    }
+
+    hbas[num_hbas++] = h;
+
+    if (setup_interrupts(h)) {
+	ERROR("Cannot set up interrupts on controller %d\n",h->num);
+	return -1;
+    }
+
+    HBA_WRITE(h,HBA_IS,0xffffffff);
+    HBA_WRITE(h,HBA_GHC,HBA_READ(h,HBA_GHC) | GHC_IE);
+
+    for (i=0;i<32;i++) {
+	struct ahci_port *p = h->ports[i];
+	if (!p) {
+	    continue;
+	}
+	p->recovery_wq = nk_wait_queue_create(0);
+	if (!p->recovery_wq ||
+	    nk_thread_start(recovery_thread,p,0,1,TSTACK_DEFAULT,0,CPU_ANY)) {
+	    ERROR("Cannot start error recovery for %s\n",p->name);
+	    PORT_WRITE(p,PX_IE,0);
+	    port_stop(p);
+	    free_port(p);
+	    h->ports[i] = 0;
+	    continue;
+	}
+	p->blkdev = nk_block_dev_register(p->name,0,&inter,p);
+	if (!p->blkdev) {
+	    ERROR("Failed to register %s\n",p->name);
+	    continue;
+	}
+	INFO("Added disk %s, blocksize=%lu, numblocks=%lu, %s depth %d, %s interrupts on vector %d\n",
+	     p->name, p->block_size, p->num_blocks,
+	     p->ncq ? "NCQ" : "no NCQ", __builtin_popcount(p->slots),
+	     h->itype==AHCI_MSI_X ? "MSI-X" : h->itype==AHCI_MSI ? "MSI" : "legacy",
+	     h->vec);
+    }
+
+    return 0;
+}
+
+
+int nk_ahci_init(struct naut_info *naut)
+{
+    INFO("init\n");
+    return pci_map_over_devices(bringup_hba,0xffff,0xffff,0);
+}
+
+void nk_ahci_deinit()
+{
+    int i,j;
+
+    INFO("deinit\n");
+
+    for (i=0;i<num_hbas;i++) {
+	struct ahci_hba *h = hbas[i];
+	HBA_WRITE(h,HBA_GHC,HBA_READ(h,HBA_GHC) & ~GHC_IE);
+	for (j=0;j<32;j++) {
+	    struct ahci_port *p = h->ports[j];
+	    if (!p) {
+		continue;
+	    }
+	    PORT_WRITE(p,PX_IE,0);
+	    if (p->recovery_wq) {
+		p->stopping = 1;
+		nk_wait_queue_wake_all(p->recovery_wq);
+		while (!p->recovery_exited) {
+		    nk_yield();
+		}
+	    }
+	    port_stop(p);
+	    if (p->blkdev) {
+		nk_block_dev_unregister(p->blkdev);
+	    }
+	    free_port(p);
+	}
+	free(h);
+    }
+    num_hbas = 0;
+}
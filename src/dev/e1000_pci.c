@@ -33,6 +33,8 @@
 #include <dev/e1000_pci.h>
 #include <nautilus/irq.h>             // interrupt register
 #include <nautilus/naut_string.h>     // memset, memcpy
+#include <nautilus/shell.h>
+#include <dev/e1000_itr.h>           // interrupt moderation
 
 
 
@@ -303,6 +305,8 @@ struct e1000_state {
   // a circular queue mapping between callback funtion and rx descriptor
   struct e1000_map_ring *rx_map;
   uint64_t rx_buffer_size;
+  // interrupt moderation
+  struct e1000_itr itr;
 };
 
 static struct list_head dev_list;
@@ -671,6 +675,19 @@ static int e1000_post_receive(void *state,
   return result;
 }
 
+// program ITR and the receive timers from the moderation state
+static void e1000_itr_program(struct e1000_state *state)
+{
+  WRITE_MEM(state, E1000_ITR_REG_OFFSET, e1000_itr_reg(state->itr.rate));
+  WRITE_MEM(state, E1000_RDTR_OFFSET, e1000_itr_rdtr(&state->itr));
+  WRITE_MEM(state, E1000_RADV_REG_OFFSET, e1000_itr_radv(&state->itr));
+  DEBUG("%s %u ints/s ITR 0x%08x RDTR 0x%08x RADV 0x%08x\n",
+        e1000_itr_class_name(state->itr.cur_class), state->itr.rate,
+        READ_MEM(state, E1000_ITR_REG_OFFSET),
+        READ_MEM(state, E1000_RDTR_OFFSET),
+        READ_MEM(state, E1000_RADV_REG_OFFSET));
+}
+
 static int e1000_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s) 
 {
   DEBUG("e1000_irq_handler fn vector: 0x%x rip: 0x%p\n", vec, excp->rip);
@@ -686,20 +703,32 @@ static int e1000_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s)
   
   void (*callback)(nk_net_dev_status_t, void*) = NULL;
   void *context = NULL;
-  nk_net_dev_status_t status = NK_NET_DEV_STATUS_SUCCESS;
-  
+  nk_net_dev_status_t status;
+
+  // with interrupt moderation, one interrupt can cover many
+  // packets, so we reap every descriptor the device has finished
+
   if(mask_int & E1000_ICR_TXDW) {
     // transmit interrupt
     DEBUG("handle the txdw interrupt\n");
-    e1000_unmap_callback(state->tx_map, (uint64_t **)&callback, (void **)&context);
-    // if there is an error while sending a packet, set the error status
-    if(TXD_STATUS(TXD_PREV_HEAD).ec || TXD_STATUS(TXD_PREV_HEAD).lc) {
-      ERROR("transmit errors\n");
-      status = NK_NET_DEV_STATUS_ERROR;
-    }
+    while(TXD_PREV_HEAD != TXD_TAIL && TXD_STATUS(TXD_PREV_HEAD).dd) {
+      status = NK_NET_DEV_STATUS_SUCCESS;
+      e1000_unmap_callback(state->tx_map, (uint64_t **)&callback, (void **)&context);
+      // if there is an error while sending a packet, set the error status
+      if(TXD_STATUS(TXD_PREV_HEAD).ec || TXD_STATUS(TXD_PREV_HEAD).lc) {
+        ERROR("transmit errors\n");
+        status = NK_NET_DEV_STATUS_ERROR;
+      }
+      e1000_itr_tx(&state->itr, TXD_LENGTH(TXD_PREV_HEAD));
+
+      // update the head of the ring buffer
+      TXD_PREV_HEAD = TXD_INC(1, TXD_PREV_HEAD);
 
-    // update the head of the ring buffer
-    TXD_PREV_HEAD = TXD_INC(1, TXD_PREV_HEAD);
+      if(callback) {
+        DEBUG("invoke callback function callback: 0x%p\n", callback);
+        callback(status, context);
+      }
+    }
     DEBUG("total packet transmitted = %d\n",
           READ_MEM(state, E1000_TPT_OFFSET));    
   }
@@ -707,27 +736,35 @@ static int e1000_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s)
   if(mask_int & E1000_ICR_RXT0) {
     // receive interrupt
     DEBUG("handle the rxt0 interrupt\n");
-    e1000_unmap_callback(state->rx_map, (uint64_t **)&callback, (void **)&context);
-    // checking errors
-    if(RXD_ERRORS(RXD_PREV_HEAD)) {
-      ERROR("receive an error packet\n");
-      status = NK_NET_DEV_STATUS_ERROR;
+    while(RXD_PREV_HEAD != RXD_TAIL && RXD_STATUS(RXD_PREV_HEAD).dd) {
+      status = NK_NET_DEV_STATUS_SUCCESS;
+      e1000_unmap_callback(state->rx_map, (uint64_t **)&callback, (void **)&context);
+      // checking errors
+      if(RXD_ERRORS(RXD_PREV_HEAD)) {
+        ERROR("receive an error packet\n");
+        status = NK_NET_DEV_STATUS_ERROR;
+      }
+      e1000_itr_rx(&state->itr, RXD_LENGTH(RXD_PREV_HEAD));
+
+      // in the irq, update only the head of the buffer
+      RXD_PREV_HEAD = RXD_INC(1, RXD_PREV_HEAD);    
+
+      if(callback) {
+        DEBUG("invoke callback function callback: 0x%p\n", callback);
+        callback(status, context);
+      }
     }
     DEBUG("RDLEN=0x%08x, RDH=0x%08x, RDT=0x%08x, RCTL=0x%08x\n",
 		    READ_MEM(state, RDLEN_OFFSET),
 		    READ_MEM(state, RDH_OFFSET),
 		    READ_MEM(state, RDT_OFFSET),
 		    READ_MEM(state, RCTL_OFFSET));
-    
-    // in the irq, update only the head of the buffer
-    RXD_PREV_HEAD = RXD_INC(1, RXD_PREV_HEAD);    
     DEBUG("total packet received = %d\n",
           READ_MEM(state, E1000_TPR_OFFSET));
   }
 
-  if(callback) {
-    DEBUG("invoke callback function callback: 0x%p\n", callback);
-    callback(status, context);
+  if(e1000_itr_update(&state->itr)) {
+    e1000_itr_program(state);
   }
 
   DEBUG("end irq\n\n\n");
@@ -882,7 +919,7 @@ int e1000_pci_init(struct naut_info * naut)
         DEBUG("e1000 mac_high = 0x%x mac_low = 0x%x\n", mac_high, mac_low);
         memcpy(state->mac_addr, &mac_all, ETHER_MAC_LEN);
 
-        list_add(&dev_list, &state->e1000_node);
+        list_add(&state->e1000_node, &dev_list);
         sprintf(state->name, "e1000-%d", num);
         num++;
 
@@ -902,6 +939,9 @@ int e1000_pci_init(struct naut_info * naut)
 	// receive interrupt delay timer = 0
 	// -> interrupt when the device receives a package
 	WRITE_MEM(state, E1000_RDTR_OFFSET, 0);
+	// interrupt moderation then takes over ITR, RDTR, and RADV
+	e1000_itr_init(&state->itr);
+	e1000_itr_program(state);
 	// enable only transmit descriptor written back and receive interrupt timer
 	WRITE_MEM(state, E1000_IMS_OFFSET, E1000_ICR_TXDW | E1000_ICR_RXT0);
 	// after the interrupt is turned on, the interrupt handler is called
@@ -927,6 +967,42 @@ int e1000_pci_init(struct naut_info * naut)
   return 0;
 }
 
+static int handle_e1000_itr(char *buf, void *priv)
+{
+  struct list_head *cur;
+  char name[DEV_NAME_LEN];
+  char arg[32];
+  int n = sscanf(buf, "e1000_itr %31s %31s", name, arg);
+
+  list_for_each(cur, &dev_list) {
+    struct e1000_state *state = list_entry(cur, struct e1000_state, e1000_node);
+    if (n >= 1 && strcmp(name, state->name)) {
+      continue;
+    }
+    if (n == 2) {
+      uint8_t flags = irq_disable_save();
+      int rc = e1000_itr_set_mode(&state->itr, arg);
+      if (!rc) {
+        e1000_itr_program(state);
+      }
+      irq_enable_restore(flags);
+      if (rc) {
+        nk_vc_printf("unknown mode %s\n", arg);
+        return 0;
+      }
+    }
+    e1000_itr_dump(&state->itr, state->name);
+  }
+  return 0;
+}
+
+static struct shell_cmd_impl e1000_itr_impl = {
+  .cmd      = "e1000_itr",
+  .help_str = "e1000_itr [dev [adaptive|off|ints/s]]",
+  .handler  = handle_e1000_itr,
+};
+nk_register_shell_cmd(e1000_itr_impl);
+
 int e1000_pci_deinit() 
 {
   INFO("deinited\n");
@@ -36,6 +36,8 @@
 #include <nautilus/dev.h>             // NK_DEV_REQ_*
 #include <nautilus/timer.h>           // nk_sleep(ns);
 #include <nautilus/cpu.h>             // udelay
+#include <nautilus/shell.h>
+#include <dev/e1000_itr.h>           // interrupt moderation
 
 #ifndef NAUT_CONFIG_DEBUG_E1000E_PCI
 #undef DEBUG_PRINT
@@ -487,6 +489,8 @@ struct e1000e_state {
   uint64_t rx_buffer_size;
   // interrupt mark set
   uint32_t ims_reg;
+  // interrupt moderation
+  struct e1000_itr itr;
 
 #if TIMING
   volatile iteration_t measure;
@@ -991,6 +995,19 @@ static int e1000e_post_receive(void *vstate,
   return result;
 }
 
+// program ITR and the receive timers from the moderation state
+static void e1000e_itr_program(struct e1000e_state *state)
+{
+  WRITE_MEM(state, E1000_ITR_REG_OFFSET, e1000_itr_reg(state->itr.rate));
+  WRITE_MEM(state, E1000E_RDTR_OFFSET_NEW, e1000_itr_rdtr(&state->itr));
+  WRITE_MEM(state, E1000E_RADV_OFFSET, e1000_itr_radv(&state->itr));
+  DEBUG("itr program fn: %s %u ints/s ITR 0x%08x RDTR 0x%08x RADV 0x%08x\n",
+        e1000_itr_class_name(state->itr.cur_class), state->itr.rate,
+        READ_MEM(state, E1000_ITR_REG_OFFSET),
+        READ_MEM(state, E1000E_RDTR_OFFSET_NEW),
+        READ_MEM(state, E1000E_RADV_OFFSET));
+}
+
 enum pkt_op { op_unknown, op_tx, op_rx };
 
 static int e1000e_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s)
@@ -1014,27 +1031,40 @@ static int e1000e_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s)
 
   void (*callback)(nk_net_dev_status_t, void*) = NULL;
   void *context = NULL;
-  nk_net_dev_status_t status = NK_NET_DEV_STATUS_SUCCESS;
+  nk_net_dev_status_t status;
+
+  // with interrupt moderation, one interrupt can cover many
+  // packets, so we reap every descriptor the device has finished
 
   if (mask_int & (E1000E_ICR_TXDW | E1000E_ICR_TXQ0)) {
-    
     which_op = op_tx;
     // transmit interrupt
     DEBUG("irq_handler fn: handle the txdw interrupt\n");
-    TIMING_GET_TSC(state->measure.tx.irq_unmap.start);
-    e1000e_unmap_callback(state->tx_map,
-                          (uint64_t **)&callback,
-                          (void **)&context);
-    TIMING_GET_TSC(state->measure.tx.irq_unmap.end);
-    
-    // if there is an error while sending a packet, set the error status
-    if (TXD_STATUS(TXD_PREV_HEAD).ec || TXD_STATUS(TXD_PREV_HEAD).lc) {
-      ERROR("irq_handler fn: transmit errors\n");
-      status = NK_NET_DEV_STATUS_ERROR;
-    }
+    while (TXD_PREV_HEAD != TXD_TAIL && TXD_STATUS(TXD_PREV_HEAD).dd) {
+      status = NK_NET_DEV_STATUS_SUCCESS;
+      TIMING_GET_TSC(state->measure.tx.irq_unmap.start);
+      e1000e_unmap_callback(state->tx_map,
+                            (uint64_t **)&callback,
+                            (void **)&context);
+      TIMING_GET_TSC(state->measure.tx.irq_unmap.end);
+
+      // if there is an error while sending a packet, set the error status
+      if (TXD_STATUS(TXD_PREV_HEAD).ec || TXD_STATUS(TXD_PREV_HEAD).lc) {
+        ERROR("irq_handler fn: transmit errors\n");
+        status = NK_NET_DEV_STATUS_ERROR;
+      }
+      e1000_itr_tx(&state->itr, TXD_LENGTH(TXD_PREV_HEAD));
 
-    // update the head of the ring buffer
-    TXD_PREV_HEAD = TXD_INC(1, TXD_PREV_HEAD);
+      // update the head of the ring buffer
+      TXD_PREV_HEAD = TXD_INC(1, TXD_PREV_HEAD);
+
+      TIMING_GET_TSC(callback_start);
+      if (callback) {
+        DEBUG("irq_handler fn: invoke callback function callback: 0x%p\n", callback);
+        callback(status, context);
+      }
+      TIMING_GET_TSC(callback_end);
+    }
     DEBUG("irq_handler fn: total packet transmitted = %d\n",
           READ_MEM(state, E1000E_TPT_OFFSET));
   }
@@ -1042,41 +1072,36 @@ static int e1000e_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s)
   if (mask_int & (E1000E_ICR_RXT0 | E1000E_ICR_RXO | E1000E_ICR_RXQ0)) {
     which_op = op_rx;
     // receive interrupt
-    /* if (mask_int & E1000E_ICR_RXT0) { */
-    /*   DEBUG("irq_handler fn: handle the rxt0 interrupt\n"); */
-    /* } */
+    while (RXD_PREV_HEAD != RXD_TAIL && RXD_STATUS(RXD_PREV_HEAD).dd) {
+      status = NK_NET_DEV_STATUS_SUCCESS;
+      TIMING_GET_TSC(state->measure.rx.irq_unmap.start);
+      e1000e_unmap_callback(state->rx_map,
+                            (uint64_t **)&callback,
+                            (void **)&context);
+      TIMING_GET_TSC(state->measure.rx.irq_unmap.end);
+
+      // checking errors
+      if (RXD_ERRORS(RXD_PREV_HEAD)) {
+        ERROR("irq_handler fn: receive an error packet\n");
+        status = NK_NET_DEV_STATUS_ERROR;
+      }
+      e1000_itr_rx(&state->itr, RXD_LENGTH(RXD_PREV_HEAD));
 
-    /* if (mask_int & E1000E_ICR_RXO) { */
-    /*   DEBUG("irq_handler fn: handle the rx0 interrupt\n"); */
-    /* } */
-   
-    // INFO("rx length %d\n", RXD_LENGTH(RXD_PREV_HEAD));
-    TIMING_GET_TSC(state->measure.rx.irq_unmap.start);
-    e1000e_unmap_callback(state->rx_map,
-                          (uint64_t **)&callback,
-                          (void **)&context);
-    TIMING_GET_TSC(state->measure.rx.irq_unmap.end);
-
-    // e1000e_interpret_ims(state);
-    // TODO: check if we need this line
-    // WRITE_MEM(state, E1000E_IMC_OFFSET, E1000E_ICR_RXO);
-    
-    // checking errors
-    if (RXD_ERRORS(RXD_PREV_HEAD)) {
-      ERROR("irq_handler fn: receive an error packet\n");
-      status = NK_NET_DEV_STATUS_ERROR;
-    }
+      // in the irq, update only the head of the buffer
+      RXD_PREV_HEAD = RXD_INC(1, RXD_PREV_HEAD);
 
-    // in the irq, update only the head of the buffer
-    RXD_PREV_HEAD = RXD_INC(1, RXD_PREV_HEAD);
+      TIMING_GET_TSC(callback_start);
+      if (callback) {
+        DEBUG("irq_handler fn: invoke callback function callback: 0x%p\n", callback);
+        callback(status, context);
+      }
+      TIMING_GET_TSC(callback_end);
+    }
   }
 
-  TIMING_GET_TSC(callback_start);
-  if (callback) {
-    DEBUG("irq_handler fn: invoke callback function callback: 0x%p\n", callback);
-    callback(status, context);
+  if (e1000_itr_update(&state->itr)) {
+    e1000e_itr_program(state);
   }
-  TIMING_GET_TSC(callback_end);
 
   DEBUG("irq_handler fn: end irq\n\n\n");
   // DO NOT DELETE THIS LINE.
@@ -1253,7 +1278,7 @@ int e1000e_pci_init(struct naut_info * naut)
         DEBUG("init fn: pci status 0x%04x\n",
               pci_cfg_readw(bus->num,pdev->num, 0, E1000E_PCI_STATUS_OFFSET));
 	
-        list_add(&dev_list, &state->node);
+        list_add(&state->node, &dev_list);
         sprintf(state->name, "e1000e-%d", num);
         num++;
         
@@ -1410,6 +1435,10 @@ int e1000e_pci_init(struct naut_info * naut)
 		  READ_MEM(state, E1000E_RDTR_OFFSET_ALIAS),
 		  E1000E_RDTR_FPD);
 	    WRITE_MEM(state, E1000E_RADV_OFFSET, 0);
+
+	    // interrupt moderation then takes over ITR, RDTR, and RADV
+	    e1000_itr_init(&state->itr);
+	    e1000e_itr_program(state);
 	    
 	    // enable only transmit descriptor written back, receive interrupt timer
 	    // rx queue 0
@@ -1444,6 +1473,42 @@ int e1000e_pci_init(struct naut_info * naut)
 
 }
 
+static int handle_e1000e_itr(char *buf, void *priv)
+{
+  struct list_head *cur;
+  char name[DEV_NAME_LEN];
+  char arg[32];
+  int n = sscanf(buf, "e1000e_itr %31s %31s", name, arg);
+
+  list_for_each(cur, &dev_list) {
+    struct e1000e_state *state = list_entry(cur, struct e1000e_state, node);
+    if (n >= 1 && strcmp(name, state->name)) {
+      continue;
+    }
+    if (n == 2) {
+      uint8_t flags = irq_disable_save();
+      int rc = e1000_itr_set_mode(&state->itr, arg);
+      if (!rc) {
+        e1000e_itr_program(state);
+      }
+      irq_enable_restore(flags);
+      if (rc) {
+        nk_vc_printf("unknown mode %s\n", arg);
+        return 0;
+      }
+    }
+    e1000_itr_dump(&state->itr, state->name);
+  }
+  return 0;
+}
+
+static struct shell_cmd_impl e1000e_itr_impl = {
+  .cmd      = "e1000e_itr",
+  .help_str = "e1000e_itr [dev [adaptive|off|ints/s]]",
+  .handler  = handle_e1000e_itr,
+};
+nk_register_shell_cmd(e1000e_itr_impl);
+
 int e1000e_pci_deinit() {
   INFO("deinited and leaking\n");
   return 0;
@@ -29,6 +29,7 @@
 #include <nautilus/mm.h>
 #include <nautilus/shell.h>
 #include <nautilus/dev.h>
+#include <nautilus/irq.h>
 
 #ifndef NAUT_CONFIG_DEBUG_PCI
 #undef DEBUG_PRINT
@@ -1699,6 +1700,119 @@ int pci_dev_unmask_msi_x_all(struct pci_dev *dev)
 }
 
 
+static int msi_x_cpu_to_apic(int cpu)
+{
+  struct sys_info *sys = &nk_get_nautilus_info()->sys;
+
+  if (cpu<0) {
+    cpu = my_cpu_id();
+  }
+
+  if (cpu >= sys->num_cpus) {
+    PCI_ERROR("cpu %d does not exist\n",cpu);
+    return -1;
+  }
+
+  return sys->cpus[cpu]->lapic_id;
+}
+
+int pci_dev_msi_x_alloc_vector(struct pci_dev *dev, int num, int cpu,
+			       int (*handler)(excp_entry_t *, excp_vec_t, void *),
+			       void *priv, int *vec_out)
+{
+  ulong_t vec;
+  int apic;
+
+  if (dev->msix.type!=PCI_MSI_X || num<0 || num>=dev->msix.size) {
+    PCI_ERROR("no MSI-X entry %d on device\n",num);
+    return -1;
+  }
+
+  if ((apic = msi_x_cpu_to_apic(cpu))<0) {
+    return -1;
+  }
+
+  if (idt_find_and_reserve_range(1,0,&vec)) {
+    PCI_ERROR("cannot find a free vector for MSI-X entry %d\n",num);
+    return -1;
+  }
+
+  if (register_int_handler(vec,handler,priv) ||
+      pci_dev_set_msi_x_entry(dev,num,vec,apic) ||
+      pci_dev_unmask_msi_x_entry(dev,num)) {
+    PCI_ERROR("failed to set up MSI-X entry %d\n",num);
+    pci_dev_set_msi_x_entry(dev,num,0,0);
+    idt_assign_entry(vec,(ulong_t)null_irq_handler,0);
+    return -1;
+  }
+
+  PCI_DEBUG("MSI-X entry %d => vector 0x%lx on cpu %d (apic %d)\n",num,vec,cpu,apic);
+
+  if (vec_out) {
+    *vec_out = vec;
+  }
+
+  return 0;
+}
+
+int pci_dev_msi_x_set_affinity(struct pci_dev *dev, int num, int cpu)
+{
+  pci_msi_x_table_entry_t *t;
+  uint32_t mdr, vc;
+  int apic;
+
+  if (dev->msix.type!=PCI_MSI_X || num<0 || num>=dev->msix.size) {
+    PCI_ERROR("no MSI-X entry %d on device\n",num);
+    return -1;
+  }
+
+  if ((apic = msi_x_cpu_to_apic(cpu))<0) {
+    return -1;
+  }
+
+  t = dev->msix.table + num;
+
+  READL(&t->msg_data,mdr);
+  READL(&t->vector_control,vc);
+
+  // rewriting the entry leaves it masked, and an interrupt
+  // that arrives meanwhile is held pending until we unmask
+  if (pci_dev_set_msi_x_entry(dev,num,mdr & 0xff,apic)) {
+    return -1;
+  }
+
+  if (!(vc & 1)) {
+    pci_dev_unmask_msi_x_entry(dev,num);
+  }
+
+  PCI_DEBUG("MSI-X entry %d moved to cpu %d (apic %d)\n",num,cpu,apic);
+
+  return 0;
+}
+
+int pci_dev_msi_x_free_vector(struct pci_dev *dev, int num)
+{
+  pci_msi_x_table_entry_t *t;
+  uint32_t mdr;
+
+  if (dev->msix.type!=PCI_MSI_X || num<0 || num>=dev->msix.size) {
+    PCI_ERROR("no MSI-X entry %d on device\n",num);
+    return -1;
+  }
+
+  t = dev->msix.table + num;
+
+  pci_dev_mask_msi_x_entry(dev,num);
+  READL(&t->msg_data,mdr);
+
+  if ((mdr & 0xff) >= 32) {
+    idt_assign_entry(mdr & 0xff,(ulong_t)null_irq_handler,0);
+  }
+
+  return 0;
+}
+
+
 int pci_dev_enable_msi_x(struct pci_dev *dev)
 {
   struct pci_msi_x_info *m = &dev->msix;
@@ -70,7 +70,7 @@ static int read_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *
 	  s->blkdev->dev.name, blocknum, count);
 
     STATE_LOCK(s);
-    if (blocknum+count >= s->num_blocks) { 
+    if (blocknum+count > s->num_blocks) { 
 	STATE_UNLOCK(s);
 	ERROR("Illegal access past end of disk\n");
 	return -1;
@@ -94,7 +94,7 @@ static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t
 	  s->blkdev->dev.name, blocknum, count);
 
     STATE_LOCK(s);
-    if (blocknum+count >= s->num_blocks) { 
+    if (blocknum+count > s->num_blocks) { 
 	STATE_UNLOCK(s);
 	ERROR("Illegal access past end of disk\n");
 	return -1;
@@ -109,12 +109,30 @@ static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t
 }
 
 
+// The ramdisk is just memory, so it can hand out pointers into
+// itself, letting the filesystems and the loader use the blocks
+// in place.   The data never moves, so no lock is needed.
+static void *get_block_ptr(void *state, uint64_t blocknum, uint64_t count)
+{
+    struct ramdisk_state *s = (struct ramdisk_state *)state;
+
+    DEBUG("get_block_ptr on device %s starting at %lu for %lu blocks\n",
+	  s->blkdev->dev.name, blocknum, count);
+
+    if (blocknum+count > s->num_blocks || blocknum+count < blocknum) { 
+	ERROR("Illegal access past end of disk\n");
+	return 0;
+    }
+
+    return s->data+blocknum*s->block_size;
+}
 
 static struct nk_block_dev_int inter = 
 {
     .get_characteristics = get_characteristics,
     .read_blocks = read_blocks,
     .write_blocks = write_blocks,
+    .get_block_ptr = get_block_ptr,
 };
 
 static int discover_ramdisks()
@@ -52,7 +52,7 @@
 
 #define VIRTIO_BLK_OFF_CONFIG(v)     (virtio_pci_device_regs_start_legacy(v) + 0)
 
-#define VIRTIO_BLK_REQUEST_QUEUE  0 // virtqueue index 
+#define VIRTIO_BLK_REQUEST_QUEUE  0 // virtqueue index (the first, if multiqueue)
 
 #define VIRTIO_BLK_T_IN           0 // read request
 #define VIRTIO_BLK_T_OUT          1 // write request
@@ -91,6 +91,9 @@
 /* Device can toggle its cache between writeback andw ritethrough modes. */
 #define VIRTIO_BLK_F_CONFIG_WCE  	11   
 
+/* Device supports multiple request queues, number is in "num_queues" */
+#define VIRTIO_BLK_F_MQ          	12
+
 /* Legacy Interface: Feature bits */
 
 /* Host supports request barriers */ 
@@ -102,11 +105,20 @@
 
 static uint64_t num_devs = 0;
 
+// One per request virtq.  A CPU submits to queue (cpu % num_queues),
+// and that queue's completions are delivered to the CPU of the same
+// number, so with a queue per CPU, I/O stays on the CPU that issued it
+struct virtio_blk_queue {
+    spinlock_t                   lock;        // serializes avail ring updates
+    struct virtio_blk_callb     *blk_callb;   // by head descriptor index
+} __attribute__((aligned(64)));
+
 struct virtio_blk_dev {
     struct nk_block_dev         *blk_dev;     // nautilus block device
     struct virtio_pci_dev       *virtio_dev;  // nautilus pci device
     struct virtio_blk_config    *blk_config;  // virtio blk configuration
-    struct virtio_blk_callb     *blk_callb;   // virtio blk callbacks
+    uint16_t                     num_queues;
+    struct virtio_blk_queue      queue[MAX_VIRTQS];
 };
 
 struct virtio_blk_config {
@@ -216,9 +228,11 @@ static int read_write_blocks(struct virtio_blk_dev *dev, uint64_t blocknum, uint
 
     DEBUG("[allocate descriptors]\n");
 
+    uint16_t qidx = my_cpu_id() % dev->num_queues;
+    struct virtio_blk_queue *q = &dev->queue[qidx];
     uint16_t desc[3];
 
-    if (virtio_pci_desc_chain_alloc(dev->virtio_dev,VIRTIO_BLK_REQUEST_QUEUE,desc,3)) {
+    if (virtio_pci_desc_chain_alloc(dev->virtio_dev,qidx,desc,3)) {
 	ERROR("Failed to allocate descriptor chain\n");
 	free(hdr);
 	return -1;
@@ -228,7 +242,7 @@ static int read_write_blocks(struct virtio_blk_dev *dev, uint64_t blocknum, uint
     uint16_t buf_index = desc[1];
     uint16_t stat_index = desc[2];
 
-    struct virtq *vq = &dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].vq;
+    struct virtq *vq = &dev->virtio_dev->virtq[qidx].vq;
 
     DEBUG("[create descriptors]\n");
 
@@ -241,22 +255,24 @@ static int read_write_blocks(struct virtio_blk_dev *dev, uint64_t blocknum, uint
     DEBUG("[create status descriptor]\n");
     fill_stat_desc(vq, &hdr->status, stat_index);
 
-    dev->blk_callb[hdr_index].callback = callback;
-    dev->blk_callb[hdr_index].context = context;
+    q->blk_callb[hdr_index].callback = callback;
+    q->blk_callb[hdr_index].context = context;
 
-    DEBUG("request in indexes: header = %d, buffer = %d, status = %d\n", hdr_index, buf_index, stat_index);
+    DEBUG("request in indexes: queue = %u, header = %d, buffer = %d, status = %d\n", qidx, hdr_index, buf_index, stat_index);
 
     // update avail ring
+    uint8_t flags = spin_lock_irq_save(&q->lock);
     vq->avail->ring[vq->avail->idx % vq->qsz] = hdr_index;
     mbarrier();
     vq->avail->idx++;
     mbarrier();
+    spin_unlock_irq_restore(&q->lock, flags);
     
     DEBUG("available ring's hdr index = %d, at ring index %d\n", hdr_index, vq->avail->idx - 1);
     DEBUG("available ring's ring index for next hdr = %u\n", vq->avail->idx);
 
     DEBUG("[notify device]\n");
-    virtio_pci_write_regw(dev->virtio_dev, QUEUE_NOTIFY, VIRTIO_BLK_REQUEST_QUEUE);
+    virtio_pci_virtqueue_notify(dev->virtio_dev, qidx);
     
     return 0;
 }
@@ -290,15 +306,16 @@ static void teardown(struct virtio_pci_dev *dev)
     virtio_pci_virtqueue_deinit(dev);
 }
 
-static int process_used_ring(struct virtio_blk_dev *dev) 
+static int process_used_ring(struct virtio_blk_dev *dev, uint16_t qidx) 
 {
     uint16_t hdr_desc_idx; 
     void (*callback)(nk_block_dev_status_t, void *);
     void *context;
-    struct virtio_pci_virtq *virtq = &dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE];
-    struct virtq *vq = &dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].vq;
+    struct virtio_blk_queue *q = &dev->queue[qidx];
+    struct virtio_pci_virtq *virtq = &dev->virtio_dev->virtq[qidx];
+    struct virtq *vq = &dev->virtio_dev->virtq[qidx].vq;
      
-    DEBUG("[processing used ring]\n");
+    DEBUG("[processing used ring of queue %u]\n", qidx);
     DEBUG("current virtq used index = %d\n", virtq->vq.used->idx);
     DEBUG("last seen used index = %d\n", virtq->last_seen_used);
      
@@ -319,10 +336,10 @@ static int process_used_ring(struct virtio_blk_dev *dev)
 	DEBUG("completion for descriptor at index %d with status: %d\n", hdr_desc_idx, status);
 	 
 	// grab corresponding callback
-	callback = dev->blk_callb[hdr_desc_idx].callback;
-	context = dev->blk_callb[hdr_desc_idx].context;
+	callback = q->blk_callb[hdr_desc_idx].callback;
+	context = q->blk_callb[hdr_desc_idx].context;
 	 
-	memset(&dev->blk_callb[hdr_desc_idx],0,sizeof(dev->blk_callb[hdr_desc_idx]));
+	memset(&q->blk_callb[hdr_desc_idx],0,sizeof(q->blk_callb[hdr_desc_idx]));
 	 
 	free(hdr);
 
@@ -330,7 +347,7 @@ static int process_used_ring(struct virtio_blk_dev *dev)
 	 
 	DEBUG("free used descriptors\n");
 
-	if (virtio_pci_desc_chain_free(dev->virtio_dev, VIRTIO_BLK_REQUEST_QUEUE, hdr_desc_idx)) {
+	if (virtio_pci_desc_chain_free(dev->virtio_dev, qidx, hdr_desc_idx)) {
 	    ERROR("error freeing descriptors\n");
 	    return -1;
 	}
@@ -363,11 +380,20 @@ static int handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
         }
     }
     
-    if (process_used_ring(dev)) {
-	ERROR("failed to process used ring\n");
-	IRQ_HANDLER_END();
-	return -1;
-    } 
+    // with MSI-X, only the queues this vector belongs to
+    uint16_t i;
+    
+    for (i=0;i<dev->num_queues;i++) {
+	if (dev->virtio_dev->itype == VIRTIO_PCI_MSI_X_INTERRUPT &&
+	    dev->virtio_dev->virtq[i].msix_vec != vec) {
+	    continue;
+	}
+	if (process_used_ring(dev, i)) {
+	    ERROR("failed to process used ring of queue %u\n", i);
+	    IRQ_HANDLER_END();
+	    return -1;
+	} 
+    }
 
     // print used for test
     //DEBUG("free count after = %d\n", dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].nfree);
@@ -484,6 +510,7 @@ uint64_t select_features(uint64_t features)
     DEBUG_FBIT(features, VIRTIO_BLK_F_FLUSH);
     DEBUG_FBIT(features, VIRTIO_BLK_F_TOPOLOGY);
     DEBUG_FBIT(features, VIRTIO_BLK_F_CONFIG_WCE);
+    DEBUG_FBIT(features, VIRTIO_BLK_F_MQ);
     DEBUG_FBIT(features, VIRTIO_BLK_F_BARRIER);
     DEBUG_FBIT(features, VIRTIO_BLK_F_SCSI);
     DEBUG_FBIT(features, VIRTIO_F_NOTIFY_ON_EMPTY);
@@ -499,6 +526,7 @@ uint64_t select_features(uint64_t features)
     FBIT_SETIF(accepted,features,VIRTIO_BLK_F_GEOMETRY);
     FBIT_SETIF(accepted,features,VIRTIO_BLK_F_RO);
     FBIT_SETIF(accepted,features,VIRTIO_BLK_F_BLK_SIZE);
+    FBIT_SETIF(accepted,features,VIRTIO_BLK_F_MQ);
     
     DEBUG("features accepted: 0x%0lx\n", accepted);
     return accepted;
@@ -537,11 +565,23 @@ static void parse_config(struct virtio_blk_dev *d)
     DEBUG("geometry_heads     = %d\n", d->blk_config->geometry.heads);
     DEBUG("geometry_sectors   = %d\n", d->blk_config->geometry.sectors);
     DEBUG("blk_size           = %d\n", d->blk_config->blk_size);
+    DEBUG("num_queues         = %d\n", d->num_queues);
+}
+
+static void free_queues(struct virtio_blk_dev *d)
+{
+    uint16_t i;
+
+    for (i=0;i<d->num_queues;i++) {
+	free(d->queue[i].blk_callb);
+	d->queue[i].blk_callb = 0;
+    }
 }
 
 int virtio_blk_init(struct virtio_pci_dev *dev)
 {
     char buf[DEV_NAME_LEN];
+    uint16_t i;
 
     if (!(dev->model==VIRTIO_PCI_LEGACY_MODEL)) {
 	ERROR("currently only supported with legacy model\n");
@@ -579,38 +619,61 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
         return -1;
     }
     
+    // one request queue per cpu, as far as the device goes
+    d->num_queues = 1;
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_MQ)) {
+	uint16_t n = virtio_pci_read_regw(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 34);
+	if (n > nk_get_num_cpus()) {
+	    n = nk_get_num_cpus();
+	}
+	if (n > MAX_VIRTQS) {
+	    n = MAX_VIRTQS;
+	}
+	d->num_queues = n ? n : 1;
+    }
+    dev->virtqs_wanted = d->num_queues;
+    
     // initilize device virtqueue
     if (virtio_pci_virtqueue_init(dev)) {
 	ERROR("failed to initialize virtqueues\n");
 	free(d);
 	return -1;
     }
+
+    if (dev->num_virtqs < d->num_queues) {
+	d->num_queues = dev->num_virtqs;
+    }
     
     dev->state = d;
     dev->teardown = teardown;
     d->virtio_dev = dev;
     
-    // allocate callback array
-    d->blk_callb = malloc(dev->virtq[0].vq.qsz * sizeof(struct virtio_blk_callb));
-    
-    DEBUG("allocated %d callbacks at %p\n", dev->virtq[0].vq.qsz, d->blk_callb);
-    
-    if (!d->blk_callb) {
-	ERROR("failed to allocate callback array\n");
-	virtio_pci_virtqueue_deinit(dev);
-	free(d);
-	return -1;
+    // allocate callback arrays
+    for (i=0;i<d->num_queues;i++) {
+	spinlock_init(&d->queue[i].lock);
+	d->queue[i].blk_callb = malloc(dev->virtq[i].vq.qsz * sizeof(struct virtio_blk_callb));
+	
+	DEBUG("allocated %d callbacks for queue %u at %p\n", dev->virtq[i].vq.qsz, i, d->queue[i].blk_callb);
+	
+	if (!d->queue[i].blk_callb) {
+	    ERROR("failed to allocate callback array\n");
+	    virtio_pci_virtqueue_deinit(dev);
+	    free_queues(d);
+	    free(d);
+	    return -1;
+	}
+	memset(d->queue[i].blk_callb, 0, dev->virtq[i].vq.qsz * sizeof(struct virtio_blk_callb));
     }
     
     // allocate virtio block configuration
     d->blk_config = malloc(sizeof(struct virtio_blk_config));
     
-    DEBUG("allocated virtio block config struct at %p for %hhx bytes\n", d->blk_callb, sizeof(struct virtio_blk_config));
+    DEBUG("allocated virtio block config struct at %p for %hhx bytes\n", d->blk_config, sizeof(struct virtio_blk_config));
     
     if (!d->blk_config) {
 	ERROR("failed to allocate virtio block config struct\n");
 	virtio_pci_virtqueue_deinit(dev);
-	free(d->blk_callb);
+	free_queues(d);
 	free(d);
 	return -1;
     }
@@ -625,7 +688,7 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
 	ERROR("failed to register block device\n");
 	virtio_pci_virtqueue_deinit(dev);
 	free(d->blk_config);
-	free(d->blk_callb);
+	free_queues(d);
 	free(d);
 	return -1;
     }
@@ -634,58 +697,22 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
     // if we do fail, the rest of this code will leak
     
     struct pci_dev *p = dev->pci_dev;
-    uint8_t i;
-    ulong_t vec;
     
     if (dev->itype==VIRTIO_PCI_MSI_X_INTERRUPT) {
-	// we assume MSI-X has been enabled on the device
-	// already, that virtqueue setup is done, and
-	// that queue i has been mapped to MSI-X table entry i
-	// MSI-X is on but whole function is masked
+	// MSI-X has been enabled on the device already, and
+	// virtqueue setup has mapped each request queue to a
+	// table entry.  MSI-X is on but whole function is masked
+	// Queue i completes on cpu i, which is among its submitters
+	int cpus[MAX_VIRTQS];
+
+	for (i=0;i<d->num_queues;i++) {
+	    cpus[i] = i;
+	}
 
 	DEBUG("setting up interrupts via MSI-X\n");
-	
-	if (dev->num_virtqs != p->msix.size) {
-	    ERROR("weird mismatch: numqueues=%u msixsize=%u\n", dev->num_virtqs, p->msix.size);
-	    // continue for now...
-	    // return -1;
-	}
-	
-	// this should really go by virtqueue, not entry
-	// and ideally pulled into a per-queue setup routine
-	// in virtio_pci...
-	uint16_t num_vec = p->msix.size;
-        
-	// now fill out the device's MSI-X table
-	for (i=0;i<num_vec;i++) {
-	    // find a free vector
-	    // note that prioritization here is your problem
-	    if (idt_find_and_reserve_range(1,0,&vec)) {
-		ERROR("cannot get vector...\n");
-		return -1;
-	    }
-	    // register your handler for that vector
-	    if (register_int_handler(vec, handler, d)) {
-		ERROR("failed to register int handler\n");
-		return -1;
-		// failed....
-	    }
-	    // set the table entry to point to your handler
-	    if (pci_dev_set_msi_x_entry(p,i,vec,0)) {
-		ERROR("failed to set MSI-X entry\n");
-		return -1;
-	    }
-	    // and unmask it (device is still masked)
-	    if (pci_dev_unmask_msi_x_entry(p,i)) {
-		ERROR("failed to unmask entry\n");
-		return -1;
-	    }
-	    DEBUG("finished setting up entry %d for vector %u on cpu 0\n",i,vec);
-	}
-	
-	// unmask entire function
-	if (pci_dev_unmask_msi_x_all(p)) {
-	    ERROR("failed to unmask device\n");
+
+	if (virtio_pci_msi_x_setup(dev, handler, d, cpus)) {
+	    ERROR("failed to set up MSI-X\n");
 	    return -1;
 	}
 	
@@ -710,6 +737,7 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
 	
     }
     
+    INFO("%s: %u request queue%s\n", buf, d->num_queues, d->num_queues==1 ? "" : "s");
     DEBUG("device inited\n");
     
     /*************************************************
@@ -131,6 +131,14 @@
 
 // device data types
 
+// header flags
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM  1
+#define VIRTIO_NET_HDR_F_DATA_VALID  2
+
+// header gso types
+#define VIRTIO_NET_HDR_GSO_NONE      0
+#define VIRTIO_NET_HDR_GSO_TCPV4     1
+
 struct virtio_net_hdr {
     uint8_t flags;
     uint8_t gso_type;
@@ -140,6 +148,22 @@ struct virtio_net_hdr {
     uint16_t csum_offset;
 } __packed;
 
+// header used when VIRTIO_NET_F_MRG_RXBUF is negotiated
+struct virtio_net_hdr_mrg_rxbuf {
+    struct virtio_net_hdr hdr;
+    uint16_t num_buffers;
+} __packed;
+
+// packet layout for offloads
+#define ETH_HDR_LEN        14
+#define ETH_TYPE_IPV4      0x0800
+#define IP_PROTO_TCP       6
+#define IP_PROTO_UDP       17
+#define TCP_CSUM_OFFSET    16
+#define UDP_CSUM_OFFSET    6
+// enough to see the ethernet, IPv4, and TCP headers with options
+#define OFFLOAD_PARSE_LEN  (ETH_HDR_LEN + 60 + 60)
+
 
 // our state
 
@@ -156,6 +180,9 @@ struct virtio_net_dev {
 
     uint8_t mac[ETHER_MAC_LEN];
     struct callback_info *callbacks[2];
+
+    uint16_t hdr_len;   // depends on whether MRG_RXBUF was negotiated
+    uint64_t offloads;  // NK_NET_DEV_OFFLOAD_* from negotiated features
 };
 
 
@@ -185,69 +212,269 @@ static int get_characteristics(void *state, struct nk_net_dev_characteristics *c
     c->min_tu = MIN_TU;
     c->max_tu = MAX_TU;
     c->packet_size_to_buffer_size = packet_size_to_buffer_size;
+    c->offloads = d->offloads;
+    c->max_tso = (d->offloads & NK_NET_DEV_OFFLOAD_TSO4) ? ETH_HDR_LEN + 0xffff : 0;
 
     return 0;
 }
 
-static int post(void *state, uint8_t *buf, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context, int send)
+
+// checksum offload support
+
+// ones-complement sum of big-endian 16 bit words, continuing from sum
+static uint32_t csum_add(uint32_t sum, uint8_t *data, uint64_t len, uint64_t *odd)
+{
+    uint64_t i;
+
+    for (i=0;i<len;i++, (*odd)^=1) {
+        sum += *odd ? data[i] : ((uint32_t)data[i])<<8;
+        if (sum & 0x80000000) {
+            sum = (sum & 0xffff) + (sum >> 16);
+        }
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+// IPv4 pseudo-header sum for an l4 segment of len bytes
+static uint32_t csum_pseudo(uint8_t *ip, uint8_t proto, uint16_t len)
+{
+    uint64_t odd = 0;
+    uint32_t sum = csum_add(0, ip+12, 8, &odd);  // source and destination
+
+    return sum + proto + len;
+}
+
+// copy/store len bytes at offset off of a fragment list
+static uint64_t sg_access(struct nk_net_dev_sg *frags, uint32_t num, uint64_t off, uint8_t *buf, uint64_t len, int store)
+{
+    uint64_t done = 0, n;
+    uint32_t i;
+
+    for (i=0;i<num && done<len;i++) {
+        if (off >= frags[i].len) {
+            off -= frags[i].len;
+            continue;
+        }
+        n = frags[i].len - off;
+        n = n < len-done ? n : len-done;
+        if (store) {
+            memcpy(frags[i].addr+off, buf+done, n);
+        } else {
+            memcpy(buf+done, frags[i].addr+off, n);
+        }
+        done += n;
+        off = 0;
+    }
+    return done;
+}
+
+// Finds the IPv4 TCP/UDP segment in a frame, returning the offset of the
+// IP header, the offset of the l4 header, and the l4 length.  Fragments,
+// which cannot be checksummed on their own, are skipped.
+static int parse_l4(uint8_t *pkt, uint64_t len, uint8_t *proto, uint64_t *l4_off, uint64_t *l4_len)
+{
+    uint8_t *ip = pkt + ETH_HDR_LEN;
+    uint64_t ihl, iplen;
+
+    if (len < ETH_HDR_LEN + 20 ||
+        ((pkt[12]<<8) | pkt[13]) != ETH_TYPE_IPV4 ||
+        (ip[0]>>4) != 4) {
+        return -1;
+    }
+    ihl = (ip[0] & 0xf) * 4;
+    iplen = (ip[2]<<8) | ip[3];
+    if (ihl < 20 || iplen < ihl || (((ip[6]<<8) | ip[7]) & 0x3fff)) {
+        return -1;
+    }
+    if (ip[9]!=IP_PROTO_TCP && ip[9]!=IP_PROTO_UDP) {
+        return -1;
+    }
+    *proto = ip[9];
+    *l4_off = ETH_HDR_LEN + ihl;
+    *l4_len = iplen - ihl;
+    return 0;
+}
+
+// Fill out the header of an outgoing frame for the requested offloads.
+// The device completes the checksum from csum_start on, so we seed the
+// checksum field with the pseudo-header sum.
+static void tx_offload(struct virtio_net_dev *d, struct nk_net_dev_sg *frags, uint32_t num, struct nk_net_dev_tx_offload *offload, struct virtio_net_hdr *h)
+{
+    uint8_t pkt[OFFLOAD_PARSE_LEN];
+    uint64_t len, l4_off, l4_len, l4_hdr_len;
+    uint16_t csum_off, sum;
+    uint8_t proto, field[2];
+
+    if (!offload || !(offload->flags & d->offloads & NK_NET_DEV_OFFLOAD_TX_CSUM)) {
+        return;
+    }
+
+    len = sg_access(frags, num, 0, pkt, OFFLOAD_PARSE_LEN, 0);
+
+    if (parse_l4(pkt, len, &proto, &l4_off, &l4_len)) {
+        return;
+    }
+
+    if (proto==IP_PROTO_TCP) {
+        if (l4_off + 20 > len) {
+            return;
+        }
+        csum_off = TCP_CSUM_OFFSET;
+        l4_hdr_len = (pkt[l4_off+12]>>4) * 4;
+    } else {
+        csum_off = UDP_CSUM_OFFSET;
+        l4_hdr_len = 8;
+    }
+
+    sum = csum_fold(csum_pseudo(pkt + ETH_HDR_LEN, proto, l4_len));
+    field[0] = sum >> 8;
+    field[1] = sum & 0xff;
+    sg_access(frags, num, l4_off + csum_off, field, 2, 1);
+
+    h->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    h->csum_start = l4_off;
+    h->csum_offset = csum_off;
+
+    if (proto==IP_PROTO_TCP &&
+        (offload->flags & d->offloads & NK_NET_DEV_OFFLOAD_TSO4) &&
+        offload->mss && l4_len > l4_hdr_len + offload->mss) {
+        h->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        h->gso_size = offload->mss;
+        h->hdr_len = l4_off + l4_hdr_len;
+    }
+}
+
+// Make sure a received frame has a good TCP/UDP checksum, given what
+// the device told us in its header.  Returns nonzero for a bad frame.
+static int rx_offload(struct virtio_net_dev *d, struct virtio_net_hdr *h, uint8_t *pkt, uint64_t len)
+{
+    uint64_t l4_off, l4_len, odd = 0;
+    uint32_t sum;
+    uint16_t csum;
+    uint8_t proto;
+
+    if (!(d->offloads & NK_NET_DEV_OFFLOAD_RX_CSUM)) {
+        // the stack checks for itself
+        return 0;
+    }
+
+    if (h->flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+        return 0;
+    }
+
+    if (h->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        // a partial checksum, typically from a local sender on the host,
+        // which we complete as the device would have
+        if ((uint64_t)h->csum_start + h->csum_offset + 2 > len) {
+            return -1;
+        }
+        sum = csum_add(0, pkt + h->csum_start, len - h->csum_start, &odd);
+        csum = ~csum_fold(sum);
+        pkt[h->csum_start + h->csum_offset] = csum >> 8;
+        pkt[h->csum_start + h->csum_offset + 1] = csum & 0xff;
+        return 0;
+    }
+
+    if (parse_l4(pkt, len, &proto, &l4_off, &l4_len)) {
+        return 0;
+    }
+
+    if (l4_off + l4_len > len) {
+        return -1;
+    }
+
+    if (proto==IP_PROTO_UDP && !pkt[l4_off+UDP_CSUM_OFFSET] && !pkt[l4_off+UDP_CSUM_OFFSET+1]) {
+        // no checksum
+        return 0;
+    }
+
+    sum = csum_pseudo(pkt + ETH_HDR_LEN, proto, l4_len);
+    sum = csum_add(sum, pkt + l4_off, l4_len, &odd);
+
+    return csum_fold(sum) != 0xffff;
+}
+
+// a packet is posted as a header descriptor followed by one descriptor
+// per fragment; a flat buffer is simply the single fragment case
+static int post_sg(void *state, struct nk_net_dev_sg *frags, uint32_t num, struct nk_net_dev_tx_offload *offload, void (*callback)(nk_net_dev_status_t status, void *context), void *context, int send)
 {
     uint16_t qidx = send ? VIRTIO_NET_SENDQ_IDX : VIRTIO_NET_RECVQ_IDX;
     struct virtio_net_dev *d = (struct virtio_net_dev *) state;
     struct virtq *vq = &d->virtio_dev->virtq[qidx].vq;
+    uint16_t idx[NK_NET_DEV_MAX_SG+1];
+    uint32_t i;
 
-    // alloc descriptor for header
-    uint16_t header_idx;
-    if (virtio_pci_desc_alloc(d->virtio_dev, qidx, &header_idx)) {
-        ERROR("descriptor alloc failed\n");
+    if (!num || num>NK_NET_DEV_MAX_SG) {
+        ERROR("invalid fragment count %u\n", num);
         return -1;
     }
-    DEBUG("allocated descriptor %d\n", header_idx);
 
-    // alloc descriptor for packet
-    uint16_t packet_idx;
-    if (virtio_pci_desc_alloc(d->virtio_dev, qidx, &packet_idx)) {
-        ERROR("descriptor alloc failed\n");
-        virtio_pci_desc_free(d->virtio_dev, qidx, header_idx);
-        return -1;
+    // alloc descriptors for header and fragments
+    for (i=0;i<num+1;i++) {
+        if (virtio_pci_desc_alloc(d->virtio_dev, qidx, &idx[i])) {
+            ERROR("descriptor alloc failed\n");
+            while (i>0) {
+                virtio_pci_desc_free(d->virtio_dev, qidx, idx[--i]);
+            }
+            return -1;
+        }
+        DEBUG("allocated descriptor %d\n", idx[i]);
     }
-    DEBUG("allocated descriptor %d\n", packet_idx);
 
     // create buffer for header
-    uint8_t *header = malloc(sizeof(struct virtio_net_hdr));
+    uint8_t *header = malloc(sizeof(struct virtio_net_hdr_mrg_rxbuf));
     if (!header) {
-        virtio_pci_desc_free(d->virtio_dev, qidx, header_idx);
-        virtio_pci_desc_free(d->virtio_dev, qidx, packet_idx);
+        for (i=0;i<num+1;i++) {
+            virtio_pci_desc_free(d->virtio_dev, qidx, idx[i]);
+        }
         ERROR("couldn't allocate buffer for virtio-net header\n");
         return -1;
     }
-    memset(header, 0, sizeof(struct virtio_net_hdr));
+    memset(header, 0, sizeof(struct virtio_net_hdr_mrg_rxbuf));
     DEBUG("malloc header %x\n", (uint64_t) header);
 
+    if (send) {
+        tx_offload(d, frags, num, offload, (struct virtio_net_hdr *) header);
+    }
+
     // setup header descriptor
-    struct virtq_desc *header_desc = &vq->desc[header_idx];
+    struct virtq_desc *header_desc = &vq->desc[idx[0]];
     header_desc->addr = (uint64_t) header;
-    header_desc->len = sizeof(struct virtio_net_hdr);
+    header_desc->len = d->hdr_len;
     header_desc->flags = VIRTQ_DESC_F_NEXT;
     if (!send) {
         header_desc->flags |= VIRTQ_DESC_F_WRITE;
     }
-    header_desc->next = packet_idx;
-
-    // setup packet descriptor
-    struct virtq_desc *packet_desc = &vq->desc[packet_idx];
-    packet_desc->addr = (uint64_t) buf;
-    packet_desc->len = len;
-    if (!send) {
-        packet_desc->flags = VIRTQ_DESC_F_WRITE;
+    header_desc->next = idx[1];
+
+    // setup fragment descriptors
+    for (i=0;i<num;i++) {
+        struct virtq_desc *packet_desc = &vq->desc[idx[i+1]];
+        packet_desc->addr = (uint64_t) frags[i].addr;
+        packet_desc->len = frags[i].len;
+        packet_desc->flags = send ? 0 : VIRTQ_DESC_F_WRITE;
+        if (i+1<num) {
+            packet_desc->flags |= VIRTQ_DESC_F_NEXT;
+            packet_desc->next = idx[i+2];
+        } else {
+            packet_desc->next = 0;
+        }
     }
-    packet_desc->next = 0;
 
     // stash the callback and context
-    d->callbacks[qidx][header_idx].callback = callback;
-    d->callbacks[qidx][header_idx].context = context;
+    d->callbacks[qidx][idx[0]].callback = callback;
+    d->callbacks[qidx][idx[0]].context = context;
     
     // put header descriptor in virtq
-    vq->avail->ring[vq->avail->idx % vq->qsz] = header_idx;
+    vq->avail->ring[vq->avail->idx % vq->qsz] = idx[0];
     mbarrier();
     vq->avail->idx++;
     mbarrier();
@@ -258,6 +485,13 @@ static int post(void *state, uint8_t *buf, uint64_t len, void (*callback)(nk_net
     return 0;
 }
 
+static int post(void *state, uint8_t *buf, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context, int send)
+{
+    struct nk_net_dev_sg frag = { .addr = buf, .len = len };
+
+    return post_sg(state, &frag, 1, 0, callback, context, send);
+}
+
 static int post_receive(void *state, uint8_t *dest, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context)
 {
     DEBUG("post_receive\n");
@@ -280,10 +514,22 @@ static int post_send(void *state, uint8_t *src, uint64_t len, void (*callback)(n
     return 0;
 }
 
+static int post_send_sg(void *state, struct nk_net_dev_sg *frags, uint32_t num, struct nk_net_dev_tx_offload *offload, void (*callback)(nk_net_dev_status_t status, void *context), void *context)
+{
+    DEBUG("post_send_sg (%u frags)\n", num);
+
+    if (post_sg(state, frags, num, offload, callback, context, 1)) {
+        return -1;
+    }
+
+    return 0;
+}
+
 static struct nk_net_dev_int ops =  {
     .get_characteristics = get_characteristics,
     .post_receive = post_receive,
     .post_send = post_send,
+    .post_send_sg = post_send_sg,
 };
 
 
@@ -322,6 +568,19 @@ static int process_used_ring(struct virtio_net_dev *d, int qidx)
 #ifdef NAUT_CONFIG_DEBUG_VIRTIO_NET
         //nk_dump_mem((uint8_t *) body->addr, len - sizeof(struct virtio_net_hdr));
 #endif
+        nk_net_dev_status_t status = NK_NET_DEV_STATUS_SUCCESS;
+
+        if (qidx == VIRTIO_NET_RECVQ_IDX) {
+            struct virtio_net_hdr_mrg_rxbuf *h = (struct virtio_net_hdr_mrg_rxbuf *) header;
+            // without guest TSO, a frame always fits in one receive buffer
+            if ((d->hdr_len == sizeof(*h) && h->num_buffers > 1) ||
+                len < d->hdr_len ||
+                rx_offload(d, &h->hdr, (uint8_t *) body->addr, len - d->hdr_len)) {
+                DEBUG("dropping bad frame\n");
+                status = NK_NET_DEV_STATUS_ERROR;
+            }
+        }
+
         // free the header buffer (this is the only buffer we allocated)
         free(header);
 
@@ -339,13 +598,19 @@ static int process_used_ring(struct virtio_net_dev *d, int qidx)
 
         // call the corresponding callback
         if (callback) {
-            callback(NK_NET_DEV_STATUS_SUCCESS, context);
+            callback(status, context);
         }
     }
 
     return 0;
 }
 
+static inline int is_my_vec(struct virtio_net_dev *d, int qidx, excp_vec_t vec)
+{
+    return d->virtio_dev->itype != VIRTIO_PCI_MSI_X_INTERRUPT ||
+	d->virtio_dev->virtq[qidx].msix_vec == vec;
+}
+
 static int handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
 {
     int rc = 0;
@@ -368,12 +633,15 @@ static int handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
         // need to check bit 1 for config change
     }
 
-    // scan used rings
-    if (process_used_ring(d, VIRTIO_NET_RECVQ_IDX)) {
+    // scan used rings - with MSI-X, only those of the
+    // virtqs this vector belongs to
+    if (is_my_vec(d, VIRTIO_NET_RECVQ_IDX, vec) &&
+        process_used_ring(d, VIRTIO_NET_RECVQ_IDX)) {
         ERROR("error processing used ring for recvq\n");
 	rc = -1;
     }
-    if (process_used_ring(d, VIRTIO_NET_SENDQ_IDX)) {
+    if (is_my_vec(d, VIRTIO_NET_SENDQ_IDX, vec) &&
+        process_used_ring(d, VIRTIO_NET_SENDQ_IDX)) {
         ERROR("error processing used ring for sendq\n");
 	rc = -1;
     }
@@ -427,6 +695,13 @@ static uint64_t select_features(uint64_t features)
     uint64_t accepted = 0;
 
     FBIT_SETIF(accepted,features,VIRTIO_NET_F_MAC);
+    FBIT_SETIF(accepted,features,VIRTIO_NET_F_CSUM);
+    FBIT_SETIF(accepted,features,VIRTIO_NET_F_GUEST_CSUM);
+    FBIT_SETIF(accepted,features,VIRTIO_NET_F_MRG_RXBUF);
+    // TSO requires that we hand the device partial checksums
+    if (FBIT_ISSET(accepted, VIRTIO_NET_F_CSUM)) {
+        FBIT_SETIF(accepted,features,VIRTIO_NET_F_HOST_TSO4);
+    }
 
     DEBUG("features accepted: 0x%0lx\n", accepted);
 
@@ -583,6 +858,20 @@ int virtio_net_init(struct virtio_pci_dev *dev)
         return -1;
     }
 
+    // header layout and offloads follow from what was negotiated
+    d->hdr_len = FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_MRG_RXBUF) ?
+        sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_CSUM)) {
+        d->offloads |= NK_NET_DEV_OFFLOAD_TX_CSUM;
+    }
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_GUEST_CSUM)) {
+        d->offloads |= NK_NET_DEV_OFFLOAD_RX_CSUM;
+    }
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_HOST_TSO4)) {
+        d->offloads |= NK_NET_DEV_OFFLOAD_TSO4;
+    }
+    INFO("header length %u, offloads 0x%lx\n", d->hdr_len, d->offloads);
+
     // create virtqueues for device
     if (virtio_pci_virtqueue_init(dev)) {
         ERROR("Failed to initialize virtqueues\n");
@@ -637,57 +926,18 @@ int virtio_net_init(struct virtio_pci_dev *dev)
     // if we do fail, the rest of this code will leak
 
     struct pci_dev *p = dev->pci_dev;
-    uint16_t num_vec = p->msix.size;
-    ulong_t vec;
     uint16_t i;
 
     // now set up interrupts
     if (dev->itype==VIRTIO_PCI_MSI_X_INTERRUPT) {
-        // we assume MSI-X has been enabled on the device
-        // already, that virtqueue setup is done, and
-        // that queue i has been mapped to MSI-X table entry i
+        // MSI-X has been enabled on the device already, and
+        // virtqueue setup has mapped each virtq to a table entry
         // MSI-X is on but whole function is masked
 
         DEBUG("setting up interrupts via MSI-X\n");
 
-        if (dev->num_virtqs != num_vec) {
-            ERROR("weird mismatch: numqueues=%u msixsize=%u\n",
-                dev->num_virtqs, p->msix.size);
-            //continue for now...
-	    //return -1;
-	    
-        }
-
-        // now fill out the device's MSI-X table
-        for (i=0;i<num_vec;i++) {
-            // find a free vector
-            // note that prioritization here is your problem
-            if (idt_find_and_reserve_range(1,0,&vec)) {
-                ERROR("Cannot get vector...\n");
-                return -1;
-            }
-            // register your handler for that vector
-            if (register_int_handler(vec, handler, d)) {
-                ERROR("Failed to register int handler\n");
-                return -1;
-                // failed....
-            }
-            // set the table entry to point to your handler
-            if (pci_dev_set_msi_x_entry(p,i,vec,0)) {
-                ERROR("Failed to set MSI-X entry\n");
-                return -1;
-            }
-            // and unmask it (device is still masked)
-            if (pci_dev_unmask_msi_x_entry(p,i)) {
-                ERROR("Failed to unmask entry\n");
-                return -1;
-            }
-            DEBUG("Finished setting up entry %d for vector %u on cpu 0\n",i,vec);
-        }
-
-        // unmask entire function
-        if (pci_dev_unmask_msi_x_all(p)) {
-            ERROR("Failed to unmask device\n");
+        if (virtio_pci_msi_x_setup(dev, handler, d, NULL)) {
+            ERROR("Failed to set up MSI-X\n");
             return -1;
         }
 	
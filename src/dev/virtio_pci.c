@@ -28,6 +28,7 @@
 #include <nautilus/nautilus.h>
 #include <dev/pci.h>
 #include <dev/virtio_pci.h>
+#include <nautilus/shell.h>
 
 #ifdef NAUT_CONFIG_VIRTIO_NET
 #include <dev/virtio_net.h>
@@ -529,6 +530,20 @@ static inline unsigned compute_size(unsigned int qsz)
 
 
 
+static inline uint16_t virtqs_limit(struct virtio_pci_dev *dev)
+{
+    return dev->virtqs_wanted && dev->virtqs_wanted < MAX_VIRTQS ? dev->virtqs_wanted : MAX_VIRTQS;
+}
+
+// virtq i gets table entry i, and any virtqs beyond the
+// size of the table share its last entry
+static uint16_t msi_x_entry_for(struct virtio_pci_dev *dev, uint16_t qidx)
+{
+    uint16_t n = dev->pci_dev->msix.size;
+
+    return qidx < n ? qidx : n-1;
+}
+
 static int virtqueue_init_legacy(struct virtio_pci_dev *dev)
 {
 
@@ -544,7 +559,7 @@ static int virtqueue_init_legacy(struct virtio_pci_dev *dev)
 
     dev->num_virtqs = 0;
 
-    for (i=0;i<MAX_VIRTQS;i++) {
+    for (i=0;i<virtqs_limit(dev);i++) {
         virtio_pci_write_regw(dev,QUEUE_SEL,i);
         qsz = virtio_pci_read_regw(dev,QUEUE_SIZE);
 
@@ -607,15 +622,21 @@ static int virtqueue_init_legacy(struct virtio_pci_dev *dev)
         virtio_pci_write_regl(dev,QUEUE_ADDR,(uint32_t)(((uint64_t)(dev->virtq[i].aligned_data))/4096));
 
 	if (dev->itype==VIRTIO_PCI_MSI_X_INTERRUPT) {
-	    // we still have the queue selected -
-	    // we map it to obvious table entry
-	    virtio_pci_write_regw(dev,QUEUE_VEC,i);
+	    // we still have the queue selected
+	    virtio_pci_write_regw(dev,QUEUE_VEC,msi_x_entry_for(dev,i));
+	    dev->virtq[i].msix_entry = virtio_pci_read_regw(dev,QUEUE_VEC);
+	    if (dev->virtq[i].msix_entry==VIRTIO_MSI_NO_VECTOR) {
+		ERROR("Device refused MSI-X entry for virtqueue %u\n",i);
+		return -1;
+	    }
+	} else {
+	    dev->virtq[i].msix_entry = VIRTIO_MSI_NO_VECTOR;
 	}
 
         dev->num_virtqs++;
   }
   
-  if (i==MAX_VIRTQS) { 
+  if (i==MAX_VIRTQS && !dev->virtqs_wanted) { 
       ERROR("Device needs too many virtqueues!\n");
       return -1;
   }
@@ -638,6 +659,13 @@ static int virtqueue_init_modern(struct virtio_pci_dev *dev)
 
     DEBUG("device has %u virtqueues\n",num);
 
+    if (dev->virtqs_wanted && num > virtqs_limit(dev)) {
+	num = virtqs_limit(dev);
+    } else if (num > MAX_VIRTQS) {
+	ERROR("Device needs too many virtqueues!\n");
+	return -1;
+    }
+
     // now let's figure out the sizes
 
     dev->num_virtqs = 0;
@@ -707,16 +735,21 @@ static int virtqueue_init_modern(struct virtio_pci_dev *dev)
 				
 
 	if (dev->itype==VIRTIO_PCI_MSI_X_INTERRUPT) {
-	    // we still have the queue selected -
-	    // we map it to obvious table entry
-	    // IS THIS RIGHT?
-	    virtio_pci_atomic_store(&dev->common->queue_msix_vector,i);
+	    // we still have the queue selected
+	    virtio_pci_atomic_store(&dev->common->queue_msix_vector,msi_x_entry_for(dev,i));
+	    dev->virtq[i].msix_entry = virtio_pci_atomic_load(&dev->common->queue_msix_vector);
+	    if (dev->virtq[i].msix_entry==VIRTIO_MSI_NO_VECTOR) {
+		ERROR("Device refused MSI-X entry for virtqueue %u\n",i);
+		return -1;
+	    }
+	} else {
+	    dev->virtq[i].msix_entry = VIRTIO_MSI_NO_VECTOR;
 	}
 
         dev->num_virtqs++;
   }
   
-  if (i==MAX_VIRTQS) { 
+  if (i==MAX_VIRTQS && !dev->virtqs_wanted) { 
       ERROR("Device needs too many virtqueues!\n");
       return -1;
   }
@@ -1044,6 +1077,107 @@ int virtio_pci_virtqueue_notify(struct virtio_pci_dev *dev, uint16_t qidx)
 }
 
 
+
+int virtio_pci_msi_x_setup(struct virtio_pci_dev *dev,
+			   int (*handler)(excp_entry_t *, excp_vec_t, void *),
+			   void *priv, const int *cpus)
+{
+    struct pci_dev *p = dev->pci_dev;
+    uint16_t i, j;
+    int cpu;
+
+    if (dev->itype!=VIRTIO_PCI_MSI_X_INTERRUPT) {
+	ERROR("Device does not use MSI-X\n");
+	return -1;
+    }
+
+    for (i=0;i<dev->num_virtqs;i++) {
+	struct virtio_pci_virtq *q = &dev->virtq[i];
+
+	cpu = (cpus && cpus[i]>=0) ? cpus[i] : 0;
+
+	// an earlier virtq may already have set up a shared entry
+	for (j=0;j<i;j++) {
+	    if (dev->virtq[j].msix_entry==q->msix_entry) {
+		break;
+	    }
+	}
+
+	if (j<i) {
+	    q->msix_vec = dev->virtq[j].msix_vec;
+	    q->msix_cpu = dev->virtq[j].msix_cpu;
+	} else {
+	    if (pci_dev_msi_x_alloc_vector(p,q->msix_entry,cpu,handler,priv,&q->msix_vec)) {
+		ERROR("Failed to set up MSI-X entry %u for virtqueue %u\n",q->msix_entry,i);
+		virtio_pci_msi_x_teardown(dev);
+		return -1;
+	    }
+	    q->msix_cpu = cpu;
+	}
+
+	DEBUG("virtqueue %u => MSI-X entry %u => vector 0x%x on cpu %d\n",
+	      i,q->msix_entry,q->msix_vec,q->msix_cpu);
+    }
+
+    if (pci_dev_unmask_msi_x_all(p)) {
+	ERROR("Failed to unmask device\n");
+	virtio_pci_msi_x_teardown(dev);
+	return -1;
+    }
+
+    return 0;
+}
+
+int virtio_pci_msi_x_set_affinity(struct virtio_pci_dev *dev, uint16_t qidx, int cpu)
+{
+    uint16_t i;
+
+    if (dev->itype!=VIRTIO_PCI_MSI_X_INTERRUPT || qidx>=dev->num_virtqs ||
+	!dev->virtq[qidx].msix_vec) {
+	ERROR("Virtqueue %u has no MSI-X vector\n",qidx);
+	return -1;
+    }
+
+    if (pci_dev_msi_x_set_affinity(dev->pci_dev,dev->virtq[qidx].msix_entry,cpu)) {
+	ERROR("Failed to move virtqueue %u to cpu %d\n",qidx,cpu);
+	return -1;
+    }
+
+    for (i=0;i<dev->num_virtqs;i++) {
+	if (dev->virtq[i].msix_entry==dev->virtq[qidx].msix_entry) {
+	    dev->virtq[i].msix_cpu = cpu;
+	}
+    }
+
+    return 0;
+}
+
+int virtio_pci_msi_x_teardown(struct virtio_pci_dev *dev)
+{
+    uint16_t i, j;
+
+    if (dev->itype!=VIRTIO_PCI_MSI_X_INTERRUPT) {
+	return 0;
+    }
+
+    pci_dev_mask_msi_x_all(dev->pci_dev);
+
+    for (i=0;i<dev->num_virtqs;i++) {
+	if (!dev->virtq[i].msix_vec) {
+	    continue;
+	}
+	pci_dev_msi_x_free_vector(dev->pci_dev,dev->virtq[i].msix_entry);
+	// forget it on any virtqs sharing the entry
+	for (j=i;j<dev->num_virtqs;j++) {
+	    if (dev->virtq[j].msix_entry==dev->virtq[i].msix_entry) {
+		dev->virtq[j].msix_vec = 0;
+	    }
+	}
+    }
+
+    return 0;
+}
+
 					 
 static int bringup_device(struct virtio_pci_dev *dev)
 {
@@ -1114,6 +1248,53 @@ int virtio_pci_init(struct naut_info * naut)
 }
     
 
+static int handle_virtio_irq(char *buf, void *priv)
+{
+    struct list_head *cur;
+    uint32_t n, q;
+    int cpu;
+    int i;
+
+    if (sscanf(buf,"virtio_irq %u %u %d",&n,&q,&cpu)==3) {
+	i = 0;
+	list_for_each(cur,&dev_list) {
+	    if (i++==n) {
+		struct virtio_pci_dev *dev = list_entry(cur,struct virtio_pci_dev,virtio_node);
+		if (q>=dev->num_virtqs || virtio_pci_msi_x_set_affinity(dev,q,cpu)) {
+		    nk_vc_printf("cannot move virtqueue %u of device %u to cpu %d\n",q,n,cpu);
+		}
+		return 0;
+	    }
+	}
+	nk_vc_printf("no virtio device %u\n",n);
+	return 0;
+    }
+
+    i = 0;
+    list_for_each(cur,&dev_list) {
+	struct virtio_pci_dev *dev = list_entry(cur,struct virtio_pci_dev,virtio_node);
+	nk_vc_printf("%d: %u:%u.%u %s\n", i++,
+		     dev->pci_dev->bus->num, dev->pci_dev->num, dev->pci_dev->fun,
+		     dev->itype==VIRTIO_PCI_MSI_X_INTERRUPT ? "MSI-X" : "legacy");
+	for (q=0;q<dev->num_virtqs;q++) {
+	    if (dev->virtq[q].msix_vec) {
+		nk_vc_printf("   virtq %u: entry %u vector 0x%x cpu %d\n", q,
+			     dev->virtq[q].msix_entry, dev->virtq[q].msix_vec,
+			     dev->virtq[q].msix_cpu);
+	    }
+	}
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl virtio_irq_impl = {
+    .cmd      = "virtio_irq",
+    .help_str = "virtio_irq [dev virtq cpu]",
+    .handler  = handle_virtio_irq,
+};
+nk_register_shell_cmd(virtio_irq_impl);
+
 int virtio_pci_deinit()
 {
     // should really scan list of devices and tear down...
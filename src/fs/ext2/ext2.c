@@ -37,6 +37,7 @@
 #define DENTRY_ALIGN 4
 #define NUM_DIRECT_DATA_BLOCKS 12
 #define ENDFILE 0xa0
+#define MAX_RUN_BLOCKS 128   // largest single device request for file data
 
 #define INFO(fmt, args...)  INFO_PRINT("ext2: " fmt, ##args)
 #define DEBUG(fmt, args...) DEBUG_PRINT("ext2: " fmt, ##args)
@@ -53,8 +54,12 @@ struct ext2_state {
     struct nk_block_dev *dev;
     struct nk_fs        *fs;
     struct ext2_super_block super;
+    struct ext2_icache *icache;
+    struct ext2_dcache *dcache;
+    struct ext2_bitmaps *bitmaps;
 };
 
+#include "ext2_cache.c"
 #include "ext2_access.c"
 
 static size_t get_file_size(struct ext2_state *fs, struct ext2_inode *inode) 
@@ -81,8 +86,8 @@ static void * ext2_open(void *state, char *path)
 
     DEBUG("open of %s returned inode number %u\n",path,inode_num);
 
-    // ideally FS would track this here so that we can handle multiple
-    // opens, locking, etc correctly, but that's outside of scope for now
+    // keep the inode cached while the file is open
+    ext2_icache_get(fs,inode_num);
 
     return (void*)(uint64_t)inode_num;
 }
@@ -94,9 +99,13 @@ static void ext2_close(void *state, void *file)
 
     DEBUG("closing inode %u\n",(uint32_t)(uint64_t)file);
 
-    // ideally FS would track this here so that we can handle multiple
-    // opens, locking, etc correctly, but that's outside of scope for now
+    // writes back the inode if this was the last open
+    ext2_icache_put(fs,(uint32_t)(uint64_t)file);
 
+    // and whatever allocation it did
+    if (ext2_bitmaps_sync(fs)) {
+	ERROR("Failed to write back allocation state on close\n");
+    }
 }
 
 static int ext2_exists(void *state, char *path) 
@@ -375,11 +384,11 @@ static int map_logical_to_physical_get_put(struct ext2_state *fs, uint32_t inode
     map_logical_to_physical_get_put(fs,inode_num,inode,logical_block,&physical_block,1)
 
 
-static int ext2_truncate(void *state, void *file, off_t len)
+// logical blocks in [nozero_start,nozero_end) are about to be completely
+// overwritten by the caller, so growing into them does not zero them
+static int resize(struct ext2_state *fs, uint32_t inode_num, off_t len, uint64_t nozero_start, uint64_t nozero_end)
 { 
-    struct ext2_state *fs = (struct ext2_state *)state;
     uint64_t block_size = get_block_size(fs);
-    uint32_t inode_num = (uint32_t)(uint64_t)file;
     uint32_t phys;
 
     struct ext2_inode inode;   
@@ -413,26 +422,38 @@ static int ext2_truncate(void *state, void *file, off_t len)
 	    }
 	}
     } else if (new_file_size_blocks > file_size_blocks) {
-	// grow
-	uint64_t block;
+	// grow, in physically contiguous runs that continue the file
+	uint64_t block = file_size_blocks;
+	uint32_t goal = 0, run_start, run_len, i;
 	uint8_t buf[block_size];
 	memset(buf,0,sizeof(buf));
-	for (block=file_size_blocks;block<new_file_size_blocks;block++) { 
-	    if (alloc_block(fs,&phys)) { 
+	if (file_size_blocks && 
+	    !map_logical_to_physical_get(fs,inode_num,&inode,file_size_blocks-1,&phys)) {
+	    goal = phys+1;
+	}
+	while (block<new_file_size_blocks) { 
+	    if (ext2_alloc_blocks(fs,goal,new_file_size_blocks-block,&run_start,&run_len)) { 
 		ERROR("Unable to allocate block in truncation\n");
 		// should unwind previous allocations here...
 		return -1;
 	    }
-	    if (map_logical_to_physical_put(fs,inode_num,&inode,block,phys)) { 
-		ERROR("Unable to create mapping of logical block %lu to physical block %lu in truncation\n", block, phys);
-		// should unwind here
-		return -1;
-	    } 
-	    // zero block
-	    if (write_block(fs,phys,buf)) { 
-		ERROR("Unable to zero block on expansion\n");
-		return -1;
+	    for (i=0;i<run_len;i++,block++) { 
+		phys = run_start+i;
+		if (map_logical_to_physical_put(fs,inode_num,&inode,block,phys)) { 
+		    ERROR("Unable to create mapping of logical block %lu to physical block %lu in truncation\n", block, phys);
+		    // should unwind here
+		    return -1;
+		} 
+		if (block>=nozero_start && block<nozero_end) {
+		    continue;
+		}
+		// zero block
+		if (write_block(fs,phys,buf)) { 
+		    ERROR("Unable to zero block on expansion\n");
+		    return -1;
+		}
 	    }
+	    goal = run_start+run_len;
 	}
     } else {
 	// same size in terms of blocks
@@ -449,6 +470,11 @@ static int ext2_truncate(void *state, void *file, off_t len)
     return 0;
 
 }
+
+static int ext2_truncate(void *state, void *file, off_t len)
+{
+    return resize((struct ext2_state *)state,(uint32_t)(uint64_t)file,len,0,0);
+}
  
 static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t offset, size_t num_bytes, int write)
 {
@@ -475,22 +501,15 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
 	    // handle read past end of file	
 	    DEBUG("Reading starts past end of file\n");
 	    return 0;
-	} else {
-	    // expand and zero fill if needed
-	    DEBUG("Writing starts past end of file - expanding and retrying\n");
-	    if (ext2_truncate(fs,file,offset+num_bytes-1)) { 
-		ERROR("file expansion failed\n");
-		return -1;
-	    } else {
-		return ext2_read_write(state, file, srcdest, offset, num_bytes, write);
-	    }
 	}
     }
 
     if (write) { 
 	if (offset+num_bytes > file_size_bytes) { 
+	    // expand, zero filling only what this write will not cover
 	    DEBUG("Writing continues past end of file - expanding and retrying\n");
-	    if (ext2_truncate(fs,file,offset+num_bytes-1)) { 
+	    if (resize(fs,inode_num,offset+num_bytes,
+		       CEIL_DIV(offset,block_size),FLOOR_DIV(offset+num_bytes,block_size))) { 
 		ERROR("file expansion failed\n");
 		return -1;
 	    } else {
@@ -537,6 +556,13 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
 	
 	if (have_first_block && cur_logical_block==logical_block_start) {
 	    // first block (partial)
+	    uint8_t *p;
+	    if (!write && (p = get_blocks_ptr(fs,cur_physical_block,1))) {
+		// read from a memory device - no need to stage the block
+		memcpy(srcdest+bytes,p+offset_into_first_block,bytes_from_first_block);
+		bytes += bytes_from_first_block;
+		continue;
+	    }
 	    if (read_block(fs,cur_physical_block,buf)) {
 		ERROR("Failed to read first partial physical block %lu\n",cur_physical_block);
 		return -1;
@@ -558,6 +584,12 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
 
 	if (have_last_block && cur_logical_block==(logical_block_start+num_blocks-1)) {
 	    // last block (partial)
+	    uint8_t *p;
+	    if (!write && (p = get_blocks_ptr(fs,cur_physical_block,1))) {
+		memcpy(srcdest+bytes,p,bytes_from_last_block);
+		bytes += bytes_from_last_block;
+		continue;
+	    }
 	    if (read_block(fs,cur_physical_block,buf)) {
 		ERROR("Failed to read last partial physical block %lu\n",cur_physical_block);
 		return -1;
@@ -577,24 +609,29 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
 	    continue;
 	}
 	
-	// common case - r/w complete blocks
-	if (!write) {
-	    if (read_block(fs,cur_physical_block,srcdest+bytes)) { 
-		ERROR("Failed to read middle block %lu\n",cur_physical_block);
+	// common case - r/w complete blocks, as many at a time
+	// as are physically contiguous
+	uint32_t run = 1;
+	uint32_t next_physical_block;
+	uint64_t middle_end = logical_block_start + num_blocks - have_last_block;
+
+	while (run<MAX_RUN_BLOCKS && cur_logical_block+run<middle_end) { 
+	    if (map_logical_to_physical_get(fs,inode_num,&inode,cur_logical_block+run,&next_physical_block)) { 
+		ERROR("Unable to map logical block %lu\n", cur_logical_block+run);
 		return -1;
-	    } else {
-		bytes += block_size;
-		continue;
 	    }
-	} else {
-	    if (write_block(fs,cur_physical_block,srcdest+bytes)) { 
-		ERROR("Failed to write middle block %lu\n",cur_physical_block);
-		return -1;
-	    } else {
-		bytes += block_size;
-		continue;
+	    if (next_physical_block!=cur_physical_block+run) { 
+		break;
 	    }
+	    run++;
+	}
+
+	if (read_write_blocks(fs,cur_physical_block,run,srcdest+bytes,write)) { 
+	    ERROR("Failed to %s middle blocks [%lu,%lu)\n",rw[write],cur_physical_block,cur_physical_block+run);
+	    return -1;
 	}
+	bytes += run*block_size;
+	cur_logical_block += run-1;
     }
 
     if (bytes != num_bytes) { 
@@ -607,6 +644,56 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
     return bytes;
 }
 
+// in-place access to a range of the file, possible only if the
+// device is memory and the range is physically contiguous
+static void *ext2_get_file_ptr(void *state, void *file, off_t offset, size_t num_bytes)
+{
+    struct ext2_state *fs = (struct ext2_state *)state;
+    uint64_t block_size = get_block_size(fs);
+    uint32_t inode_num = (uint32_t)(uint64_t)file;
+    struct ext2_inode inode;   
+    uint32_t first_logical, last_logical, first_physical, physical, i;
+    uint8_t *p;
+
+    DEBUG("direct access to inode %u %lu bytes at offset %lu\n", inode_num, num_bytes, offset);
+
+    if (!num_bytes) {
+	return 0;
+    }
+
+    if (read_inode(fs,inode_num,&inode)) { 
+	ERROR("Failed to read inode %u\n",inode_num);
+	return 0;
+    }
+
+    if (offset+num_bytes > get_file_size(fs,&inode)) { 
+	DEBUG("Direct access past end of file\n");
+	return 0;
+    }
+
+    first_logical = FLOOR_DIV(offset,block_size);
+    last_logical = FLOOR_DIV(offset+num_bytes-1,block_size);
+
+    if (map_logical_to_physical_get(fs,inode_num,&inode,first_logical,&first_physical)) { 
+	ERROR("Unable to map logical block %u\n", first_logical);
+	return 0;
+    }
+
+    for (i=first_logical+1;i<=last_logical;i++) { 
+	if (map_logical_to_physical_get(fs,inode_num,&inode,i,&physical)) { 
+	    ERROR("Unable to map logical block %u\n", i);
+	    return 0;
+	}
+	if (physical!=first_physical+(i-first_logical)) { 
+	    DEBUG("Range is not physically contiguous at logical block %u\n",i);
+	    return 0;
+	}
+    }
+
+    p = get_blocks_ptr(fs,first_physical,last_logical-first_logical+1);
+
+    return p ? p + offset%block_size : 0;
+}
 
 static ssize_t ext2_read(void *state, void *file, void *srcdest, off_t offset, size_t num_bytes)
 {
@@ -649,6 +736,20 @@ static int dentry_get_put_del(struct ext2_state      *fs,
 	  op==GET ? "GET" : op==PUT ? "PUT" : "DEL",
 	  fs->fs->name, inode_num, dentry->name);
 
+    if (op==GET) {
+	uint32_t ino;
+	uint8_t  file_type;
+	if (ext2_dcache_lookup(fs,inode_num,dentry->name,dentry->name_len,&ino,&file_type)) {
+	    if (!ino) {
+		// known not to exist
+		return -1;
+	    }
+	    dentry->inode = ino;
+	    dentry->file_type = file_type;
+	    return 0;
+	}
+    }
+
     if (!their_inode) {
 	if (read_inode(fs,inode_num,&our_inode)) { 
 	    ERROR("Failed to read inode\n");
@@ -701,6 +802,7 @@ static int dentry_get_put_del(struct ext2_state      *fs,
 			    ERROR("Cannot write updated directory block\n");
 			    return -1;
 			} else {
+			    ext2_dcache_insert(fs,inode_num,dentry->name,dentry->name_len,dentry->inode,dentry->file_type);
 			    return 0;
 			}
 		    }
@@ -713,6 +815,7 @@ static int dentry_get_put_del(struct ext2_state      *fs,
 
 			// found it
 			if (op==GET) { 
+			    ext2_dcache_insert(fs,inode_num,de->name,de->name_len,de->inode,de->file_type);
 			    *dentry = *de;
 			    return 0;
 			} else {
@@ -736,6 +839,8 @@ static int dentry_get_put_del(struct ext2_state      *fs,
 			    } else {
 				// we should free the block here and update the inode 
 				// if there are now no non-empty entries on it.
+				// the name itself is still intact in the buffer
+				ext2_dcache_insert(fs,inode_num,de->name,de->name_len,0,0);
 				return 0;
 			    }
 			}
@@ -747,6 +852,10 @@ static int dentry_get_put_del(struct ext2_state      *fs,
 	
     // reached end of line...
     if (op!=PUT) { 
+	if (op==GET) {
+	    // remember that it is not there
+	    ext2_dcache_insert(fs,inode_num,dentry->name,dentry->name_len,0,0);
+	}
 	return -1;
     }
     
@@ -773,6 +882,8 @@ static int dentry_get_put_del(struct ext2_state      *fs,
 	ERROR("Unable to map new directory block %u\n",logical_block);
 	return -1;
     }
+
+    ext2_dcache_insert(fs,inode_num,dentry->name,dentry->name_len,dentry->inode,dentry->file_type);
     
     return 0;
 }
@@ -1140,7 +1251,12 @@ static void *ext2_create(void *state, char *path, int dir)
 
 static void *ext2_create_file(void *state, char *path)
 {
-    return ext2_create(state,path,0);
+    void *f = ext2_create(state,path,0);
+
+    // the caller now holds the new file open, as with ext2_open
+    ext2_icache_get((struct ext2_state *)state,(uint32_t)(uint64_t)f);
+
+    return f;
 }
 
 static int ext2_create_dir(void *state, char *path)
@@ -1150,7 +1266,7 @@ static int ext2_create_dir(void *state, char *path)
     if (!f) { 
 	return -1;
     } else {
-	return 0;
+	return ext2_bitmaps_sync((struct ext2_state *)state);
     }
 }
 
@@ -1238,6 +1354,13 @@ int ext2_remove(void *state, char *path)
 	return -1;
     }
 
+    ext2_icache_forget(fs, inum);
+
+    if (ext2_bitmaps_sync(fs)) {
+	ERROR("Failed to write back allocation state during removal\n");
+	return -1;
+    }
+
     return 0;
 }
 
@@ -1283,6 +1406,7 @@ static struct nk_fs_int ext2_inter = {
     .close_file = ext2_close,
     .read_file = ext2_read,
     .write_file = ext2_write,
+    .get_file_ptr = ext2_get_file_ptr,
 };
 
 
@@ -1321,11 +1445,26 @@ int nk_fs_ext2_attach(char *devname, char *fsname, int readonly)
 	free(s);
 	return -1;
     }
+
+    // without the caches everything still works, just uncached
+    if (ext2_cache_init(s)) {
+	ERROR("Cannot allocate caches for fs %s, continuing without them\n", fsname);
+    }
     
+    // allocation works from in-memory bitmaps, so we cannot go on without
+    // them, and they must be in place before anyone can find the fs
+    if (ext2_bitmaps_init(s)) {
+	ERROR("Cannot load allocation bitmaps for fs %s\n", fsname);
+	ext2_cache_deinit(s);
+	free(s);
+	return -1;
+    }
+
     s->fs = nk_fs_register(fsname, flags, &ext2_inter, s);
 
     if (!s->fs) { 
 	ERROR("Unable to register filesystem %s\n", fsname);
+	ext2_cache_deinit(s);
 	free(s);
 	return -1;
     }
@@ -1341,7 +1480,13 @@ int nk_fs_ext2_detach(char *fsname)
     if (!fs) { 
 	return -1;
     } else {
-	return nk_fs_unregister(fs);
+	struct ext2_state *s = (struct ext2_state *)fs->state;
+	int rc;
+	// unpublish first so no new users find it, then flush dirty
+	// inodes and allocation state before the device goes away
+	rc = nk_fs_unregister(fs);
+	ext2_cache_deinit(s);
+	return rc;
     }
 }
 
@@ -103,22 +103,45 @@ static uint32_t get_block_size(struct ext2_state *fs)
     return (1024 << shift);
 }
 
-static int read_write_block(struct ext2_state * fs, uint32_t block_num, void *srcdest, int write) 
+// direct pointer to count consecutive fs blocks, if the device
+// is memory, otherwise zero
+static uint8_t *get_blocks_ptr(struct ext2_state * fs, uint32_t block_num, uint32_t count)
+{
+    uint32_t block_size = get_block_size(fs);
+    uint64_t start      = (uint64_t)block_num*block_size;
+    uint64_t end        = start + (uint64_t)count*block_size;
+    uint64_t dev_offset = FLOOR_DIV(start,fs->chars.block_size);
+    uint64_t dev_num    = CEIL_DIV(end,fs->chars.block_size) - dev_offset;
+    uint8_t *p;
+
+    p = nk_block_dev_get_block_ptr(fs->dev,dev_offset,dev_num);
+
+    return p ? p + (start - dev_offset*fs->chars.block_size) : 0;
+}
+
+// count consecutive fs blocks in one device request
+static int read_write_blocks(struct ext2_state * fs, uint32_t block_num, uint32_t count, void *srcdest, int write) 
 {
     uint32_t block_size = get_block_size(fs);
-    uint64_t dev_offset = FLOOR_DIV(block_num*block_size,fs->chars.block_size);
-    uint64_t dev_num    = FLOOR_DIV(block_size,fs->chars.block_size);
+    uint64_t dev_offset = FLOOR_DIV((uint64_t)block_num*block_size,fs->chars.block_size);
+    uint64_t dev_num    = FLOOR_DIV((uint64_t)count*block_size,fs->chars.block_size);
     int rc;
 
     write &= 0x1;
 
-    DEBUG("%sing block %u on fs %s / dev %s, bs=%u, dev_off=%lu, dev_num=%lu\n",
-	  rw[write], block_num, fs->fs->name, fs->dev->dev.name, block_size, dev_offset, dev_num);
+    DEBUG("%sing %u block(s) at %u on fs %s / dev %s, bs=%u, dev_off=%lu, dev_num=%lu\n",
+	  rw[write], count, block_num, fs->fs->name, fs->dev->dev.name, block_size, dev_offset, dev_num);
 
     if (write) { 
 	rc = nk_block_dev_write(fs->dev,dev_offset,dev_num,srcdest,NK_DEV_REQ_BLOCKING,0,0); 
     } else {
-	rc = nk_block_dev_read(fs->dev,dev_offset,dev_num,srcdest,NK_DEV_REQ_BLOCKING,0,0);
+	uint8_t *p = get_blocks_ptr(fs,block_num,count);
+	if (p) {
+	    memcpy(srcdest,p,(uint64_t)count*block_size);
+	    rc = 0;
+	} else {
+	    rc = nk_block_dev_read(fs->dev,dev_offset,dev_num,srcdest,NK_DEV_REQ_BLOCKING,0,0);
+	}
     }
     
     if (rc) { 
@@ -130,6 +153,11 @@ static int read_write_block(struct ext2_state * fs, uint32_t block_num, void *sr
 
 }
 
+static int read_write_block(struct ext2_state * fs, uint32_t block_num, void *srcdest, int write) 
+{
+    return read_write_blocks(fs,block_num,1,srcdest,write);
+}
+
 #define read_block(fs,block_num,dest)  read_write_block(fs,block_num,dest,0)
 #define write_block(fs,block_num,src)  read_write_block(fs,block_num,src,1)
 
@@ -234,8 +262,9 @@ static int read_write_inode(struct ext2_state *fs, uint32_t inode_num, struct ex
     }
 }
 
-#define read_inode(fs,inode_num,dest)  read_write_inode(fs,inode_num,dest,0)
-#define write_inode(fs,inode_num,src)  read_write_inode(fs,inode_num,src,1)
+// everything but the cache itself goes through the inode cache
+#define read_inode(fs,inode_num,dest)  ext2_icache_read(fs,inode_num,dest)
+#define write_inode(fs,inode_num,src)  ext2_icache_write(fs,inode_num,src)
 
 /* split_path
  *
@@ -381,131 +410,53 @@ static uint32_t get_inode_num_from_dir(struct ext2_state *fs,
  *
  * given a path to a file, tries to find the inode number of the file
  * returns inode number of file if found, or 0
+ *
+ * each component is looked up by directory inode number alone, so
+ * when the dentry cache has the answer no inode or directory block
+ * is read at all
  */
 static uint32_t get_inode_num_by_path(struct ext2_state *fs, char *path) 
 {
-    int num_parts = 0;
+    char buf[strlen(path)+1];
+    char *cur_part, *next_part;
+    uint32_t cur_inode_num = EXT2_ROOT_INO;
 
     DEBUG("get_inode_num_by_path(%s,%s)\n",fs->fs->name, path);
 
-    if (!strcmp(path, "/")) {
-	DEBUG("root dir\n");
-	return EXT2_ROOT_INO;
-    }
-
-    char **parts = split_path(path, &num_parts);
-    char *cur_part = *parts;
-
-    int i;
-    struct ext2_inode cur_inode;
-    uint32_t new_inode_num = 0;
-    uint32_t cur_inode_num;
-
-    if (get_root_dir_inode(fs,&cur_inode)) { 
-	ERROR("Cannot get root directory inode\n");
-	free_split_path(parts,num_parts);
-	return 0;
-    }
-    cur_inode_num=EXT2_ROOT_INO;
-
-    DEBUG("Root inode fetched has mode %u, uid %u, size %u, blocks %u\n",
-	  cur_inode.i_mode, cur_inode.i_uid, cur_inode.i_size, cur_inode.i_blocks);
+    strcpy(buf,path);
 
-    DEBUG("%s has %d parts\n", path, num_parts);
-    
-    for(i = 1; i <= num_parts; i++) {   // HUH?  PAD (<=)
+    for (cur_part=buf; cur_part; cur_part=next_part) {
+	next_part = strchr(cur_part,'/');
+	if (next_part) {
+	    *next_part++ = 0;
+	}
+	if (!*cur_part) {
+	    // leading, trailing, or doubled slash
+	    continue;
+	}
 	//treat current inode as directory, and search for inode of next part
 	DEBUG("Considering part %s\n",cur_part);
-	new_inode_num = get_inode_num_from_dir(fs, cur_inode_num, &cur_inode, cur_part);
-	if (!new_inode_num) {
+	cur_inode_num = get_inode_num_from_dir(fs, cur_inode_num, 0, cur_part);
+	if (!cur_inode_num) {
 	    ERROR("Finished search and did not find element %s\n",cur_part);
-	    free_split_path(parts,num_parts);
-	    return 0;
-	}
-	DEBUG("GET INODE found: %d, %s\n", new_inode_num, cur_part);
-	if (read_inode(fs, new_inode_num, &cur_inode)) { 
-	    ERROR("Failed to read inode...\n");
-	    free_split_path(parts,num_parts);
 	    return 0;
 	}
-	cur_inode_num = new_inode_num;
-	cur_part = *(parts+i);
+	DEBUG("GET INODE found: %u, %s\n", cur_inode_num, cur_part);
     }
 
     //final inode is the requested file. return its number
-    DEBUG("Found inode: %u\n", new_inode_num);
-    free_split_path(parts,num_parts);
+    DEBUG("Found inode: %u\n", cur_inode_num);
 
-    return new_inode_num;
+    return cur_inode_num;
 }
 
+/*
+ * Allocation and freeing only touch the in-memory bitmaps
+ * (ext2_cache.c), which are written back on sync
+ */
 static int alloc_free_inode(struct ext2_state *fs, uint32_t *num, int free)
 {
-    char *af[2] = { "alloc", "free" };
-
-    uint32_t bg_start, bg_end, bgi;
-    uint32_t block_size=get_block_size(fs);
-    uint8_t buf[block_size];
-    struct ext2_group_desc bg;
-    
-    free &= 0x1;
-
-    if (free) { 
-	bg_start = bg_end = (*num-1)/inodes_per_group(&fs->super);
-    } else {
-	bg_start = 0;
-	bg_end = num_block_groups(&fs->super);
-    }
-
-    for (bgi=bg_start;bgi<bg_end;bgi++) {
-	//get block group descriptor
-	if (read_block_group(fs, bgi, &bg)) { 
-	    ERROR("Failed to read block group %u in inode %s\n", bgi, af[free]);
-	    return -1;
-	}
-	
-	if (read_block(fs,bg.bg_inode_bitmap,buf)) { 
-	    ERROR("Failed to read inode bitmap in inode %s\n", af[free]);
-	    return -1;
-	}
-	
-	int byte;
-	int bit;
-	uint8_t cur_byte;
-    
-	if (free) { 
-	    uint32_t actual;
-	    actual = *num-1;  // inode numbers start with 1.... 
-	    actual %= inodes_per_group(&fs->super); // we want index in this group
-	    byte = actual/8;
-	    bit = actual%8;
-	    buf[byte] &= ~(0x1<<bit);
-	} else {
-	    for (byte=0; byte<block_size; byte++) {
-		cur_byte = buf[byte];
-		for (bit=0; bit < 8; bit++, cur_byte>>=1) {
-		    if (!(cur_byte & 0x01)) {
-			buf[byte] |= (0x1 << bit);
-			*num = byte*8 + bit + 1; //first inode number is 1, not 0
-			*num += bgi*inodes_per_group(&fs->super); // we want inode index on whole volume
-			goto out_good;
-		    }
-		}
-	    }
-	    // if we got here, we could not find anything...
-	    *num=0;
-	    return -1;
-	}
-    }
-    
- out_good:
-
-    if (write_block(fs,bg.bg_inode_bitmap,buf)) { 
-	ERROR("Failed to write inode bitmap in inode %s\n", af[free]);
-	return -1;
-    }
-    
-    return 0;
+    return ext2_alloc_free_inode_bit(fs,num,free&0x1);
 }
 
 #define alloc_inode(fs,num) alloc_free_inode(fs,num,0)
@@ -514,71 +465,13 @@ static int alloc_free_inode(struct ext2_state *fs, uint32_t *num, int free)
 
 static int alloc_free_block(struct ext2_state *fs, uint32_t *num, int free)
 {
-    char *af[2] = { "alloc", "free" };
-
-    uint32_t bg_start, bg_end, bgi;
-    uint32_t block_size=get_block_size(fs);
-    uint8_t buf[block_size];
-    struct ext2_group_desc bg;
-    
-    free &= 0x1;
+    uint32_t got;
 
-    if (free) { 
-	bg_start = bg_end = *num/blocks_per_group(&fs->super);
+    if (free) {
+	return ext2_free_blocks(fs,*num,1);
     } else {
-	bg_start = 0;
-	bg_end = num_block_groups(&fs->super);
+	return ext2_alloc_blocks(fs,0,1,num,&got);
     }
-
-    for (bgi=bg_start;bgi<bg_end;bgi++) {
-	//get block group descriptor
-	if (read_block_group(fs, bgi, &bg)) { 
-	    ERROR("Failed to read block group %u in block %s\n", bgi, af[free]);
-	    return -1;
-	}
-	
-	if (read_block(fs,bg.bg_block_bitmap,buf)) { 
-	    ERROR("Failed to read block bitmap in block %s\n", af[free]);
-	    return -1;
-	}
-	
-	int byte;
-	int bit;
-	uint8_t cur_byte;
-    
-	if (free) { 
-	    uint32_t actual;
-	    actual = *num;  // inode numbers start with 0 
-	    actual %= blocks_per_group(&fs->super); // we want index in this group
-	    byte = actual/8;
-	    bit = actual%8;
-	    buf[byte] &= ~(0x1<<bit);
-	} else {
-	    for (byte=0; byte<block_size; byte++) {
-		cur_byte = buf[byte];
-		for (bit=0; bit < 8; bit++, cur_byte>>=1) {
-		    if (!(cur_byte & 0x01)) {
-			buf[byte] |= (0x1 << bit);
-			*num = byte*8 + bit ; //first block number is 0
-			*num += bgi*blocks_per_group(&fs->super); // we want block index on whole volume
-			goto out_good;
-		    }
-		}
-	    }
-	    // if we got here, we could not find anything...
-	    *num=0;
-	    return -1;
-	}
-    }
-    
- out_good:
-
-    if (write_block(fs,bg.bg_block_bitmap,buf)) { 
-	ERROR("Failed to write block bitmap in block %s\n", af[free]);
-	return -1;
-    }
-    
-    return 0;
 }
 
 #define alloc_block(fs,num) alloc_free_block(fs,num,0)
@@ -0,0 +1,1006 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, Peter Dinda
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+/* ext2_cache.c
+ *
+ * In-memory inode and directory entry caches for ext2.
+ *
+ * The inode cache holds copies of on-disk inodes.  read_inode() and
+ * write_inode() go through it, and writes are held back (write-back)
+ * until the inode is evicted, its last open file is closed, or the
+ * filesystem is synced or detached.  Open files pin their inodes
+ * with a reference count so they are never evicted.
+ *
+ * The dentry cache maps (directory inode, name) to an inode number,
+ * including negative entries for names known not to exist.  Path
+ * resolution consults it before touching any directory block.
+ *
+ * Both caches are fixed size, hashed, and LRU.  Neither lock is held
+ * across device I/O.  If either cache could not be allocated, every
+ * operation falls through to the device.
+ *
+ * The block and inode allocation bitmaps of every group are also kept
+ * in memory, along with the free counts.  Allocation never touches the
+ * device; dirty bitmaps, group descriptors, and the superblock counts
+ * are written back on sync (last close, remove, detach).
+ */
+
+#define EXT2_ICACHE_SIZE      256   // inodes cached per filesystem
+#define EXT2_ICACHE_BUCKETS   64    // power of two
+#define EXT2_DCACHE_SIZE      512   // names cached per filesystem
+#define EXT2_DCACHE_BUCKETS   256   // power of two
+#define EXT2_DCACHE_NAME_LEN  64    // longer names are never cached
+
+struct ext2_icache_entry {
+    struct list_head  hash_node;
+    struct list_head  lru_node;      // on the lru list, or the free list
+    uint32_t          ino;           // 0 = free
+    uint32_t          refcount;      // open files pinning this inode
+    uint64_t          dirty;         // generation of the last unsynced write, 0 = clean
+    struct ext2_inode inode;
+};
+
+struct ext2_icache {
+    spinlock_t        lock;
+    uint64_t          gen;
+    uint64_t          hits;
+    uint64_t          misses;
+    uint64_t          writebacks;
+    struct list_head  lru;           // most recently used first
+    struct list_head  free;
+    struct list_head  buckets[EXT2_ICACHE_BUCKETS];
+    struct ext2_icache_entry entries[EXT2_ICACHE_SIZE];
+};
+
+struct ext2_dcache_entry {
+    struct list_head  hash_node;
+    struct list_head  lru_node;
+    uint32_t          dir;           // 0 = free
+    uint32_t          ino;           // 0 = negative entry (name does not exist)
+    uint8_t           file_type;
+    uint8_t           name_len;
+    char              name[EXT2_DCACHE_NAME_LEN];
+};
+
+struct ext2_dcache {
+    spinlock_t        lock;
+    uint64_t          hits;
+    uint64_t          negative_hits;
+    uint64_t          misses;
+    struct list_head  lru;
+    struct list_head  free;
+    struct list_head  buckets[EXT2_DCACHE_BUCKETS];
+    struct ext2_dcache_entry entries[EXT2_DCACHE_SIZE];
+};
+
+#define CACHE_LOCK_CONF uint8_t _cache_lock_flags
+#define CACHE_LOCK(c) _cache_lock_flags = spin_lock_irq_save(&(c)->lock)
+#define CACHE_UNLOCK(c) spin_unlock_irq_restore(&(c)->lock, _cache_lock_flags)
+
+// the raw device accessors in ext2_access.c
+static int read_write_superblock(struct ext2_state *fs, int write);
+static int read_write_block(struct ext2_state * fs, uint32_t block_num, void *srcdest, int write);
+static int read_write_block_group(struct ext2_state* fs, uint32_t block_group_num, struct ext2_group_desc *srcdest, int write);
+static int read_write_inode(struct ext2_state *fs, uint32_t inode_num, struct ext2_inode *srcdest, int write);
+
+
+static int ext2_cache_init(struct ext2_state *fs)
+{
+    struct ext2_icache *ic = malloc(sizeof(*ic));
+    struct ext2_dcache *dc = malloc(sizeof(*dc));
+    int i;
+
+    if (!ic || !dc) {
+	ERROR("Cannot allocate inode and dentry caches\n");
+	free(ic);
+	free(dc);
+	return -1;
+    }
+
+    memset(ic,0,sizeof(*ic));
+    spinlock_init(&ic->lock);
+    INIT_LIST_HEAD(&ic->lru);
+    INIT_LIST_HEAD(&ic->free);
+    for (i=0;i<EXT2_ICACHE_BUCKETS;i++) {
+	INIT_LIST_HEAD(&ic->buckets[i]);
+    }
+    for (i=0;i<EXT2_ICACHE_SIZE;i++) {
+	INIT_LIST_HEAD(&ic->entries[i].hash_node);
+	list_add_tail(&ic->entries[i].lru_node,&ic->free);
+    }
+
+    memset(dc,0,sizeof(*dc));
+    spinlock_init(&dc->lock);
+    INIT_LIST_HEAD(&dc->lru);
+    INIT_LIST_HEAD(&dc->free);
+    for (i=0;i<EXT2_DCACHE_BUCKETS;i++) {
+	INIT_LIST_HEAD(&dc->buckets[i]);
+    }
+    for (i=0;i<EXT2_DCACHE_SIZE;i++) {
+	INIT_LIST_HEAD(&dc->entries[i].hash_node);
+	list_add_tail(&dc->entries[i].lru_node,&dc->free);
+    }
+
+    fs->icache = ic;
+    fs->dcache = dc;
+
+    return 0;
+}
+
+
+/*
+ * Inode cache
+ */
+
+static inline struct list_head *icache_bucket(struct ext2_icache *ic, uint32_t ino)
+{
+    return &ic->buckets[(ino * 0x9e3779b1U) >> 26 & (EXT2_ICACHE_BUCKETS-1)];
+}
+
+// cache lock must be held
+static struct ext2_icache_entry *icache_find(struct ext2_icache *ic, uint32_t ino)
+{
+    struct ext2_icache_entry *e;
+
+    list_for_each_entry(e,icache_bucket(ic,ino),hash_node) {
+	if (e->ino==ino) {
+	    return e;
+	}
+    }
+    return 0;
+}
+
+// write back one dirty entry, dropping the lock around the I/O
+// the entry stays cached (and findable) while it is written
+// cache lock must be held, and is held again on return
+static int icache_writeback_locked(struct ext2_state *fs, struct ext2_icache_entry *e, uint8_t *flags)
+{
+    struct ext2_icache *ic = fs->icache;
+    struct ext2_inode snap = e->inode;
+    uint32_t ino = e->ino;
+    uint64_t gen = e->dirty;
+    int rc;
+
+    spin_unlock_irq_restore(&ic->lock, *flags);
+
+    rc = read_write_inode(fs,ino,&snap,1);
+
+    *flags = spin_lock_irq_save(&ic->lock);
+
+    if (!rc) {
+	ic->writebacks++;
+	// unless it was rewritten (or recycled) meanwhile, it is now clean
+	if (e->ino==ino && e->dirty==gen) {
+	    e->dirty = 0;
+	}
+    }
+
+    return rc;
+}
+
+// find a slot for a new entry, evicting the least recently used
+// unpinned inode, writing it back first if needed
+// cache lock must be held; returns 0 if everything is pinned
+static struct ext2_icache_entry *icache_alloc_locked(struct ext2_state *fs, uint8_t *flags)
+{
+    struct ext2_icache *ic = fs->icache;
+    struct ext2_icache_entry *e;
+    int tries;
+
+    if (!list_empty(&ic->free)) {
+	e = list_first_entry(&ic->free,struct ext2_icache_entry,lru_node);
+	list_del_init(&e->lru_node);
+	return e;
+    }
+
+    for (tries=0;tries<4;tries++) {
+	list_for_each_entry_reverse(e,&ic->lru,lru_node) {
+	    if (!e->refcount && !e->dirty) {
+		list_del_init(&e->hash_node);
+		list_del_init(&e->lru_node);
+		e->ino = 0;
+		return e;
+	    }
+	}
+	// nothing clean, so clean the oldest unpinned entry and look again
+	list_for_each_entry_reverse(e,&ic->lru,lru_node) {
+	    if (!e->refcount) {
+		if (icache_writeback_locked(fs,e,flags)) {
+		    return 0;
+		}
+		break;
+	    }
+	}
+	if (&e->lru_node==&ic->lru) {
+	    // all pinned
+	    return 0;
+	}
+    }
+
+    return 0;
+}
+
+// insert or update; dirty => this is a write that has not reached the disk
+// returns nonzero if the inode could not be cached
+static int icache_put(struct ext2_state *fs, uint32_t ino, struct ext2_inode *src, int dirty)
+{
+    struct ext2_icache *ic = fs->icache;
+    struct ext2_icache_entry *e;
+    CACHE_LOCK_CONF;
+
+    CACHE_LOCK(ic);
+
+    e = icache_find(ic,ino);
+
+    if (!e) {
+	e = icache_alloc_locked(fs,&_cache_lock_flags);
+	if (!e) {
+	    CACHE_UNLOCK(ic);
+	    return -1;
+	}
+	// a racing reader may have filled it in while we were writing back
+	struct ext2_icache_entry *o = icache_find(ic,ino);
+	if (o) {
+	    list_add(&e->lru_node,&ic->free);
+	    e = o;
+	} else {
+	    e->ino = ino;
+	    e->refcount = 0;
+	    e->dirty = 0;
+	    e->inode = *src;
+	    list_add(&e->hash_node,icache_bucket(ic,ino));
+	    list_add(&e->lru_node,&ic->lru);
+	}
+    }
+
+    if (dirty) {
+	e->inode = *src;
+	e->dirty = ++ic->gen;
+    }
+
+    list_move(&e->lru_node,&ic->lru);
+
+    CACHE_UNLOCK(ic);
+
+    return 0;
+}
+
+static int ext2_icache_read(struct ext2_state *fs, uint32_t ino, struct ext2_inode *dest)
+{
+    struct ext2_icache *ic = fs->icache;
+    struct ext2_icache_entry *e;
+    CACHE_LOCK_CONF;
+
+    if (!ic) {
+	return read_write_inode(fs,ino,dest,0);
+    }
+
+    CACHE_LOCK(ic);
+    e = icache_find(ic,ino);
+    if (e) {
+	*dest = e->inode;
+	list_move(&e->lru_node,&ic->lru);
+	ic->hits++;
+	CACHE_UNLOCK(ic);
+	return 0;
+    }
+    ic->misses++;
+    CACHE_UNLOCK(ic);
+
+    if (read_write_inode(fs,ino,dest,0)) {
+	return -1;
+    }
+
+    icache_put(fs,ino,dest,0);
+
+    return 0;
+}
+
+static int ext2_icache_write(struct ext2_state *fs, uint32_t ino, struct ext2_inode *src)
+{
+    if (!fs->icache || icache_put(fs,ino,src,1)) {
+	// could not cache it, so write it through
+	return read_write_inode(fs,ino,src,1);
+    }
+    return 0;
+}
+
+// pin an inode in the cache for an open file
+static void ext2_icache_get(struct ext2_state *fs, uint32_t ino)
+{
+    struct ext2_icache *ic = fs->icache;
+    struct ext2_icache_entry *e;
+    struct ext2_inode inode;
+    CACHE_LOCK_CONF;
+
+    if (!ic || !ino) {
+	return;
+    }
+
+    // make sure it is cached
+    if (ext2_icache_read(fs,ino,&inode)) {
+	return;
+    }
+
+    CACHE_LOCK(ic);
+    e = icache_find(ic,ino);
+    if (e) {
+	e->refcount++;
+    }
+    CACHE_UNLOCK(ic);
+}
+
+// unpin; the last close writes the inode back
+static void ext2_icache_put(struct ext2_state *fs, uint32_t ino)
+{
+    struct ext2_icache *ic = fs->icache;
+    struct ext2_icache_entry *e;
+    CACHE_LOCK_CONF;
+
+    if (!ic || !ino) {
+	return;
+    }
+
+    CACHE_LOCK(ic);
+    e = icache_find(ic,ino);
+    if (e && e->refcount) {
+	e->refcount--;
+	if (!e->refcount && e->dirty) {
+	    if (icache_writeback_locked(fs,e,&_cache_lock_flags)) {
+		ERROR("Failed to write back inode %u on close\n",ino);
+	    }
+	}
+    }
+    CACHE_UNLOCK(ic);
+}
+
+// write back every dirty inode
+static int ext2_icache_sync(struct ext2_state *fs)
+{
+    struct ext2_icache *ic = fs->icache;
+    CACHE_LOCK_CONF;
+    int i, rc=0;
+
+    if (!ic) {
+	return 0;
+    }
+
+    CACHE_LOCK(ic);
+    for (i=0;i<EXT2_ICACHE_SIZE;i++) {
+	struct ext2_icache_entry *e = &ic->entries[i];
+	if (e->ino && e->dirty) {
+	    rc |= icache_writeback_locked(fs,e,&_cache_lock_flags);
+	}
+    }
+    CACHE_UNLOCK(ic);
+
+    return rc;
+}
+
+// the inode is being freed; write back what it has and drop it
+static void ext2_icache_forget(struct ext2_state *fs, uint32_t ino)
+{
+    struct ext2_icache *ic = fs->icache;
+    struct ext2_icache_entry *e;
+    CACHE_LOCK_CONF;
+
+    if (!ic) {
+	return;
+    }
+
+    CACHE_LOCK(ic);
+    e = icache_find(ic,ino);
+    if (e && e->dirty) {
+	icache_writeback_locked(fs,e,&_cache_lock_flags);
+	e = icache_find(ic,ino);
+    }
+    if (e && !e->refcount) {
+	list_del_init(&e->hash_node);
+	list_move(&e->lru_node,&ic->free);
+	e->ino = 0;
+	e->dirty = 0;
+    }
+    CACHE_UNLOCK(ic);
+}
+
+
+/*
+ * Dentry cache
+ */
+
+static inline struct list_head *dcache_bucket(struct ext2_dcache *dc, uint32_t dir, const char *name, int len)
+{
+    uint32_t h = 2166136261U ^ dir;
+    int i;
+
+    for (i=0;i<len;i++) {
+	h = (h ^ (uint8_t)name[i]) * 16777619U;
+    }
+
+    return &dc->buckets[h & (EXT2_DCACHE_BUCKETS-1)];
+}
+
+// cache lock must be held
+static struct ext2_dcache_entry *dcache_find(struct ext2_dcache *dc, uint32_t dir, const char *name, int len)
+{
+    struct ext2_dcache_entry *e;
+
+    list_for_each_entry(e,dcache_bucket(dc,dir,name,len),hash_node) {
+	if (e->dir==dir && e->name_len==len && !memcmp(e->name,name,len)) {
+	    return e;
+	}
+    }
+    return 0;
+}
+
+// 1 => cached answer in *ino (0 if the name is known not to exist)
+// 0 => not cached
+static int ext2_dcache_lookup(struct ext2_state *fs, uint32_t dir, const char *name, int len, uint32_t *ino, uint8_t *file_type)
+{
+    struct ext2_dcache *dc = fs->dcache;
+    struct ext2_dcache_entry *e;
+    CACHE_LOCK_CONF;
+
+    if (!dc || len>=EXT2_DCACHE_NAME_LEN) {
+	return 0;
+    }
+
+    CACHE_LOCK(dc);
+    e = dcache_find(dc,dir,name,len);
+    if (e) {
+	*ino = e->ino;
+	*file_type = e->file_type;
+	list_move(&e->lru_node,&dc->lru);
+	if (e->ino) {
+	    dc->hits++;
+	} else {
+	    dc->negative_hits++;
+	}
+    } else {
+	dc->misses++;
+    }
+    CACHE_UNLOCK(dc);
+
+    return e!=0;
+}
+
+// record that name in dir is ino (0 => does not exist)
+static void ext2_dcache_insert(struct ext2_state *fs, uint32_t dir, const char *name, int len, uint32_t ino, uint8_t file_type)
+{
+    struct ext2_dcache *dc = fs->dcache;
+    struct ext2_dcache_entry *e;
+    CACHE_LOCK_CONF;
+
+    if (!dc || len>=EXT2_DCACHE_NAME_LEN) {
+	return;
+    }
+
+    CACHE_LOCK(dc);
+    e = dcache_find(dc,dir,name,len);
+    if (!e) {
+	if (!list_empty(&dc->free)) {
+	    e = list_first_entry(&dc->free,struct ext2_dcache_entry,lru_node);
+	} else {
+	    e = list_entry(dc->lru.prev,struct ext2_dcache_entry,lru_node);
+	    list_del_init(&e->hash_node);
+	}
+	e->dir = dir;
+	e->name_len = len;
+	memcpy(e->name,name,len);
+	list_add(&e->hash_node,dcache_bucket(dc,dir,name,len));
+    }
+    e->ino = ino;
+    e->file_type = file_type;
+    list_move(&e->lru_node,&dc->lru);
+    CACHE_UNLOCK(dc);
+}
+
+
+/*
+ * Allocation bitmaps
+ *
+ * Bit i of group g's block bitmap is block first_data_block+g*blocks_per_group+i,
+ * and bit i of its inode bitmap is inode g*inodes_per_group+i+1.  Bits past
+ * the end of a short last group are kept set so they are never handed out.
+ */
+
+#define EXT2_GROUP_BLOCKS_DIRTY 0x1
+#define EXT2_GROUP_INODES_DIRTY 0x2
+#define EXT2_GROUP_DESC_DIRTY   0x4
+
+struct ext2_group {
+    struct ext2_group_desc desc;     // free counts here are kept current
+    uint8_t                dirty;
+    uint64_t              *block_map;
+    uint64_t              *inode_map;
+};
+
+struct ext2_bitmaps {
+    spinlock_t        lock;
+    uint32_t          num_groups;
+    uint32_t          blocks_per_group;
+    uint32_t          inodes_per_group;
+    uint32_t          first_data_block;
+    uint32_t          block_words;   // 64 bit words per group block bitmap
+    uint32_t          inode_words;   // 64 bit words per group inode bitmap
+    uint32_t          next_block;    // where goal-less allocation starts
+    int               super_dirty;
+    struct ext2_group groups[0];
+};
+
+// first clear bit at or after from, or nbits if none
+static uint32_t bitmap_find_zero(uint64_t *map, uint32_t nbits, uint32_t from)
+{
+    uint32_t i = from/64;
+    uint32_t words = (nbits+63)/64;
+    uint64_t w;
+
+    if (from>=nbits) {
+	return nbits;
+    }
+
+    // treat the bits before from as set
+    w = map[i] | ((1ULL<<(from%64))-1);
+
+    while (1) {
+	if (~w) {
+	    // one tzcnt per 64 bits
+	    uint32_t bit = i*64 + __builtin_ctzll(~w);
+	    return bit<nbits ? bit : nbits;
+	}
+	if (++i>=words) {
+	    return nbits;
+	}
+	w = map[i];
+    }
+}
+
+// length of the run of clear bits starting at from, up to max
+static uint32_t bitmap_zero_run(uint64_t *map, uint32_t nbits, uint32_t from, uint32_t max)
+{
+    uint32_t limit = from<nbits ? nbits-from : 0;
+    uint32_t len = 0;
+
+    if (max<limit) {
+	limit = max;
+    }
+
+    while (len<limit) {
+	uint32_t pos = from+len;
+	uint64_t w = map[pos/64] >> (pos%64);
+	uint32_t avail = 64 - pos%64;
+
+	if (w) {
+	    // the shift leaves the top bits clear, so this is < avail
+	    len += __builtin_ctzll(w);
+	    break;
+	}
+	len += avail;
+    }
+
+    return len<limit ? len : limit;
+}
+
+static void bitmap_set_range(uint64_t *map, uint32_t from, uint32_t len, int val)
+{
+    uint32_t i;
+
+    for (i=from;i<from+len;i++) {
+	if (val) {
+	    map[i/64] |= 1ULL<<(i%64);
+	} else {
+	    map[i/64] &= ~(1ULL<<(i%64));
+	}
+    }
+}
+
+static inline uint32_t group_num_blocks(struct ext2_state *fs, struct ext2_bitmaps *b, uint32_t g)
+{
+    uint32_t start = b->first_data_block + g*b->blocks_per_group;
+    uint32_t left = fs->super.s_blocks_count - start;
+
+    return left < b->blocks_per_group ? left : b->blocks_per_group;
+}
+
+static int ext2_bitmaps_init(struct ext2_state *fs)
+{
+    struct ext2_bitmaps *b;
+    uint32_t block_size = 1024 << fs->super.s_log_block_size;
+    uint32_t bpg = fs->super.s_blocks_per_group;
+    uint32_t ipg = fs->super.s_inodes_per_group;
+    uint32_t ng, g, i, n;
+    uint8_t  buf[block_size];
+
+    if (!bpg || !ipg || bpg>block_size*8 || ipg>block_size*8 || bpg%8 || ipg%8) {
+	ERROR("Unsupported group geometry (%u blocks, %u inodes per group)\n",bpg,ipg);
+	return -1;
+    }
+
+    ng = (fs->super.s_blocks_count - fs->super.s_first_data_block + bpg - 1) / bpg;
+
+    b = malloc(sizeof(*b) + ng*sizeof(struct ext2_group));
+    if (!b) {
+	ERROR("Cannot allocate bitmap state\n");
+	return -1;
+    }
+    memset(b,0,sizeof(*b) + ng*sizeof(struct ext2_group));
+
+    spinlock_init(&b->lock);
+    b->num_groups = ng;
+    b->blocks_per_group = bpg;
+    b->inodes_per_group = ipg;
+    b->first_data_block = fs->super.s_first_data_block;
+    b->block_words = (bpg+63)/64;
+    b->inode_words = (ipg+63)/64;
+    b->next_block = b->first_data_block;
+
+    fs->bitmaps = b;
+
+    for (g=0;g<ng;g++) {
+	struct ext2_group *grp = &b->groups[g];
+
+	grp->block_map = malloc(b->block_words*8);
+	grp->inode_map = malloc(b->inode_words*8);
+
+	if (!grp->block_map || !grp->inode_map) {
+	    ERROR("Cannot allocate bitmaps for group %u\n",g);
+	    goto fail;
+	}
+
+	if (read_write_block_group(fs,g,&grp->desc,0)) {
+	    ERROR("Cannot read descriptor for group %u\n",g);
+	    goto fail;
+	}
+
+	if (read_write_block(fs,grp->desc.bg_block_bitmap,buf,0)) {
+	    ERROR("Cannot read block bitmap for group %u\n",g);
+	    goto fail;
+	}
+	memset(grp->block_map,0xff,b->block_words*8);
+	n = group_num_blocks(fs,b,g);
+	memcpy(grp->block_map,buf,(n+7)/8);
+	// keep anything past the end of the group allocated
+	bitmap_set_range(grp->block_map,n,b->block_words*64-n,1);
+
+	if (read_write_block(fs,grp->desc.bg_inode_bitmap,buf,0)) {
+	    ERROR("Cannot read inode bitmap for group %u\n",g);
+	    goto fail;
+	}
+	memset(grp->inode_map,0xff,b->inode_words*8);
+	memcpy(grp->inode_map,buf,ipg/8);
+
+	// trust the bitmaps over the descriptor counts
+	for (i=0, n=0; i<b->block_words; i++) {
+	    n += 64 - __builtin_popcountll(grp->block_map[i]);
+	}
+	grp->desc.bg_free_blocks_count = n;
+	for (i=0, n=0; i<b->inode_words; i++) {
+	    n += 64 - __builtin_popcountll(grp->inode_map[i]);
+	}
+	grp->desc.bg_free_inodes_count = n;
+    }
+
+    DEBUG("Loaded bitmaps for %u groups\n", ng);
+
+    return 0;
+
+ fail:
+    for (g=0;g<ng;g++) {
+	free(b->groups[g].block_map);
+	free(b->groups[g].inode_map);
+    }
+    free(b);
+    fs->bitmaps = 0;
+    return -1;
+}
+
+#define BITMAPS_LOCK_CONF uint8_t _bitmaps_lock_flags
+#define BITMAPS_LOCK(b) _bitmaps_lock_flags = spin_lock_irq_save(&(b)->lock)
+#define BITMAPS_UNLOCK(b) spin_unlock_irq_restore(&(b)->lock, _bitmaps_lock_flags)
+
+/*
+ * Allocate up to want blocks as one physically contiguous run,
+ * starting at goal if it is free and otherwise at the first free block
+ * after it.  The run is cut short by the first allocated block.
+ * goal==0 continues from the last allocation.
+ */
+static int ext2_alloc_blocks(struct ext2_state *fs, uint32_t goal, uint32_t want, uint32_t *start, uint32_t *got)
+{
+    struct ext2_bitmaps *b = fs->bitmaps;
+    uint32_t g, gstart, bit, i, n, len;
+    BITMAPS_LOCK_CONF;
+
+    if (!b || !want) {
+	return -1;
+    }
+
+    BITMAPS_LOCK(b);
+
+    if (!goal || goal<b->first_data_block || goal>=fs->super.s_blocks_count) {
+	goal = b->next_block;
+    }
+
+    gstart = (goal - b->first_data_block) / b->blocks_per_group;
+    bit = (goal - b->first_data_block) % b->blocks_per_group;
+
+    for (i=0;i<=b->num_groups;i++) {
+	struct ext2_group *grp;
+
+	g = (gstart+i) % b->num_groups;
+	grp = &b->groups[g];
+
+	if (i) {
+	    bit = 0;
+	}
+	if (!grp->desc.bg_free_blocks_count) {
+	    continue;
+	}
+
+	n = group_num_blocks(fs,b,g);
+	bit = bitmap_find_zero(grp->block_map,n,bit);
+	if (bit>=n) {
+	    continue;
+	}
+
+	len = bitmap_zero_run(grp->block_map,n,bit,want);
+	bitmap_set_range(grp->block_map,bit,len,1);
+
+	grp->desc.bg_free_blocks_count -= len;
+	grp->dirty |= EXT2_GROUP_BLOCKS_DIRTY | EXT2_GROUP_DESC_DIRTY;
+	fs->super.s_free_blocks_count -= len;
+	b->super_dirty = 1;
+
+	*start = b->first_data_block + g*b->blocks_per_group + bit;
+	*got = len;
+	b->next_block = *start + len;
+
+	BITMAPS_UNLOCK(b);
+
+	DEBUG("Allocated %u blocks at %u (goal %u, wanted %u)\n", len, *start, goal, want);
+
+	return 0;
+    }
+
+    BITMAPS_UNLOCK(b);
+
+    ERROR("No free blocks\n");
+
+    return -1;
+}
+
+static int ext2_free_blocks(struct ext2_state *fs, uint32_t start, uint32_t count)
+{
+    struct ext2_bitmaps *b = fs->bitmaps;
+    uint32_t g, bit, i;
+    BITMAPS_LOCK_CONF;
+
+    if (!b || start<b->first_data_block || start+count>fs->super.s_blocks_count) {
+	ERROR("Cannot free blocks [%u,%u)\n",start,start+count);
+	return -1;
+    }
+
+    BITMAPS_LOCK(b);
+
+    for (i=0;i<count;i++) {
+	g = (start + i - b->first_data_block) / b->blocks_per_group;
+	bit = (start + i - b->first_data_block) % b->blocks_per_group;
+	if (!(b->groups[g].block_map[bit/64] & (1ULL<<(bit%64)))) {
+	    ERROR("Freeing free block %u\n", start+i);
+	    continue;
+	}
+	bitmap_set_range(b->groups[g].block_map,bit,1,0);
+	b->groups[g].desc.bg_free_blocks_count++;
+	b->groups[g].dirty |= EXT2_GROUP_BLOCKS_DIRTY | EXT2_GROUP_DESC_DIRTY;
+	fs->super.s_free_blocks_count++;
+    }
+    b->super_dirty = 1;
+
+    BITMAPS_UNLOCK(b);
+
+    return 0;
+}
+
+static int ext2_alloc_free_inode_bit(struct ext2_state *fs, uint32_t *num, int free)
+{
+    struct ext2_bitmaps *b = fs->bitmaps;
+    uint32_t g, bit;
+    BITMAPS_LOCK_CONF;
+
+    if (!b) {
+	return -1;
+    }
+
+    BITMAPS_LOCK(b);
+
+    if (free) {
+	if (!*num || *num>fs->super.s_inodes_count) {
+	    BITMAPS_UNLOCK(b);
+	    ERROR("Cannot free inode %u\n",*num);
+	    return -1;
+	}
+	g = (*num-1) / b->inodes_per_group;
+	bit = (*num-1) % b->inodes_per_group;
+	if (b->groups[g].inode_map[bit/64] & (1ULL<<(bit%64))) {
+	    bitmap_set_range(b->groups[g].inode_map,bit,1,0);
+	    b->groups[g].desc.bg_free_inodes_count++;
+	    fs->super.s_free_inodes_count++;
+	} else {
+	    ERROR("Freeing free inode %u\n",*num);
+	}
+    } else {
+	for (g=0;g<b->num_groups;g++) {
+	    if (!b->groups[g].desc.bg_free_inodes_count) {
+		continue;
+	    }
+	    bit = bitmap_find_zero(b->groups[g].inode_map,b->inodes_per_group,0);
+	    if (bit<b->inodes_per_group) {
+		break;
+	    }
+	}
+	if (g==b->num_groups) {
+	    BITMAPS_UNLOCK(b);
+	    ERROR("No free inodes\n");
+	    *num = 0;
+	    return -1;
+	}
+	bitmap_set_range(b->groups[g].inode_map,bit,1,1);
+	b->groups[g].desc.bg_free_inodes_count--;
+	fs->super.s_free_inodes_count--;
+	*num = g*b->inodes_per_group + bit + 1;
+    }
+
+    b->groups[g].dirty |= EXT2_GROUP_INODES_DIRTY | EXT2_GROUP_DESC_DIRTY;
+    b->super_dirty = 1;
+
+    BITMAPS_UNLOCK(b);
+
+    return 0;
+}
+
+// write back dirty bitmaps, group descriptors, and the superblock counts
+static int ext2_bitmaps_sync(struct ext2_state *fs)
+{
+    struct ext2_bitmaps *b = fs->bitmaps;
+    uint32_t block_size = 1024 << fs->super.s_log_block_size;
+    uint8_t  buf[block_size];
+    struct ext2_group_desc desc;
+    uint32_t g;
+    uint8_t dirty;
+    int rc = 0;
+    BITMAPS_LOCK_CONF;
+
+    if (!b) {
+	return 0;
+    }
+
+    for (g=0;g<b->num_groups;g++) {
+	struct ext2_group *grp = &b->groups[g];
+
+	// the bitmap blocks are not shared, so only the descriptor
+	// block needs to be read first (by read_write_block_group)
+
+	BITMAPS_LOCK(b);
+	dirty = grp->dirty;
+	grp->dirty = 0;
+	desc = grp->desc;
+	BITMAPS_UNLOCK(b);
+
+	if (!dirty) {
+	    continue;
+	}
+
+	if (dirty & EXT2_GROUP_BLOCKS_DIRTY) {
+	    memset(buf,0xff,block_size);
+	    BITMAPS_LOCK(b);
+	    memcpy(buf,grp->block_map,b->block_words*8 < block_size ? b->block_words*8 : block_size);
+	    BITMAPS_UNLOCK(b);
+	    if (read_write_block(fs,desc.bg_block_bitmap,buf,1)) {
+		ERROR("Cannot write block bitmap for group %u\n",g);
+		BITMAPS_LOCK(b);
+		grp->dirty |= EXT2_GROUP_BLOCKS_DIRTY;
+		BITMAPS_UNLOCK(b);
+		rc = -1;
+	    }
+	}
+	if (dirty & EXT2_GROUP_INODES_DIRTY) {
+	    memset(buf,0xff,block_size);
+	    BITMAPS_LOCK(b);
+	    memcpy(buf,grp->inode_map,b->inodes_per_group/8);
+	    BITMAPS_UNLOCK(b);
+	    if (read_write_block(fs,desc.bg_inode_bitmap,buf,1)) {
+		ERROR("Cannot write inode bitmap for group %u\n",g);
+		BITMAPS_LOCK(b);
+		grp->dirty |= EXT2_GROUP_INODES_DIRTY;
+		BITMAPS_UNLOCK(b);
+		rc = -1;
+	    }
+	}
+	if (dirty & EXT2_GROUP_DESC_DIRTY) {
+	    if (read_write_block_group(fs,g,&desc,1)) {
+		ERROR("Cannot write descriptor for group %u\n",g);
+		BITMAPS_LOCK(b);
+		grp->dirty |= EXT2_GROUP_DESC_DIRTY;
+		BITMAPS_UNLOCK(b);
+		rc = -1;
+	    }
+	}
+    }
+
+    BITMAPS_LOCK(b);
+    dirty = b->super_dirty;
+    b->super_dirty = 0;
+    BITMAPS_UNLOCK(b);
+
+    if (dirty) {
+	if (read_write_superblock(fs,1)) {
+	    ERROR("Cannot write superblock\n");
+	    BITMAPS_LOCK(b);
+	    b->super_dirty = 1;
+	    BITMAPS_UNLOCK(b);
+	    rc = -1;
+	}
+    }
+
+    return rc;
+}
+
+static void ext2_bitmaps_deinit(struct ext2_state *fs)
+{
+    struct ext2_bitmaps *b = fs->bitmaps;
+    uint32_t g;
+
+    if (!b) {
+	return;
+    }
+
+    if (ext2_bitmaps_sync(fs)) {
+	ERROR("Failed to write back some allocation state\n");
+    }
+
+    for (g=0;g<b->num_groups;g++) {
+	free(b->groups[g].block_map);
+	free(b->groups[g].inode_map);
+    }
+    free(b);
+    fs->bitmaps = 0;
+}
+
+
+static void ext2_cache_deinit(struct ext2_state *fs)
+{
+    if (fs->icache) {
+	if (ext2_icache_sync(fs)) {
+	    ERROR("Failed to write back some inodes\n");
+	}
+	INFO("inode cache on %s: %lu hits, %lu misses, %lu writebacks\n", fs->dev->dev.name,
+	     fs->icache->hits, fs->icache->misses, fs->icache->writebacks);
+    }
+    if (fs->dcache) {
+	INFO("dentry cache on %s: %lu hits, %lu negative hits, %lu misses\n", fs->dev->dev.name,
+	     fs->dcache->hits, fs->dcache->negative_hits, fs->dcache->misses);
+    }
+    free(fs->icache);
+    free(fs->dcache);
+    fs->icache = 0;
+    fs->dcache = 0;
+    // after the inodes, which may have been the last users
+    ext2_bitmaps_deinit(fs);
+}
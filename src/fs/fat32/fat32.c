@@ -223,25 +223,24 @@ static ssize_t fat32_read_write(void *state, void *file, void *srcdest, off_t of
         long dest_off = 0;
         
         do {
-            if (nk_block_dev_read(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf, NK_DEV_REQ_BLOCKING,0,0)) {
-		ERROR("Failed to read block\n");
-		return -1;
-	    }
+            long n = MIN((long)(cluster_size - remainder), to_be_read);
+            // if the device is memory, copy straight out of it
+            char *src = nk_block_dev_get_block_ptr(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size);
 
-            if (remainder > 0) {
-                memcpy(srcdest + dest_off, (char *)buf + remainder, MIN(cluster_size - remainder, to_be_read));
-                to_be_read = to_be_read - cluster_size + remainder;
-                
-                dest_off += MIN(cluster_size - remainder, to_be_read);
-                DEBUG("dest_off is %ld\n", dest_off);
-                remainder = 0;
-            } else {
-                memcpy(srcdest + dest_off, buf, MIN(to_be_read, cluster_size));
-                DEBUG("read buf is %s\n", buf);
-                dest_off += MIN(to_be_read, cluster_size);
-                DEBUG("dest_off is %ld\n", dest_off);
-                to_be_read -= cluster_size;
+            if (!src) {
+                if (nk_block_dev_read(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf, NK_DEV_REQ_BLOCKING,0,0)) {
+                    ERROR("Failed to read block\n");
+                    return -1;
+                }
+                src = buf;
             }
+
+            memcpy(srcdest + dest_off, src + remainder, n);
+            dest_off += n;
+            to_be_read -= n;
+            remainder = 0;
+            DEBUG("dest_off is %ld\n", dest_off);
+
             //update cluster number
             uint32_t next = fs->table_chars.FAT32_begin[cluster_num];
 
@@ -253,9 +252,63 @@ static ssize_t fat32_read_write(void *state, void *file, void *srcdest, off_t of
 
         } while (to_be_read > 0);
 
-        return MIN(num_bytes, file_size - offset);
+        return dest_off;
+    }
+
+}
+
+// in-place access to a range of the file, possible only if the
+// device is memory and the clusters holding the range are contiguous
+static void *fat32_get_file_ptr(void *state, void *file, off_t offset, size_t num_bytes)
+{
+    struct fat32_state *fs = (struct fat32_state *) state;
+    uint32_t dir_cluster_num;
+    dir_entry dir_ent;
+
+    DEBUG("direct access to fs %s file %s offset %lu %lu bytes\n", fs->fs->name, (char*) file, offset, num_bytes);
+
+    if (!num_bytes) {
+        return NULL;
     }
 
+    if (path_lookup(fs, (char*) file, &dir_cluster_num, &dir_ent, 0) == -1) {
+        DEBUG("Directory entry does not exist\n");
+        return NULL;
+    }
+
+    if (offset + num_bytes > dir_ent.size) {
+        DEBUG("Direct access past end of file\n");
+        return NULL;
+    }
+
+    uint32_t cluster_size = get_cluster_size(fs);
+    uint32_t first = FLOOR_DIV(offset, cluster_size);
+    uint32_t last = FLOOR_DIV(offset + num_bytes - 1, cluster_size);
+    uint32_t cluster_num = DECODE_CLUSTER(dir_ent.high_cluster, dir_ent.low_cluster);
+    uint32_t start_cluster = 0;
+    uint32_t i;
+
+    for (i = 0; i <= last; i++) {
+        if (i == first) {
+            start_cluster = cluster_num;
+        } else if (i > first && cluster_num != start_cluster + (i - first)) {
+            DEBUG("Range is not contiguous on the device at cluster %u\n", i);
+            return NULL;
+        }
+        if (i < last) {
+            uint32_t next = fs->table_chars.FAT32_begin[cluster_num];
+            if (next >= EOC_MIN && next <= EOC_MAX) {
+                DEBUG("Cluster chain ends before end of file\n");
+                return NULL;
+            }
+            cluster_num = next;
+        }
+    }
+
+    char *p = nk_block_dev_get_block_ptr(fs->dev, get_sector_num(start_cluster, fs),
+                                         (uint64_t)fs->bootrecord.cluster_size * (last - first + 1));
+
+    return p ? p + offset % cluster_size : NULL;
 }
 
 static ssize_t fat32_read(void *state, void *file, void *srcdest, off_t offset, size_t num_bytes)
@@ -658,6 +711,7 @@ static struct nk_fs_int fat32_inter = {
     .close_file = fat32_close,
     .read_file = fat32_read,
     .write_file = fat32_write,
+    .get_file_ptr = fat32_get_file_ptr,
 };
 
 static void fat32_demo(struct fat32_state *s)
@@ -23,6 +23,7 @@
 
 #include <nautilus/nautilus.h>
 #include <nautilus/spinlock.h>
+#include <nautilus/rcu.h>
 #include <nautilus/paging.h>
 #include <nautilus/thread.h>
 #include <nautilus/shell.h>
@@ -41,8 +42,15 @@
 
 
 
+// the aspace registry is read-mostly: lookups are RCU readers and
+// writers serialize on state_lock.  The dump calls into each aspace's
+// print method, which can take a while, so rather than doing that in
+// a read section it registers itself as a dumper in one and walks the
+// list afterwards.  Unregister waits out a grace period, so any dumper
+// that could have seen the entry is counted, then for the dumpers.
 static spinlock_t state_lock;
 static struct list_head aspace_list;
+static volatile uint32_t dumpers;
 
 #define STATE_LOCK_CONF uint8_t _state_lock_flags
 #define STATE_LOCK() _state_lock_flags = spin_lock_irq_save(&state_lock)
@@ -73,22 +81,34 @@ nk_aspace_t *nk_aspace_register(char *name, uint64_t flags, nk_aspace_interface_
     STATE_LOCK_CONF;
     
     STATE_LOCK();
-    list_add_tail(&a->aspace_list_node, &aspace_list);
+    list_add_tail_rcu(&a->aspace_list_node, &aspace_list);
     STATE_UNLOCK();
 
     return a;
 }
 
 
+static void aspace_free_rcu(struct nk_rcu_head *h)
+{
+    free(container_of(h, nk_aspace_t, rcu));
+}
+
 int nk_aspace_unregister(nk_aspace_t *a)
 {
     STATE_LOCK_CONF;
     
     STATE_LOCK();
-    list_del_init(&a->aspace_list_node);
+    list_del_rcu(&a->aspace_list_node);
     STATE_UNLOCK();
 
-    free(a);
+    // a dump that started before the unlink may still reach it, and
+    // after the grace period every such dump is counted in dumpers
+    nk_rcu_synchronize();
+    while (__atomic_load_n(&dumpers, __ATOMIC_ACQUIRE)) {
+	nk_yield();
+    }
+
+    nk_call_rcu(&a->rcu, aspace_free_rcu);
     
     return 0;
 }
@@ -158,15 +178,14 @@ nk_aspace_t *nk_aspace_find(char *name)
     struct list_head *cur;
     nk_aspace_t  *target=0;
     
-    STATE_LOCK_CONF;
-    STATE_LOCK();
-    list_for_each(cur,&aspace_list) {
+    nk_rcu_read_lock();
+    list_for_each_rcu(cur,&aspace_list) {
 	if (!strcmp(list_entry(cur,struct nk_aspace,aspace_list_node)->name,name)) { 
 	    target = list_entry(cur,struct nk_aspace, aspace_list_node);
 	    break;
 	}
     }
-    STATE_UNLOCK();
+    nk_rcu_read_unlock();
     DEBUG("search for %s finds %p\n",name,target);
     return target;
 }
@@ -332,13 +351,19 @@ int nk_aspace_init_ap()
 int nk_aspace_dump_aspaces(int detail)
 {
     struct list_head *cur;
-    STATE_LOCK_CONF;
-    STATE_LOCK();
-    list_for_each(cur,&aspace_list) {
+    // entering in a read section orders us against any unregister:
+    // either its grace period waits for us to be counted, or its
+    // unlink is already visible
+    nk_rcu_read_lock();
+    __sync_fetch_and_add(&dumpers,1);
+    nk_rcu_read_unlock();
+
+    list_for_each_rcu(cur,&aspace_list) {
 	struct nk_aspace *a = list_entry(cur,struct nk_aspace, aspace_list_node);
 	BOILERPLATE_DO(a,print,detail);
     }
-    STATE_UNLOCK();
+
+    __sync_fetch_and_sub(&dumpers,1);
     return 0;
 }
 
@@ -245,6 +245,22 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 
 }
 
+void *nk_block_dev_get_block_ptr(struct nk_block_dev *dev, 
+				 uint64_t blocknum, 
+				 uint64_t count)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_block_dev_int *di = (struct nk_block_dev_int *)(d->interface);
+
+    if (!di->get_block_ptr) {
+	return 0;
+    }
+
+    DEBUG("get_block_ptr %s (start=%lu, count=%lu)\n", d->name,blocknum,count);
+
+    return di->get_block_ptr(d->state,blocknum,count);
+}
+
 static int 
 handle_blktest (char * buf, void * priv)
 {
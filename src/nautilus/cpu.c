@@ -30,6 +30,7 @@
 #include <nautilus/shell.h>
 #include <nautilus/topo.h>
 #include <nautilus/irq.h>
+#include <nautilus/rcu.h>
 #include <dev/i8254.h>
 
 
@@ -244,11 +245,15 @@ handle_regs (char * buf, void * priv)
     uint64_t tid;
 
     if (sscanf(buf,"regs %lu",&tid) == 1) { 
-        nk_thread_t *t = nk_find_thread_by_tid(tid);
+        nk_thread_t *t;
+        nk_rcu_read_lock();
+        t = nk_find_thread_by_tid(tid);
+        if (t) {
+            nk_print_regs((struct nk_regs *) t->rsp);
+        }
+        nk_rcu_read_unlock();
         if (!t) {
             nk_vc_printf("No such thread\n");
-        } else {
-            nk_print_regs((struct nk_regs *) t->rsp);
         }
         return 0;
     }
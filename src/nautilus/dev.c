@@ -23,6 +23,7 @@
 
 #include <nautilus/nautilus.h>
 #include <nautilus/spinlock.h>
+#include <nautilus/rcu.h>
 #include <nautilus/dev.h>
 #include <nautilus/thread.h>
 #include <nautilus/waitqueue.h>
@@ -37,6 +38,8 @@
 #define DEBUG(fmt, args...) DEBUG_PRINT("dev: " fmt, ##args)
 #define INFO(fmt, args...) INFO_PRINT("dev: " fmt, ##args)
 
+// the device registry is read-mostly: lookups and the dump are RCU
+// readers and take no lock at all, while writers serialize on state_lock
 static spinlock_t state_lock;
 
 #define STATE_LOCK_CONF uint8_t _state_lock_flags
@@ -60,7 +63,6 @@ int nk_dev_deinit()
 	ERROR("Extant devices on deinit\n");
 	return -1;
     }
-    spinlock_deinit(&state_lock);
     INFO("device deinit\n");
     return 0;
 }
@@ -95,7 +97,7 @@ struct nk_dev *nk_dev_register(char *name, nk_dev_type_t type, uint64_t flags, s
     d->interface = inter;
 
     STATE_LOCK();
-    list_add(&d->dev_list_node,&dev_list);
+    list_add_rcu(&d->dev_list_node,&dev_list);
     STATE_UNLOCK();
     
     INFO("Added device with name %s, type %lu, flags 0x%lx\n", d->name, d->type,d->flags);
@@ -103,18 +105,23 @@ struct nk_dev *nk_dev_register(char *name, nk_dev_type_t type, uint64_t flags, s
     return d;
 }
 
+static void dev_free_rcu(struct nk_rcu_head *h)
+{
+    free(container_of(h, struct nk_dev, rcu));
+}
+
 int            nk_dev_unregister(struct nk_dev *d)
 {
     STATE_LOCK_CONF;
     
     STATE_LOCK();
-    list_del(&d->dev_list_node);
+    list_del_rcu(&d->dev_list_node);
     STATE_UNLOCK();
 
     nk_wait_queue_wake_all(d->waiting_threads);
     nk_wait_queue_destroy(d->waiting_threads);
     INFO("Unregistered device %s\n",d->name);
-    free(d);
+    nk_call_rcu(&d->rcu, dev_free_rcu);
     return 0;
 }
 
@@ -122,15 +129,14 @@ struct nk_dev *nk_dev_find(char *name)
 {
     struct list_head *cur;
     struct nk_dev *target=0;
-    STATE_LOCK_CONF;
-    STATE_LOCK();
-    list_for_each(cur,&dev_list) {
+    nk_rcu_read_lock();
+    list_for_each_rcu(cur,&dev_list) {
 	if (!strncasecmp(list_entry(cur,struct nk_dev,dev_list_node)->name,name,DEV_NAME_LEN)) { 
 	    target = list_entry(cur,struct nk_dev, dev_list_node);
 	    break;
 	}
     }
-    STATE_UNLOCK();
+    nk_rcu_read_unlock();
     return target;
 }
 
@@ -160,10 +166,38 @@ void nk_dev_signal(struct nk_dev *d)
 void nk_dev_dump_devices()
 {
     struct list_head *cur;
-    STATE_LOCK_CONF;
-    STATE_LOCK();
-    list_for_each(cur,&dev_list) {
-	struct nk_dev *d = list_entry(cur,struct nk_dev, dev_list_node);
+    struct nk_dev *snap;
+    int n=0, i=0;
+
+    // copy the entries out so the console output happens after
+    // the read section, which must not block
+    nk_rcu_read_lock();
+    list_for_each_rcu(cur,&dev_list) {
+	n++;
+    }
+    nk_rcu_read_unlock();
+
+    if (!n) {
+	return;
+    }
+
+    snap = malloc(sizeof(*snap)*n);
+    if (!snap) {
+	ERROR("cannot allocate device snapshot\n");
+	return;
+    }
+
+    nk_rcu_read_lock();
+    list_for_each_rcu(cur,&dev_list) {
+	if (i==n) {
+	    break;
+	}
+	snap[i++] = *list_entry(cur,struct nk_dev, dev_list_node);
+    }
+    nk_rcu_read_unlock();
+
+    for (n=i, i=0; i<n; i++) {
+	struct nk_dev *d = &snap[i];
 	nk_vc_printf("%s: %s flags=0x%lx interface=%p state=%p\n",
 		     d->name, 
 		     d->type==NK_DEV_GENERIC ? "generic" : 
@@ -179,7 +213,8 @@ void nk_dev_dump_devices()
 		     d->state);
 		     
     }
-    STATE_UNLOCK();
+
+    free(snap);
 }
 
 
@@ -59,31 +59,96 @@
 #define STACK_CLONE_DEPTH 2
 #define GPR_RAX_OFFSET 0x70
 
+/* Run queue geometry */
+#define FIBER_QUEUE_SIZE 4096 /* entries in each deque and inbox, must be a power of two */
+#define FIBER_QUEUE_MASK (FIBER_QUEUE_SIZE-1)
+#define FIBER_REFILL_BATCH 32 /* most fibers moved from the inbox to the deque at once */
+
+/* Fiber stack geometry */
+#define FIBER_STACK_CLASSES 6
+#define FIBER_STACK_CHUNK (512*1024) /* pools carve small stacks out of chunks this big */
+#define FIBER_STACK_GUARD ((NAUT_CONFIG_FIBER_STACK_GUARD_SIZE + 63UL) & ~63UL)
+#define FIBER_STACK_GUARD_PATTERN 0xf1be57ac6f1be57aUL
+#define FIBER_OBJ_FIBER_SIZE ((sizeof(nk_fiber_t) + 63UL) & ~63UL)
+
 /* Macros for accessing parts of the fiber state */
 #define _GET_FIBER_STATE() get_cpu()->f_state
 #define _NK_IDLE_FIBER() get_cpu()->f_state->idle_fiber
 #define _GET_FIBER_THREAD() get_cpu()->f_state->fiber_thread
-#define _GET_SCHED_HEAD() &(get_cpu()->f_state->f_sched_queue)
  
 /* Macros for locking and unlocking fibers */
-#define _LOCK_SCHED_QUEUE(state) spin_lock(&(state->lock)) 
-#define _UNLOCK_SCHED_QUEUE(state) spin_unlock(&(state->lock)) 
 #define _LOCK_FIBER(f) spin_lock(&(f->lock))
 #define _UNLOCK_FIBER(f) spin_unlock(&(f->lock))
 
+/*
+  Run queues
+
+  Each CPU's fiber thread has two lock-free queues of fiber pointers:
+
+  deque - a Chase-Lev work stealing deque.  Only the fiber thread
+          that owns it pushes and pops, both at the bottom, so the
+          fiber it most recently made runnable runs next.  Other
+          fiber threads that run out of work steal from the top.
+
+  inbox - a bounded ring with many producers and one consumer.
+          Fibers made runnable by anyone but the owner land here,
+          as do fibers that yield.  When the deque runs dry, the
+          owner moves a batch from the inbox to the deque, oldest
+          at the bottom, so fibers that yield take turns.
+
+  Queue entries do not own fibers.  A fiber is taken off a queue by
+  changing its status from READY to RUN with a compare-and-swap.
+  This lets nk_fiber_yield_to() claim a fiber wherever it is queued;
+  the entry it leaves behind is skipped by whoever pops it.  Each
+  entry holds a reference on the fiber, as does the fiber while it
+  is alive, and the last reference frees it.
+
+  A fiber can be marked READY while the CPU switching away from it
+  is still on its stack.  Its switching flag is set until the
+  context switch code is done with the stack, and a CPU that is
+  about to switch to it waits for the flag to clear.
+*/
+struct fiber_deque {
+    volatile sint64_t top __attribute__((aligned(64))); /* thieves take from here */
+    volatile sint64_t bottom __attribute__((aligned(64))); /* owner pushes and pops here */
+    nk_fiber_t * volatile buf[FIBER_QUEUE_SIZE] __attribute__((aligned(64)));
+};
+
+struct fiber_inbox {
+    volatile uint64_t tail __attribute__((aligned(64))); /* producers claim slots here */
+    volatile uint64_t head __attribute__((aligned(64))); /* owner consumes here */
+    struct {
+        volatile uint64_t seq; /* == position+1 once the slot is filled */
+        nk_fiber_t *f;
+    } slot[FIBER_QUEUE_SIZE] __attribute__((aligned(64)));
+};
+
 /* Each CPU has a fiber state associated with it */
 typedef struct nk_fiber_percpu_state {
-    spinlock_t  lock; /* lock for the entire fiber percpu state */
+    struct fiber_deque deque; /* this CPU's fibers, can be stolen by other CPUs */
+    struct fiber_inbox inbox; /* fibers handed to this CPU, and fibers that yielded */
     nk_thread_t *fiber_thread; /* Points to the CPU's Fiber thread which is created at bootup */
     nk_fiber_t *curr_fiber; /* points to the fiber currently running on this CPU */
     nk_fiber_t *idle_fiber; /* points to this CPU's idle fiber */
-    struct list_head f_sched_queue; /* sched queue for fibers on this CPU (can be accessed by other CPUs) */
     struct nk_wait_queue *waitq; /* Wait queue that the fiber thread can sleep on */
     int fork_cpu; /* Determines which CPU forked fibers will be placed on. Default => curr CPU */
+    volatile int sleeping; /* fiber thread is sleeping or waiting for fibers */
+    volatile int steal_hint; /* another CPU has fibers to spare */
+    uint64_t seed; /* for picking steal victims */
+    uint64_t steals; /* fibers stolen from other CPUs */
+    nk_fiber_t *reap; /* fiber that exited here, to free once we are off its stack */
+    struct {
+        nk_fiber_t *free; /* free fibers (and their stacks), linked through their first word */
+        uint64_t count; /* number of free fibers */
+        uint64_t chunks; /* allocations made to grow the pool */
+    } stack_pool[FIBER_STACK_CLASSES];
 } fiber_state;
 
+/* Number of fiber threads that are sleeping or waiting for fibers */
+static volatile int fiber_sleepers = 0;
+
 /* These functions are implemented in assembly. Can be found in src/asm/fiber_lowlevel.S */
-extern void _nk_fiber_context_switch(nk_fiber_t *f_to);
+extern void _nk_fiber_context_switch(nk_fiber_t *f_to, nk_fiber_t *f_from);
 extern void _nk_fiber_context_switch_early(nk_fiber_t* f_to);
 extern void _nk_exit_switch(nk_fiber_t *next);
 extern nk_fiber_t *nk_fiber_fork();
@@ -124,45 +189,563 @@ static nk_thread_t *_get_fiber_thread()
   return _get_fiber_state()->fiber_thread;
 }
 
-// returns the current CPU's sched queue head
-static struct list_head* _get_sched_head()
+// utility function for setting up  a fiber's stack 
+static void _fiber_push(nk_fiber_t * f, uint64_t x)
 {
-  return &(_get_fiber_state()->f_sched_queue); 
+    f->rsp -= 8;
+    *(uint64_t*)(f->rsp) = x;
 }
 
-// returns the current CPU's fiber sched queue lock
-static spinlock_t *_get_sched_queue_lock()
+/******** FIBER STACKS **********/
+
+/*
+  A fiber and its stack are allocated as one object:
+
+     [ guard zone | stack | nk_fiber_t ]
+
+  The guard zone is filled with a pattern when the object is made.
+  A fiber whose stack pointer is below its stack, or which has written
+  into its guard zone, is caught when it switches away or exits.
+  Overflows of up to the size of the guard zone are thus caught before
+  they reach whatever lies below.  (We cannot use unmapped guard pages:
+  the kernel is identity mapped with large pages, and with no separate
+  exception stack, a fault on an overflowed stack becomes a triple fault.)
+
+  Stack sizes are rounded up to a size class, and each CPU keeps a free
+  list per class.  Small objects are carved out of chunks allocated on
+  the CPU's own node, and pooled objects are never returned to the kernel
+  allocator.  Stacks too big for any class, or all stacks if pooling is
+  off, are allocated on their own and freed when the fiber is.
+*/
+
+static const nk_stack_size_t fiber_stack_class_size[FIBER_STACK_CLASSES] = {
+  FSTACK_4KB, FSTACK_16KB, FSTACK_64KB, FSTACK_256KB, FSTACK_1MB, FSTACK_2MB };
+
+// Fills in the guard zone below a new stack
+static void _fiber_guard_init(void *stack)
 {
-  return &(get_cpu()->f_state->lock); 
+  uint64_t *g = (uint64_t *)(stack - FIBER_STACK_GUARD);
+  uint64_t i;
+
+  for (i = 0; i < FIBER_STACK_GUARD / 8; i++) {
+    g[i] = FIBER_STACK_GUARD_PATTERN;
+  }
 }
 
-// utility function for setting up  a fiber's stack 
-static void _fiber_push(nk_fiber_t * f, uint64_t x)
+// Returns nonzero if every step-th word of f's guard zone, and the
+// 64 bytes just below its stack, are intact
+static inline int _fiber_guard_intact(nk_fiber_t *f, uint64_t step)
 {
-    f->rsp -= 8;
-    *(uint64_t*)(f->rsp) = x;
+  #if NAUT_CONFIG_FIBER_STACK_GUARD_SIZE > 0
+  uint64_t *g = (uint64_t *)(f->stack - FIBER_STACK_GUARD);
+  uint64_t n = FIBER_STACK_GUARD / 8;
+  uint64_t i;
+
+  for (i = n - 8; i < n; i++) {
+    if (g[i] != FIBER_STACK_GUARD_PATTERN) {
+      return 0;
+    }
+  }
+  for (i = 0; i < n - 8; i += step) {
+    if (g[i] != FIBER_STACK_GUARD_PATTERN) {
+      return 0;
+    }
+  }
+  #endif
+  return 1;
 }
 
-// Round Robin policy for fibers. Returns the first fiber in the curr CPU's sched queue
-// Returns NULL if no fiber is available in the curr CPU's sched queue
-static nk_fiber_t* _rr_policy()
+static void _fiber_stack_overrun(nk_fiber_t *f)
 {
-  // Grab the first fiber from the sched queue
-  struct list_head *f_queue = _GET_SCHED_HEAD(); 
-  nk_fiber_t *fiber_to_schedule = list_first_entry(f_queue, nk_fiber_t, sched_node); 
-  
-  // If sched queue not empty, fiber_to_schedule != NULL
-  if (fiber_to_schedule){
-    // Remove the fiber from the sched queue
-    list_del_init(&(fiber_to_schedule->sched_node));
+  FIBER_ERROR("STACK OVERRUN : fiber %p rsp=%p stack=[%p, %p) guard=%lu bytes\n",
+              f, (void *)f->rsp, f->stack, f->stack + f->stack_size, FIBER_STACK_GUARD);
+  panic("Fiber %p has run off the end of its stack (start=%p, rsp=%p, size=%lx)\n",
+        f, f->stack, (void *)f->rsp, f->stack_size);
+}
+
+// Checks f's stack as it switches away. Only looks at the saved stack 
+// pointer(s) and the top of the guard zone, so this is cheap.
+// (The idle fiber runs on the fiber thread's stack, so its stack
+// pointer is not checked)
+static inline void _fiber_stack_check(nk_fiber_t *f)
+{
+  #if NAUT_CONFIG_FIBER_STACK_GUARD_SIZE > 0
+  if ((!f->is_idle && f->rsp < (uint64_t)f->stack) ||
+      #if NAUT_CONFIG_FIBER_FSAVE
+      (!f->is_idle && f->fpu_state_offset < (uint64_t)f->stack) ||
+      #endif
+      !_fiber_guard_intact(f, FIBER_STACK_GUARD)) {
+    _fiber_stack_overrun(f);
+  }
+  #endif
+}
+
+// Checks f's stack as it exits, sampling the whole guard zone 
+// (every word of it when debugging)
+static inline void _fiber_stack_check_exit(nk_fiber_t *f)
+{
+  #if NAUT_CONFIG_DEBUG_FIBERS
+  uint64_t step = 1;
+  #else
+  uint64_t step = 128;
+  #endif
+  if (!_fiber_guard_intact(f, step)) {
+    _fiber_stack_overrun(f);
+  }
+}
+
+#ifdef NAUT_CONFIG_FIBER_STACK_POOL
+// returns the size class for a stack size, or -1 if it is too big for any class
+static inline int _fiber_stack_class(nk_stack_size_t size)
+{
+  int c;
+
+  for (c = 0; c < FIBER_STACK_CLASSES; c++) {
+    if (size <= fiber_stack_class_size[c]) {
+      return c;
+    }
+  }
+  return -1;
+}
+
+// Takes a free fiber of class c from this CPU's pool. Returns NULL if there is none
+static nk_fiber_t *_fiber_pool_get(int c)
+{
+  uint8_t flags = irq_disable_save();
+  fiber_state *state = _GET_FIBER_STATE();
+  nk_fiber_t *f = state->stack_pool[c].free;
+
+  if (f) {
+    state->stack_pool[c].free = *(nk_fiber_t **)f;
+    state->stack_pool[c].count--;
+  }
+  irq_enable_restore(flags);
+  return f;
+}
+
+// Returns a list of n free fibers of class c, from head to tail, to this CPU's pool
+static void _fiber_pool_put(int c, nk_fiber_t *head, nk_fiber_t *tail, uint64_t n)
+{
+  uint8_t flags = irq_disable_save();
+  fiber_state *state = _GET_FIBER_STATE();
+
+  *(nk_fiber_t **)tail = state->stack_pool[c].free;
+  state->stack_pool[c].free = head;
+  state->stack_pool[c].count += n;
+  irq_enable_restore(flags);
+}
+
+// Allocates new objects of class c on this CPU's node and adds them to 
+// its pool.  Returns the number added
+static uint64_t _fiber_pool_grow(int c)
+{
+  nk_stack_size_t stack_size = fiber_stack_class_size[c];
+  uint64_t obj_size = FIBER_STACK_GUARD + stack_size + FIBER_OBJ_FIBER_SIZE;
+  uint64_t chunk_size = obj_size * 4 <= FIBER_STACK_CHUNK ? FIBER_STACK_CHUNK : obj_size;
+  void *chunk = malloc_specific(chunk_size, my_cpu_id());
+  nk_fiber_t *head = 0, *tail = 0, *f;
+  uint64_t off, n = 0;
+
+  if (!chunk) {
+    FIBER_ERROR("Failed to allocate %lu bytes for fiber stacks\n", chunk_size);
+    return 0;
   }
 
+  for (off = 0; off + obj_size <= chunk_size; off += obj_size, n++) {
+    _fiber_guard_init(chunk + off + FIBER_STACK_GUARD);
+    f = (nk_fiber_t *)(chunk + off + FIBER_STACK_GUARD + stack_size);
+    *(nk_fiber_t **)f = head;
+    head = f;
+    if (!tail) {
+      tail = f;
+    }
+  }
+
+  _fiber_pool_put(c, head, tail, n);
+  atomic_inc(_GET_FIBER_STATE()->stack_pool[c].chunks);
+
+  FIBER_DEBUG("_fiber_pool_grow() : added %lu fibers with %lu byte stacks to cpu %d\n", n, stack_size, my_cpu_id());
+
+  return n;
+}
+#endif
+
+// Allocates a fiber with a stack of at least stack_size bytes.
+// The fiber is zeroed, except for its stack fields
+static nk_fiber_t *_fiber_alloc(nk_stack_size_t stack_size)
+{
+  nk_fiber_t *f;
+  void *stack;
+
+  #ifdef NAUT_CONFIG_FIBER_STACK_POOL
+  int c = _fiber_stack_class(stack_size);
+
+  // the pools appear once this CPU's fiber state is set up
+  if (c >= 0 && _GET_FIBER_STATE()) {
+    while (!(f = _fiber_pool_get(c))) {
+      if (!_fiber_pool_grow(c)) {
+        return 0;
+      }
+    }
+    memset(f, 0, sizeof(nk_fiber_t));
+    f->stack_size = fiber_stack_class_size[c];
+    f->stack = (void *)f - f->stack_size;
+    f->stack_class = c;
+    return f;
+  }
+  #endif
+
+  stack_size = (stack_size + 63UL) & ~63UL;
+
+  f = malloc(sizeof(nk_fiber_t));
+  stack = malloc(FIBER_STACK_GUARD + stack_size);
+  if (!f || !stack) {
+    free(f);
+    free(stack);
+    return 0;
+  }
+
+  memset(f, 0, sizeof(nk_fiber_t));
+  f->stack_size = stack_size;
+  f->stack = stack + FIBER_STACK_GUARD;
+  f->stack_class = -1;
+  _fiber_guard_init(f->stack);
+  return f;
+}
+
+// Frees a fiber and its stack.  We must not be running on that stack
+static void _fiber_free(nk_fiber_t *f)
+{
+  #ifdef NAUT_CONFIG_FIBER_STACK_POOL
+  if (f->stack_class >= 0) {
+    _fiber_pool_put(f->stack_class, f, f, 1);
+    return;
+  }
+  #endif
+  free(f->stack - FIBER_STACK_GUARD);
+  free(f);
+}
+
+static void _fiber_put(nk_fiber_t *f);
+
+// Drops the own reference of the last fiber that exited on this CPU,
+// freeing it unless stale run queue entries still point to it.
+// Fiber thread only, and not on the exited fiber's stack
+static inline void _fiber_reap(fiber_state *state)
+{
+  if (state->reap) {
+    _fiber_put(state->reap);
+    state->reap = 0;
+  }
+}
+
+/******** RUN QUEUES **********/
+
+static int _wake_fiber_thread(fiber_state *state);
+
+// Owner only. Pushes f at the bottom of the deque. Returns -1 if the deque is full
+static int _deque_push(struct fiber_deque *q, nk_fiber_t *f)
+{
+  sint64_t b = q->bottom;
+  sint64_t t = q->top;
+
+  if (b - t >= FIBER_QUEUE_SIZE) {
+    return -1;
+  }
+  q->buf[b & FIBER_QUEUE_MASK] = f;
+  // stores are not reordered with other stores, so thieves see f before the new bottom
+  __asm__ __volatile__ ("" : : : "memory");
+  q->bottom = b + 1;
+  return 0;
+}
+
+// Owner only. Pops from the bottom of the deque. Returns NULL if empty
+static nk_fiber_t *_deque_pop(struct fiber_deque *q)
+{
+  sint64_t b = q->bottom - 1;
+  sint64_t t;
+  nk_fiber_t *f;
+
+  q->bottom = b;
+  // the store to bottom must be visible before we look at top
+  mbarrier();
+  t = q->top;
+
+  if (t > b) {
+    // empty
+    q->bottom = b + 1;
+    return 0;
+  }
+
+  f = q->buf[b & FIBER_QUEUE_MASK];
+
+  if (t == b) {
+    // last entry, so we race any thieves for it
+    if (atomic_cmpswap(q->top, t, t + 1) != t) {
+      f = 0;
+    }
+    q->bottom = b + 1;
+  }
+
+  return f;
+}
+
+#define FIBER_STEAL_RETRY ((nk_fiber_t *)-1)
+
+// Any CPU. Takes from the top of the deque.  Returns NULL if empty, 
+// or FIBER_STEAL_RETRY if we lost a race with the owner or another thief
+static nk_fiber_t *_deque_steal(struct fiber_deque *q)
+{
+  sint64_t t = q->top;
+  mbarrier();
+  sint64_t b = q->bottom;
+  nk_fiber_t *f;
+
+  if (t >= b) {
+    return 0;
+  }
+
+  f = q->buf[t & FIBER_QUEUE_MASK];
+
+  if (atomic_cmpswap(q->top, t, t + 1) != t) {
+    return FIBER_STEAL_RETRY;
+  }
+
+  return f;
+}
+
+// Any CPU. Appends f to the inbox. Returns -1 if the inbox is full
+static int _inbox_push(struct fiber_inbox *q, nk_fiber_t *f)
+{
+  uint64_t pos = q->tail;
+
+  while (1) {
+    sint64_t diff = (sint64_t)(q->slot[pos & FIBER_QUEUE_MASK].seq - pos);
+
+    if (!diff) {
+      // slot is free, try to claim it
+      uint64_t old = atomic_cmpswap(q->tail, pos, pos + 1);
+      if (old == pos) {
+        q->slot[pos & FIBER_QUEUE_MASK].f = f;
+        __asm__ __volatile__ ("" : : : "memory");
+        q->slot[pos & FIBER_QUEUE_MASK].seq = pos + 1;
+        return 0;
+      }
+      pos = old;
+    } else if (diff < 0) {
+      // the owner has not consumed this slot from the last lap
+      return -1;
+    } else {
+      // another producer got here first
+      pos = q->tail;
+    }
+  }
+}
+
+// Owner only. Removes the oldest fiber from the inbox. Returns NULL if empty
+// (or if the oldest slot is claimed but its producer has not filled it yet)
+static nk_fiber_t *_inbox_pop(struct fiber_inbox *q)
+{
+  uint64_t pos = q->head;
+  nk_fiber_t *f;
+
+  if (q->slot[pos & FIBER_QUEUE_MASK].seq != pos + 1) {
+    return 0;
+  }
+  f = q->slot[pos & FIBER_QUEUE_MASK].f;
+  __asm__ __volatile__ ("" : : : "memory");
+  q->slot[pos & FIBER_QUEUE_MASK].seq = pos + FIBER_QUEUE_SIZE;
+  q->head = pos + 1;
+  return f;
+}
+
+// returns nonzero if the CPU with this state has fibers queued
+static inline int _fiber_queued(fiber_state *state)
+{
+  return state->deque.bottom > state->deque.top || state->inbox.tail != state->inbox.head;
+}
+
+// Drops a reference to f, freeing it if it was the last one
+static void _fiber_put(nk_fiber_t *f)
+{
+  if (!atomic_dec_val(f->refs)) {
+    _fiber_free(f);
+  }
+}
+
+// Consumes a run queue entry for f. Returns f if we now own it,
+// or NULL if the entry was stale (f was claimed from another entry)
+static nk_fiber_t *_fiber_claim(nk_fiber_t *f)
+{
+  int won = atomic_cmpswap(f->f_status, READY, RUN) == READY;
+  _fiber_put(f);
+  return won ? f : 0;
+}
+
+// Waits until the CPU that last ran f is off its stack
+static inline void _fiber_wait_switched(nk_fiber_t *f)
+{
+  PAUSE_WHILE(f->switching);
+}
+
+// returns true if the current thread owns (can push to and pop from) state's deque
+static inline int _fiber_owner(fiber_state *state)
+{
+  return state == _GET_FIBER_STATE() && state->fiber_thread == get_cur_thread();
+}
+
+// Queues a READY fiber on state's CPU.  The owner pushes onto its deque
+// if lifo is set, otherwise fibers go through the inbox.  If this
+// CPU's queues are full, any CPU with room gets the fiber.
+// Returns the state of the CPU the fiber was queued on
+static fiber_state *_fiber_enqueue(fiber_state *state, nk_fiber_t *f, int lifo)
+{
+  struct sys_info *sys = per_cpu_get(system);
+  int owner = _fiber_owner(state);
+  int i;
+
+  // the entry's reference must exist before the entry can be consumed
+  atomic_inc(f->refs);
+
+  if (owner && lifo && !_deque_push(&state->deque, f)) {
+    return state;
+  }
+  if (!_inbox_push(&state->inbox, f)) {
+    return state;
+  }
+  if (owner && !_deque_push(&state->deque, f)) {
+    return state;
+  }
+
+  FIBER_WARN("fiber queues for cpu %d are full\n", state->fiber_thread ? state->fiber_thread->current_cpu : -1);
+
+  for (i = 0; i < sys->num_cpus; i++) {
+    if (sys->cpus[i]->f_state && !_inbox_push(&sys->cpus[i]->f_state->inbox, f)) {
+      return sys->cpus[i]->f_state;
+    }
+  }
+
+  panic("All fiber queues are full\n");
+  return 0;
+}
+
+// Owner only. Moves the oldest fibers in the inbox to the deque, 
+// oldest at the bottom. Returns the number moved
+static int _fiber_refill(fiber_state *state)
+{
+  nk_fiber_t *batch[FIBER_REFILL_BATCH];
+  int n, i;
+
+  for (n = 0; n < FIBER_REFILL_BATCH && (batch[n] = _inbox_pop(&state->inbox)); n++) {
+  }
+
+  // the deque is empty when we are called, so these cannot fail
+  for (i = n - 1; i >= 0; i--) {
+    _deque_push(&state->deque, batch[i]);
+  }
+
+  return n;
+}
+
+#ifdef NAUT_CONFIG_FIBER_WORK_STEALING
+// picks a random starting point for a scan of the CPUs
+static inline int _fiber_random_cpu(fiber_state *state, int num_cpus)
+{
+  // xorshift, good enough for spreading out thieves
+  state->seed ^= state->seed << 13;
+  state->seed ^= state->seed >> 7;
+  state->seed ^= state->seed << 17;
+  return (int)(state->seed % num_cpus);
+}
+
+// Steals a fiber from another CPU's deque. Returns NULL if there is nothing to steal
+static nk_fiber_t *_fiber_steal(fiber_state *state)
+{
+  struct sys_info *sys = per_cpu_get(system);
+  int num_cpus = sys->num_cpus;
+  int start = _fiber_random_cpu(state, num_cpus);
+  nk_fiber_t *f;
+  int i;
+
+  for (i = 0; i < num_cpus; i++) {
+    fiber_state *victim = sys->cpus[(start + i) % num_cpus]->f_state;
+    if (!victim || victim == state) {
+      continue;
+    }
+    while ((f = _deque_steal(&victim->deque))) {
+      if (f != FIBER_STEAL_RETRY && _fiber_claim(f)) {
+        FIBER_DEBUG("_fiber_steal() : stole fiber %p from cpu %d\n", f, (start + i) % num_cpus);
+        state->steals++;
+        return f;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Wakes up one sleeping fiber thread other than state's so it can steal from us
+static void _wake_thief(fiber_state *state)
+{
+  if (!fiber_sleepers) {
+    return;
+  }
+
+  struct sys_info *sys = per_cpu_get(system);
+  int num_cpus = sys->num_cpus;
+  int start = _fiber_random_cpu(state, num_cpus);
+  int i;
+
+  for (i = 0; i < num_cpus; i++) {
+    fiber_state *s = sys->cpus[(start + i) % num_cpus]->f_state;
+    if (s && s != state && s->sleeping) {
+      s->steal_hint = 1;
+      _wake_fiber_thread(s);
+      return;
+    }
+  }
+}
+#else
+#define _wake_thief(state)
+#endif
+
+// Owner only. Picks the next fiber to run on this CPU: the most recently 
+// queued fiber on the deque, then the oldest in the inbox, and finally
+// (with work stealing) a fiber from another CPU.
+// Returns NULL if no fiber is available.
+static nk_fiber_t* _fiber_dequeue(fiber_state *state)
+{
+  nk_fiber_t *f;
+
+  // whatever we are running on, it is not the stack of a fiber that exited here
+  _fiber_reap(state);
+
+  while (1) {
+    while ((f = _deque_pop(&state->deque))) {
+      if (_fiber_claim(f)) {
+        goto out;
+      }
+    }
+    if (!_fiber_refill(state)) {
+      break;
+    }
+    // we will run one of these, and the rest can go to idle CPUs
+    if (state->deque.bottom - state->deque.top > 1) {
+      _wake_thief(state);
+    }
+  }
+
+  #ifdef NAUT_CONFIG_FIBER_WORK_STEALING
+  f = _fiber_steal(state);
+  #endif
+
+ out:
   //DEBUG: prints the fiber that was just dequeued and indicates current and idle fiber
-  FIBER_DEBUG("_rr_policy() : just dequeued a fiber : %p\n", fiber_to_schedule);
-  FIBER_DEBUG("_rr_policy() : current fiber is %p and idle fiber is %p\n", _GET_FIBER_STATE()->curr_fiber,_GET_FIBER_STATE()->idle_fiber); 
+  FIBER_DEBUG("_fiber_dequeue() : just dequeued a fiber : %p\n", f);
+  FIBER_DEBUG("_fiber_dequeue() : current fiber is %p and idle fiber is %p\n", state->curr_fiber, state->idle_fiber); 
 
   // Returns the fiber to schedule (or NULL if no fiber to schedule)
-  return fiber_to_schedule;
+  return f;
 }
 
 // Cleans up an exiting fiber. Frees fiber struct and fiber's stack, cleans up fiber's wait queue
@@ -199,9 +782,14 @@ static void _nk_fiber_exit(nk_fiber_t *f)
     // DEBUG: Prints out what fibers are in waitq and what the waitq size is
     //FIBER_DEBUG("_nk_fiber_exit() : In waitq loop. Temp is %p and size is %d\n", temp, waitq->size);
     
-    // if temp is a valid fiber, add it to a random sched queue
+    // if temp is a valid fiber, make it runnable again
+    // (with work stealing, it stays here and idle CPUs can take it)
     if (temp){
+      #ifdef NAUT_CONFIG_FIBER_WORK_STEALING
+      nk_fiber_run(temp, F_CURR_CPU);
+      #else
       nk_fiber_run(temp, F_RAND_CPU);
+      #endif
 
       // DEBUG: prints the number of fibers that temp is waiting on
       FIBER_DEBUG("_nk_fiber_exit() : restarting fiber %p on wait_queue %p\n", temp, waitq);
@@ -211,21 +799,29 @@ static void _nk_fiber_exit(nk_fiber_t *f)
   // Mark the current fiber as done (since we are exiting)
   f->is_done = 1;
 
+  // Catch a fiber that overran its stack before its memory is reused
+  _fiber_stack_check_exit(f);
+
   // Picks fiber to switch to and updates fiber state
-  _LOCK_SCHED_QUEUE(state);
-  next = _rr_policy();
+  next = _fiber_dequeue(state);
   if (!(next)) {
     next = state->idle_fiber;
   }
   state->curr_fiber = next;
-  _UNLOCK_SCHED_QUEUE(state);
+  next->curr_cpu = my_cpu_id();
+  next->f_status = RUN;
   
   // Unlock the fiber before free (in case we implement reaping)
   _UNLOCK_FIBER(f);
 
-  // Free the current fiber's memory (stack and fiber structure)
-  free(f->stack);
-  free(f);
+  // Hand the fiber's own reference to the reaper, which drops it once
+  // we are off its stack, the next time this CPU picks a fiber.  It must
+  // not be dropped here: a stale run queue entry on another CPU could
+  // then free the fiber (and its stack) while we are still running on it
+  state->reap = f;
+
+  // next may have been queued while its last CPU was still switching away from it
+  _fiber_wait_switched(next);
   
   // Switch back to the idle fiber using special exit function
   // Jumps to exit switch so we avoid pushing return addr to freed stack
@@ -355,11 +951,17 @@ static void _nk_fiber_init(nk_fiber_t *f)
 // Sets up the context switch between f_from and f_to
 __attribute__((noreturn)) static void _nk_fiber_yield_helper(nk_fiber_t *f_to, fiber_state *state, nk_fiber_t* f_from)
 {
+  // Catch f_from if it overran its stack
+  _fiber_stack_check(f_from);
+
   // If a fiber is not waiting or exiting, change its status to yielding
   if (f_from->f_status == READY && !(f_from->is_idle)) {
     f_from->f_status = YIELD;
   }
   
+  // f_to may have been queued while its last CPU was still switching away from it
+  _fiber_wait_switched(f_to);
+
   // Update fiber state and f_to's curr_cpu/status
   _LOCK_FIBER(f_to);
   state->curr_fiber = f_to;
@@ -382,24 +984,24 @@ __attribute__((noreturn)) static void _nk_fiber_yield_helper(nk_fiber_t *f_to, f
   
   // Enqueue the current fiber (if it is not the idle fiber)
   if (!(f_from->is_idle)) {
-    // Gets the sched queue for the current CPU
-    _LOCK_SCHED_QUEUE(state);
-    struct list_head *fiber_sched_queue = &(state->f_sched_queue);
-     
     // DEBUG: Prints the fiber that's about to be enqueued
     FIBER_DEBUG("_nk_fiber_yield_helper() : About to enqueue fiber: %p \n", f_from);
     
+    // We are on f_from's stack until the context switch, so it
+    // cannot run elsewhere before then (the switch clears this)
+    f_from->switching = 1;
+
     _LOCK_FIBER(f_from);
     f_from->f_status = READY;
     f_from->curr_cpu = my_cpu_id();
     _UNLOCK_FIBER(f_from);
 
-    // Adds fiber we're switching away from to the current CPU's fiber queue
-    list_add_tail(&(f_from->sched_node), fiber_sched_queue);
-    _UNLOCK_SCHED_QUEUE(state);
+    // Adds fiber we're switching away from to the current CPU's inbox,
+    // behind the fibers that are already waiting
+    _fiber_enqueue(state, f_from, 0);
   }
   // Begin context switch (register saving and stack switch)
-  _nk_fiber_context_switch(f_to);
+  _nk_fiber_context_switch(f_to, f_from);
 
   // Tells compiler this point is unreachable, stops compiler warning
   __builtin_unreachable();
@@ -418,17 +1020,22 @@ __attribute__((noreturn)) void __nk_fiber_join_yield(uint64_t rsp, uint64_t offs
   // Adjust f_from's stack ptr
   f_from->rsp = rsp;
 
+  #if NAUT_CONFIG_FIBER_FSAVE
+  f_from->fpu_state_offset = offset;
+  #endif
+
+  // Catch f_from if it overran its stack
+  _fiber_stack_check(f_from);
+
   // get next fiber to yield to
-  _LOCK_SCHED_QUEUE(state);
-  nk_fiber_t *f_to = _rr_policy();
-  _UNLOCK_SCHED_QUEUE(state);
+  nk_fiber_t *f_to = _fiber_dequeue(state);
   if (!(f_to)) { 
     if (f_from->is_idle) {
       // Should never come from the idle fiber
       panic("Attempted to call yield_to from idle fiber. Should never happen!\n");
       *(uint64_t*)(rsp+GPR_RAX_OFFSET) = -1;
       //_nk_fiber_context_switch_early(f_from);
-      _nk_fiber_context_switch(f_from);
+      _nk_fiber_context_switch(f_from, f_from);
     } else {
         f_to = state->idle_fiber;
     }
@@ -440,6 +1047,9 @@ __attribute__((noreturn)) void __nk_fiber_join_yield(uint64_t rsp, uint64_t offs
     nk_fiber_set_vc(f_from->vc);
   }
  
+  // f_to may have been queued while its last CPU was still switching away from it
+  _fiber_wait_switched(f_to);
+
   // Update f_to info and status 
   _LOCK_FIBER(f_to);
   f_to->curr_cpu = my_cpu_id();
@@ -447,8 +1057,9 @@ __attribute__((noreturn)) void __nk_fiber_join_yield(uint64_t rsp, uint64_t offs
   _UNLOCK_FIBER(f_to);
 
   // Begin context switch (register saving and stack change)
+  // f_from can be woken from its wait queue once we are off its stack
   *(uint64_t*)(rsp+GPR_RAX_OFFSET) = 0;
-  _nk_fiber_context_switch(f_to);
+  _nk_fiber_context_switch(f_to, f_from);
   
   // Tells compiler this point is unreachable, stops compiler warning
   __builtin_unreachable();
@@ -490,7 +1101,9 @@ static int _wake_fiber_thread(fiber_state *state)
 
   #if NAUT_CONFIG_FIBER_ENABLE_WAIT 
   if (!(list_empty_careful(&(state->waitq->list)))) {
-    nk_wait_queue_wake_one_extended(state->waitq, 1);
+    // we do not hold the wait queue lock, and must not race
+    // with the fiber thread's condition check
+    nk_wait_queue_wake_one_extended(state->waitq, 0);
   }
   #endif
   // NAUT_CONFIG_FIBER_ENABLE_SPIN case: No need to wake, so just return 0
@@ -515,36 +1128,22 @@ static fiber_state *_get_random_fiber_state()
   return sys->cpus[random_cpu]->f_state;
 }
 
-// Checks if to_del is on a sched queue (ready to be switched to)
+// Checks if to_del is on a run queue (ready to be switched to), and if so claims it.
+// Its run queue entry is left behind, and will be skipped when it is popped
 // returns -EINVAL if not ready, otherwise returns 0
 static int _check_yield_to(nk_fiber_t *to_del) {
-  _LOCK_FIBER(to_del);
   // If the fiber isn't ready to switch to, indicate failure.
-  if (to_del->f_status != READY) {
-     FIBER_DEBUG("_check_yield_to() : to_del's status is %s\n", to_del->f_status);
-     _UNLOCK_FIBER(to_del);
+  if (atomic_cmpswap(to_del->f_status, READY, RUN) != READY) {
+     FIBER_DEBUG("_check_yield_to() : to_del's status is %d\n", to_del->f_status);
      return -EINVAL;
-  } else { /* The fiber is ready, so we will take it from its queue so we can use it */
-      // Gets the fiber state of the CPU of the target fiber
-      fiber_state *state = per_cpu_get(system)->cpus[to_del->curr_cpu]->f_state;
-      
-      // Prevents deadlock by avoiding lock if to_del is on own queue (would spin forever)
-      if (state == _GET_FIBER_STATE()) {
-        list_del_init(&(to_del->sched_node));
-        _UNLOCK_FIBER(to_del);
-      } else { 
-      _LOCK_SCHED_QUEUE(state);
-      list_del_init(&(to_del->sched_node));
-      _UNLOCK_FIBER(to_del);
-      _UNLOCK_SCHED_QUEUE(state);
-      }
-      return 0;
   }
+  return 0;
 }
 
 // sets up fiber state for current CPU
 static struct nk_fiber_percpu_state *init_local_fiber_state()
 {
+    int i;
     struct nk_fiber_percpu_state *state = (struct nk_fiber_percpu_state*)malloc_specific(sizeof(struct nk_fiber_percpu_state), my_cpu_id());
     
     if (!state) {
@@ -554,9 +1153,11 @@ static struct nk_fiber_percpu_state *init_local_fiber_state()
 	
 	memset(state, 0, sizeof(struct nk_fiber_percpu_state));
     
-    spinlock_init(&(state->lock));
-     
-    INIT_LIST_HEAD(&(state->f_sched_queue));
+    for (i = 0; i < FIBER_QUEUE_SIZE; i++) {
+        state->inbox.slot[i].seq = i;
+    }
+
+    state->seed = rdtsc() | 1;
     
     state->waitq = nk_wait_queue_create("fib");
     
@@ -570,6 +1171,21 @@ static struct nk_fiber_percpu_state *init_local_fiber_state()
     return 0;
 }
 
+// Fills the current CPU's pool with default size fibers
+static void init_local_fiber_pool()
+{
+#ifdef NAUT_CONFIG_FIBER_STACK_POOL
+    int c = _fiber_stack_class(FSTACK_16KB);
+    
+    while (_GET_FIBER_STATE()->stack_pool[c].count < NAUT_CONFIG_FIBER_STACK_POOL_PREALLOC) {
+        if (!_fiber_pool_grow(c)) {
+            ERROR("Could not preallocate fiber stacks\n");
+            return;
+        }
+    }
+#endif
+}
+
 // Sets up fiber state on all APs
 int nk_fiber_init_ap ()
 {
@@ -584,6 +1200,8 @@ int nk_fiber_init_ap ()
 	    return -1;
     }
 
+    init_local_fiber_pool();
+
     return 0;
 }
 
@@ -600,14 +1218,30 @@ int nk_fiber_init()
 	    return -1;
     }
 
+    init_local_fiber_pool();
+
     return 0;
 }
 
 // Utility function used to determine if fiber thread should sleep or not
+// (returns nonzero if there is work to do)
 static int _check_empty(void *s) 
 {
   fiber_state *state = (fiber_state*)s;
-  return (!(list_empty(&(state->f_sched_queue)) && state->curr_fiber->is_idle));
+  return ((_fiber_queued(state) || state->steal_hint) && state->curr_fiber->is_idle);
+}
+
+// Brackets the idle fiber putting its thread to sleep, so busy CPUs can find it
+static inline void _fiber_sleep_begin(fiber_state *state)
+{
+  state->sleeping = 1;
+  atomic_inc(fiber_sleepers);
+}
+
+static inline void _fiber_sleep_end(fiber_state *state)
+{
+  atomic_dec(fiber_sleepers);
+  state->sleeping = 0;
 }
 
 // The idle fiber has different behavior depending on those chosen Kconfig option.
@@ -616,9 +1250,16 @@ static int _check_empty(void *s)
     // nk_fiber_run will wake up fiber_thread if a fiber is added to queue when it is sleeping
 // WAIT: yields continuously, but will put fiber thread onto wait queue if no fibers are available
     // nk_fiber_run will wake up fiber_thread when a fiber is added to the queue
+// With work stealing, each yield by the idle fiber also tries to steal, and a sleeping
+// fiber thread is woken up by a busy one that has fibers to spare.
 static void __nk_fiber_idle(void *in, void **out)
 {
+  fiber_state *state = _GET_FIBER_STATE();
+
   while (1) {
+    // We are about to look for fibers ourselves
+    state->steal_hint = 0;
+
     // If we have fiber thread spin enabled
     #ifdef NAUT_CONFIG_FIBER_ENABLE_SPIN
     nk_fiber_yield();
@@ -627,9 +1268,11 @@ static void __nk_fiber_idle(void *in, void **out)
     // If we have fiber thread sleep enabled
     #ifdef NAUT_CONFIG_FIBER_ENABLE_SLEEP  
     nk_fiber_yield();
-    if (list_empty_careful(_GET_SCHED_HEAD())){
+    if (!_fiber_queued(state)){
       FIBER_DEBUG("nk_fiber_idle() : fiber thread going to sleep\n");
+      _fiber_sleep_begin(state);
       nk_sleep(NAUT_CONFIG_FIBER_THREAD_SLEEP_TIME);
+      _fiber_sleep_end(state);
       FIBER_DEBUG("nk_fiber-idle() : fiber thread waking up\n");
     }
     #endif
@@ -639,10 +1282,11 @@ static void __nk_fiber_idle(void *in, void **out)
     // wakes up when nk_fiber_run is called
     #ifdef NAUT_CONFIG_FIBER_ENABLE_WAIT
     nk_fiber_yield();
-    fiber_state *state = _GET_FIBER_STATE();
     if (!(_check_empty((void*)state))){
       FIBER_DEBUG("nk_fiber_idle() : fiber thread waiting on more fibers\n");
+      _fiber_sleep_begin(state);
       nk_wait_queue_sleep_extended(state->waitq, _check_empty, state);
+      _fiber_sleep_end(state);
       FIBER_DEBUG("nk_fiber-idle() : fiber thread waking up\n");
     }
     #endif 
@@ -755,14 +1399,10 @@ static void _debug_yield(nk_fiber_t *f_to)
     //DEBUG: Indicates what fiber was picked to schedule
     FIBER_DEBUG("nk_fiber_yield() : The fiber picked to schedule is %p\n", f_to); 
   
-    //DEBUG: Will print out the fiber queue for this CPU's fiber thread
-    nk_fiber_t *f_iter = NULL;
-    struct list_head *f_sched = _GET_SCHED_HEAD();
-    list_for_each_entry(f_iter, f_sched, sched_node){
-      FIBER_DEBUG("nk_fiber_yield() : The fiber queue contains fiber: %p\n", f_iter);
-    }
-    //DEBUG: Will indicate when fiber queue is done printing (to indicate whether queue is finite)
-    FIBER_DEBUG("nk_fiber_yield() : Done printing out the fiber queue.\n");
+    //DEBUG: Will print out the run queue occupancy for this CPU's fiber thread
+    fiber_state *state = _GET_FIBER_STATE();
+    FIBER_DEBUG("nk_fiber_yield() : %ld fibers on the deque, %lu in the inbox, %lu stolen so far\n",
+                state->deque.bottom - state->deque.top, state->inbox.tail - state->inbox.head, state->steals);
   }
 }
 #endif
@@ -839,33 +1479,18 @@ int nk_fiber_create(nk_fiber_fun_t fun,
   // Get stack size
   nk_stack_size_t required_stack_size = stack_size ? stack_size: FSTACK_16KB;
 
-  // Allocate space for a fiber
-  fiber = malloc(sizeof(nk_fiber_t));
+  // Allocate space for a fiber and its stack (zeroed, except for the 
+  // stack, whose size may be rounded up)
+  fiber = _fiber_alloc(required_stack_size);
 
-  // Check if malloc for nk_fiber_t struct failed
+  // Check if the allocation failed
   if (!fiber) {
-    // Print error here
+    FIBER_ERROR("nk_fiber_create() : failed to allocate fiber with %lu byte stack\n", required_stack_size);
     return -EINVAL;
   }
 
-  // Initialize the whole struct with zeros
-  memset(fiber, 0, sizeof(nk_fiber_t));
-  
   // Set fiber status to init
   fiber->f_status = INIT;
- 
-  // Set stack size
-  fiber->stack_size = required_stack_size;
- 
-  // Allocate stack space
-  fiber->stack = (void*) malloc(required_stack_size);
-
-  // Check if malloc for the stack failed
-  if (!fiber->stack){
-    // Free the previously allocated nk_fiber_t
-    free(fiber);
-    return -EINVAL;
-  }
 
   // Initialize function, input, and output related to the fiber
   fiber->fun = fun;
@@ -885,8 +1510,8 @@ int nk_fiber_create(nk_fiber_fun_t fun,
   // Initialize the fiber's spinlock
   spinlock_init(&(fiber->lock));
 
-  // Initializes the fiber's list field
-  INIT_LIST_HEAD(&(fiber->sched_node));
+  // The fiber holds a reference on itself until it exits
+  fiber->refs = 1;
 
   // Initializes wait queue
   INIT_LIST_HEAD(&(fiber->wait_queue)); 
@@ -944,17 +1569,19 @@ int nk_fiber_run(nk_fiber_t *f, int target_cpu)
   _LOCK_FIBER(f);
   f->curr_cpu = t_cpu;
   f->f_status = READY;
-  
-  // Lock the CPU fiber state and enqueue the fiber into sched queue 
-  _LOCK_SCHED_QUEUE(state);
-  list_add_tail(&(f->sched_node), &(state->f_sched_queue));
-  
-  // Unlock CPU fiber state and f
-  _UNLOCK_SCHED_QUEUE(state);
   _UNLOCK_FIBER(f);
+  
+  // Enqueue the fiber. If we are the selected CPU's fiber thread, it goes on our
+  // deque and runs next, otherwise it goes into the selected CPU's inbox
+  state = _fiber_enqueue(state, f, 1);
  
-  // Wake up fiber thread for selected CPU (or do nothing if it is already awake)
-  _wake_fiber_thread(state); 
+  if (_fiber_owner(state)) {
+    // We are busy running the caller, so let an idle CPU take it
+    _wake_thief(state);
+  } else {
+    // Wake up fiber thread for selected CPU (or do nothing if it is already awake)
+    _wake_fiber_thread(state); 
+  }
 
   return 0;
 }
@@ -1024,14 +1651,11 @@ __attribute__((noreturn)) void _nk_fiber_yield(uint64_t rsp, uint64_t offset)
   if (state->fiber_thread != get_cur_thread()) {
     // Abort yield somehow. Subtract from RSP and retq?
     *(uint64_t*)(rsp+GPR_RAX_OFFSET) = -1; 
-    _nk_fiber_context_switch(curr_fiber);
+    _nk_fiber_context_switch(curr_fiber, curr_fiber);
   }
   
-  // Pick a random fiber to yield to (NULL if no fiber in queue)
-
-  _LOCK_SCHED_QUEUE(state);
-  nk_fiber_t *f_to = _rr_policy();
-  _UNLOCK_SCHED_QUEUE(state);
+  // Pick the next fiber to yield to (NULL if no fiber in queue)
+  nk_fiber_t *f_to = _fiber_dequeue(state);
   
   #if NAUT_CONFIG_DEBUG_FIBERS
   //_debug_yield(f_to);
@@ -1044,7 +1668,7 @@ __attribute__((noreturn)) void _nk_fiber_yield(uint64_t rsp, uint64_t offset)
     if (curr_fiber->is_idle) {
       //Abort yield somehow? Subtract from RSP and retq?
       *(uint64_t*)(rsp+GPR_RAX_OFFSET) = 1; 
-      _nk_fiber_context_switch(curr_fiber);
+      _nk_fiber_context_switch(curr_fiber, curr_fiber);
     } else {
         f_to = state->idle_fiber;
     }
@@ -1086,27 +1710,22 @@ __attribute__((noreturn)) void _nk_fiber_yield_to(nk_fiber_t *f_to, int earlyRet
   curr_fiber->fpu_state_offset = offset;
   #endif
 
-  // Locks fiber state
-  _LOCK_SCHED_QUEUE(state);
-  // Remove f_to from its respective fiber queue (need to check all CPUs)
-  // This is currently not safe, fiber may be running and therefore not in sched queue
+  // Claim f_to, wherever it is queued
   if (_check_yield_to(f_to) < 0){
     //DEBUG: Will indicate whether the fiber we're attempting to yield to was not found
     FIBER_DEBUG("nk_fiber_yield_to() : Failed to find fiber in queues :(\n");
     
     // If early ret flag is set, we will indicate failure instead of yielding to random fiber
     if (earlyRetFlag) {
-      _UNLOCK_SCHED_QUEUE(state);
       *(uint64_t*)(rsp+GPR_RAX_OFFSET) = -1;
-      _nk_fiber_context_switch(curr_fiber);
+      _nk_fiber_context_switch(curr_fiber, curr_fiber);
       FIBER_DEBUG("nk_fiber_yield_to() : early ret flag set, returning early\n");
     }
     
-    // early ret flag not set, so we find a random fiber to yield to instead
-    nk_fiber_t *new_to = _rr_policy();
-    _UNLOCK_SCHED_QUEUE(state);
+    // early ret flag not set, so we find another fiber to yield to instead
+    nk_fiber_t *new_to = _fiber_dequeue(state);
     
-    // Checks to see if we received a valid fiber from _rr_policy (NULL = no fibers to schedule)
+    // Checks to see if we received a valid fiber from _fiber_dequeue (NULL = no fibers to schedule)
     if (!(new_to)) { 
       if (curr_fiber->is_idle) { /* if no fiber to sched and curr idle, no reason to switch */
         *(uint64_t*)(rsp+GPR_RAX_OFFSET) = 0;
@@ -1122,7 +1741,6 @@ __attribute__((noreturn)) void _nk_fiber_yield_to(nk_fiber_t *f_to, int earlyRet
   }
 
   // Use utility function to perform rest of yield 
-  _UNLOCK_SCHED_QUEUE(state);
   *(uint64_t*)(rsp+GPR_RAX_OFFSET) = 0;
   _nk_fiber_yield_helper(f_to, state, curr_fiber);
 }
@@ -1211,6 +1829,9 @@ int nk_fiber_join(nk_fiber_t *wait_on)
   wait_on->num_wait++;
 
   // Update status of curr_fiber and yield
+  // Once wait_on exits, curr_fiber can be run on another CPU, but 
+  // not before we are off its stack (the join yield clears this)
+  curr_fiber->switching = 1;
   curr_fiber->f_status = WAIT;
   _UNLOCK_FIBER(wait_on);
   return _nk_fiber_join_yield();
@@ -1287,9 +1908,8 @@ nk_fiber_t *__nk_fiber_fork(uint64_t rsp0, uint64_t offset)
   FIBER_DEBUG("__nk_fiber_fork() : rbp_stash_addr: %p, rbp1_offset_from_ret0: %p, rbp_stash_offset: %p, rbp_offset_from: %p\n", rbp_stash_addr, rbp1_offset_from_ret0_addr, rbp_stash_offset_from_ret0_addr, rbp_offset_from_ret0_addr);
    
   // Allocate new fiber struct using current fiber's data
-  nk_fiber_t *new;
-  nk_fiber_create(NULL, NULL, 0, alloc_size, &new);
-  if (!new) {
+  nk_fiber_t *new = 0;
+  if (nk_fiber_create(NULL, NULL, 0, alloc_size, &new) < 0 || !new) {
     //panic("__nk_fiber_fork() : could not allocate new fiber. Fork failed.\n");
     return (nk_fiber_t*)-1;
   }
@@ -1369,8 +1989,7 @@ nk_fiber_t *__nk_fiber_fork(uint64_t rsp0, uint64_t offset)
 
   // Add the forked fiber to the sched queue
   if (nk_fiber_run(new, state->fork_cpu) < 0) {
-    free(new->stack);
-    free(new);
+    _fiber_free(new);
     return (nk_fiber_t*)-1;
   } 
 
@@ -1415,9 +2034,7 @@ int nk_fiber_set_fork_cpu(int target_cpu)
 
   // Determines whether target_cpu is sane
   if (target_cpu >= 0 && target_cpu <= num_cpus) {
-    _LOCK_SCHED_QUEUE(state);
     state->fork_cpu = target_cpu;
-    _UNLOCK_SCHED_QUEUE(state);
     return 0;
   }
 
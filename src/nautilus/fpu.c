@@ -31,6 +31,7 @@
 #include <nautilus/smp.h>
 
 #include <nautilus/backtrace.h>
+#include <nautilus/thread.h>
 #ifndef NAUT_CONFIG_DEBUG_FPU
 #undef DEBUG_PRINT
 #define DEBUG_PRINT(fmt, args...)
@@ -44,6 +45,13 @@
 
 #define FPU_DEBUG(fmt, args...) DEBUG_PRINT("FPU: " fmt, ##args)
 #define FPU_WARN(fmt, args...)  WARN_PRINT("FPU: " fmt, ##args)
+#define FPU_INFO(fmt, args...)  INFO_PRINT("FPU: " fmt, ##args)
+
+uint64_t nk_fpu_save_mode = NK_FPU_SAVE_FXSAVE;
+uint64_t nk_fpu_save_mode_noopt = NK_FPU_SAVE_FXSAVE;
+uint64_t nk_fpu_xinuse = 0;
+uint64_t nk_fpu_xcomp_bv = 0;
+uint64_t nk_fpu_save_size = FXSAVE_SIZE;
 
 #define _INTEL_FPU_FEAT_QUERY(r, feat)  \
     ({ \
@@ -342,6 +350,35 @@ get_xsave_features (void)
     return r.a;
 }
 
+/*
+ * Bytes that an XSAVE (standard form) or XSAVEC (compacted form)
+ * of the components in mask writes, from CPUID leaf 0xd
+ */
+static uint32_t
+xsave_area_size (uint64_t mask, int compacted)
+{
+    cpuid_ret_t r;
+    uint32_t size = FXSAVE_SIZE + 64; // legacy region and header
+    int i;
+
+    for (i = 2; i < 63; i++) {
+        if (!(mask & (1ULL << i))) {
+            continue;
+        }
+        cpuid_sub(0x0d, i, &r);
+        if (compacted) {
+            if (r.c & 0x2) {
+                size = (size + 63) & ~63;   // component is 64 byte aligned
+            }
+            size += r.a;
+        } else if (r.b + r.a > size) {
+            size = r.b + r.a;
+        }
+    }
+
+    return size;
+}
+
 static void
 set_osxsave (void)
 {
@@ -383,7 +420,7 @@ intel_fpu_init (struct naut_info * naut)
     DEFAULT_FUN_CHECK(has_ssse3, SSSE3)
 }
 
-static void
+static uint64_t
 fpu_init_common (struct naut_info * naut)
 {
     uint8_t x87_ready = 0;
@@ -503,11 +540,66 @@ fpu_init_common (struct naut_info * naut)
     /* Configure XSAVE Support */
     if (xsave_ready) {
         xsave_support &= get_xsave_features();
+        /* Thread and fiber save areas are fixed size, so drop AVX-512 if it won't fit */
+        if (xsave_area_size(xsave_support, 0) > XSAVE_SIZE) {
+            FPU_WARN("XSAVE area for 0x%x exceeds %d bytes, not saving AVX-512 state\n",
+                     xsave_support, XSAVE_SIZE);
+            xsave_support &= 0x7;
+        }
         asm volatile ("xor %%rcx, %%rcx ;"
                       "xsetbv ;"
-                      : : "a"(xsave_support) : "rcx", "memory");
+                      : : "a"(xsave_support), "d"(0) : "rcx", "memory");
+        return xsave_support;
     }
     #endif
+
+    return 0;
+}
+
+/*
+ * Choose the save/restore instructions for thread and fiber switches.
+ * XSAVEOPT is preferred for threads since their save area is fixed, so
+ * components not modified since the last XRSTOR need not be written.
+ * Fibers save to a different spot on their stack each time, and new
+ * threads get a copy of their creator's state, so those use plain
+ * XSAVE in that case.
+ */
+static void
+fpu_select_save_mode (uint64_t xcr0)
+{
+    cpuid_ret_t r;
+
+    if (!xcr0) {
+        FPU_INFO("Saving FP state with FXSAVE\n");
+        return;
+    }
+
+    cpuid_sub(0x0d, 1, &r);
+
+    nk_fpu_xinuse = !!(r.a & 0x4);
+
+    // a thread's area must stay in one format, since XSAVEOPT does not
+    // rewrite the XCOMP_BV that an XSAVEC would have left behind
+    if (r.a & 0x1) {
+        nk_fpu_save_mode = NK_FPU_SAVE_XSAVEOPT;
+        nk_fpu_save_mode_noopt = NK_FPU_SAVE_XSAVE;
+    } else if (r.a & 0x2) {
+        nk_fpu_save_mode = NK_FPU_SAVE_XSAVEC;
+        nk_fpu_save_mode_noopt = NK_FPU_SAVE_XSAVEC;
+        nk_fpu_xcomp_bv = (1ULL << 63) | xcr0;
+    } else {
+        nk_fpu_save_mode = NK_FPU_SAVE_XSAVE;
+        nk_fpu_save_mode_noopt = NK_FPU_SAVE_XSAVE;
+    }
+
+    nk_fpu_save_size = xsave_area_size(xcr0, nk_fpu_save_mode == NK_FPU_SAVE_XSAVEC);
+
+    FPU_INFO("Saving FP state (XCR0=0x%lx, %lu bytes) with %s for threads, %s otherwise%s\n",
+             xcr0, nk_fpu_save_size,
+             nk_fpu_save_mode == NK_FPU_SAVE_XSAVEOPT ? "XSAVEOPT" :
+             nk_fpu_save_mode == NK_FPU_SAVE_XSAVEC ? "XSAVEC" : "XSAVE",
+             nk_fpu_save_mode_noopt == NK_FPU_SAVE_XSAVEC ? "XSAVEC" : "XSAVE",
+             nk_fpu_xinuse ? ", skipping unused state" : "");
 }
 
 /* 
@@ -522,7 +614,7 @@ fpu_init (struct naut_info * naut, int is_ap)
 {
     FPU_DEBUG("Probing for Floating Point/SIMD extensions...\n");
 
-    fpu_init_common(naut);
+    uint64_t xcr0 = fpu_init_common(naut);
 
     if (nk_is_amd()) {
         amd_fpu_init(naut);
@@ -535,6 +627,8 @@ fpu_init (struct naut_info * naut, int is_ap)
 
     if (is_ap == 0) {
 
+        fpu_select_save_mode(xcr0);
+
         if (register_int_handler(XM_EXCP, xm_handler, NULL) != 0) {
             ERROR_PRINT("Could not register excp handler for XM\n");
             return;
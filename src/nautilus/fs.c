@@ -24,7 +24,9 @@
  * redistribute, and modify it as specified in the file "LICENSE.txt".
  */
 #include <nautilus/nautilus.h>
+#include <nautilus/spinlock.h>
 #include <nautilus/fs.h>
+#include <nautilus/rcu.h>
 #include <nautilus/testfs.h>
 #include <nautilus/shell.h>
 #include <nautilus/blkdev.h>
@@ -38,10 +40,16 @@
 #define DEBUG(fmt, args...)
 #endif
 
+// the filesystem registry is read-mostly: lookups and the dump are
+// RCU readers, while writers serialize on state_lock
 #define STATE_LOCK_CONF uint8_t _state_lock_flags
 #define STATE_LOCK() _state_lock_flags = spin_lock_irq_save(&state_lock)
 #define STATE_UNLOCK() spin_unlock_irq_restore(&state_lock, _state_lock_flags);
 
+#define FILES_LOCK_CONF uint8_t _files_lock_flags
+#define FILES_LOCK() _files_lock_flags = spin_lock_irq_save(&files_lock)
+#define FILES_UNLOCK() spin_unlock_irq_restore(&files_lock, _files_lock_flags);
+
 #define FILE_LOCK_CONF uint8_t _file_lock_flags
 #define FILE_LOCK(fd) _file_lock_flags = spin_lock_irq_save(&fd->lock)
 #define FILE_UNLOCK(fd) spin_unlock_irq_restore(&fd->lock, _file_lock_flags);
@@ -66,6 +74,7 @@ struct nk_fs_open_file_state {
 
 static spinlock_t state_lock;
 static struct list_head fs_list;
+static spinlock_t files_lock;
 static struct list_head open_files;
 
 static void map_over_open_files(void (*callback)(nk_fs_fd_t)) 
@@ -126,6 +135,13 @@ static void *file_create(struct nk_fs *fs, char* path)
     }
 }
 
+static void file_close(struct nk_fs *fs, void *file) 
+{
+    if (fs && fs->interface && fs->interface->close_file) {
+	fs->interface->close_file(fs->state, file);
+    }
+}
+
 static int file_trunc(nk_fs_fd_t fd, off_t len)
 {
     if (fd && fd->fs && fd->fs->interface && fd->fs->interface->trunc_file) {
@@ -163,6 +179,19 @@ static inline ssize_t file_write(nk_fs_fd_t fd, char *buf, size_t num_bytes)
     }
 }
 
+static inline void *file_get_ptr(nk_fs_fd_t fd, size_t num_bytes) 
+{
+    if (!FS_FD_ERR(fd) && fd->fs && fd->fs->interface 
+	&& fd->fs->interface->get_file_ptr) {
+	return fd->fs->interface->get_file_ptr(fd->fs->state, 
+					       fd->file, 
+					       fd->position,
+					       num_bytes);
+    } else {
+	return 0;
+    }
+}
+
 
 static int exists(struct nk_fs *fs, char *path) 
 {
@@ -188,6 +217,7 @@ int nk_fs_init(void)
     INIT_LIST_HEAD(&fs_list);
     INIT_LIST_HEAD(&open_files);
     spinlock_init(&state_lock);
+    spinlock_init(&files_lock);
     INFO("inited\n");
     return 0;
 }
@@ -201,7 +231,7 @@ int nk_deinit_fs(void)
     if (!list_empty(&fs_list)) {
 	ERROR("registered filesystems remain\n");
     }
-    spinlock_deinit(&state_lock);
+    spinlock_deinit(&files_lock);
     INFO("deinited\n");
     return 0;
 }
@@ -227,7 +257,7 @@ struct nk_fs *nk_fs_register(char *name, uint64_t flags, struct nk_fs_int *inter
     f->state = state;
 
     STATE_LOCK();
-    list_add(&f->fs_list_node,&fs_list);
+    list_add_rcu(&f->fs_list_node,&fs_list);
     STATE_UNLOCK();
     
     INFO("Added filesystem with name %s and flags 0x%lx\n", f->name,f->flags);
@@ -235,22 +265,28 @@ struct nk_fs *nk_fs_register(char *name, uint64_t flags, struct nk_fs_int *inter
     return f;
 }
 
+static void fs_free_rcu(struct nk_rcu_head *h)
+{
+    free(container_of(h, struct nk_fs, rcu));
+}
+
 int            nk_fs_unregister(struct nk_fs *f)
 {
     STATE_LOCK_CONF;
     STATE_LOCK();
-    list_del(&f->fs_list_node);
+    list_del_rcu(&f->fs_list_node);
     STATE_UNLOCK();
     INFO("Unregistered filesystem %s\n",f->name);
-    free(f);
+    nk_call_rcu(&f->rcu, fs_free_rcu);
     return 0;
 }
 
+// caller must be in an RCU read section
 static struct nk_fs *__fs_find(char *name)
 {
     struct list_head *cur;
     struct nk_fs *target=0;
-    list_for_each(cur,&fs_list) {
+    list_for_each_rcu(cur,&fs_list) {
 	if (!strncasecmp(list_entry(cur,struct nk_fs,fs_list_node)->name,name,FS_NAME_LEN)) { 
 	    target = list_entry(cur,struct nk_fs, fs_list_node);
 	    break;
@@ -261,11 +297,10 @@ static struct nk_fs *__fs_find(char *name)
 
 struct nk_fs *nk_fs_find(char *name)
 {
-    STATE_LOCK_CONF;
     struct nk_fs *fs=0;
-    STATE_LOCK();
+    nk_rcu_read_lock();
     fs = __fs_find(name);
-    STATE_UNLOCK();
+    nk_rcu_read_unlock();
     return fs;
 }
 
@@ -293,7 +328,6 @@ static char *decode_path(char *path, char *fs_name)
 
 int nk_fs_stat(char *path, struct nk_fs_stat *st)
 {
-    STATE_LOCK_CONF;
     struct nk_fs *fs;
     char fs_name[strlen(path)+1];
 
@@ -301,9 +335,9 @@ int nk_fs_stat(char *path, struct nk_fs_stat *st)
 
     DEBUG("decode has fs_name %s path %s\n", fs_name,path);
 
-    STATE_LOCK();
+    nk_rcu_read_lock();
     fs = __fs_find(fs_name);
-    STATE_UNLOCK();
+    nk_rcu_read_unlock();
 
     if (!fs) { 
 	ERROR("Cannot find filesystem named %s\n",fs_name);
@@ -335,7 +369,7 @@ nk_fs_fd_t nk_fs_creat(char *path, int mode)
 
 nk_fs_fd_t nk_fs_open(char *path, int flags, int mode) 
 {
-    STATE_LOCK_CONF;
+    FILES_LOCK_CONF;
     struct nk_fs *fs;
     char fs_name[strlen(path)+1];
 
@@ -343,9 +377,9 @@ nk_fs_fd_t nk_fs_open(char *path, int flags, int mode)
 
     path=decode_path(path,fs_name);
 
-    STATE_LOCK();
+    nk_rcu_read_lock();
     fs = __fs_find(fs_name);
-    STATE_UNLOCK();
+    nk_rcu_read_unlock();
 
     if (!fs) { 
 	ERROR("Cannot find filesystem named %s\n",fs_name);
@@ -386,9 +420,9 @@ nk_fs_fd_t nk_fs_open(char *path, int flags, int mode)
 	return FS_BAD_FD;
     }
     
-    STATE_LOCK();
+    FILES_LOCK();
     list_add(&fd->file_node, &open_files);
-    STATE_UNLOCK();
+    FILES_UNLOCK();
 
     if (flags & O_TRUNC) { 
 	file_trunc(fd,0);
@@ -405,11 +439,15 @@ nk_fs_fd_t nk_fs_open(char *path, int flags, int mode)
 
 int nk_fs_close(nk_fs_fd_t fd) 
 {
-    STATE_LOCK_CONF;
+    FILES_LOCK_CONF;
 
-    STATE_LOCK();
+    FILES_LOCK();
     list_del(&fd->file_node);
-    STATE_UNLOCK();
+    FILES_UNLOCK();
+
+    if (fd->file) {
+	file_close(fd->fs, fd->file);
+    }
 
     free(fd);
     
@@ -437,6 +475,25 @@ ssize_t nk_fs_read(nk_fs_fd_t fd, void *buf, size_t num_bytes)
     return n;
 }
 
+void *nk_fs_get_ptr(nk_fs_fd_t fd, size_t num_bytes) 
+{
+    FILE_LOCK_CONF;
+
+    if (FS_FD_ERR(fd) || !(fd->flags & O_RDONLY)) { // includes RDWR
+	ERROR("Cannot map file not opened for reading\n");
+	return 0;
+    }
+
+    FILE_LOCK(fd);
+    void *p = file_get_ptr(fd, num_bytes);
+    FILE_UNLOCK(fd);
+
+    DEBUG("direct access to %ld bytes at position %lu is %s (%p)\n", 
+	  num_bytes, fd->position, p ? "possible" : "not possible", p);
+
+    return p;
+}
+
 ssize_t nk_fs_write(nk_fs_fd_t fd, void *buf, size_t num_bytes) 
 {
     FILE_LOCK_CONF;
@@ -526,31 +583,57 @@ ssize_t nk_fs_tell(nk_fs_fd_t fd)
 
 void nk_fs_dump_filesystems()
 {
-    STATE_LOCK_CONF;
     struct list_head *cur;
+    char (*names)[FS_NAME_LEN];
+    int n=0, i=0;
 
-    STATE_LOCK();
+    // copy the names out so the console output happens after
+    // the read section, which must not block
+    nk_rcu_read_lock();
+    list_for_each_rcu(cur,&fs_list) {
+	n++;
+    }
+    nk_rcu_read_unlock();
 
-    list_for_each(cur,&fs_list) {
-	struct nk_fs *fs = list_entry(cur,struct nk_fs,fs_list_node);
-	nk_vc_printf("%s:\n", fs->name);
+    if (!n) {
+	return;
     }
-    STATE_UNLOCK();
+
+    names = malloc(FS_NAME_LEN*n);
+    if (!names) {
+	ERROR("cannot allocate filesystem snapshot\n");
+	return;
+    }
+
+    nk_rcu_read_lock();
+    list_for_each_rcu(cur,&fs_list) {
+	if (i==n) {
+	    break;
+	}
+	memcpy(names[i++],list_entry(cur,struct nk_fs,fs_list_node)->name,FS_NAME_LEN);
+    }
+    nk_rcu_read_unlock();
+
+    for (n=i, i=0; i<n; i++) {
+	nk_vc_printf("%s:\n", names[i]);
+    }
+
+    free(names);
 }
 
 
 void nk_fs_dump_files()
 {
-    STATE_LOCK_CONF;
+    FILES_LOCK_CONF;
     struct list_head *cur;
 
-    STATE_LOCK();
+    FILES_LOCK();
 
     list_for_each(cur,&open_files) {
 	struct nk_fs_open_file_state *f = list_entry(cur,struct nk_fs_open_file_state,file_node);
 	nk_vc_printf("%s:%p at %lu flags %x\n", f->fs->name,f->file,f->position,f->flags);
     }
-    STATE_UNLOCK();
+    FILES_UNLOCK();
 }
 
 
@@ -38,7 +38,38 @@
 #include <nautilus/hashtable.h>
 #include <nautilus/naut_string.h>
 #include <nautilus/mm.h>
+#include <nautilus/cpu.h>
+#include <nautilus/shell.h>
 
+/*
+  Two implementations live here behind the same API:
+
+  chained - the original table: an array of singly linked lists,
+            a malloc per insert, and a stop-the-world rehash into a
+            larger prime-sized array on growth.
+
+  swiss   - an open-addressed table in the style of Abseil's Swiss
+            tables.  Alongside the slot array is an array of one-byte
+            control words, either EMPTY or the low 7 bits of the
+            hash of the slot's key.  A lookup compares 16 control
+            words at a time against the key's 7 bits with SSE2, and
+            so touches the slots themselves only on a likely match.
+            Probing is linear, from the key's home slot, without
+            wraparound - the slot array has an overflow region past
+            the last home slot.  This allows deletion by backward
+            shifting, so there are no tombstones, and an element
+            never moves to a higher index, which keeps iteration
+            with removal simple.   Growth is incremental: a new
+            table of twice the size is allocated, and each later
+            insert moves a group of elements from the old table,
+            while lookups consult both.
+
+  NAUT_CONFIG_HASHTABLE_SWISS selects which one nk_create_htable()
+  builds.  The "htperf" shell command compares them.
+*/
+
+#define HTABLE_CHAINED 0
+#define HTABLE_SWISS   1
 
 struct nk_hash_entry {
     addr_t key;
@@ -47,7 +78,24 @@ struct nk_hash_entry {
     struct nk_hash_entry * next;
 };
 
+struct swiss_slot {
+    addr_t key;
+    addr_t value;
+};
+
+struct swiss_table {
+    uint8_t           *ctrl;      // total+SWISS_GROUP control words
+    struct swiss_slot *slots;     // total slots
+    uint_t             capacity;  // home slots, a power of two
+    uint_t             total;     // home slots plus overflow
+    uint_t             count;
+    uint_t             limit;     // grow beyond this count
+};
+
 struct nk_hashtable {
+    int    kind;
+
+    // chained
     uint_t table_length;
     struct nk_hash_entry ** table;
     uint_t entry_count;
@@ -55,6 +103,11 @@ struct nk_hashtable {
     uint_t prime_index;
     uint_t (*hash_fn) (addr_t key);
     int (*eq_fn) (addr_t key1, addr_t key2);
+
+    // swiss
+    struct swiss_table cur;
+    struct swiss_table old;       // being drained, if old.ctrl!=0
+    uint_t             migrate;   // old slots below this are drained
 };
 
 
@@ -209,8 +262,8 @@ const uint_t prime_table_length = sizeof(primes) / sizeof(primes[0]);
 
 
 /*****************************************************************************/
-struct nk_hashtable * 
-nk_create_htable (uint_t min_size,
+static struct nk_hashtable * 
+chained_create_htable (uint_t min_size,
                   uint_t (*hash_fn) (addr_t),
                   int (*eq_fn) (addr_t, addr_t)) 
 {
@@ -242,6 +295,8 @@ nk_create_htable (uint_t min_size,
         return NULL; /*oom*/
     }
 
+    memset(htable, 0, sizeof(struct nk_hashtable));
+
     htable->table = (struct nk_hash_entry **)malloc(sizeof(struct nk_hash_entry*) * size);
 
     if (htable->table == NULL) { 
@@ -252,6 +307,7 @@ nk_create_htable (uint_t min_size,
 
     memset(htable->table, 0, size * sizeof(struct nk_hash_entry *));
 
+    htable->kind          = HTABLE_CHAINED;
     htable->table_length  = size;
     htable->prime_index   = prime_index;
     htable->entry_count   = 0;
@@ -356,8 +412,8 @@ nk_htable_count (struct nk_hashtable * htable)
 }
 
 /*****************************************************************************/
-int 
-nk_htable_insert (struct nk_hashtable * htable, 
+static int 
+chained_htable_insert (struct nk_hashtable * htable, 
                   addr_t key, 
                   addr_t value) 
 {
@@ -397,8 +453,8 @@ nk_htable_insert (struct nk_hashtable * htable,
 
 
 
-int 
-nk_htable_change (struct nk_hashtable * htable, 
+static int 
+chained_htable_change (struct nk_hashtable * htable, 
                   addr_t key, 
                   addr_t value, 
                   int free_value) 
@@ -431,8 +487,8 @@ nk_htable_change (struct nk_hashtable * htable,
 
 
 
-int 
-nk_htable_inc (struct nk_hashtable * htable, 
+static int 
+chained_htable_inc (struct nk_hashtable * htable, 
                addr_t key, 
                addr_t value) 
 {
@@ -459,8 +515,8 @@ nk_htable_inc (struct nk_hashtable * htable,
 }
 
 
-int 
-nk_htable_dec (struct nk_hashtable * htable, addr_t key, addr_t value) 
+static int 
+chained_htable_dec (struct nk_hashtable * htable, addr_t key, addr_t value) 
 {
     struct nk_hash_entry * tmp_entry;
     uint_t hash_value;
@@ -489,8 +545,8 @@ nk_htable_dec (struct nk_hashtable * htable, addr_t key, addr_t value)
 
 /*****************************************************************************/
 /* returns value associated with key */
-addr_t 
-nk_htable_search (struct nk_hashtable * htable, addr_t key) 
+static addr_t 
+chained_htable_search (struct nk_hashtable * htable, addr_t key) 
 {
     struct nk_hash_entry * cursor;
     uint_t hash_value;
@@ -517,8 +573,8 @@ nk_htable_search (struct nk_hashtable * htable, addr_t key)
 
 /*****************************************************************************/
 /* returns value associated with key */
-addr_t 
-nk_htable_remove(struct nk_hashtable * htable, addr_t key, int free_key) 
+static addr_t 
+chained_htable_remove(struct nk_hashtable * htable, addr_t key, int free_key) 
 {
     /* TODO: consider compacting the table when the load factor drops enough,
      *       or provide a 'compact' method. */
@@ -561,8 +617,8 @@ nk_htable_remove(struct nk_hashtable * htable, addr_t key, int free_key)
 
 /*****************************************************************************/
 /* destroy */
-void 
-nk_free_htable (struct nk_hashtable * htable, int free_values, int free_keys) 
+static void 
+chained_free_htable (struct nk_hashtable * htable, int free_values, int free_keys) 
 {
     uint_t i;
     struct nk_hash_entry * cursor;;
@@ -614,8 +670,8 @@ nk_free_htable (struct nk_hashtable * htable, int free_values, int free_keys)
 
 
 
-struct nk_hashtable_iter * 
-nk_create_htable_iter (struct nk_hashtable * htable) 
+static struct nk_hashtable_iter * 
+chained_create_htable_iter (struct nk_hashtable * htable) 
 {
     uint_t i;
     uint_t table_length;
@@ -648,14 +704,14 @@ nk_create_htable_iter (struct nk_hashtable * htable)
 }
 
 
-addr_t 
-nk_htable_get_iter_key (struct nk_hashtable_iter * iter) 
+static addr_t 
+chained_htable_get_iter_key (struct nk_hashtable_iter * iter) 
 {
     return iter->entry->key; 
 }
 
-addr_t 
-nk_htable_get_iter_value (struct nk_hashtable_iter * iter) 
+static addr_t 
+chained_htable_get_iter_value (struct nk_hashtable_iter * iter) 
 {
     return iter->entry->value; 
 }
@@ -663,8 +719,8 @@ nk_htable_get_iter_value (struct nk_hashtable_iter * iter)
 
 /* advance - advance the iterator to the next element
  *           returns zero if advanced to end of table */
-int 
-nk_htable_iter_advance (struct nk_hashtable_iter * iter) 
+static int 
+chained_htable_iter_advance (struct nk_hashtable_iter * iter) 
 {
     uint_t j;
     uint_t table_length;
@@ -715,8 +771,8 @@ nk_htable_iter_advance (struct nk_hashtable_iter * iter)
  *          If you want the value, read it before you remove:
  *          beware memory leaks if you don't.
  *          Returns zero if end of iteration. */
-int 
-nk_htable_iter_remove (struct nk_hashtable_iter * iter, int free_key) 
+static int 
+chained_htable_iter_remove (struct nk_hashtable_iter * iter, int free_key) 
 {
     struct nk_hash_entry * remember_entry; 
     struct nk_hash_entry * remember_parent;
@@ -741,7 +797,7 @@ nk_htable_iter_remove (struct nk_hashtable_iter * iter, int free_key)
 
     /* Advance the iterator, correcting the parent */
     remember_parent = iter->parent;
-    ret = nk_htable_iter_advance(iter);
+    ret = chained_htable_iter_advance(iter);
 
     if (iter->parent == remember_entry) { 
         iter->parent = remember_parent; 
@@ -753,8 +809,8 @@ nk_htable_iter_remove (struct nk_hashtable_iter * iter, int free_key)
 
 
 /* returns zero if not found */
-int 
-nk_htable_iter_search (struct nk_hashtable_iter * iter,
+static int 
+chained_htable_iter_search (struct nk_hashtable_iter * iter,
                        struct nk_hashtable * htable, 
                        addr_t key) 
 {
@@ -793,3 +849,864 @@ nk_destroy_htable_iter (struct nk_hashtable_iter * iter)
         free(iter);
     }
 }
+
+
+
+/* SWISS TABLE */
+
+#define SWISS_GROUP          16    // control words compared at once
+#define SWISS_EMPTY          0x80  // a full slot's control word is the hash's low 7 bits
+#define SWISS_MIN_CAPACITY   16
+#define SWISS_MAX_CAPACITY   (1u << 25)  // the home slot comes from hash bits 7..31
+#define SWISS_DRAIN_SLOTS    32    // old slots drained per insert during growth
+
+typedef char v16qi  __attribute__((vector_size(16)));
+typedef char v16qiu __attribute__((vector_size(16), aligned(1), may_alias));
+
+// bit i set if ctrl[i]==b, for the 16 control words at ctrl
+static inline uint32_t 
+swiss_match (const uint8_t * ctrl, uint8_t b) 
+{
+    v16qi g = *(v16qiu *)ctrl;
+    v16qi t = { b, b, b, b, b, b, b, b, b, b, b, b, b, b, b, b };
+
+    return __builtin_ia32_pmovmskb128((v16qi)(g == t));
+}
+
+static inline uint_t 
+swiss_home (struct swiss_table * t, uint_t hash) 
+{
+    return (hash >> 7) & (t->capacity - 1);
+}
+
+static inline uint8_t 
+swiss_h2 (uint_t hash) 
+{
+    return hash & 0x7f;
+}
+
+/* 
+ * The overflow region is as large as the home region.  Since a table
+ * holds fewer elements than it has home slots, no run of full slots
+ * can go past the end, whatever the hash function does.  The control
+ * words have a group's worth of permanently empty padding beyond that,
+ * so a 16-wide compare never reads past the array.
+ */
+static int 
+swiss_table_init (struct swiss_table * t, uint_t capacity) 
+{
+    t->capacity = capacity;
+    t->total    = 2 * capacity;
+    t->count    = 0;
+    t->limit    = capacity - capacity / 4;
+    t->ctrl     = (uint8_t *)malloc(t->total + SWISS_GROUP);
+    t->slots    = (struct swiss_slot *)malloc(sizeof(struct swiss_slot) * t->total);
+
+    if (t->ctrl == NULL || t->slots == NULL) {
+        free(t->ctrl);
+        free(t->slots);
+        t->ctrl = NULL;
+        t->slots = NULL;
+        return -1; /*oom*/
+    }
+
+    memset(t->ctrl, SWISS_EMPTY, t->total + SWISS_GROUP);
+
+    return 0;
+}
+
+static void 
+swiss_table_deinit (struct swiss_table * t) 
+{
+    free(t->ctrl);
+    free(t->slots);
+    memset(t, 0, sizeof(struct swiss_table));
+}
+
+/* returns the slot holding key, or -1.  Slots below lo are known empty */
+static inline long 
+swiss_find (struct nk_hashtable * htable, 
+            struct swiss_table * t, 
+            uint_t lo, 
+            addr_t key, 
+            uint_t hash) 
+{
+    uint_t pos = swiss_home(t, hash);
+    uint8_t h2 = swiss_h2(hash);
+
+    if (pos < lo) {
+        pos = lo;
+    }
+
+    while (pos < t->total) {
+        uint32_t match = swiss_match(t->ctrl + pos, h2);
+        uint32_t empty = swiss_match(t->ctrl + pos, SWISS_EMPTY);
+
+        if (empty) {
+            /* the run of full slots ends here */
+            match &= (empty & -empty) - 1;
+        }
+
+        while (match) {
+            uint_t i = pos + __builtin_ctz(match);
+
+            if (htable->eq_fn(key, t->slots[i].key)) {
+                return i;
+            }
+            match &= match - 1;
+        }
+
+        if (empty) {
+            return -1;
+        }
+
+        pos += SWISS_GROUP;
+    }
+
+    return -1;
+}
+
+/* returns the slot used, or -1 if probing ran off the end */
+static inline long 
+swiss_place (struct swiss_table * t, addr_t key, addr_t value, uint_t hash) 
+{
+    uint_t pos = swiss_home(t, hash);
+
+    while (pos < t->total) {
+        uint32_t empty = swiss_match(t->ctrl + pos, SWISS_EMPTY);
+
+        if (empty) {
+            uint_t i = pos + __builtin_ctz(empty);
+
+            if (i >= t->total) {
+                return -1;
+            }
+
+            t->ctrl[i] = swiss_h2(hash);
+            t->slots[i].key = key;
+            t->slots[i].value = value;
+            t->count++;
+
+            return i;
+        }
+
+        pos += SWISS_GROUP;
+    }
+
+    return -1;
+}
+
+/* 
+ * Deletion by backward shift: the hole is filled by the next element
+ * in the run that may legally live there (its home is at or before
+ * the hole), which leaves a hole further on, and so on until the run
+ * ends.   Elements only ever move down.
+ */
+static void 
+swiss_erase (struct nk_hashtable * htable, struct swiss_table * t, uint_t i) 
+{
+    uint_t j;
+
+    for (j = i + 1; t->ctrl[j] != SWISS_EMPTY; j++) {
+        if (swiss_home(t, do_hash(htable, t->slots[j].key)) <= i) {
+            t->ctrl[i] = t->ctrl[j];
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+
+    t->ctrl[i] = SWISS_EMPTY;
+    t->count--;
+}
+
+/* 
+ * Move up to n slots' worth of the old table into the current one.  
+ * The old table is drained from the bottom, so a lookup in it starts
+ * no lower than the drain point.
+ */
+static void 
+swiss_drain (struct nk_hashtable * htable, uint_t n) 
+{
+    struct swiss_table * o = &(htable->old);
+    uint_t end;
+
+    if (o->ctrl == NULL) {
+        return;
+    }
+
+    end = (o->total - htable->migrate > n) ? htable->migrate + n : o->total;
+
+    for (; htable->migrate < end; htable->migrate++) {
+        uint_t i = htable->migrate;
+
+        if (o->ctrl[i] != SWISS_EMPTY) {
+            struct swiss_slot * s = &(o->slots[i]);
+
+            if (swiss_place(&(htable->cur), s->key, s->value, do_hash(htable, s->key)) < 0) {
+                /* cannot happen given the table sizing - leave it be */
+                return;
+            }
+
+            o->ctrl[i] = SWISS_EMPTY;
+            o->count--;
+        }
+    }
+
+    if (htable->migrate == o->total) {
+        swiss_table_deinit(o);
+        htable->migrate = 0;
+    }
+}
+
+static int 
+swiss_grow (struct nk_hashtable * htable) 
+{
+    struct swiss_table t;
+
+    /* A previous growth is normally long finished by now */
+    if (htable->old.ctrl != NULL) {
+        swiss_drain(htable, htable->old.total);
+
+        if (htable->old.ctrl != NULL) {
+            return 0;
+        }
+    }
+
+    if (htable->cur.capacity >= SWISS_MAX_CAPACITY) {
+        return 0;
+    }
+
+    if (swiss_table_init(&t, 2 * htable->cur.capacity)) {
+        return 0;
+    }
+
+    htable->old = htable->cur;
+    htable->cur = t;
+    htable->migrate = 0;
+
+    return -1;
+}
+
+static inline struct swiss_slot * 
+swiss_lookup (struct nk_hashtable * htable, 
+              addr_t key, 
+              struct swiss_table ** t, 
+              long * i) 
+{
+    uint_t hash = do_hash(htable, key);
+
+    if ((*i = swiss_find(htable, &(htable->cur), 0, key, hash)) >= 0) {
+        *t = &(htable->cur);
+    } else if ((htable->old.ctrl != NULL) && 
+               ((*i = swiss_find(htable, &(htable->old), htable->migrate, key, hash)) >= 0)) {
+        *t = &(htable->old);
+    } else {
+        return NULL;
+    }
+
+    return &((*t)->slots[*i]);
+}
+
+
+static struct nk_hashtable * 
+swiss_create_htable (uint_t min_size,
+                     uint_t (*hash_fn) (addr_t),
+                     int (*eq_fn) (addr_t, addr_t)) 
+{
+    struct nk_hashtable * htable;
+    uint_t capacity = SWISS_MIN_CAPACITY;
+
+    /* Check requested hashtable isn't too large */
+    if (min_size > SWISS_MAX_CAPACITY - SWISS_MAX_CAPACITY / 4) {
+        return NULL;
+    }
+
+    while (capacity - capacity / 4 < min_size) {
+        capacity <<= 1;
+    }
+
+    htable = (struct nk_hashtable *)malloc(sizeof(struct nk_hashtable));
+
+    if (htable == NULL) {
+        return NULL; /*oom*/
+    }
+
+    memset(htable, 0, sizeof(struct nk_hashtable));
+
+    if (swiss_table_init(&(htable->cur), capacity)) {
+        free(htable);
+        return NULL; /*oom*/
+    }
+
+    htable->kind    = HTABLE_SWISS;
+    htable->hash_fn = hash_fn;
+    htable->eq_fn   = eq_fn;
+
+    return htable;
+}
+
+static int 
+swiss_htable_insert (struct nk_hashtable * htable, addr_t key, addr_t value) 
+{
+    /* This method allows duplicate keys - but they shouldn't be used */
+    uint_t hash = do_hash(htable, key);
+
+    swiss_drain(htable, SWISS_DRAIN_SLOTS);
+
+    if (htable->cur.count >= htable->cur.limit) {
+        /* As with the chained table, if growth fails we still try 
+         * cramming this value into the existing table */
+        swiss_grow(htable);
+    }
+
+    if (swiss_place(&(htable->cur), key, value, hash) < 0) {
+        return 0;
+    }
+
+    htable->entry_count++;
+
+    return -1;
+}
+
+static int 
+swiss_htable_change (struct nk_hashtable * htable, addr_t key, addr_t value, int free_value) 
+{
+    struct swiss_table * t;
+    struct swiss_slot * s;
+    long i;
+
+    if ((s = swiss_lookup(htable, key, &t, &i)) == NULL) {
+        return 0;
+    }
+
+    if (free_value) {
+        free((void *)(s->value));
+    }
+
+    s->value = value;
+
+    return -1;
+}
+
+static int 
+swiss_htable_inc (struct nk_hashtable * htable, addr_t key, addr_t value) 
+{
+    struct swiss_table * t;
+    struct swiss_slot * s;
+    long i;
+
+    if ((s = swiss_lookup(htable, key, &t, &i)) == NULL) {
+        return 0;
+    }
+
+    s->value += value;
+
+    return -1;
+}
+
+static int 
+swiss_htable_dec (struct nk_hashtable * htable, addr_t key, addr_t value) 
+{
+    struct swiss_table * t;
+    struct swiss_slot * s;
+    long i;
+
+    if ((s = swiss_lookup(htable, key, &t, &i)) == NULL) {
+        return 0;
+    }
+
+    s->value -= value;
+
+    return -1;
+}
+
+static addr_t 
+swiss_htable_search (struct nk_hashtable * htable, addr_t key) 
+{
+    struct swiss_table * t;
+    struct swiss_slot * s;
+    long i;
+
+    s = swiss_lookup(htable, key, &t, &i);
+
+    return s ? s->value : (addr_t)NULL;
+}
+
+static addr_t 
+swiss_htable_remove (struct nk_hashtable * htable, addr_t key, int free_key) 
+{
+    struct swiss_table * t;
+    struct swiss_slot * s;
+    addr_t value;
+    long i;
+
+    if ((s = swiss_lookup(htable, key, &t, &i)) == NULL) {
+        return (addr_t)NULL;
+    }
+
+    value = s->value;
+
+    if (free_key) {
+        freekey((void *)(s->key));
+    }
+
+    swiss_erase(htable, t, i);
+    htable->entry_count--;
+
+    return value;
+}
+
+static void 
+swiss_free_table_entries (struct swiss_table * t, int free_values, int free_keys) 
+{
+    uint_t i;
+
+    if (t->ctrl == NULL || !(free_values || free_keys)) {
+        return;
+    }
+
+    for (i = 0; i < t->total; i++) {
+        if (t->ctrl[i] != SWISS_EMPTY) {
+            if (free_keys) {
+                freekey((void *)(t->slots[i].key));
+            }
+            if (free_values) {
+                free((void *)(t->slots[i].value));
+            }
+        }
+    }
+}
+
+static void 
+swiss_free_htable (struct nk_hashtable * htable, int free_values, int free_keys) 
+{
+    swiss_free_table_entries(&(htable->old), free_values, free_keys);
+    swiss_free_table_entries(&(htable->cur), free_values, free_keys);
+
+    swiss_table_deinit(&(htable->old));
+    swiss_table_deinit(&(htable->cur));
+
+    free(htable);
+}
+
+
+/* 
+ * Iterator positions number the old table's slots (while it exists)
+ * followed by the current table's slots
+ */
+
+static inline uint_t 
+swiss_iter_base (struct nk_hashtable * htable) 
+{
+    return htable->old.ctrl ? htable->old.total : 0;
+}
+
+static inline uint_t 
+swiss_iter_end (struct nk_hashtable * htable) 
+{
+    return swiss_iter_base(htable) + htable->cur.total;
+}
+
+/* first full slot at or after i, or t->total */
+static uint_t 
+swiss_scan (struct swiss_table * t, uint_t i) 
+{
+    while (i < t->total) {
+        uint32_t full = ~swiss_match(t->ctrl + i, SWISS_EMPTY) & 0xffff;
+
+        if (full) {
+            i += __builtin_ctz(full);
+            return (i < t->total) ? i : t->total;
+        }
+
+        i += SWISS_GROUP;
+    }
+
+    return t->total;
+}
+
+/* first full position at or after index, or the end */
+static uint_t 
+swiss_iter_next (struct nk_hashtable * htable, uint_t index) 
+{
+    uint_t base = swiss_iter_base(htable);
+
+    if (index < base) {
+        if ((index = swiss_scan(&(htable->old), index)) < base) {
+            return index;
+        }
+    }
+
+    return base + swiss_scan(&(htable->cur), index - base);
+}
+
+static inline struct swiss_slot * 
+swiss_iter_slot (struct nk_hashtable_iter * iter, struct swiss_table ** t, uint_t * i) 
+{
+    struct nk_hashtable * htable = iter->htable;
+    uint_t base = swiss_iter_base(htable);
+
+    if (iter->index < base) {
+        *t = &(htable->old);
+        *i = iter->index;
+    } else {
+        *t = &(htable->cur);
+        *i = iter->index - base;
+    }
+
+    if ((*i >= (*t)->total) || ((*t)->ctrl[*i] == SWISS_EMPTY)) {
+        return NULL;
+    }
+
+    return &((*t)->slots[*i]);
+}
+
+static struct nk_hashtable_iter * 
+swiss_create_htable_iter (struct nk_hashtable * htable) 
+{
+    struct nk_hashtable_iter * iter = (struct nk_hashtable_iter *)malloc(sizeof(struct nk_hashtable_iter));
+
+    if (iter == NULL) {
+        return NULL;
+    }
+
+    iter->htable = htable;
+    iter->entry  = NULL;
+    iter->parent = NULL;
+    iter->index  = swiss_iter_next(htable, 0);
+
+    return iter;
+}
+
+static addr_t 
+swiss_htable_get_iter_key (struct nk_hashtable_iter * iter) 
+{
+    struct swiss_table * t;
+    struct swiss_slot * s;
+    uint_t i;
+
+    s = swiss_iter_slot(iter, &t, &i);
+
+    return s ? s->key : (addr_t)NULL;
+}
+
+static addr_t 
+swiss_htable_get_iter_value (struct nk_hashtable_iter * iter) 
+{
+    struct swiss_table * t;
+    struct swiss_slot * s;
+    uint_t i;
+
+    s = swiss_iter_slot(iter, &t, &i);
+
+    return s ? s->value : (addr_t)NULL;
+}
+
+static int 
+swiss_htable_iter_advance (struct nk_hashtable_iter * iter) 
+{
+    uint_t end = swiss_iter_end(iter->htable);
+
+    if (iter->index >= end) {
+        return 0;
+    }
+
+    iter->index = swiss_iter_next(iter->htable, iter->index + 1);
+
+    return (iter->index < end) ? -1 : 0;
+}
+
+static int 
+swiss_htable_iter_remove (struct nk_hashtable_iter * iter, int free_key) 
+{
+    struct swiss_table * t;
+    struct swiss_slot * s;
+    uint_t i;
+
+    if ((s = swiss_iter_slot(iter, &t, &i)) == NULL) {
+        return 0;
+    }
+
+    if (free_key) {
+        freekey((void *)(s->key));
+    }
+
+    swiss_erase(iter->htable, t, i);
+    iter->htable->entry_count--;
+
+    /* Anything shifted into this slot came from above, and so has not 
+     * been visited yet */
+    iter->index = swiss_iter_next(iter->htable, iter->index);
+
+    return (iter->index < swiss_iter_end(iter->htable)) ? -1 : 0;
+}
+
+static int 
+swiss_htable_iter_search (struct nk_hashtable_iter * iter,
+                          struct nk_hashtable * htable, 
+                          addr_t key) 
+{
+    struct swiss_table * t;
+    long i;
+
+    if (swiss_lookup(htable, key, &t, &i) == NULL) {
+        return 0;
+    }
+
+    iter->htable = htable;
+    iter->entry  = NULL;
+    iter->parent = NULL;
+    iter->index  = (t == &(htable->old)) ? i : swiss_iter_base(htable) + i;
+
+    return -1;
+}
+
+
+
+/* PUBLIC INTERFACE */
+
+#define IS_SWISS(h) ((h)->kind == HTABLE_SWISS)
+
+struct nk_hashtable * 
+nk_create_htable (uint_t min_size,
+                  uint_t (*hash_fn) (addr_t),
+                  int (*eq_fn) (addr_t, addr_t)) 
+{
+#ifdef NAUT_CONFIG_HASHTABLE_SWISS
+    return swiss_create_htable(min_size, hash_fn, eq_fn);
+#else
+    return chained_create_htable(min_size, hash_fn, eq_fn);
+#endif
+}
+
+void 
+nk_free_htable (struct nk_hashtable * htable, int free_values, int free_keys) 
+{
+    if (IS_SWISS(htable)) {
+        swiss_free_htable(htable, free_values, free_keys);
+    } else {
+        chained_free_htable(htable, free_values, free_keys);
+    }
+}
+
+int 
+nk_htable_insert (struct nk_hashtable * htable, addr_t key, addr_t value) 
+{
+    return IS_SWISS(htable) ? 
+        swiss_htable_insert(htable, key, value) : 
+        chained_htable_insert(htable, key, value);
+}
+
+int 
+nk_htable_change (struct nk_hashtable * htable, addr_t key, addr_t value, int free_value) 
+{
+    return IS_SWISS(htable) ? 
+        swiss_htable_change(htable, key, value, free_value) : 
+        chained_htable_change(htable, key, value, free_value);
+}
+
+int 
+nk_htable_inc (struct nk_hashtable * htable, addr_t key, addr_t value) 
+{
+    return IS_SWISS(htable) ? 
+        swiss_htable_inc(htable, key, value) : 
+        chained_htable_inc(htable, key, value);
+}
+
+int 
+nk_htable_dec (struct nk_hashtable * htable, addr_t key, addr_t value) 
+{
+    return IS_SWISS(htable) ? 
+        swiss_htable_dec(htable, key, value) : 
+        chained_htable_dec(htable, key, value);
+}
+
+addr_t 
+nk_htable_search (struct nk_hashtable * htable, addr_t key) 
+{
+    return IS_SWISS(htable) ? 
+        swiss_htable_search(htable, key) : 
+        chained_htable_search(htable, key);
+}
+
+addr_t 
+nk_htable_remove (struct nk_hashtable * htable, addr_t key, int free_key) 
+{
+    return IS_SWISS(htable) ? 
+        swiss_htable_remove(htable, key, free_key) : 
+        chained_htable_remove(htable, key, free_key);
+}
+
+struct nk_hashtable_iter * 
+nk_create_htable_iter (struct nk_hashtable * htable) 
+{
+    return IS_SWISS(htable) ? 
+        swiss_create_htable_iter(htable) : 
+        chained_create_htable_iter(htable);
+}
+
+addr_t 
+nk_htable_get_iter_key (struct nk_hashtable_iter * iter) 
+{
+    return IS_SWISS(iter->htable) ? 
+        swiss_htable_get_iter_key(iter) : 
+        chained_htable_get_iter_key(iter);
+}
+
+addr_t 
+nk_htable_get_iter_value (struct nk_hashtable_iter * iter) 
+{
+    return IS_SWISS(iter->htable) ? 
+        swiss_htable_get_iter_value(iter) : 
+        chained_htable_get_iter_value(iter);
+}
+
+int 
+nk_htable_iter_advance (struct nk_hashtable_iter * iter) 
+{
+    return IS_SWISS(iter->htable) ? 
+        swiss_htable_iter_advance(iter) : 
+        chained_htable_iter_advance(iter);
+}
+
+int 
+nk_htable_iter_remove (struct nk_hashtable_iter * iter, int free_key) 
+{
+    return IS_SWISS(iter->htable) ? 
+        swiss_htable_iter_remove(iter, free_key) : 
+        chained_htable_iter_remove(iter, free_key);
+}
+
+int 
+nk_htable_iter_search (struct nk_hashtable_iter * iter,
+                       struct nk_hashtable * htable, 
+                       addr_t key) 
+{
+    return IS_SWISS(htable) ? 
+        swiss_htable_iter_search(iter, htable, key) : 
+        chained_htable_iter_search(iter, htable, key);
+}
+
+
+
+/*
+ * htperf [numkeys]
+ *
+ * runs the same workload against both implementations
+ */
+
+static uint_t 
+htperf_hash (addr_t key) 
+{
+    return (uint_t)nk_hash_long(key, 32);
+}
+
+static int 
+htperf_eq (addr_t key1, addr_t key2) 
+{
+    return key1 == key2;
+}
+
+// the i-th of n keys in a scrambled order, so that lookups do not
+// simply walk memory in allocation order
+#define HTPERF_STEP 2654435761UL
+#define HTPERF_KEY(i,n) (1 + ((uint64_t)(i) * HTPERF_STEP) % (n))
+
+static int
+handle_htperf (char * buf, void * priv)
+{
+    uint_t n = 100000;
+    uint_t k, i, found;
+    char *names[2] = { "chained", "swiss" };
+    uint64_t start, ins, hit, miss, iter, rem;
+
+    sscanf(buf, "htperf %u", &n);
+
+    if (!n || !(n % HTPERF_STEP)) {
+        nk_vc_printf("need at least one key, and not a multiple of %lu\n", HTPERF_STEP);
+        return 0;
+    }
+
+    nk_vc_printf("%u keys, cycles per operation (lower is better)\n", n);
+    nk_vc_printf("%-8s %8s %8s %8s %8s %8s\n", "", "insert", "hit", "miss", "iterate", "remove");
+
+    for (k = 0; k < 2; k++) {
+        struct nk_hashtable * h;
+        struct nk_hashtable_iter * it;
+
+        // start small, so growth is part of the insert cost
+        h = k ? swiss_create_htable(0, htperf_hash, htperf_eq) : 
+                chained_create_htable(0, htperf_hash, htperf_eq);
+
+        if (!h) {
+            nk_vc_printf("cannot create %s table\n", names[k]);
+            return 0;
+        }
+
+        start = rdtsc();
+        for (i = 1; i <= n; i++) {
+            if (!nk_htable_insert(h, i, i)) {
+                nk_vc_printf("%s: insert failed at %u\n", names[k], i);
+                nk_free_htable(h, 0, 0);
+                return 0;
+            }
+        }
+        ins = rdtsc() - start;
+
+        found = 0;
+        start = rdtsc();
+        for (i = 0; i < n; i++) {
+            found += nk_htable_search(h, HTPERF_KEY(i, n)) == HTPERF_KEY(i, n);
+        }
+        hit = rdtsc() - start;
+
+        start = rdtsc();
+        for (i = 0; i < n; i++) {
+            found += nk_htable_search(h, n + HTPERF_KEY(i, n)) != 0;
+        }
+        miss = rdtsc() - start;
+
+        if (found != n) {
+            nk_vc_printf("%s: lookups are wrong (%u of %u)\n", names[k], found, n);
+        }
+
+        found = 0;
+        start = rdtsc();
+        if ((it = nk_create_htable_iter(h))) {
+            do {
+                found += nk_htable_get_iter_key(it) != 0;
+            } while (nk_htable_iter_advance(it));
+            nk_destroy_htable_iter(it);
+        }
+        iter = rdtsc() - start;
+
+        if (found != n) {
+            nk_vc_printf("%s: iteration is wrong (%u of %u)\n", names[k], found, n);
+        }
+
+        start = rdtsc();
+        for (i = 0; i < n; i++) {
+            nk_htable_remove(h, HTPERF_KEY(i, n), 0);
+        }
+        rem = rdtsc() - start;
+
+        if (nk_htable_count(h)) {
+            nk_vc_printf("%s: %u entries left after removal\n", names[k], nk_htable_count(h));
+        }
+
+        nk_vc_printf("%-8s %8lu %8lu %8lu %8lu %8lu\n", names[k], 
+                     ins / n, hit / n, miss / n, iter / n, rem / n);
+
+        nk_free_htable(h, 0, 0);
+    }
+
+    return 0;
+}
+
+
+static struct shell_cmd_impl htperf_impl = {
+    .cmd      = "htperf",
+    .help_str = "htperf [numkeys]",
+    .handler  = handle_htperf,
+};
+nk_register_shell_cmd(htperf_impl);
@@ -27,6 +27,7 @@
 #include <nautilus/thread.h>
 #include <nautilus/task.h>
 #include <nautilus/scheduler.h>
+#include <nautilus/rcu.h>
 
 #ifndef NAUT_CONFIG_DEBUG_SCHED
 #undef DEBUG_PRINT
@@ -55,8 +56,6 @@ idle (void * in, void ** out)
 
     struct nk_task *task;
 
-    uint64_t last_steal = nk_sched_get_runtime(get_cur_thread());
-    uint64_t runtime;
     uint64_t numstolen;
 
     while (1) {
@@ -86,20 +85,17 @@ idle (void * in, void ** out)
 #endif
 	
 #if NAUT_CONFIG_WORK_STEALING
-	runtime = nk_sched_get_runtime(get_cur_thread());
-	if ((runtime - last_steal) > (NAUT_CONFIG_WORK_STEALING_INTERVAL_MS*1000000ULL)) {
-	    preempt_disable();
-	    DEBUG_PRINT("CPU %d trying to steal\n",my_cpu_id());
-	    nk_sched_cpu_mug(-1,NAUT_CONFIG_WORK_STEALING_AMOUNT,&numstolen);
+	// nk_sched_balance rate-limits itself
+	if (!nk_sched_balance(&numstolen) && numstolen) {
 	    DEBUG_PRINT("CPU %d stole %lu threads\n",my_cpu_id(),numstolen);
-	    last_steal = runtime;
-	    preempt_enable();
 	}
 #endif
 	    
 
         nk_yield();
 
+	nk_rcu_quiescent();
+
 #ifdef NAUT_CONFIG_XEON_PHI
         udelay(1);
 #else
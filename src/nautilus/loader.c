@@ -40,6 +40,7 @@ struct nk_exec {
     void      *blob;          // where we loaded it
     uint64_t   blob_size;     // extent in memory
     uint64_t   entry_offset;  // where to start executing in it
+    int        in_place;      // blob is the file itself (not ours to free)
 };
 
 
@@ -123,6 +124,9 @@ typedef struct mb_mb64_hrt {
 #define MB_TAG_MB64_HRT_FLAG_RELOC      0x1
     // whether this is an executable
 #define MB_TAG_MB64_HRT_FLAG_EXE        0x2
+    // whether this executable never writes its own image, and so
+    // can be run directly from where the file lives
+#define MB_TAG_MB64_HRT_FLAG_XIP        0x4
     // How to map the memory in the initial PTs
     // highest set bit wins
 #define MB_TAG_MB64_HRT_FLAG_MAP_4KB    0x100
@@ -359,32 +363,42 @@ struct nk_exec *nk_load_exec(char *path)
 {
     nk_fs_fd_t fd=FS_BAD_FD;
     void *page = 0;
+    void *hdr;
     struct nk_exec *e = 0;
      
     DEBUG("Loading executable at path %s\n", path);
 
-    if (!(page = malloc(MB_LOAD))) { 
-        ERROR("Failed to allocate temporary space for loading file %s\n",path);
-        goto out_bad;
-    }
-
-    memset(page,0,MB_LOAD);
-    
     if (FS_FD_ERR(fd = nk_fs_open(path,O_RDONLY,0666))) { 
         ERROR("Executable file %s could not be opened\n", path);
         goto out_bad;
     }
 
-    if (nk_fs_read(fd,page,MB_LOAD)!=MB_LOAD) { 
-        ERROR("Could not read first page of file %s\n", path);
-        goto out_bad;
+    // if the file lives in memory (e.g., the boot ramdisk), we can
+    // look at the header where it is
+    if ((hdr = nk_fs_get_ptr(fd,MB_LOAD))) { 
+        DEBUG("Using header of %s in place at %p\n", path, hdr);
+        nk_fs_seek(fd,MB_LOAD,0);
+    } else {
+        if (!(page = malloc(MB_LOAD))) { 
+            ERROR("Failed to allocate temporary space for loading file %s\n",path);
+            goto out_bad;
+        }
+
+        memset(page,0,MB_LOAD);
+
+        if (nk_fs_read(fd,page,MB_LOAD)!=MB_LOAD) { 
+            ERROR("Could not read first page of file %s\n", path);
+            goto out_bad;
+        }
+
+        hdr = page;
     }
 
     // the MB header should be in the first 2 pages by construction
 
     mb_data_t m;
 
-    if (parse_multiboot_header(page, MB_LOAD, &m)) { 
+    if (parse_multiboot_header(hdr, MB_LOAD, &m)) { 
         ERROR("Cannot parse multiboot kernel header from first page of %s\n", path);
         goto out_bad;
     }
@@ -430,6 +444,31 @@ struct nk_exec *nk_load_exec(char *path)
 
     memset(e,0,sizeof(*e));
 
+    e->entry_offset = m.entry->entry_addr - PAGE_SIZE_4KB; 
+
+    ssize_t n = 0;
+    struct nk_fs_stat st;
+    void *src = 0;
+
+    // the part of the blob that is backed by the file
+    if (!nk_fs_fstat(fd,&st) && st.st_size > MB_LOAD) { 
+        n = st.st_size - MB_LOAD;
+        n = n < blob_size ? n : blob_size;
+        src = nk_fs_get_ptr(fd,n);
+    }
+
+    // An executable that promises not to write its image, that has
+    // no bss to clear, and whose file covers its whole load segment
+    // can run directly out of the file
+    if (src && (m.mb64_hrt->hrt_flags & MB_TAG_MB64_HRT_FLAG_XIP) && bss_end <= load_end &&
+	n >= load_end - load_start) { 
+        e->blob = src;
+        e->blob_size = n;
+        e->in_place = 1;
+        DEBUG("Executing %s in place at %p (0x%lx bytes)\n", path, src, n);
+        goto out_good;
+    }
+
     e->blob = malloc(blob_size);
 
     if (!e->blob) { 
@@ -438,18 +477,21 @@ struct nk_exec *nk_load_exec(char *path)
     }
     
     e->blob_size = blob_size;
-    e->entry_offset = m.entry->entry_addr - PAGE_SIZE_4KB; 
     
     // now copy it to memory
-    ssize_t n;
-    
-    
-    if ((n = nk_fs_read(fd,e->blob,e->blob_size))<0) {
+    if (src) { 
+        memcpy(e->blob,src,n);
+    } else if ((n = nk_fs_read(fd,e->blob,e->blob_size))<0) {
         ERROR("Unable to read blob from %s\n", path);
         goto out_bad;
     }
 
     DEBUG("Tried to read 0x%lx byte blob, got 0x%lx bytes\n", e->blob_size, n);
+
+    // a short file leaves the rest of the image zero
+    if (n < e->blob_size) {
+	memset(e->blob+n,0,e->blob_size-n);
+    }
     
     DEBUG("Successfully loaded executable %s\n",path);
 
@@ -457,6 +499,7 @@ struct nk_exec *nk_load_exec(char *path)
 
     DEBUG("Cleared BSS\n");
 
+ out_good:
     nk_fs_close(fd);
     DEBUG("file closed\n");
     free(page);
@@ -466,7 +509,7 @@ struct nk_exec *nk_load_exec(char *path)
  out_bad:
     if (!FS_FD_ERR(fd)) { nk_fs_close(fd); }
     if (page) { free(page); }
-    if (e && e->blob) { free(e->blob); }
+    if (e && e->blob && !e->in_place) { free(e->blob); }
     if (e) { free(e); }
 
     return 0;
@@ -515,7 +558,7 @@ nk_start_exec (struct nk_exec *exec, void *in, void **out)
 int 
 nk_unload_exec (struct nk_exec *exec)
 {
-    if (exec && exec->blob) {
+    if (exec && exec->blob && !exec->in_place) {
         free(exec->blob);
     }
     if (exec) { 
@@ -0,0 +1,342 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/percpu.h>
+#include <nautilus/cpu_state.h>
+#include <nautilus/irq.h>
+#include <nautilus/mm.h>
+#include <nautilus/shell.h>
+#include <nautilus/lockstat.h>
+#ifdef NAUT_CONFIG_PROVENANCE
+#include <nautilus/provenance.h>
+#endif
+
+/*
+  Everything here runs underneath the lock primitives themselves, so
+  it must never take a lock or print.  Each CPU owns its table and
+  only updates it with interrupts off; the dump reads the tables of
+  other CPUs without synchronization, which is fine for statistics.
+*/
+
+#define INFO(fmt, args...) INFO_PRINT("lockstat: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("lockstat: " fmt, ##args)
+
+#define LOCKSTAT_SITES 512    // per cpu, power of two
+#define LOCKSTAT_HELD  16     // locks a cpu can be tracked holding at once
+
+struct lockstat_site {
+    uint64_t site;            // 0 = unused
+    void    *lock;            // most recent lock acquired here
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_total;
+    uint64_t wait_max;
+    uint64_t hold_total;
+    uint64_t hold_max;
+};
+
+struct nk_lockstat_cpu {
+    uint64_t gen;             // matches reset_gen when the table is current
+    uint64_t overflow;        // acquisitions from sites that did not fit
+    int      num_held;
+    struct {
+	void                 *lock;
+	struct lockstat_site *s;
+	uint64_t              start;
+    } held[LOCKSTAT_HELD];
+    struct lockstat_site sites[LOCKSTAT_SITES];
+};
+
+static volatile uint64_t reset_gen = 0;
+
+static inline struct nk_lockstat_cpu *my_lockstat(void)
+{
+    struct cpu *c = (struct cpu *)__cpu_state_get_cpu();
+    return c ? c->lockstat : 0;
+}
+
+static inline uint64_t site_hash(uint64_t site)
+{
+    return site ^ (site >> 7) ^ (site >> 17);
+}
+
+static struct lockstat_site *site_find(struct nk_lockstat_cpu *ls, uint64_t site)
+{
+    uint64_t i, h = site_hash(site) & (LOCKSTAT_SITES-1);
+
+    for (i=0;i<LOCKSTAT_SITES;i++) {
+	struct lockstat_site *s = &ls->sites[(h+i) & (LOCKSTAT_SITES-1)];
+	if (s->site == site) {
+	    return s;
+	}
+	if (!s->site) {
+	    s->site = site;
+	    return s;
+	}
+    }
+    return 0;
+}
+
+static inline void check_reset(struct nk_lockstat_cpu *ls)
+{
+    if (ls->gen != reset_gen) {
+	memset(ls->sites, 0, sizeof(ls->sites));
+	ls->overflow = 0;
+	ls->num_held = 0;
+	ls->gen = reset_gen;
+    }
+}
+
+void nk_lockstat_acquire(void *lock, uint64_t site, uint64_t wait_cycles, int contended)
+{
+    struct nk_lockstat_cpu *ls = my_lockstat();
+    struct lockstat_site *s;
+    uint8_t flags;
+
+    if (!ls) {
+	return;
+    }
+
+    flags = irq_disable_save();
+
+    check_reset(ls);
+
+    s = site_find(ls, site);
+
+    if (!s) {
+	ls->overflow++;
+    } else {
+	s->lock = lock;
+	s->acquisitions++;
+	if (contended) {
+	    s->contended++;
+	    s->wait_total += wait_cycles;
+	    if (wait_cycles > s->wait_max) {
+		s->wait_max = wait_cycles;
+	    }
+	}
+    }
+
+    // if the held stack is full, the oldest entry is forgotten
+    if (ls->num_held == LOCKSTAT_HELD) {
+	memmove(&ls->held[0], &ls->held[1], sizeof(ls->held[0])*(LOCKSTAT_HELD-1));
+	ls->num_held--;
+    }
+    ls->held[ls->num_held].lock = lock;
+    ls->held[ls->num_held].s = s;
+    ls->held[ls->num_held].start = rdtsc();
+    ls->num_held++;
+
+    irq_enable_restore(flags);
+}
+
+void nk_lockstat_release(void *lock)
+{
+    struct nk_lockstat_cpu *ls = my_lockstat();
+    uint64_t hold;
+    uint8_t flags;
+    int i;
+
+    if (!ls) {
+	return;
+    }
+
+    flags = irq_disable_save();
+
+    check_reset(ls);
+
+    // locks acquired on another cpu (or before we were
+    // counting, or with a try lock) are simply not found
+    for (i=ls->num_held-1;i>=0;i--) {
+	if (ls->held[i].lock == lock) {
+	    struct lockstat_site *s = ls->held[i].s;
+	    if (s) {
+		hold = rdtsc() - ls->held[i].start;
+		s->hold_total += hold;
+		if (hold > s->hold_max) {
+		    s->hold_max = hold;
+		}
+	    }
+	    memmove(&ls->held[i], &ls->held[i+1], sizeof(ls->held[0])*(ls->num_held-i-1));
+	    ls->num_held--;
+	    break;
+	}
+    }
+
+    irq_enable_restore(flags);
+}
+
+
+int nk_lockstat_init(void)
+{
+    struct sys_info *sys = &nk_get_nautilus_info()->sys;
+    int i;
+
+    for (i=0;i<sys->num_cpus;i++) {
+	struct nk_lockstat_cpu *ls = malloc(sizeof(*ls));
+	if (!ls) {
+	    ERROR("Failed to allocate table for cpu %d\n",i);
+	    return -1;
+	}
+	memset(ls,0,sizeof(*ls));
+	ls->gen = reset_gen;
+	sys->cpus[i]->lockstat = ls;
+    }
+
+    INFO("inited on %d cpus (%lu bytes each)\n", sys->num_cpus, sizeof(struct nk_lockstat_cpu));
+    return 0;
+}
+
+void nk_lockstat_reset(void)
+{
+    // each cpu clears its own table on its next lock operation
+    __sync_fetch_and_add(&reset_gen,1);
+}
+
+
+static void print_site(struct lockstat_site *s)
+{
+    char *sym = 0;
+#ifdef NAUT_CONFIG_PROVENANCE
+    provenance_info *p = nk_prov_get_info(s->site);
+    if (p) {
+	sym = p->symbol;
+	free(p);
+    }
+#endif
+    nk_vc_printf("%016lx %-24s %016lx %10lu %10lu %14lu %12lu %14lu %12lu\n",
+		 s->site, sym ? sym : "", (uint64_t)s->lock,
+		 s->acquisitions, s->contended,
+		 s->wait_total, s->wait_max,
+		 s->hold_total, s->hold_max);
+}
+
+void nk_lockstat_dump(int max_sites)
+{
+    struct sys_info *sys = &nk_get_nautilus_info()->sys;
+    struct lockstat_site *all, *s, *best;
+    uint64_t num_all = LOCKSTAT_SITES*2;
+    uint64_t overflow = 0;
+    uint64_t i, j, h;
+    int c, n;
+
+    all = malloc(sizeof(*all)*num_all);
+    if (!all) {
+	nk_vc_printf("lockstat: cannot allocate merge table\n");
+	return;
+    }
+    memset(all,0,sizeof(*all)*num_all);
+
+    // merge the per-cpu tables by site
+    for (c=0;c<sys->num_cpus;c++) {
+	struct nk_lockstat_cpu *ls = sys->cpus[c]->lockstat;
+	if (!ls || ls->gen != reset_gen) {
+	    continue;
+	}
+	overflow += ls->overflow;
+	for (i=0;i<LOCKSTAT_SITES;i++) {
+	    struct lockstat_site *src = &ls->sites[i];
+	    if (!src->site || !src->acquisitions) {
+		continue;
+	    }
+	    h = site_hash(src->site) % num_all;
+	    for (j=0;j<num_all;j++) {
+		s = &all[(h+j) % num_all];
+		if (!s->site || s->site == src->site) {
+		    break;
+		}
+	    }
+	    if (j==num_all) {
+		overflow += src->acquisitions;
+		continue;
+	    }
+	    s->site = src->site;
+	    s->lock = src->lock;
+	    s->acquisitions += src->acquisitions;
+	    s->contended += src->contended;
+	    s->wait_total += src->wait_total;
+	    s->hold_total += src->hold_total;
+	    if (src->wait_max > s->wait_max) {
+		s->wait_max = src->wait_max;
+	    }
+	    if (src->hold_max > s->hold_max) {
+		s->hold_max = src->hold_max;
+	    }
+	}
+    }
+
+    nk_vc_printf("%-16s %-24s %-16s %10s %10s %14s %12s %14s %12s\n",
+		 "site", "symbol", "lock (last)", "acquire", "contend",
+		 "wait_cyc", "wait_max", "hold_cyc", "hold_max");
+
+    // worst sites by total wait, then by total hold
+    for (n=0;n<max_sites;n++) {
+	best = 0;
+	for (i=0;i<num_all;i++) {
+	    s = &all[i];
+	    if (!s->site) {
+		continue;
+	    }
+	    if (!best ||
+		s->wait_total > best->wait_total ||
+		(s->wait_total == best->wait_total && s->hold_total > best->hold_total)) {
+		best = s;
+	    }
+	}
+	if (!best) {
+	    break;
+	}
+	print_site(best);
+	best->site = 0;
+    }
+
+    if (overflow) {
+	nk_vc_printf("%lu acquisitions from sites that did not fit in the tables\n", overflow);
+    }
+
+    free(all);
+}
+
+
+static int
+handle_lockstat (char * buf, void * priv)
+{
+    int n = 20;
+
+    if (strstr(buf,"reset")) {
+	nk_lockstat_reset();
+	nk_vc_printf("lockstat reset\n");
+	return 0;
+    }
+
+    sscanf(buf,"lockstat %d",&n);
+
+    nk_lockstat_dump(n);
+
+    return 0;
+}
+
+
+static struct shell_cmd_impl lockstat_impl = {
+    .cmd      = "lockstat",
+    .help_str = "lockstat [n|reset]",
+    .handler  = handle_lockstat,
+};
+nk_register_shell_cmd(lockstat_impl);
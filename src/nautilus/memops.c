@@ -0,0 +1,680 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpuid.h>
+#include <nautilus/shell.h>
+#include <nautilus/memops.h>
+
+#define ERROR(fmt, args...) ERROR_PRINT("memops: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("memops: " fmt, ##args)
+#define INFO(fmt, args...)  INFO_PRINT("memops: " fmt, ##args)
+
+/*
+  Every kernel handles every size.  Short operations are done with
+  a pair of possibly overlapping scalar or vector accesses, and
+  longer ones with an unaligned head, an aligned body, and an
+  unaligned tail that was loaded up front.  None of these kernels may
+  be handed overlapping buffers; memmove takes care of that.
+
+  This file is built with loop pattern recognition off so that the
+  compiler does not turn these loops back into calls to memcpy.
+*/
+
+#define REP_THRESHOLD_SSE2  2048
+#define REP_THRESHOLD_AVX2  4096
+#define NT_THRESHOLD_DEFAULT (4UL*1024*1024)   // if the LLC size is unknown
+
+typedef uint16_t u16u __attribute__((aligned(1), may_alias));
+typedef uint32_t u32u __attribute__((aligned(1), may_alias));
+typedef uint64_t u64u __attribute__((aligned(1), may_alias));
+
+typedef long long v2di  __attribute__((vector_size(16)));
+typedef long long v2diu __attribute__((vector_size(16), aligned(1), may_alias));
+typedef char      v16qi __attribute__((vector_size(16)));
+typedef char      v16qiu __attribute__((vector_size(16), aligned(1), may_alias));
+typedef long long v4di  __attribute__((vector_size(32)));
+typedef long long v4diu __attribute__((vector_size(32), aligned(1), may_alias));
+typedef char      v32qi __attribute__((vector_size(32)));
+typedef char      v32qiu __attribute__((vector_size(32), aligned(1), may_alias));
+
+
+// safe before the FPU is up
+struct nk_memops nk_memops = {
+    .name          = "rep",
+    .copy          = nk_memops_copy_rep,
+    .fill          = nk_memops_fill_rep,
+    .compare       = nk_memops_compare_bytes,
+    .rep_threshold = 0,
+    .nt_threshold  = -1UL,
+};
+
+static int have_erms = 0;
+
+
+/*
+ * Shared pieces
+ */
+
+static inline void rep_movsb(void *dst, const void *src, size_t n)
+{
+    __asm__ __volatile__ ("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void rep_stosb(void *dst, uint8_t c, size_t n)
+{
+    __asm__ __volatile__ ("rep stosb" : "+D"(dst), "+c"(n) : "a"(c) : "memory");
+}
+
+// n <= 16
+static inline void copy_small(uint8_t *d, const uint8_t *s, size_t n)
+{
+    if (n>=8) {
+	uint64_t a = *(u64u*)s, b = *(u64u*)(s+n-8);
+	*(u64u*)d = a; *(u64u*)(d+n-8) = b;
+    } else if (n>=4) {
+	uint32_t a = *(u32u*)s, b = *(u32u*)(s+n-4);
+	*(u32u*)d = a; *(u32u*)(d+n-4) = b;
+    } else if (n>=2) {
+	uint16_t a = *(u16u*)s, b = *(u16u*)(s+n-2);
+	*(u16u*)d = a; *(u16u*)(d+n-2) = b;
+    } else if (n) {
+	*d = *s;
+    }
+}
+
+// n <= 16, x is the fill byte replicated
+static inline void fill_small(uint8_t *d, uint64_t x, size_t n)
+{
+    if (n>=8) {
+	*(u64u*)d = x; *(u64u*)(d+n-8) = x;
+    } else if (n>=4) {
+	*(u32u*)d = x; *(u32u*)(d+n-4) = x;
+    } else if (n>=2) {
+	*(u16u*)d = x; *(u16u*)(d+n-2) = x;
+    } else if (n) {
+	*d = x;
+    }
+}
+
+int nk_memops_compare_bytes(const void *s1, const void *s2, size_t n)
+{
+    const uint8_t *a = s1, *b = s2;
+    size_t i;
+
+    for (i=0;i<n;i++) {
+	if (a[i]!=b[i]) {
+	    return (int)a[i] - (int)b[i];
+	}
+    }
+    return 0;
+}
+
+
+/*
+ * rep movsb / rep stosb - base ISA only
+ */
+
+void *nk_memops_copy_rep(void *dst, const void *src, size_t n)
+{
+    if (n<=16) {
+	copy_small(dst,src,n);
+    } else {
+	rep_movsb(dst,src,n);
+    }
+    return dst;
+}
+
+void *nk_memops_fill_rep(void *dst, int c, size_t n)
+{
+    if (n<=16) {
+	fill_small(dst,0x0101010101010101ULL*(uint8_t)c,n);
+    } else {
+	rep_stosb(dst,c,n);
+    }
+    return dst;
+}
+
+
+/*
+ * SSE2 - always present on x64
+ */
+
+// n > 32
+static void copy_nt_sse2(uint8_t *d, const uint8_t *s, size_t n)
+{
+    uint8_t *end = d + n;
+    v2di head = *(v2diu*)s;
+    v2di tail = *(v2diu*)(s+n-16);
+    size_t skew = 16 - ((uint64_t)d & 15);
+
+    *(v2diu*)d = head;
+    d += skew; s += skew;
+
+    while (d + 64 <= end) {
+	v2di a = *(v2diu*)s, b = *(v2diu*)(s+16), c = *(v2diu*)(s+32), e = *(v2diu*)(s+48);
+	__builtin_ia32_movntdq((v2di*)d, a);
+	__builtin_ia32_movntdq((v2di*)(d+16), b);
+	__builtin_ia32_movntdq((v2di*)(d+32), c);
+	__builtin_ia32_movntdq((v2di*)(d+48), e);
+	d += 64; s += 64;
+    }
+    // order the weakly ordered stores before anything that follows
+    __builtin_ia32_sfence();
+
+    while (d + 16 <= end) {
+	*(v2di*)d = *(v2diu*)s;
+	d += 16; s += 16;
+    }
+    *(v2diu*)(end-16) = tail;
+}
+
+static void *copy_sse2(void *dst, const void *src, size_t n)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    uint8_t *end;
+    v2di head, tail;
+    size_t skew;
+
+    if (n<=16) {
+	copy_small(d,s,n);
+	return dst;
+    }
+    if (n<=32) {
+	head = *(v2diu*)s;
+	tail = *(v2diu*)(s+n-16);
+	*(v2diu*)d = head;
+	*(v2diu*)(d+n-16) = tail;
+	return dst;
+    }
+    if (n>=nk_memops.nt_threshold) {
+	copy_nt_sse2(d,s,n);
+	return dst;
+    }
+    if (have_erms && n>=nk_memops.rep_threshold) {
+	rep_movsb(d,s,n);
+	return dst;
+    }
+
+    end = d + n;
+    head = *(v2diu*)s;
+    tail = *(v2diu*)(s+n-16);
+    skew = 16 - ((uint64_t)d & 15);
+
+    *(v2diu*)d = head;
+    d += skew; s += skew;
+
+    while (d + 64 <= end) {
+	v2di a = *(v2diu*)s, b = *(v2diu*)(s+16), c = *(v2diu*)(s+32), e = *(v2diu*)(s+48);
+	*(v2di*)d = a;
+	*(v2di*)(d+16) = b;
+	*(v2di*)(d+32) = c;
+	*(v2di*)(d+48) = e;
+	d += 64; s += 64;
+    }
+    while (d + 16 <= end) {
+	*(v2di*)d = *(v2diu*)s;
+	d += 16; s += 16;
+    }
+    *(v2diu*)(end-16) = tail;
+
+    return dst;
+}
+
+static void *fill_sse2(void *dst, int c, size_t n)
+{
+    uint8_t *d = dst;
+    uint8_t *end = d + n;
+    uint64_t x = 0x0101010101010101ULL*(uint8_t)c;
+    v2di v = { (long long)x, (long long)x };
+
+    if (n<=16) {
+	fill_small(d,x,n);
+	return dst;
+    }
+    if (n<nk_memops.nt_threshold && have_erms && n>=nk_memops.rep_threshold) {
+	rep_stosb(d,c,n);
+	return dst;
+    }
+
+    *(v2diu*)d = v;
+    *(v2diu*)(end-16) = v;
+    d = (uint8_t*)(((uint64_t)d + 16) & ~15UL);
+
+    if (n>=nk_memops.nt_threshold) {
+	while (d + 64 <= end) {
+	    __builtin_ia32_movntdq((v2di*)d, v);
+	    __builtin_ia32_movntdq((v2di*)(d+16), v);
+	    __builtin_ia32_movntdq((v2di*)(d+32), v);
+	    __builtin_ia32_movntdq((v2di*)(d+48), v);
+	    d += 64;
+	}
+	__builtin_ia32_sfence();
+    }
+
+    while (d + 64 <= end) {
+	*(v2di*)d = v;
+	*(v2di*)(d+16) = v;
+	*(v2di*)(d+32) = v;
+	*(v2di*)(d+48) = v;
+	d += 64;
+    }
+    while (d + 16 <= end) {
+	*(v2di*)d = v;
+	d += 16;
+    }
+
+    return dst;
+}
+
+static int compare_sse2(const void *s1, const void *s2, size_t n)
+{
+    const uint8_t *a = s1, *b = s2;
+    size_t i = 0;
+    uint32_t m;
+
+    while (i + 16 <= n) {
+	v16qi x = *(v16qiu*)(a+i), y = *(v16qiu*)(b+i);
+	m = __builtin_ia32_pmovmskb128((v16qi)(x==y));
+	if (m!=0xffff) {
+	    i += __builtin_ctz(~m);
+	    return (int)a[i] - (int)b[i];
+	}
+	i += 16;
+    }
+
+    return nk_memops_compare_bytes(a+i,b+i,n-i);
+}
+
+
+/*
+ * AVX2 - only when the OS side has the YMM state enabled
+ */
+
+#ifdef NAUT_CONFIG_XSAVE_AVX_SUPPORT
+
+__attribute__((target("avx2")))
+static void *copy_avx2(void *dst, const void *src, size_t n)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    uint8_t *end;
+    v4di head, tail;
+    size_t skew;
+
+    if (n<=32) {
+	// no 256 bit state touched for these
+	return copy_sse2(dst,src,n);
+    }
+    if (have_erms && n>=nk_memops.rep_threshold && n<nk_memops.nt_threshold) {
+	rep_movsb(d,s,n);
+	return dst;
+    }
+
+    end = d + n;
+    head = *(v4diu*)s;
+    tail = *(v4diu*)(s+n-32);
+    skew = 32 - ((uint64_t)d & 31);
+
+    *(v4diu*)d = head;
+    d += skew; s += skew;
+
+    if (n>=nk_memops.nt_threshold) {
+	while (d + 128 <= end) {
+	    v4di a = *(v4diu*)s, b = *(v4diu*)(s+32), c = *(v4diu*)(s+64), e = *(v4diu*)(s+96);
+	    __builtin_ia32_movntdq256((v4di*)d, a);
+	    __builtin_ia32_movntdq256((v4di*)(d+32), b);
+	    __builtin_ia32_movntdq256((v4di*)(d+64), c);
+	    __builtin_ia32_movntdq256((v4di*)(d+96), e);
+	    d += 128; s += 128;
+	}
+	__builtin_ia32_sfence();
+    }
+
+    while (d + 128 <= end) {
+	v4di a = *(v4diu*)s, b = *(v4diu*)(s+32), c = *(v4diu*)(s+64), e = *(v4diu*)(s+96);
+	*(v4di*)d = a;
+	*(v4di*)(d+32) = b;
+	*(v4di*)(d+64) = c;
+	*(v4di*)(d+96) = e;
+	d += 128; s += 128;
+    }
+    while (d + 32 <= end) {
+	*(v4di*)d = *(v4diu*)s;
+	d += 32; s += 32;
+    }
+    *(v4diu*)(end-32) = tail;
+
+    __builtin_ia32_vzeroupper();
+
+    return dst;
+}
+
+__attribute__((target("avx2")))
+static void *fill_avx2(void *dst, int c, size_t n)
+{
+    uint8_t *d = dst;
+    uint8_t *end = d + n;
+    long long x = 0x0101010101010101ULL*(uint8_t)c;
+    v4di v = { x, x, x, x };
+
+    if (n<=32) {
+	return fill_sse2(dst,c,n);
+    }
+    if (have_erms && n>=nk_memops.rep_threshold && n<nk_memops.nt_threshold) {
+	rep_stosb(d,c,n);
+	return dst;
+    }
+
+    *(v4diu*)d = v;
+    *(v4diu*)(end-32) = v;
+    d = (uint8_t*)(((uint64_t)d + 32) & ~31UL);
+
+    if (n>=nk_memops.nt_threshold) {
+	while (d + 128 <= end) {
+	    __builtin_ia32_movntdq256((v4di*)d, v);
+	    __builtin_ia32_movntdq256((v4di*)(d+32), v);
+	    __builtin_ia32_movntdq256((v4di*)(d+64), v);
+	    __builtin_ia32_movntdq256((v4di*)(d+96), v);
+	    d += 128;
+	}
+	__builtin_ia32_sfence();
+    }
+
+    while (d + 128 <= end) {
+	*(v4di*)d = v;
+	*(v4di*)(d+32) = v;
+	*(v4di*)(d+64) = v;
+	*(v4di*)(d+96) = v;
+	d += 128;
+    }
+    while (d + 32 <= end) {
+	*(v4di*)d = v;
+	d += 32;
+    }
+
+    __builtin_ia32_vzeroupper();
+
+    return dst;
+}
+
+__attribute__((target("avx2")))
+static int compare_avx2(const void *s1, const void *s2, size_t n)
+{
+    const uint8_t *a = s1, *b = s2;
+    size_t i = 0;
+    uint32_t m;
+
+    while (i + 32 <= n) {
+	v32qi x = *(v32qiu*)(a+i), y = *(v32qiu*)(b+i);
+	m = __builtin_ia32_pmovmskb256((v32qi)(x==y));
+	if (m!=0xffffffff) {
+	    __builtin_ia32_vzeroupper();
+	    i += __builtin_ctz(~m);
+	    return (int)a[i] - (int)b[i];
+	}
+	i += 32;
+    }
+
+    __builtin_ia32_vzeroupper();
+
+    return compare_sse2(a+i,b+i,n-i);
+}
+
+#endif
+
+
+/*
+ * Selection
+ */
+
+static int usable_bytes(void) { return 1; }
+
+static void *copy_bytes(void *dst, const void *src, size_t n)
+{
+    volatile uint8_t *d = dst;
+    const uint8_t *s = src;
+
+    // volatile keeps this the byte loop it is meant to measure
+    while (n--) {
+	*d++ = *s++;
+    }
+    return dst;
+}
+
+static void *fill_bytes(void *dst, int c, size_t n)
+{
+    volatile uint8_t *d = dst;
+
+    while (n--) {
+	*d++ = c;
+    }
+    return dst;
+}
+
+static int usable_avx2(void)
+{
+#ifdef NAUT_CONFIG_XSAVE_AVX_SUPPORT
+    cpuid_ret_t r;
+    uint32_t lo, hi;
+
+    cpuid(CPUID_FEATURE_INFO, &r);
+    // OSXSAVE and AVX
+    if (!(r.c & (1<<27)) || !(r.c & (1<<28))) {
+	return 0;
+    }
+    // and the OS has enabled the SSE and YMM state
+    __asm__ __volatile__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    if ((lo & 0x6) != 0x6) {
+	return 0;
+    }
+    if (cpuid_leaf_max() < CPUID_LEAF_EXT_FEATS) {
+	return 0;
+    }
+    cpuid_sub(CPUID_LEAF_EXT_FEATS, 0, &r);
+    return !!(r.b & (1<<5));
+#else
+    return 0;
+#endif
+}
+
+static struct memops_impl {
+    char   *name;
+    int   (*usable)(void);
+    void *(*copy)(void *dst, const void *src, size_t n);
+    void *(*fill)(void *dst, int c, size_t n);
+    int   (*compare)(const void *s1, const void *s2, size_t n);
+    size_t  rep_threshold;
+} impls[] = {
+    // best first
+#ifdef NAUT_CONFIG_XSAVE_AVX_SUPPORT
+    { "avx2",  usable_avx2,  copy_avx2,  fill_avx2,  compare_avx2,  REP_THRESHOLD_AVX2 },
+#endif
+    { "sse2",  usable_bytes, copy_sse2,  fill_sse2,  compare_sse2,  REP_THRESHOLD_SSE2 },
+    { "rep",   usable_bytes, nk_memops_copy_rep,   nk_memops_fill_rep,   nk_memops_compare_bytes, 0 },
+    { "bytes", usable_bytes, copy_bytes, fill_bytes, nk_memops_compare_bytes, 0 },
+};
+
+#define NUM_IMPLS (sizeof(impls)/sizeof(impls[0]))
+
+// size of the largest cache, or 0 if it cannot be found
+static size_t llc_size(void)
+{
+    cpuid_ret_t r;
+    size_t size, max = 0;
+    uint32_t i;
+
+    if (cpuid_leaf_max() >= CPUID_LEAF_CACHE_PARM) {
+	// Intel deterministic cache parameters
+	for (i=0;i<16;i++) {
+	    cpuid_sub(CPUID_LEAF_CACHE_PARM, i, &r);
+	    if (!(r.a & 0x1f)) {
+		break;
+	    }
+	    size = (size_t)(((r.b>>22) & 0x3ff) + 1)   // ways
+		* (((r.b>>12) & 0x3ff) + 1)            // partitions
+		* ((r.b & 0xfff) + 1)                  // line size
+		* (r.c + 1);                           // sets
+	    if (size>max) {
+		max = size;
+	    }
+	}
+    }
+
+    if (!max && cpuid_ext_leaf_max() >= CPUID_EXT_FUNC_CACHE1) {
+	// AMD: L3 in 512 KB units, else L2 in KB
+	cpuid(CPUID_EXT_FUNC_CACHE1, &r);
+	max = (size_t)(r.d>>18) * 512 * 1024;
+	if (!max) {
+	    max = (size_t)(r.c>>16) * 1024;
+	}
+    }
+
+    return max;
+}
+
+int nk_memops_init(void)
+{
+    cpuid_ret_t r;
+    size_t llc;
+    int i;
+
+    if (cpuid_leaf_max() >= CPUID_LEAF_EXT_FEATS) {
+	cpuid_sub(CPUID_LEAF_EXT_FEATS, 0, &r);
+	have_erms = !!(r.b & (1<<9));
+    }
+
+    llc = llc_size();
+
+    for (i=0;i<NUM_IMPLS;i++) {
+	if (impls[i].usable()) {
+	    break;
+	}
+    }
+
+    // a copy this big would just evict everything, so stream it instead
+    nk_memops.nt_threshold = llc ? llc/4*3 : NT_THRESHOLD_DEFAULT;
+    nk_memops.rep_threshold = impls[i].rep_threshold;
+    nk_memops.compare = impls[i].compare;
+    nk_memops.fill = impls[i].fill;
+    nk_memops.copy = impls[i].copy;
+    nk_memops.name = impls[i].name;
+
+    INFO("using %s kernels%s, llc %lu KB, non-temporal at %lu KB\n",
+	 nk_memops.name, have_erms ? " with ERMS" : "", llc/1024, nk_memops.nt_threshold/1024);
+
+    return 0;
+}
+
+
+/*
+ * memperf [copy|fill|cmp] [maxsize]
+ *
+ * sweeps sizes and misalignments over every usable kernel
+ */
+
+static int
+handle_memperf (char * buf, void * priv)
+{
+    char what[16] = "all";
+    size_t max = 16*1024*1024;
+    size_t size, reps, r;
+    uint8_t *a, *b;
+    int aligns[] = { 0, 1, 7, 33 };
+    int op, ai, i;
+    char *ops[] = { "copy", "fill", "cmp" };
+
+    sscanf(buf,"memperf %15s %lu",what,&max);
+
+    a = malloc(max+64);
+    b = malloc(max+64);
+
+    if (!a || !b) {
+	nk_vc_printf("cannot allocate %lu byte buffers\n",max);
+	free(a); free(b);
+	return 0;
+    }
+
+    nk_vc_printf("selected: %s, erms=%d, rep at %lu, non-temporal at %lu\n",
+		 nk_memops.name, have_erms, nk_memops.rep_threshold, nk_memops.nt_threshold);
+    nk_vc_printf("cycles per KB (lower is better)\n");
+
+    for (op=0;op<3;op++) {
+	if (strcmp(what,"all") && strcmp(what,ops[op])) {
+	    continue;
+	}
+	nk_memops.fill(a,0x5a,max+64);
+	nk_memops.fill(b,0x5a,max+64);
+	nk_vc_printf("%-5s %9s %5s", ops[op], "size", "align");
+	for (i=0;i<NUM_IMPLS;i++) {
+	    if (impls[i].usable()) {
+		nk_vc_printf(" %10s", impls[i].name);
+	    }
+	}
+	nk_vc_printf("\n");
+	for (size=8; size<=max; size*=8) {
+	    // about 64 MB of traffic per point, but at least 3 passes
+	    reps = (64*1024*1024)/size;
+	    if (reps<3) {
+		reps = 3;
+	    }
+	    for (ai=0; ai<sizeof(aligns)/sizeof(aligns[0]); ai++) {
+		nk_vc_printf("%-5s %9lu %5d", "", size, aligns[ai]);
+		for (i=0;i<NUM_IMPLS;i++) {
+		    uint64_t start, end;
+		    if (!impls[i].usable()) {
+			continue;
+		    }
+		    start = rdtsc();
+		    for (r=0;r<reps;r++) {
+			switch (op) {
+			case 0:
+			    impls[i].copy(a+aligns[ai],b,size);
+			    break;
+			case 1:
+			    impls[i].fill(a+aligns[ai],r,size);
+			    break;
+			case 2:
+			    // equal buffers, so the whole length is compared
+			    impls[i].compare(a+aligns[ai],b+aligns[ai],size);
+			    break;
+			}
+		    }
+		    end = rdtsc();
+		    nk_vc_printf(" %10lu", ((end-start)*1024)/(reps*size));
+		}
+		nk_vc_printf("\n");
+	    }
+	}
+    }
+
+    free(a);
+    free(b);
+
+    return 0;
+}
+
+
+static struct shell_cmd_impl memperf_impl = {
+    .cmd      = "memperf",
+    .help_str = "memperf [copy|fill|cmp|all] [maxsize]",
+    .handler  = handle_memperf,
+};
+nk_register_shell_cmd(memperf_impl);
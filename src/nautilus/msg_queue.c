@@ -28,13 +28,21 @@
 #include <nautilus/scheduler.h>
 #include <nautilus/msg_queue.h>
 #include <nautilus/list.h>
+#include <nautilus/rcu.h>
 #include <nautilus/shell.h>
 
-// This is a trival implementation of classic message queues for threads ONLY
-// interrupt handlers can use the "try" functions
-
-// that is NOT intended to be used for anything that requires performance
+// Message queues for threads - interrupt handlers can use the "try"
+// functions
 
+// The queue itself is a bounded lock-free multi-producer/multi-consumer
+// ring.  Each slot carries a sequence number that says whose turn it
+// is:  the slot for position p is free for the push at p when seq==2p,
+// and holds the message for the pull at p when seq==2p+1.  (Doubling
+// keeps the two states distinct even for a one-slot queue.)  A pusher or
+// puller claims positions with a CAS on cur_push/cur_pull and then
+// hands the slot over by storing the next sequence number.  The wait
+// queues are only touched when a side actually needs to block, or when
+// the waiter counts show that the other side is blocked.
 
 // this is also a place where we can enhance performance by adding new types
 // of message queues
@@ -45,20 +53,32 @@
 #define USE_POLLING_TIMEOUT_FUNCS 0
 
 
+struct nk_msg_queue_slot {
+    volatile uint64_t  seq;
+    void              *msg;
+};
+
 struct nk_msg_queue {
-    spinlock_t         lock;
     struct list_head   node; // for the global list of named queues
-    uint64_t           refcount;
+    volatile uint64_t  refcount; // atomic; zero means the queue is dying
+    struct nk_rcu_head rcu;
     char               name[NK_MSG_QUEUE_NAME_LEN];
 
     nk_wait_queue_t    *push_wait_queue;
     nk_wait_queue_t    *pull_wait_queue;
 
+    // number of threads that are blocking or about to block
+    volatile uint64_t  push_waiters;
+    volatile uint64_t  pull_waiters;
+
     uint64_t           queue_size;
-    uint64_t           cur_count;
-    uint64_t           cur_push;
-    uint64_t           cur_pull;
-    void              *msgs[0];
+    uint64_t           mask;     // queue_size-1 if it is a power of two, else 0
+
+    // producer and consumer positions, on separate cache lines
+    volatile uint64_t  cur_push __attribute__((aligned(64)));
+    volatile uint64_t  cur_pull __attribute__((aligned(64)));
+
+    struct nk_msg_queue_slot slots[0] __attribute__((aligned(64)));
 };
 
 #ifndef NAUT_CONFIG_DEBUG_MSG_QUEUES
@@ -72,18 +92,13 @@ struct nk_msg_queue {
 
 static uint64_t   count=0;
 
+// writers to queue_list serialize on state_lock; find is an RCU reader
 static spinlock_t state_lock;
 
 #define STATE_LOCK_CONF uint8_t _state_lock_flags
 #define STATE_LOCK() _state_lock_flags = spin_lock_irq_save(&state_lock)
 #define STATE_UNLOCK() spin_unlock_irq_restore(&state_lock, _state_lock_flags);
 
-#define QUEUE_LOCK_CONF uint8_t _queue_lock_flags
-#define QUEUE_LOCK(q) _queue_lock_flags = spin_lock_irq_save(&(q)->lock)
-#define QUEUE_TRY_LOCK(q) spin_try_lock_irq_save(&(q)->lock,&_queue_lock_flags)
-#define QUEUE_UNLOCK(q) spin_unlock_irq_restore(&(q)->lock, _queue_lock_flags);
-#define QUEUE_UNIRQ(q) irq_enable_restore(_queue_lock_flags);
-
 static struct list_head queue_list;
 
 
@@ -112,6 +127,7 @@ struct nk_msg_queue *nk_msg_queue_create(char *name,
 					 void *type_chars)
 {
     STATE_LOCK_CONF;
+    uint64_t i;
     uint64_t mynum = __sync_fetch_and_add(&count,1);
     char buf[NK_MSG_QUEUE_NAME_LEN];
     char mbuf[NK_WAIT_QUEUE_NAME_LEN];
@@ -122,8 +138,13 @@ struct nk_msg_queue *nk_msg_queue_create(char *name,
     }
 
     DEBUG("create %s with size %lu\n",name,size);
+
+    if (!size) {
+	ERROR("Cannot create zero size queue\n");
+	return 0;
+    }
     
-    struct nk_msg_queue *q = malloc(sizeof(*q)+size*sizeof(void*));
+    struct nk_msg_queue *q = malloc(sizeof(*q)+size*sizeof(struct nk_msg_queue_slot));
 
     if (!q) {
 	ERROR("Cannot allocate\n");
@@ -132,7 +153,6 @@ struct nk_msg_queue *nk_msg_queue_create(char *name,
 
     memset(q,0,sizeof(*q));
 
-    spinlock_init(&q->lock);
     INIT_LIST_HEAD(&q->node);
     q->refcount = 1;
     snprintf(mbuf,NK_MSG_QUEUE_NAME_LEN,"%s-push-wait",name);
@@ -151,13 +171,18 @@ struct nk_msg_queue *nk_msg_queue_create(char *name,
 	return 0;
     }
     q->queue_size = size;
+    q->mask = (size & (size-1)) ? 0 : size-1;
     q->cur_push = 0;
     q->cur_pull = 0;
+    for (i=0;i<size;i++) {
+	q->slots[i].seq = 2*i;
+	q->slots[i].msg = 0;
+    }
 
     strncpy(q->name,name,NK_MSG_QUEUE_NAME_LEN); q->name[NK_MSG_QUEUE_NAME_LEN-1]=0;
 
     STATE_LOCK();
-    list_add_tail(&q->node,&queue_list);
+    list_add_tail_rcu(&q->node,&queue_list);
     STATE_UNLOCK();
 
     DEBUG("created %s size=%lu\n",q->name,q->queue_size);
@@ -167,32 +192,41 @@ struct nk_msg_queue *nk_msg_queue_create(char *name,
 
 void nk_msg_queue_attach(struct nk_msg_queue *q)
 {
-    QUEUE_LOCK_CONF;
     DEBUG("attach to queue %s start\n",q->name);
-    QUEUE_LOCK(q);
-    q->refcount++;
-    QUEUE_UNLOCK(q);
+    __sync_fetch_and_add(&q->refcount,1);
     DEBUG("attach to queue %s end\n",q->name);
 }
 
+// attach unless the last reference is already gone
+static int try_attach(struct nk_msg_queue *q)
+{
+    uint64_t r;
+
+    while ((r = q->refcount)) {
+	if (__sync_bool_compare_and_swap(&q->refcount,r,r+1)) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
 struct nk_msg_queue *nk_msg_queue_find(char *name)
 {
     struct list_head *cur;
-    struct nk_msg_queue *target=0;
+    struct nk_msg_queue *q, *target=0;
 
     DEBUG("find queue with name %s\n",name);
-    STATE_LOCK_CONF;
-    STATE_LOCK();
-    list_for_each(cur,&queue_list) {
-	if (!strncasecmp(list_entry(cur,struct nk_msg_queue,node)->name,name,NK_MSG_QUEUE_NAME_LEN)) { 
-	    target = list_entry(cur,struct nk_msg_queue, node);
+    nk_rcu_read_lock();
+    list_for_each_rcu(cur,&queue_list) {
+	q = list_entry(cur,struct nk_msg_queue, node);
+	if (!strncasecmp(q->name,name,NK_MSG_QUEUE_NAME_LEN) && try_attach(q)) {
+	    target = q;
 	    break;
 	}
     }
-    STATE_UNLOCK();
+    nk_rcu_read_unlock();
     if (target) {
 	DEBUG("find queue with name %s succeeded and attached\n",name);
-	nk_msg_queue_attach(target);
     } else {
 	DEBUG("find queue with name %s failed\n",name);
     }	
@@ -209,214 +243,259 @@ void nk_msg_queue_dump_queues()
     STATE_LOCK();
     list_for_each(cur,&queue_list) {
 	q = list_entry(cur,struct nk_msg_queue, node);
-	nk_vc_printf("%s : refcount=%lu cur_count=%lu cur_push=%lu cur_pull=%lu\n",
-		     q->name, q->refcount, q->cur_count, q->cur_push, q->cur_pull);
+	nk_vc_printf("%s : refcount=%lu cur_count=%lu cur_push=%lu cur_pull=%lu push_waiters=%lu pull_waiters=%lu\n",
+		     q->name, q->refcount, q->cur_push - q->cur_pull, q->cur_push, q->cur_pull,
+		     q->push_waiters, q->pull_waiters);
     }
     STATE_UNLOCK();
 }
 
 
 
-void nk_msg_queue_release(struct nk_msg_queue *q)
+static void queue_free_rcu(struct nk_rcu_head *h)
 {
-    QUEUE_LOCK_CONF;
+    free(container_of(h, struct nk_msg_queue, rcu));
+}
 
+void nk_msg_queue_release(struct nk_msg_queue *q)
+{
     DEBUG("release queue with name %s\n",q->name);
     
-    QUEUE_LOCK(q);
-    q->refcount--;
-    if (q->refcount>0) {
-	QUEUE_UNLOCK(q);
+    if (__sync_sub_and_fetch(&q->refcount,1)>0) {
 	DEBUG("release queue with name %s - simple release\n",q->name);
 	return;
     } else {
+	// we dropped the last reference, so find can no longer attach
 	STATE_LOCK_CONF;
 	
 	STATE_LOCK();
-	list_del_init(&q->node);
+	list_del_rcu(&q->node);
 	STATE_UNLOCK();
 
 	nk_wait_queue_wake_all(q->push_wait_queue);
 	nk_wait_queue_destroy(q->push_wait_queue);
 	nk_wait_queue_wake_all(q->pull_wait_queue);
 	nk_wait_queue_destroy(q->pull_wait_queue);
-	QUEUE_UNLOCK(q);
-	free(q);
 	DEBUG("release queue with name %s - complex release\n",q->name);
+	// a concurrent find may still be looking at the name
+	nk_call_rcu(&q->rcu, queue_free_rcu);
     }
 }
 
+#define SLOT(q,pos) (&(q)->slots[(q)->mask ? ((pos) & (q)->mask) : ((pos) % (q)->queue_size)])
+
+#define SEQ_LOAD(s)    __atomic_load_n(&(s)->seq,__ATOMIC_ACQUIRE)
+#define SEQ_STORE(s,v) __atomic_store_n(&(s)->seq,(v),__ATOMIC_RELEASE)
+
+// whether the next push / pull would currently succeed
+// (ignoring races with other pushers / pullers)
+static inline int can_push(struct nk_msg_queue *q)
+{
+    uint64_t pos = q->cur_push;
+    return (sint64_t)(SEQ_LOAD(SLOT(q,pos)) - 2*pos) >= 0;
+}
+
+static inline int can_pull(struct nk_msg_queue *q)
+{
+    uint64_t pos = q->cur_pull;
+    return (sint64_t)(SEQ_LOAD(SLOT(q,pos)) - (2*pos+1)) >= 0;
+}
+
 int nk_msg_queue_full(struct nk_msg_queue *q)
 {
-    //DEBUG("full %s q->curcount=%lu q->queue_size=%lu\n", q->name, q->cur_count, q->queue_size);
-    return  q->cur_count==q->queue_size;
+    return !can_push(q);
 }    
 
 int nk_msg_queue_empty(struct nk_msg_queue *q)
 {
-    //DEBUG("empty %s q->curcount=%lu q->queue_size=%lu\n", q->name, q->cur_count, q->queue_size);
-    return  q->cur_count==0;
+    return !can_pull(q);
 }    
-    
-    
 
-#define SLOT(q,n) ((q)->msgs[(((q)->n)) % ((q)->queue_size)])
-
-// with lock held
-static inline int _nk_msg_queue_try_push(struct nk_msg_queue *q, void *m)
+//
+// Claim up to n consecutive positions whose slots are ready
+// for us (seq==2*pos+ready) and return how many we got
+//
+static inline uint64_t claim(struct nk_msg_queue *q, volatile uint64_t *cur, uint64_t ready, uint64_t n, uint64_t *posp)
 {
-    //DEBUG("try push %s\n",q->name);
-    if (q->cur_count < q->queue_size) {
-	SLOT(q,cur_push) = m;
-	q->cur_push++;
-	q->cur_count++;
-	//DEBUG("try push %s done\n",q->name);
-	return 0;
-    } else {
-	//DEBUG("try push %s full\n",q->name);
-	return -1;
+    uint64_t pos, k;
+    sint64_t dif;
+
+    if (n > q->queue_size) {
+	n = q->queue_size;
     }
-}
 
-// with lock held
-static inline int _nk_msg_queue_try_pull(struct nk_msg_queue *q, void **m)
-{
-    //DEBUG("try pull %s\n",q->name);
-    if (q->cur_count > 0) {
-	*m = SLOT(q,cur_pull);
-	q->cur_pull++;
-	q->cur_count--;
-	//DEBUG("try pull %s done\n",q->name);
-	return 0;
-    } else {
-	//DEBUG("try pull %s empty\n",q->name);
-	return -1;
+    while (1) {
+	pos = *cur;
+	for (k=0;k<n;k++) {
+	    if (SEQ_LOAD(SLOT(q,pos+k)) != 2*(pos+k)+ready) {
+		break;
+	    }
+	}
+	if (!k) {
+	    dif = (sint64_t)(SEQ_LOAD(SLOT(q,pos)) - (2*pos+ready));
+	    if (dif<0) {
+		// full (push) or empty (pull)
+		return 0;
+	    }
+	    // someone else already took pos, so look again
+	    continue;
+	}
+	if (__sync_bool_compare_and_swap(cur,pos,pos+k)) {
+	    *posp = pos;
+	    return k;
+	}
     }
 }
 
-int  nk_msg_queue_try_push(struct nk_msg_queue *q, void *m)
+static inline uint64_t _nk_msg_queue_try_push_n(struct nk_msg_queue *q, void **m, uint64_t n)
 {
-    QUEUE_LOCK_CONF;
-    int rc;
+    uint64_t pos, k, i;
 
-    //DEBUG("try push %s\n",q->name);
+    k = claim(q,&q->cur_push,0,n,&pos);
 
-    if (QUEUE_TRY_LOCK(q)) {
-	return -1;
-    }
-    rc = _nk_msg_queue_try_push(q,m);
-    QUEUE_UNLOCK(q);
-    if (!rc) {
-	//DEBUG("try push %s succeeded\n",q->name);
-	nk_wait_queue_wake_one(q->pull_wait_queue);
-    } else {
-	//DEBUG("try push %s failed\n",q->name);
+    for (i=0;i<k;i++) {
+	struct nk_msg_queue_slot *s = SLOT(q,pos+i);
+	s->msg = m[i];
+	SEQ_STORE(s,2*(pos+i)+1);
     }
-    return rc;
+
+    return k;
 }
-    
-int  nk_msg_queue_try_pull(struct nk_msg_queue *q, void **m)
+
+static inline uint64_t _nk_msg_queue_try_pull_n(struct nk_msg_queue *q, void **m, uint64_t n)
 {
-    QUEUE_LOCK_CONF;
-    int rc;
+    uint64_t pos, k, i;
 
-    //DEBUG("try pull %s\n",q->name);
+    k = claim(q,&q->cur_pull,1,n,&pos);
 
-    if (QUEUE_TRY_LOCK(q)) {
-	return -1;
+    for (i=0;i<k;i++) {
+	struct nk_msg_queue_slot *s = SLOT(q,pos+i);
+	m[i] = s->msg;
+	SEQ_STORE(s,2*(pos+i+q->queue_size));
     }
-    rc = _nk_msg_queue_try_pull(q,m);
-    QUEUE_UNLOCK(q);
-    if (!rc) {
-	//DEBUG("try pull %s succeeded\n",q->name);
-	nk_wait_queue_wake_one(q->push_wait_queue);
-    } else {
-	//DEBUG("try pull %s failed\n",q->name);
+
+    return k;
+}
+
+//
+// Wake threads blocked on the other side, if there are any
+// The fence pairs with the waiter count increment a blocking
+// thread does before it rechecks the queue
+//
+static inline void wake_waiters(nk_wait_queue_t *wq, volatile uint64_t *waiters, uint64_t n)
+{
+    __sync_synchronize();
+    if (*waiters) {
+	if (n>1) {
+	    nk_wait_queue_wake_all(wq);
+	} else {
+	    nk_wait_queue_wake_one(wq);
+	}
     }
-    return rc;
 }
 
+#define WAKE_PULLERS(q,n) wake_waiters((q)->pull_wait_queue,&(q)->pull_waiters,n)
+#define WAKE_PUSHERS(q,n) wake_waiters((q)->push_wait_queue,&(q)->push_waiters,n)
+
+struct op {
+    struct nk_msg_queue *queue;
+    nk_timer_t          *timer;
+    int                  pull;
+};
 
+static int check_queue(void *s)
+{
+    struct op *o = (struct op *)s;
+    return o->pull ? can_pull(o->queue) : can_push(o->queue);
+}
 
-void nk_msg_queue_push(struct nk_msg_queue *q, void *m)
+// block until the queue looks like it can be pushed / pulled
+static void wait_on_queue(struct nk_msg_queue *q, int pull)
 {
-    QUEUE_LOCK_CONF;
+    struct op o = { q, 0, pull };
+    volatile uint64_t *waiters = pull ? &q->pull_waiters : &q->push_waiters;
 
-    DEBUG("push begin %s\n",q->name);
- retry:
-    QUEUE_LOCK(q);
-    if (!_nk_msg_queue_try_push(q,m)) {
-	// success is immediate
-	QUEUE_UNLOCK(q);
-	// we may need to wake up someone trying to pull
-	nk_wait_queue_wake_one(q->pull_wait_queue);
- 	DEBUG("push end %s\n",q->name);
-	return;
-    } else {
-	DEBUG("push sleep %s\n", q->name);
-	// we need to gracefully put ourselves to sleep
-	nk_thread_t *t = get_cur_thread();
+    __sync_fetch_and_add(waiters,1);
+    nk_wait_queue_sleep_extended(pull ? q->pull_wait_queue : q->push_wait_queue, check_queue, &o);
+    __sync_fetch_and_sub(waiters,1);
+}
+
+uint64_t nk_msg_queue_try_push_n(struct nk_msg_queue *q, void **m, uint64_t n)
+{
+    uint64_t k = _nk_msg_queue_try_push_n(q,m,n);
 
-	// disable preemption early since interrupts may remain on given our locking model
-	preempt_disable();
+    if (k) {
+	WAKE_PULLERS(q,k);
+    }
 
-	// onto the msg_queue's wait queue we go
-	t->status = NK_THR_WAITING;
-	nk_wait_queue_enqueue(q->push_wait_queue,t);
+    return k;
+}
 
-	// and go to sleep - this will also release the lock
-	// and reenable preemption
-	nk_sched_sleep(&q->lock);
+uint64_t nk_msg_queue_try_pull_n(struct nk_msg_queue *q, void **m, uint64_t n)
+{
+    uint64_t k = _nk_msg_queue_try_pull_n(q,m,n);
 
-	// We need to restore interrupts
-	QUEUE_UNIRQ(q);
-	
-	DEBUG("push retry %s\n", q->name);
-	// now we are awake, so try again
-	goto retry;
+    if (k) {
+	WAKE_PUSHERS(q,k);
     }
 
+    return k;
+}
 
+int  nk_msg_queue_try_push(struct nk_msg_queue *q, void *m)
+{
+    return nk_msg_queue_try_push_n(q,&m,1) ? 0 : -1;
+}
+    
+int  nk_msg_queue_try_pull(struct nk_msg_queue *q, void **m)
+{
+    return nk_msg_queue_try_pull_n(q,m,1) ? 0 : -1;
 }
 
-void nk_msg_queue_pull(struct nk_msg_queue *q, void **m)
+void nk_msg_queue_push_n(struct nk_msg_queue *q, void **m, uint64_t n)
 {
-    QUEUE_LOCK_CONF;
+    uint64_t done = 0;
 
-    DEBUG("pull begin %s\n",q->name);
- retry:
-    QUEUE_LOCK(q);
-    if (!_nk_msg_queue_try_pull(q,m)) {
-	// success is immediate
-	QUEUE_UNLOCK(q);
-	// we may need to wake up someone trying to push
-	nk_wait_queue_wake_one(q->push_wait_queue);
-	DEBUG("pull end %s\n",q->name);
-	return;
-    } else {
-	DEBUG("pull sleep %s\n", q->name);
-	
-	// we need to gracefully put ourselves to sleep
-	nk_thread_t *t = get_cur_thread();
+    DEBUG("push %lu begin %s\n",n,q->name);
 
-	// disable preemption early since interrupts remain on
-	preempt_disable();
+    while (done<n) {
+	done += nk_msg_queue_try_push_n(q,m+done,n-done);
+	if (done<n) {
+	    DEBUG("push sleep %s\n", q->name);
+	    wait_on_queue(q,0);
+	    DEBUG("push retry %s\n", q->name);
+	}
+    }
+
+    DEBUG("push %lu end %s\n",n,q->name);
+}
 
-	// onto the msg_queue's wait queue we go
-	t->status = NK_THR_WAITING;
-	nk_wait_queue_enqueue(q->pull_wait_queue,t);
+void nk_msg_queue_pull_n(struct nk_msg_queue *q, void **m, uint64_t n)
+{
+    uint64_t done = 0;
 
-	// and go to sleep - this will also release the lock
-	// and reenable preemption
-	nk_sched_sleep(&q->lock);
+    DEBUG("pull %lu begin %s\n",n,q->name);
 
-	QUEUE_UNIRQ(q)
-	
-	DEBUG("pull retry %s\n", q->name);
-	
-	// now we are awake, so try again
-	goto retry;
+    while (done<n) {
+	done += nk_msg_queue_try_pull_n(q,m+done,n-done);
+	if (done<n) {
+	    DEBUG("pull sleep %s\n", q->name);
+	    wait_on_queue(q,1);
+	    DEBUG("pull retry %s\n", q->name);
+	}
     }
+
+    DEBUG("pull %lu end %s\n",n,q->name);
+}
+
+void nk_msg_queue_push(struct nk_msg_queue *q, void *m)
+{
+    nk_msg_queue_push_n(q,&m,1);
+}
+
+void nk_msg_queue_pull(struct nk_msg_queue *q, void **m)
+{
+    nk_msg_queue_pull_n(q,m,1);
 }
 
 
@@ -470,18 +549,6 @@ int nk_msg_queue_pull_timeout(struct nk_msg_queue *q, void **m, uint64_t timeout
 
 #else
 
-struct op {
-    struct nk_msg_queue *queue;
-    nk_timer_t          *timer;
-    int                  pull;
-};
-
-static int check_queue(void *s)
-{
-    struct op *o = (struct op *)s;
-    return o->pull ? !nk_msg_queue_empty(o->queue) : !nk_msg_queue_full(o->queue);
-}
-
 static int check_timer(void *s)
 {
     struct op *o = (struct op *)s;
@@ -491,7 +558,6 @@ static int check_timer(void *s)
 
 static int _nk_msg_queue_push_pull_timeout(struct nk_msg_queue *q, void **m, uint64_t timeout_ns, int pull)
 {
-    QUEUE_LOCK_CONF;
     uint64_t start = nk_sched_get_realtime();
     uint64_t now = start;
     int done=0;
@@ -506,9 +572,7 @@ static int _nk_msg_queue_push_pull_timeout(struct nk_msg_queue *q, void **m, uin
 	return 1;
     }
     
-    QUEUE_LOCK(q);
-    done = pull ? !_nk_msg_queue_try_pull(q,m) : !_nk_msg_queue_try_push(q,*m);
-    QUEUE_UNLOCK(q);
+    done = pull ? !nk_msg_queue_try_pull(q,m) : !nk_msg_queue_try_push(q,*m);
 
     if (done) {
 	DEBUG("%s timeout  %s ends with action\n",kind,q->name);
@@ -523,6 +587,8 @@ static int _nk_msg_queue_push_pull_timeout(struct nk_msg_queue *q, void **m, uin
 
 	struct op o = { q, t, pull };
 	
+	volatile uint64_t *waiters = pull ? &q->pull_waiters : &q->push_waiters;
+
 	// the queues we will simultaneously be on
 	nk_wait_queue_t *queues[2] = { pull ? q->pull_wait_queue : q->push_wait_queue, t->waitq} ;
 	// their condition checks
@@ -543,9 +609,14 @@ static int _nk_msg_queue_push_pull_timeout(struct nk_msg_queue *q, void **m, uin
 	}
 
 	DEBUG("starting multiple sleep\n");
+
+	// announce ourselves before the queue is rechecked
+	__sync_fetch_and_add(waiters,1);
 	
 	nk_wait_queue_sleep_extended_multiple(2,queues,condchecks,states);
 
+	__sync_fetch_and_sub(waiters,1);
+
 	DEBUG("returned from multiple sleep and checking\n");
 
 	// once we get here, we know we are off both wait queues
@@ -24,6 +24,8 @@
 #include <nautilus/naut_string.h>
 #include <nautilus/naut_types.h>
 #include <nautilus/mm.h>
+#include <nautilus/memops.h>
+#include <nautilus/nautilus.h>
 
 unsigned char _ctype[] = {
 _C,_C,_C,_C,_C,_C,_C,_C,			/* 0-7 */
@@ -76,29 +78,35 @@ strnlen (const char * str, size_t max)
 }
 
 
+/* memcpy, memset, and memcmp use the kernels chosen at boot (memops.c),
+   except in interrupt handlers, which must not touch vector state.
+   Until every cpu has its per-cpu state we cannot tell, so we play safe. */
+
+extern uint8_t cpu_info_ready;
+
+static inline int
+base_kernels_only (void)
+{
+    return !cpu_info_ready || per_cpu_get(interrupt_nesting_level);
+}
+
 void *
 memcpy (void * dst, const void * src, size_t n)
 {
-    unsigned char * d = (unsigned char *)dst;
-    unsigned char * s = (unsigned char *)src;
-
-    while (n--) {
-        *d++ = *s++;
+    if (base_kernels_only()) {
+        return nk_memops_copy_rep(dst, src, n);
     }
-
-    return dst;
+    return nk_memops.copy(dst, src, n);
 }
 
 
 void * 
 memset (void * dst, char c, size_t n)
 {
-    unsigned char * d = (unsigned char *)dst;
-    while (n--) {
-        *d++ = c;
+    if (base_kernels_only()) {
+        return nk_memops_fill_rep(dst, c, n);
     }
-
-    return dst;
+    return nk_memops.fill(dst, c, n);
 }
 
 
@@ -111,8 +119,15 @@ memmove (void * dst, const void * src, size_t n)
     /* This test makes the forward copying code be used whenever possible.
        Reduces the working set.  */
     if (dstp - srcp >= n) {
-        /* Copy from the beginning to the end.  */
-        dst = memcpy (dst, src, n);
+        if (srcp - dstp >= n) {
+            /* No overlap at all.  */
+            dst = memcpy (dst, src, n);
+        } else {
+            /* Overlapping with dst below src.  The memcpy kernels do not
+               promise anything here, but rep movsb copies strictly
+               forward.  */
+            asm volatile ("rep movsb" : "+D"(dstp), "+S"(srcp), "+c"(n) : : "memory");
+        }
     } else {
         /* Copy from the end to the beginning.  */
         srcp += n;
@@ -147,23 +162,10 @@ memmove (void * dst, const void * src, size_t n)
 int 
 memcmp (const void * s1_, const void * s2_, size_t n) 
 {
-    const char * s1 = s1_;
-    const char * s2 = s2_;
-
-    while (n > 0) {
-
-        int cmp = (*s1 - *s2);
-
-        if (cmp != 0) {
-            return cmp;
-        }
-
-        ++s1;
-        ++s2;
-        --n;
+    if (base_kernels_only()) {
+        return nk_memops_compare_bytes(s1_, s2_, n);
     }
-
-    return 0;
+    return nk_memops.compare(s1_, s2_, n);
 }
 
 
@@ -87,6 +87,8 @@ int nk_net_dev_get_characteristics(struct nk_net_dev *dev, struct nk_net_dev_cha
     struct nk_net_dev_int *di = (struct nk_net_dev_int *)(d->interface);
 
     DEBUG("get characteristics of %s\n",d->name);
+    // devices that predate a field leave it zero
+    memset(c,0,sizeof(*c));
     return di->get_characteristics(d->state,c);
 }
 
@@ -183,6 +185,72 @@ int nk_net_dev_send_packet(struct nk_net_dev *dev,
     }
 }
 
+int nk_net_dev_supports_sg(struct nk_net_dev *dev)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_net_dev_int *di = (struct nk_net_dev_int *)(d->interface);
+
+    return di->post_send_sg!=0;
+}
+
+int nk_net_dev_send_packet_sg(struct nk_net_dev *dev, 
+			      struct nk_net_dev_sg *frags,
+			      uint32_t num,
+			      struct nk_net_dev_tx_offload *offload,
+			      nk_dev_request_type_t type,
+			      void (*callback)(nk_net_dev_status_t status, void *state),
+			      void *state)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_net_dev_int *di = (struct nk_net_dev_int *)(d->interface);
+    DEBUG("send sg packet on %s (frags=%u, type=%lx)\n", d->name,num,type);
+
+    if (!di->post_send_sg) { 
+	DEBUG("sg packet send not possible\n");
+	return -1;
+    }
+
+    if (!num || num>NK_NET_DEV_MAX_SG) {
+	ERROR("Invalid fragment count %u\n",num);
+	return -1;
+    }
+
+    switch (type) {
+    case NK_DEV_REQ_CALLBACK:
+	return di->post_send_sg(d->state,frags,num,offload,callback,state);
+	break;
+    case NK_DEV_REQ_NONBLOCKING:
+	if (di->post_send_sg(d->state,frags,num,offload,0,0)) { 
+	    ERROR("Failed to launch sg send\n");
+	    return -1;
+	}
+	DEBUG("SG packet launch started\n");
+	return 0;
+	break;
+    case NK_DEV_REQ_BLOCKING: {
+	volatile struct op o;
+
+	o.completed = 0;
+	o.status = 0;
+	o.dev = dev;
+
+	if (di->post_send_sg(d->state,frags,num,offload,generic_send_callback,(void*)&o)) { 
+	    ERROR("Failed to launch sg send\n");
+	    return -1;
+	}
+	DEBUG("SG packet launch started, waiting for completion\n");
+	while (!o.completed) {
+	    nk_dev_wait((struct nk_dev *)dev, generic_cond_check, (void*)&o);
+	}
+	DEBUG("SG packet launch completed\n");
+	return o.status;
+    }
+	break;
+    default:
+	return -1;
+    }
+}
+
 int nk_net_dev_receive_packet(struct nk_net_dev *dev, 
 			      uint8_t *dest, 
 			      uint64_t len, 
@@ -0,0 +1,157 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/cpu_state.h>
+#include <nautilus/qspinlock.h>
+
+/*
+  Each CPU has one queue node per context that can be spinning at
+  once: thread, interrupt, nested interrupt, and exception.  The
+  queue tail in the lock word is (cpu+1, node index), so zero means
+  "no queue".
+
+  Nothing here may take a lock or print, since this is the lock.
+*/
+
+#define QSPIN_NODES          4
+#define QSPIN_TAIL_IDX_SHIFT 16
+#define QSPIN_TAIL_CPU_SHIFT 18
+
+#define QSPIN_TATAS_TRIES    16     // backoff rounds before queueing
+#define QSPIN_MAX_BACKOFF    1024   // pauses
+
+struct qnode {
+    struct qnode * volatile next;
+    volatile uint32_t       locked;   // set by our predecessor on handoff
+    uint32_t                count;    // nesting depth, only used in node 0
+} __attribute__((aligned(16)));
+
+static struct qnode qnodes[NAUT_CONFIG_MAX_CPUS][QSPIN_NODES] __attribute__((aligned(64)));
+
+
+static inline uint32_t encode_tail(uint32_t cpu, uint32_t idx)
+{
+    return ((cpu + 1) << QSPIN_TAIL_CPU_SHIFT) | (idx << QSPIN_TAIL_IDX_SHIFT);
+}
+
+static inline struct qnode *decode_tail(uint32_t tail)
+{
+    uint32_t cpu = (tail >> QSPIN_TAIL_CPU_SHIFT) - 1;
+    uint32_t idx = (tail >> QSPIN_TAIL_IDX_SHIFT) & (QSPIN_NODES - 1);
+    return &qnodes[cpu][idx];
+}
+
+// test-and-test-and-set, giving up after tries rounds (forever if tries<0)
+static int tatas(volatile nk_qspinlock_t *l, int tries, int stop_if_queued)
+{
+    uint32_t backoff = 1, i;
+    uint32_t val;
+    int n;
+
+    for (n=0; tries<0 || n<tries; n++) {
+	val = *l;
+	if (stop_if_queued && (val & NK_QSPIN_TAIL_MASK)) {
+	    return -1;
+	}
+	if (!val && __sync_bool_compare_and_swap(l, 0, 1)) {
+	    return 0;
+	}
+	for (i=0;i<backoff;i++) {
+	    __asm__ __volatile__ ("pause");
+	}
+	if (backoff < QSPIN_MAX_BACKOFF) {
+	    backoff <<= 1;
+	}
+    }
+    return -1;
+}
+
+
+void nk_qspin_lock_slow(volatile nk_qspinlock_t *l)
+{
+    struct cpu *c;
+    struct qnode *node, *prev, *next;
+    uint32_t idx, tail, val;
+
+    if (!tatas(l, QSPIN_TATAS_TRIES, 1)) {
+	return;
+    }
+
+    // our node must stay ours until we are done with it
+    preempt_disable();
+
+    c = (struct cpu *)__cpu_state_get_cpu();
+
+    if (!c) {
+	// no per-cpu state yet (early boot), so no way to name a node
+	tatas(l, -1, 0);
+	preempt_enable();
+	return;
+    }
+
+    idx = qnodes[c->id][0].count++;
+
+    if (idx >= QSPIN_NODES) {
+	// nested too deeply to queue; this should never happen
+	tatas(l, -1, 0);
+	qnodes[c->id][0].count--;
+	preempt_enable();
+	return;
+    }
+
+    node = &qnodes[c->id][idx];
+    node->next = 0;
+    node->locked = 0;
+    tail = encode_tail(c->id, idx);
+
+    // make ourselves the tail, keeping the locked byte
+    do {
+	val = *l;
+    } while (!__sync_bool_compare_and_swap(l, val, (val & ~NK_QSPIN_TAIL_MASK) | tail));
+
+    if (val & NK_QSPIN_TAIL_MASK) {
+	// wait behind our predecessor for it to hand us the head
+	prev = decode_tail(val);
+	prev->next = node;
+	PAUSE_WHILE(!node->locked);
+    }
+
+    // we are the head, so we are next; wait for the owner to leave
+    PAUSE_WHILE((val = *l) & NK_QSPIN_LOCKED);
+
+    // if nobody queued behind us, take the lock and clear the queue at once
+    if ((val & NK_QSPIN_TAIL_MASK) == tail &&
+	__sync_bool_compare_and_swap(l, val, 1)) {
+	goto out;
+    }
+
+    // someone is behind us; nobody else can take the lock while a
+    // queue exists, so just set the locked byte and pass on the head
+    __sync_fetch_and_or(l, 1);
+
+    PAUSE_WHILE(!(next = node->next));
+
+    next->locked = 1;
+
+ out:
+    qnodes[c->id][0].count--;
+    preempt_enable();
+}
@@ -0,0 +1,255 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/irq.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/waitqueue.h>
+#include <nautilus/shell.h>
+#include <nautilus/rcu.h>
+
+#ifndef NAUT_CONFIG_DEBUG_RCU
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("rcu: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("rcu: " fmt, ##args)
+#define INFO(fmt, args...)  INFO_PRINT("rcu: " fmt, ##args)
+
+/*
+  A grace period is just a number.  Starting one bumps gp_seq.  Each
+  CPU copies gp_seq into its own slot at every quiescent state, so the
+  grace period numbered g is over once every slot is at least g.  The
+  quiescent state path is a load and, at most, a store to a line the
+  CPU owns.
+
+  Deferred callbacks are batched on a single list and handed to the
+  "rcu" thread, which waits out one grace period per batch.
+*/
+
+#define RCU_KICK_SPINS 1024      // polls of a lagging cpu between kicks
+
+extern uint8_t cpu_info_ready;
+
+static volatile uint64_t gp_seq = 0;
+
+static struct rcu_cpu {
+    volatile uint64_t qs_seq;
+} __attribute__((aligned(64))) rcu_cpus[NAUT_CONFIG_MAX_CPUS];
+
+static volatile int rcu_ready = 0;
+
+static spinlock_t          cb_lock;
+static struct nk_rcu_head *cb_head = 0;
+static struct nk_rcu_head **cb_tail = &cb_head;
+static uint64_t            cb_count = 0;
+static nk_wait_queue_t    *cb_wait = 0;
+
+static uint64_t            gp_count = 0;
+static uint64_t            cb_done = 0;
+
+#define CB_LOCK_CONF uint8_t _cb_lock_flags
+#define CB_LOCK() _cb_lock_flags = spin_lock_irq_save(&cb_lock)
+#define CB_UNLOCK() spin_unlock_irq_restore(&cb_lock, _cb_lock_flags);
+
+
+void nk_rcu_quiescent(void)
+{
+    uint64_t g;
+
+    if (!cpu_info_ready) {
+	return;
+    }
+
+    g = gp_seq;
+
+    if (rcu_cpus[my_cpu_id()].qs_seq != g) {
+	rcu_cpus[my_cpu_id()].qs_seq = g;
+    }
+}
+
+void nk_rcu_synchronize(void)
+{
+    int n = nk_get_num_cpus();
+    int me, i, can_yield;
+    uint64_t g, spins;
+
+    // before the scheduler is running everywhere there is
+    // no way to see a grace period end, but there are also
+    // no other cpus running readers
+    if (!rcu_ready || n==1) {
+	return;
+    }
+
+    // full barrier: our unpublishing stores come before anyone
+    // can see the new grace period
+    g = __sync_add_and_fetch(&gp_seq,1);
+
+    me = my_cpu_id();
+    rcu_cpus[me].qs_seq = g;
+
+    can_yield = irqs_enabled() && !preempt_is_disabled() && !in_interrupt_context();
+
+    if (!can_yield) {
+	ERROR("synchronize called from a context that cannot yield (cpu %d)\n", me);
+    }
+
+    for (i=0;i<n;i++) {
+	spins = 0;
+	while (rcu_cpus[i].qs_seq < g) {
+	    if (can_yield) {
+		nk_yield();
+	    } else {
+		__asm__ __volatile__ ("pause");
+	    }
+	    // an idle cpu may be halted, so give it a reason to pass through
+	    if (!(++spins % RCU_KICK_SPINS)) {
+		nk_sched_kick_cpu(i);
+	    }
+	}
+    }
+
+    __sync_fetch_and_add(&gp_count,1);
+
+    DEBUG("grace period %lu complete\n", g);
+}
+
+void nk_call_rcu(struct nk_rcu_head *head, void (*func)(struct nk_rcu_head *head))
+{
+    CB_LOCK_CONF;
+    int was_empty;
+
+    head->func = func;
+    head->next = 0;
+
+    CB_LOCK();
+    was_empty = !cb_head;
+    *cb_tail = head;
+    cb_tail = &head->next;
+    cb_count++;
+    CB_UNLOCK();
+
+    if (was_empty && cb_wait) {
+	nk_wait_queue_wake_all(cb_wait);
+    }
+}
+
+static int have_callbacks(void *state)
+{
+    return __sync_fetch_and_add(&cb_head,0) != 0;
+}
+
+static void rcu_thread(void *in, void **out)
+{
+    CB_LOCK_CONF;
+    struct nk_rcu_head *batch, *next;
+    uint64_t count;
+
+    if (nk_thread_name(get_cur_thread(),"rcu")) {
+	ERROR("Failed to name rcu thread\n");
+    }
+
+    while (1) {
+	nk_wait_queue_sleep_extended(cb_wait, have_callbacks, 0);
+
+	CB_LOCK();
+	batch = cb_head;
+	count = cb_count;
+	cb_head = 0;
+	cb_tail = &cb_head;
+	cb_count = 0;
+	CB_UNLOCK();
+
+	if (!batch) {
+	    continue;
+	}
+
+	// everything in the batch was unpublished before we took it
+	nk_rcu_synchronize();
+
+	for (;batch;batch=next) {
+	    next = batch->next;
+	    batch->func(batch);
+	}
+
+	__sync_fetch_and_add(&cb_done,count);
+
+	DEBUG("reclaimed batch of %lu\n", count);
+    }
+}
+
+int nk_rcu_init(void)
+{
+    uint64_t g = gp_seq;
+    int i;
+
+    spinlock_init(&cb_lock);
+
+    for (i=0;i<nk_get_num_cpus();i++) {
+	rcu_cpus[i].qs_seq = g;
+    }
+
+    cb_wait = nk_wait_queue_create("rcu-wait");
+
+    if (!cb_wait) {
+	ERROR("Failed to allocate wait queue\n");
+	return -1;
+    }
+
+    rcu_ready = 1;
+
+    if (nk_thread_start(rcu_thread, 0, 0, 1, TSTACK_DEFAULT, 0, -1)) {
+	ERROR("Failed to start rcu thread\n");
+	return -1;
+    }
+
+    INFO("inited\n");
+
+    return 0;
+}
+
+
+static int
+handle_rcu (char * buf, void * priv)
+{
+    uint64_t start;
+
+    if (strstr(buf,"sync")) {
+	start = rdtsc();
+	nk_rcu_synchronize();
+	nk_vc_printf("grace period took %lu cycles\n", rdtsc()-start);
+	return 0;
+    }
+
+    nk_vc_printf("gp_seq=%lu grace_periods=%lu callbacks_pending=%lu callbacks_done=%lu\n",
+		 gp_seq, gp_count, cb_count, cb_done);
+
+    return 0;
+}
+
+
+static struct shell_cmd_impl rcu_impl = {
+    .cmd      = "rcu",
+    .help_str = "rcu [sync]",
+    .handler  = handle_rcu,
+};
+nk_register_shell_cmd(rcu_impl);
@@ -26,6 +26,7 @@
 #include <nautilus/intrinsics.h>
 #include <nautilus/thread.h>
 #include <nautilus/mm.h>
+#include <nautilus/percpu.h>
 
 #ifndef NAUT_CONFIG_DEBUG_SYNCH
 #undef DEBUG_PRINT
@@ -51,14 +52,57 @@ nk_rwlock_init (nk_rwlock_t * l)
 }
 
 
+/*
+ * The acquisition attempts below use the internal spinlock directly
+ * so that, with lockstat on, waits are attributed to the caller of
+ * the rwlock function rather than to this file
+ */
+static inline int
+rd_try_lock (nk_rwlock_t * l)
+{
+    uint8_t flags;
+    if (spin_try_lock_irq_save(&l->lock, &flags)) {
+        return -1;
+    }
+    ++l->readers;
+    __spin_release(&l->lock);
+    irq_enable_restore(flags);
+    return 0;
+}
+
+static inline int
+wr_try_lock (nk_rwlock_t * l)
+{
+    if (spin_try_lock(&l->lock)) {
+        return -1;
+    }
+    if (likely(l->readers == 0)) {
+        return 0;
+    }
+    __spin_release(&l->lock);
+    /* TODO: we should yield if we're not spread across cores */
+    return -1;
+}
+
+static inline int
+wr_try_lock_irq_save (nk_rwlock_t * l, uint8_t * flags)
+{
+    *flags = irq_disable_save();
+    if (wr_try_lock(l)) {
+        irq_enable_restore(*flags);
+        return -1;
+    }
+    return 0;
+}
+
+
 int 
 nk_rwlock_rd_lock (nk_rwlock_t * l)
 {
     NK_PROFILE_ENTRY();
     DEBUG_PRINT("rwlock read lock: %p\n", (void*)l);
-    int flags = spin_lock_irq_save(&l->lock);
-    ++l->readers;
-    spin_unlock_irq_restore(&l->lock, flags);
+    NK_LOCKSTAT_ACQUIRE_AT(l, NK_LOCKSTAT_CALLER(), rd_try_lock(l),
+                           PAUSE_WHILE(rd_try_lock(l)));
     NK_PROFILE_EXIT();
     return 0;
 }
@@ -69,6 +113,7 @@ nk_rwlock_rd_unlock (nk_rwlock_t * l)
 {
     NK_PROFILE_ENTRY();
     DEBUG_PRINT("rwlock read unlock: %p\n", (void*)l);
+    NK_LOCKSTAT_RELEASE(l);
     int flags = spin_lock_irq_save(&l->lock);
     --l->readers;
     spin_unlock_irq_restore(&l->lock, flags);
@@ -82,18 +127,8 @@ nk_rwlock_wr_lock (nk_rwlock_t * l)
 {
     NK_PROFILE_ENTRY();
     DEBUG_PRINT("rwlock write lock: %p\n", (void*)l);
-
-    while (1) {
-        spin_lock(&l->lock);
-
-        if (likely(l->readers == 0)) {
-            break;
-        } else { 
-            spin_unlock(&l->lock);
-            /* TODO: we should yield if we're not spread across cores */
-        }
-    }
-
+    NK_LOCKSTAT_ACQUIRE_AT(l, NK_LOCKSTAT_CALLER(), wr_try_lock(l),
+                           while (wr_try_lock(l)) { });
     NK_PROFILE_EXIT();
     return 0;
 }
@@ -104,6 +139,7 @@ nk_rwlock_wr_unlock (nk_rwlock_t * l)
 {
     NK_PROFILE_ENTRY();
     DEBUG_PRINT("rwlock write unlock: %p\n", (void*)l);
+    NK_LOCKSTAT_RELEASE(l);
     spin_unlock(&l->lock);
     NK_PROFILE_EXIT();
     return 0;
@@ -113,33 +149,153 @@ nk_rwlock_wr_unlock (nk_rwlock_t * l)
 uint8_t 
 nk_rwlock_wr_lock_irq_save (nk_rwlock_t * l)
 {
-    int flags;
+    uint8_t flags;
     NK_PROFILE_ENTRY();
     DEBUG_PRINT("rwlock write lock (irq): %p\n", (void*)l);
+    NK_LOCKSTAT_ACQUIRE_AT(l, NK_LOCKSTAT_CALLER(), wr_try_lock_irq_save(l, &flags),
+                           while (wr_try_lock_irq_save(l, &flags)) { });
+    NK_PROFILE_EXIT();
+    return flags;
+}
 
-    while (1) {
-        flags = spin_lock_irq_save(&l->lock);
 
-        if (likely(l->readers == 0 )) {
+int 
+nk_rwlock_wr_unlock_irq_restore (nk_rwlock_t * l, uint8_t flags)
+{
+    NK_PROFILE_ENTRY();
+    DEBUG_PRINT("rwlock write unlock (irq): %p\n", (void*)l);
+    NK_LOCKSTAT_RELEASE(l);
+    spin_unlock_irq_restore(&l->lock, flags);
+    NK_PROFILE_EXIT();
+    return 0;
+}
+
+
+/*
+ * Big-reader lock
+ */
+
+extern uint8_t cpu_info_ready;
+
+static inline int
+br_my_slot (void)
+{
+    return cpu_info_ready ? my_cpu_id() : 0;
+}
+
+static inline int
+br_num_slots (void)
+{
+    int n = nk_get_num_cpus();
+    return n > 0 ? n : 1;
+}
+
+int
+nk_brlock_init (nk_brlock_t * l)
+{
+    DEBUG_PRINT("brlock init (%p)\n", (void*)l);
+    memset(l, 0, sizeof(*l));
+    spinlock_init(&l->wlock);
+    return 0;
+}
+
+
+int
+nk_brlock_rd_lock (nk_brlock_t * l)
+{
+    int slot;
+
+    NK_PROFILE_ENTRY();
+
+    // a reader must not be descheduled while counted, otherwise a
+    // writer spinning with interrupts off on this CPU never sees
+    // the count drain
+    preempt_disable();
+    slot = br_my_slot();
+
+    while (1) {
+        PAUSE_WHILE(l->writer);
+        __sync_fetch_and_add(&l->slot[slot].readers, 1);
+        // the atomic add is a full barrier, so the writer either
+        // sees our count or we see its flag
+        if (likely(!l->writer)) {
             break;
-        } else {
-            spin_unlock_irq_restore(&l->lock, flags);
         }
+        // a writer got in first; step aside for it
+        __sync_fetch_and_sub(&l->slot[slot].readers, 1);
     }
 
+    NK_PROFILE_EXIT();
+    return slot;
+}
+
+
+void
+nk_brlock_rd_unlock (nk_brlock_t * l, int slot)
+{
+    NK_PROFILE_ENTRY();
+    __sync_fetch_and_sub(&l->slot[slot].readers, 1);
+    preempt_enable();
+    NK_PROFILE_EXIT();
+}
+
+
+static inline void
+br_wr_drain (nk_brlock_t * l)
+{
+    int i, n = br_num_slots();
+
+    __sync_lock_test_and_set(&l->writer, 1);
+
+    for (i = 0; i < n; i++) {
+        PAUSE_WHILE(l->slot[i].readers);
+    }
+}
+
+
+void
+nk_brlock_wr_lock (nk_brlock_t * l)
+{
+    NK_PROFILE_ENTRY();
+    DEBUG_PRINT("brlock write lock: %p\n", (void*)l);
+    spin_lock(&l->wlock);
+    br_wr_drain(l);
+    NK_PROFILE_EXIT();
+}
+
+
+void
+nk_brlock_wr_unlock (nk_brlock_t * l)
+{
+    NK_PROFILE_ENTRY();
+    DEBUG_PRINT("brlock write unlock: %p\n", (void*)l);
+    __sync_lock_release(&l->writer);
+    spin_unlock(&l->wlock);
+    NK_PROFILE_EXIT();
+}
+
+
+uint8_t
+nk_brlock_wr_lock_irq_save (nk_brlock_t * l)
+{
+    uint8_t flags;
+    NK_PROFILE_ENTRY();
+    DEBUG_PRINT("brlock write lock (irq): %p\n", (void*)l);
+    flags = spin_lock_irq_save(&l->wlock);
+    br_wr_drain(l);
     NK_PROFILE_EXIT();
     return flags;
 }
 
 
-int 
-nk_rwlock_wr_unlock_irq_restore (nk_rwlock_t * l, uint8_t flags)
+void
+nk_brlock_wr_unlock_irq_restore (nk_brlock_t * l, uint8_t flags)
 {
     NK_PROFILE_ENTRY();
-    DEBUG_PRINT("rwlock write unlock (irq): %p\n", (void*)l);
-    spin_unlock_irq_restore(&l->lock, flags);
+    DEBUG_PRINT("brlock write unlock (irq): %p\n", (void*)l);
+    __sync_lock_release(&l->writer);
+    spin_unlock_irq_restore(&l->wlock, flags);
     NK_PROFILE_EXIT();
-    return 0;
 }
 
 
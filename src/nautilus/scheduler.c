@@ -62,6 +62,7 @@
 #include <nautilus/backtrace.h>
 #include <nautilus/shell.h>
 #include <nautilus/topo.h>
+#include <nautilus/rcu.h>
 #include <dev/apic.h>
 #include <dev/gpio.h>
 
@@ -131,10 +132,41 @@
 // Maximum number of threads within a priority queue or queue
 #define MAX_QUEUE (NAUT_CONFIG_MAX_THREADS)
 
+// Load tracking and balancing
+//
+// A cpu's load is an exponentially weighted moving average of
+// the number of runnable threads it has, in units of 1<<LOAD_SHIFT
+// per thread.   It is sampled by the scheduling pass at most once
+// per LOAD_SAMPLE_NS, and each sample is weighted 1/(1<<LOAD_EWMA_SHIFT)
+#define LOAD_SHIFT        10
+#define LOAD_ONE          (1ULL<<LOAD_SHIFT)
+#define LOAD_EWMA_SHIFT   3
+#define LOAD_SAMPLE_NS    1000000ULL
+// a cpu is only worth stealing from / placing away from if
+// the imbalance is at least this much
+#define LOAD_IMBALANCE    LOAD_ONE
+// minimum time between balancing passes on a cpu
+#ifdef NAUT_CONFIG_WORK_STEALING
+#define BALANCE_INTERVAL_NS (NAUT_CONFIG_WORK_STEALING_INTERVAL_MS*1000000ULL)
+#define BALANCE_AMOUNT      NAUT_CONFIG_WORK_STEALING_AMOUNT
+#else
+#define BALANCE_INTERVAL_NS 10000000ULL
+#define BALANCE_AMOUNT      4
+#endif
+
+//
+// Topological distance between cpus, used for placement and for
+// picking stealing victims
+//
+typedef enum { LEVEL_SMT=0,      // same physical core (or the same cpu)
+	       LEVEL_SOCKET=1,   // same socket or NUMA domain
+	       LEVEL_REMOTE=2,
+	       NUM_LEVELS=3 } cpu_level;
+
 
-#define GLOBAL_LOCK_CONF uint8_t _global_flags=0
-#define GLOBAL_LOCK() _global_flags = spin_lock_irq_save(&global_sched_state.lock)
-#define GLOBAL_UNLOCK() spin_unlock_irq_restore(&global_sched_state.lock,_global_flags)
+#define SHARD_LOCK_CONF uint8_t _shard_flags=0
+#define SHARD_LOCK(h) _shard_flags = spin_lock_irq_save(&((h)->lock))
+#define SHARD_UNLOCK(h) spin_unlock_irq_restore(&((h)->lock),_shard_flags)
 
 #define LOCAL_LOCK_CONF uint8_t _local_flags=0
 #define LOCAL_LOCK(s) _local_flags = spin_lock_irq_save(&((s)->lock))
@@ -172,11 +204,28 @@
 //
 // Common to all cores
 //
+// The threads themselves are kept in per-cpu shards (see
+// struct nk_sched_thread_shard below).  What remains global is
+// the total thread count, which is maintained atomically, and
+// the tid lookup table, which is lock-free
+//
+
+// tid lookup table size (must exceed the maximum number of threads)
+#define TID_TABLE_SIZE  (2*MAX_QUEUE)
+// tid slot states other than a valid tid
+#define TID_EMPTY       0ULL            // free - terminates a probe
+#define TID_CLAIMED     (-1ULL)         // being filled in by a writer
+
+struct tid_slot {
+    volatile uint64_t          tid;
+    struct nk_thread * volatile thread;
+};
+
 struct nk_sched_global_state {
-    spinlock_t          lock;
-    struct rt_list      *thread_list;
-    uint64_t             num_threads;
-    int                  reaping;
+    volatile uint64_t    num_threads;
+    spinlock_t           tid_lock;   // serializes tid table writers
+    volatile uint64_t    tid_seq;    // odd while a removal is moving slots
+    struct tid_slot      tid_table[TID_TABLE_SIZE];
 };
 
 static volatile int scheduler_ready = 0;
@@ -198,34 +247,30 @@ static volatile uint8_t      stop_flags;
 
 static struct nk_sched_global_state global_sched_state;
 
-//
-// List implementation for use in scheduler
-// Avoids changing thread structures
-//
 typedef struct nk_sched_thread_state rt_thread;
-typedef struct rt_node {
-    rt_thread      *thread;
-    struct rt_node *next;
-    struct rt_node *prev;
-} rt_node;
 
-static rt_node* rt_node_init(rt_thread *t);
-static void     rt_node_deinit(rt_node *n);
-
-typedef struct rt_list {
-    rt_node *head;
-    rt_node *tail;
-} rt_list;
+//
+// Per-cpu shard of the thread bookkeeping
+//
+// A thread is registered on the shard of the CPU that creates it.
+// When it exits, it moves to the shard's exited list, which is
+// all that the reaper and reanimation need to examine.
+// Each shard is allocated with its CPU's scheduler state, and
+// so is local to that CPU's NUMA node.
+//
+#define REAP_BATCH 32
 
-static rt_list*   rt_list_init();
-static void       rt_list_deinit(rt_list *l);
-static int        _rt_list_enqueue(rt_list *l, rt_thread *t, rt_node *newnode);
-static int        rt_list_enqueue(rt_list *l, rt_thread *t);
-static rt_thread* rt_list_dequeue(rt_list *l);
-static rt_thread* rt_list_remove(rt_list *l, rt_node *n);
-static rt_thread* rt_list_remove_search(rt_list *l, rt_thread *t);
-static void       rt_list_map(rt_list *l, void (*func)(rt_thread *t, void *priv), void *priv);
-static int        rt_list_empty(rt_list *l);
+struct nk_sched_thread_shard {
+    spinlock_t          lock;
+    struct list_head    threads;       // live threads
+    struct list_head    exited;        // threads that have called nk_sched_exit()
+    uint64_t            num_threads;   // on either list
+    uint64_t            num_exited;    // on the exited list
+    uint64_t            num_reaped;    // statistics
+    uint64_t            num_reanimated;
+    int                 reaping;       // reaper or reanimator owns the shard
+    rt_thread          *reap_pool[REAP_BATCH];
+} __attribute__((aligned(64)));
 
 
 
@@ -234,19 +279,20 @@ typedef enum { RUNNABLE_QUEUE = 0,
 	       APERIODIC_QUEUE = 2} queue_type;
 
 //
-// Queue specific to scheduler (circular buffer)
+// Queue specific to scheduler (FIFO)
+//
+// This is intrusive - the links live in the thread's scheduler
+// state (q_node), so enqueue, dequeue, and removal never allocate
+// and are constant time
 //
 typedef struct rt_queue {
-    queue_type type;
-    uint64_t   size;        // number of elements currently in the queue
-    uint64_t   head;        // index of newest element 
-    uint64_t   tail;        // index of oldest element
-    rt_thread *threads[MAX_QUEUE];
+    queue_type       type;
+    uint64_t         size;        // number of elements currently in the queue
+    struct list_head threads;     // oldest element first
 } rt_queue ;
 
 static int        rt_queue_enqueue(rt_queue *queue, rt_thread *thread);
 static rt_thread* rt_queue_dequeue(rt_queue *queue);
-static rt_thread* rt_queue_peek(rt_queue *queue, uint64_t pos);
 static rt_thread* rt_queue_remove(rt_queue *queue, rt_thread *thread);
 static int        rt_queue_empty(rt_queue *queue);
 static void       rt_queue_dump(rt_queue *queue, char *pre);
@@ -258,10 +304,24 @@ static void       rt_queue_dump(rt_queue *queue, char *pre);
 //   Runnable:  deadline (EDF queue)
 //   Pending:   arrival time 
 //   Aperiodic: priority 
+//
+// The heap is handle-indexed - each thread records its current
+// position (heap_pos), so removal of an arbitrary thread is
+// O(log n) instead of a search and rebuild.
+//
+// The queue also keeps running totals over the periodic threads
+// it holds, and a list of the sporadic threads it holds, so that
+// admission control does not need to walk the whole heap.
+//
 
 typedef struct rt_priority_queue {
     queue_type type;
     uint64_t   size;
+    uint64_t   periodic_count;      // number of periodic threads in the queue
+    uint64_t   periodic_util;       // sum of their slice/period (UTIL_ONE scale)
+    uint64_t   periodic_period_sum; // sum of their periods
+    uint64_t   sporadic_count;      // number of sporadic threads in the queue
+    struct list_head sporadic;      // the sporadic threads (via sp_node)
     rt_thread *threads[MAX_QUEUE];
 } rt_priority_queue ;
 
@@ -321,8 +381,17 @@ typedef struct nk_sched_percpu_state {
 
     uint64_t num_thefts;   // how many threads I've successfully stolen
 
+    uint64_t load;              // EWMA of runnable threads (LOAD_ONE per thread)
+    uint64_t load_sample_time;  // when load was last sampled
+    uint64_t last_balance_time; // when a balancing pass last ran
+    uint64_t num_balances;      // balancing passes run here
+    uint64_t num_placements;    // threads placed here by initial placement
+    uint64_t num_level_thefts[NUM_LEVELS]; // thefts from SMT sibling, socket, remote
+
     uint64_t reinject_count;  // how many timer/kick interrupts I've had to reinject
 
+    struct nk_sched_thread_shard shard; // threads created on this cpu
+
 #if INSTRUMENT
     uint64_t resched_fast_num;
     uint64_t resched_fast_sum;
@@ -410,13 +479,13 @@ typedef struct nk_sched_percpu_state {
 #else
 #define DUMP_APERIODIC(s,p) 
 #endif
-#define PEEK_APERIODIC(s,k) rt_queue_peek(&(s)->aperiodic,k)
+#define FOR_EACH_APERIODIC(s,t,k) list_for_each_entry(t,&(s)->aperiodic.threads,q_node)
 #define SIZE_APERIODIC(s) ((s)->aperiodic.size)
 #else
 #define GET_NEXT_APERIODIC(s) rt_priority_queue_dequeue(&(s)->aperiodic)
 #define PUT_APERIODIC(s,t) rt_priority_queue_enqueue(&(s)->aperiodic,t)
 #define REMOVE_APERIODIC(s,t) rt_priority_queue_remove(&(s)->aperiodic,t)
-#define PEEK_APERIODIC(s,k) rt_priority_queue_peek(&(s)->aperiodic,k)
+#define FOR_EACH_APERIODIC(s,t,k) for ((k)=0; (k)<SIZE_APERIODIC(s) && ((t)=rt_priority_queue_peek(&(s)->aperiodic,k)); (k)++)
 #define SIZE_APERIODIC(s) ((s)->aperiodic.size)
 #define HAVE_APERIODIC(s) (!rt_priority_queue_empty(&(s)->aperiodic))
 #ifdef NAUT_CONFIG_DEBUG_SCHED
@@ -514,8 +583,24 @@ typedef struct nk_sched_thread_state {
     // the thread context itself
     struct nk_thread *thread;
 
-    // the thread node in a thread list (the global thread list)
-    struct rt_node   *list; 
+    // link in its shard's live or exited thread list
+    struct list_head  shard_node;
+    // the cpu whose shard holds the thread
+    int               shard;
+    // the thread is on the shard's exited list
+    int               exited;
+
+    // link in the aperiodic run queue, when that is an rt_queue
+    struct list_head  q_node;
+    // the rt_queue the thread is currently on, if any
+    struct rt_queue  *queue;
+
+    // the rt_priority_queue the thread is currently on, if any,
+    // and its index in that queue's heap
+    struct rt_priority_queue *pqueue;
+    uint64_t          heap_pos;
+    // link in the rt_priority_queue's sporadic list
+    struct list_head  sp_node;
 
 } rt_thread ;
 
@@ -615,24 +700,42 @@ static void print_thread(rt_thread *r, void *priv)
 }
 
 
-static uint64_t   reap_count;
-static rt_thread *reap_pool[MAX_QUEUE];
+static inline struct nk_sched_thread_shard *get_shard(int cpu)
+{
+    return &per_cpu_get(system)->cpus[cpu]->sched_state->shard;
+}
 
-static void pre_reap_thread(rt_thread *r, void *priv)
+static inline int thread_is_reapable(rt_thread *r)
 {
-    ASSERT(r);
-    ASSERT(r->thread);
+    return !r->thread->refcount && r->thread->status==NK_THR_EXITED && r->status==REAPABLE;
+}
 
-    nk_thread_t  * t = r->thread;
-    rt_node      * temp;
+// apply func to all threads in all shards, live and exited
+// each shard is locked only while it is being walked
+static void shard_map(void (*func)(rt_thread *t, void *priv), void *priv)
+{
+    SHARD_LOCK_CONF;
+    struct sys_info *sys = per_cpu_get(system);
+    struct nk_sched_thread_shard *sh;
+    rt_thread *r;
+    int cpu;
 
-    if (reap_count<MAX_QUEUE && !t->refcount && t->status==NK_THR_EXITED && r->status==REAPABLE) {
-	DEBUG("Reaping tid %llu (%s)\n",t->tid,t->name);
-	reap_pool[reap_count++] = r;
+    for (cpu=0;cpu<sys->num_cpus;cpu++) {
+	if (!sys->cpus[cpu] || !sys->cpus[cpu]->sched_state) {
+	    continue;
+	}
+	sh = get_shard(cpu);
+	SHARD_LOCK(sh);
+	list_for_each_entry(r,&sh->threads,shard_node) {
+	    func(r,priv);
+	}
+	list_for_each_entry(r,&sh->exited,shard_node) {
+	    func(r,priv);
+	}
+	SHARD_UNLOCK(sh);
     }
 }
 
-
 void nk_sched_dump_cores(int cpu_arg)
 {
     LOCAL_LOCK_CONF;
@@ -656,13 +759,13 @@ void nk_sched_dump_cores(int cpu_arg)
 
     for (cpu=0;cpu<sys->num_cpus;cpu++) { 
 	if (cpu_arg<0 || cpu_arg==cpu) {
-	    char buf[256];
+	    char buf[320];
 	    struct apic_dev *apic = sys->cpus[cpu]->apic;
 	    struct nk_aspace *aspace = sys->cpus[cpu]->cur_aspace;
 
 	    s = sys->cpus[cpu]->sched_state;
 	    LOCAL_LOCK(s);
-	    snprintf(buf,256,"%dc %s %unl %luin %luex %luri %lut %s %utp %lup %lur %lua %lum (%s) (%luul %lusp %luap %luaq %luadp) (%luste %lustd %luute %luutd) (%luapic) [%s]\n",
+	    snprintf(buf,320,"%dc %s %unl %luin %luex %luri %lut %s %utp %lup %lur %lua %lum (%lucl %lubal %lupl %lusm %lusk %lurm) (%s) (%luul %lusp %luap %luaq %luadp) (%luste %lustd %luute %luutd) (%luapic) [%s]\n",
 		     cpu, 
 		     intr_model,
 		     sys->cpus[cpu]->interrupt_nesting_level,
@@ -674,6 +777,11 @@ void nk_sched_dump_cores(int cpu_arg)
 		     s->current->thread->sched_state->constraints.interrupt_priority_class,
 		     s->pending.size, s->runnable.size, s->aperiodic.size,
 		     s->num_thefts,
+		     (s->load*100)>>LOAD_SHIFT,
+		     s->num_balances, s->num_placements,
+		     s->num_level_thefts[LEVEL_SMT],
+		     s->num_level_thefts[LEVEL_SOCKET],
+		     s->num_level_thefts[LEVEL_REMOTE],
 		     
 #if NAUT_CONFIG_APERIODIC_ROUND_ROBIN
 		     "RR",
@@ -737,32 +845,39 @@ void nk_sched_dump_time(int cpu_arg)
 
 void nk_sched_dump_threads(int cpu)
 {
-    GLOBAL_LOCK_CONF;
-    struct sys_info *sys = per_cpu_get(system);
-    struct apic_dev *apic = sys->cpus[my_cpu_id()]->apic;
+    shard_map(print_thread,(void*)(long)cpu);
+}
 
-    GLOBAL_LOCK();
+struct thread_map {
+    int      cpu;       // -1 => all
+    int      skip_me;   // skip the calling thread
+    uint8_t (*filter)(struct nk_thread *, struct nk_thread *); 
+    void    (*func)(struct nk_thread *t, void *state);
+    void     *state;
+};
 
-    rt_list_map(global_sched_state.thread_list,print_thread,(void*)(long)cpu);
+static void map_thread(rt_thread *r, void *priv)
+{
+    struct thread_map *m = (struct thread_map *)priv;
+    struct nk_thread *t = r->thread;
 
-    GLOBAL_UNLOCK();
+    if (m->skip_me && t==get_cur_thread()) {
+	return;
+    }
+    if (m->cpu!=-1 && t->current_cpu!=m->cpu) {
+	return;
+    }
+    if (m->filter && !m->filter(get_cur_thread(),t)) {
+	return;
+    }
+    m->func(t,m->state);
 }
 
 void nk_sched_map_threads(int cpu, void (func)(struct nk_thread *t, void *state), void *state)
 {
-    GLOBAL_LOCK_CONF;
-   
-    GLOBAL_LOCK();
+    struct thread_map m = { .cpu=cpu, .skip_me=0, .filter=0, .func=func, .state=state };
 
-    rt_node *n = global_sched_state.thread_list->head;
-    while (n != NULL) {
-	if (cpu==-1 || n->thread->thread->current_cpu==cpu) { 
-	    func(n->thread->thread,state);
-	}
-        n = n->next;
-    }
-
-    GLOBAL_UNLOCK();
+    shard_map(map_thread,&m);
 }
 
 /* KCH NOTE: The following helper functions *currently* assume that they will
@@ -820,23 +935,11 @@ static uint8_t (*const thread_filter_funcs[])(struct nk_thread*, struct nk_threa
 // Map a function to all other threads on the same X, where X can be hwthread, physical core, or socket
 void nk_topo_map_sibling_threads(void (func)(struct nk_thread *t, void *state), nk_topo_filt_t filter, void *state)
 {
-    GLOBAL_LOCK_CONF;
-    GLOBAL_LOCK();
-
-    rt_node *n = global_sched_state.thread_list->head;
+    struct thread_map m = { .cpu=-1, .skip_me=1, 
+			    .filter = filter==NK_TOPO_ALL_FILT ? 0 : thread_filter_funcs[filter],
+			    .func=func, .state=state };
 
-    while (n != NULL) {
-        if (n->thread->thread != get_cur_thread()) { // skip myself
-            if (filter == NK_TOPO_ALL_FILT ||
-                    thread_filter_funcs[filter](get_cur_thread(), n->thread->thread)) {
-                func(n->thread->thread, state);
-            }
-        }
-
-        n = n->next;
-    }
-
-    GLOBAL_UNLOCK();
+    shard_map(map_thread,&m);
 }
 
 void nk_topo_map_hwthread_sibling_threads(void (func)(struct nk_thread *t, void *state), void *state)
@@ -961,45 +1064,264 @@ void nk_sched_start_world()
 }
 
 
-struct thread_query {
-    uint64_t     tid;
-    nk_thread_t *thread;
-};
+//
+// Lock-free tid lookup
+//
+// Open addressing with linear probing.  Writers serialize on a short
+// spinlock, and a slot's thread pointer is published before its tid,
+// so a reader that sees a matching tid also sees the thread.  Removal
+// uses backward-shift deletion rather than tombstones: the entries
+// after the removed one are moved back toward their home slots, so
+// the table never fills up with dead slots and a miss stops at the
+// first empty slot.  A reader can miss an entry that is being moved,
+// so removals bump tid_seq around the move and a reader that misses
+// retries if it changed.  Readers never take a lock and never disable
+// interrupts.  A destroyed thread is freed only after an RCU grace
+// period, so a caller that looks up a thread inside nk_rcu_read_lock()
+// can use it until the matching unlock.  A reanimated thread is reused
+// in place, so such a caller should check the tid if it cares.
+//
+#define TID_LOCK_CONF uint8_t _tid_lock_flags
+#define TID_LOCK() _tid_lock_flags = spin_lock_irq_save(&global_sched_state.tid_lock)
+#define TID_UNLOCK() spin_unlock_irq_restore(&global_sched_state.tid_lock, _tid_lock_flags)
 
-static void find_thread(rt_thread *r, void *priv)
+static inline uint64_t tid_hash(uint64_t tid)
 {
-    nk_thread_t  * t = r->thread;
-    struct thread_query *q = (struct thread_query *)priv;
+    return ((tid * 0x9e3779b97f4a7c15ULL) >> 17) % TID_TABLE_SIZE;
+}
+
+static inline struct tid_slot *tid_slot_at(uint64_t i)
+{
+    return &global_sched_state.tid_table[i % TID_TABLE_SIZE];
+}
 
-    if (t->tid == q->tid) { 
-	q->thread = t;
+// writer only
+static inline void tid_slot_set(struct tid_slot *slot, uint64_t tid, struct nk_thread *t)
+{
+    slot->tid = TID_CLAIMED;
+    __sync_synchronize();
+    slot->thread = t;
+    __sync_synchronize();
+    slot->tid = tid;
+}
+
+static int tid_table_insert(struct nk_thread *t)
+{
+    TID_LOCK_CONF;
+    uint64_t i, h = tid_hash(t->tid);
+
+    TID_LOCK();
+    for (i=0;i<TID_TABLE_SIZE;i++) {
+	struct tid_slot *slot = tid_slot_at(h+i);
+	if (slot->tid==TID_EMPTY) {
+	    tid_slot_set(slot,t->tid,t);
+	    TID_UNLOCK();
+	    return 0;
+	}
     }
+    TID_UNLOCK();
+    return -1;
 }
 
+// returns the thread with this tid, or null
+static struct nk_thread *tid_table_find(uint64_t tid)
+{
+    uint64_t i, seq, h = tid_hash(tid);
+
+    do {
+	seq = global_sched_state.tid_seq;
+	__sync_synchronize();
+	for (i=0;i<TID_TABLE_SIZE;i++) {
+	    struct tid_slot *slot = tid_slot_at(h+i);
+	    uint64_t cur = slot->tid;
+	    if (cur==tid) {
+		struct nk_thread *t = slot->thread;
+		__sync_synchronize();
+		// the slot may have been rewritten under us
+		if (slot->tid==tid) {
+		    return t;
+		}
+		break;
+	    }
+	    if (cur==TID_EMPTY) {
+		break;
+	    }
+	}
+	__sync_synchronize();
+    } while ((seq & 1) || seq!=global_sched_state.tid_seq);
+
+    return 0;
+}
+
+static void tid_table_remove(struct nk_thread *t)
+{
+    TID_LOCK_CONF;
+    uint64_t i, j, k, h = tid_hash(t->tid);
+    struct tid_slot *slot = 0;
+
+    TID_LOCK();
+
+    for (i=h;i<h+TID_TABLE_SIZE;i++) {
+	slot = tid_slot_at(i);
+	if (slot->tid==t->tid || slot->tid==TID_EMPTY) {
+	    break;
+	}
+    }
+
+    if (!slot || slot->tid!=t->tid || slot->thread!=t) {
+	TID_UNLOCK();
+	return;
+    }
+
+    __sync_fetch_and_add(&global_sched_state.tid_seq,1);
+
+    // pull back each following entry whose home is not after the hole
+    for (j=i+1;j<i+TID_TABLE_SIZE;j++) {
+	struct tid_slot *next = tid_slot_at(j);
+	if (next->tid==TID_EMPTY) {
+	    break;
+	}
+	// distances are taken mod the table size, which need not be a
+	// power of two, so keep both operands reduced and non-negative
+	k = tid_hash(next->tid);
+	if ((j % TID_TABLE_SIZE + TID_TABLE_SIZE - k) % TID_TABLE_SIZE >= j - i) {
+	    tid_slot_set(tid_slot_at(i),next->tid,next->thread);
+	    i = j;
+	}
+    }
+
+    slot = tid_slot_at(i);
+    slot->tid = TID_CLAIMED;
+    __sync_synchronize();
+    slot->thread = 0;
+    __sync_synchronize();
+    slot->tid = TID_EMPTY;
+
+    __sync_fetch_and_add(&global_sched_state.tid_seq,1);
+
+    TID_UNLOCK();
+}
 
 struct nk_thread *nk_find_thread_by_tid(uint64_t tid)
 {
-    GLOBAL_LOCK_CONF;
-    struct thread_query q;
-    
-    q.tid=tid;
-    q.thread=0;
+    if (tid==TID_EMPTY || tid==TID_CLAIMED) {
+	return 0;
+    }
+
+    return tid_table_find(tid);
+}
 
-    GLOBAL_LOCK();
+// move an exiting thread to its shard's exited list
+static void shard_thread_exit(rt_thread *r)
+{
+    SHARD_LOCK_CONF;
+    struct nk_sched_thread_shard *sh = get_shard(r->shard);
 
-    rt_list_map(global_sched_state.thread_list,find_thread,(void*)&q);
+    SHARD_LOCK(sh);
+    if (!r->exited) {
+	list_move_tail(&r->shard_node,&sh->exited);
+	r->exited = 1;
+	sh->num_exited++;
+    }
+    SHARD_UNLOCK(sh);
+}
 
-    GLOBAL_UNLOCK();
+//
+// Reap one shard in batches of at most REAP_BATCH threads, so
+// that the shard lock is never held for a walk of more than one
+// batch worth of reapable threads.   Only the exited list is 
+// examined.   Returns the number of threads reaped.
+//
+// wait => if another core is reaping this shard, wait for it to finish
+//
+static uint64_t reap_shard(int cpu, int wait)
+{
+    SHARD_LOCK_CONF;
+    struct nk_sched_thread_shard *sh = get_shard(cpu);
+    uint64_t count, total=0, i;
+    rt_thread *r;
 
-    return q.thread;
+    if (!__sync_bool_compare_and_swap(&sh->reaping,0,1)) {
+	// reaping pass is already in progress elsewhere
+	// our caller will also see the benefit of that pass
+	if (wait) {
+	    DEBUG("reap of shard %d waiting on previous reap to complete\n", cpu);
+	    while (__sync_fetch_and_or(&sh->reaping,0)) {
+		// wait for the reaping pass to finish
+	    }
+	}
+	return 0;
+    }
+
+    do {
+	count = 0;
+
+	// We need to do this in two phases since
+	// destroy thread also needs the shard lock
+	// first phase, collect
+	SHARD_LOCK(sh);
+	list_for_each_entry(r,&sh->exited,shard_node) {
+	    if (count>=REAP_BATCH) {
+		break;
+	    }
+	    if (thread_is_reapable(r)) {
+		DEBUG("Reaping tid %llu (%s)\n",r->thread->tid,r->thread->name);
+		sh->reap_pool[count++] = r;
+	    }
+	}
+	SHARD_UNLOCK(sh);
+
+	// Now reap
+	// We are still holding sh->reaping, so
+	// we must have exclusive access to the reap_pool built
+	// in the previous step
+	// reverse order to potentially improve frees
+	for (i=count;i>0;i--) {
+	    DEBUG("Reaping thread %lu\n", sh->reap_pool[i-1]->thread->tid);
+	    // thread destruction calls back to pre_destroy, which
+	    // will acquire the shard lock when it removes the thread from
+	    // the shard's exited list
+	    nk_thread_destroy(sh->reap_pool[i-1]->thread);
+	}
+
+	total += count;
+
+    } while (count==REAP_BATCH);
+
+    sh->num_reaped += total;
+
+    // done with reaping - another core can now go
+    __sync_fetch_and_and(&sh->reaping,0);
+
+    return total;
+}
+
+void nk_sched_reap_cpu(int cpu, int uncond)
+{
+    struct sys_info *sys = per_cpu_get(system);
+
+    if (in_interrupt_context()) {
+	DEBUG("Ignoring %sconditional reap of cpu %d while in interrupt context\n", uncond ? "un" : "", cpu);
+	return;
+    }
+
+    if (cpu<0 || cpu>=sys->num_cpus || !sys->cpus[cpu]->sched_state) {
+	return;
+    }
+
+    if (!uncond && !get_shard(cpu)->num_exited) {
+	return;
+    }
+
+    DEBUG("Reaped %lu threads from shard %d\n", reap_shard(cpu,uncond), cpu);
 }
 
 void nk_sched_reap(int uncond)
 {
+    struct sys_info *sys = per_cpu_get(system);
+    int cpu, me = my_cpu_id();
+
     DEBUG("Executing Reap (%s)\n", uncond? "UNCOND": "cond");
-    
-    GLOBAL_LOCK_CONF;
-    uint64_t i;
 
     if (in_interrupt_context()) {
 	// never reap in interrupt context, even unconditionally
@@ -1016,118 +1338,107 @@ void nk_sched_reap(int uncond)
 	return;
     }
 
-    if (!__sync_bool_compare_and_swap(&global_sched_state.reaping,0,1)) {
-	// reaping pass is already in progress elsewhere
-	// we will wait for it to  inish.  In this way, our caller
-	// will also see the benefit of that pass
-	DEBUG("%sconditional reap waiting on previous reap to complete\n", uncond ? "un" : "");
-	while (__sync_fetch_and_or(&global_sched_state.reaping,0)) {
-	    // wait for the reapping pass to finish
+    DEBUG("Reap begins (%lu threads)\n", global_sched_state.num_threads);
+
+    // start with our own shard, which is the one most likely to be cache-hot
+    for (cpu=0;cpu<sys->num_cpus;cpu++) {
+	int which = (me + cpu) % sys->num_cpus;
+	if (sys->cpus[which]->sched_state) {
+	    reap_shard(which,1);
 	}
-	DEBUG("%sconditional reap - previous reap now complete, ignoring this reap\n", uncond ? "un" : "");
-	return;
     }
 
-    DEBUG("Reap begins (%lu threads)\n", global_sched_state.num_threads);
+    DEBUG("%sconditional reap ends (%lu threads)\n", uncond ? "un" : "", global_sched_state.num_threads);
+}
 
-    GLOBAL_LOCK();
+// search a shard's exited list for a matching thread and remove it
+// must be called with sh->reaping held
+static rt_thread *reanimate_from_shard(struct nk_sched_thread_shard *sh,
+				       nk_stack_size_t min_stack_size,
+				       int placement_cpu)
+{
+    SHARD_LOCK_CONF;
+    rt_thread *cur, *rt = 0;
+
+    SHARD_LOCK(sh);
 
-    reap_count = 0;
+    // start search from the oldest exited thread
+    list_for_each_entry(cur,&sh->exited,shard_node) {
+	if (thread_is_reapable(cur) &&
+	    cur->thread->stack_size >= min_stack_size &&
+	    (placement_cpu<0 || cur->thread->placement_cpu==placement_cpu)) {
+	    rt = cur;
+	    break;
+	}
+    }
 
-    // We need to do this in two phases since
-    // destroy thread also needs the global lock
-    // first phase, collect
-    rt_list_map(global_sched_state.thread_list,pre_reap_thread,0);
+    if (rt) {
+	list_del_init(&rt->shard_node);
+	rt->exited = 0;
+	sh->num_exited--;
+	sh->num_threads--;
+	sh->num_reanimated++;
+    }
 
-    GLOBAL_UNLOCK();
+    SHARD_UNLOCK(sh);
 
-    // Now reap
-    // We are still holding global_sched_state.reaping, so
-    // we must have exclusive access to the reap_pool built
-    // in the previous step
-    if (reap_count!=0) { 
-	// reverse order to potentially improve frees
-	for (i=reap_count;i>0;i--) { 
-	    DEBUG("Reaping thread %lu\n", reap_pool[i-1]->thread->tid);
-	    // thread destruction calls back to pre_destory, which
-	    // will acquire the global lock when it removes the thread from
-	    // the global thread list, hence we do not need to hold
-	    // global lock here.
-	    nk_thread_destroy(reap_pool[i-1]->thread);
-	}
+    if (rt) {
+	tid_table_remove(rt->thread);
+	__sync_fetch_and_sub(&global_sched_state.num_threads,1);
     }
 
-    DEBUG("%sconditional reap ends (%lu threads)\n", uncond ? "un" : "", global_sched_state.num_threads);
-    
-    // done with reaping - another core can now go
-    __sync_fetch_and_and(&global_sched_state.reaping,0);
+    return rt;
 }
 
 //
-// The current implementation is essentially a specialized reaping pass,
-// looking in reverse order on the logic that recent threads will be similar
-// to the requested thread
-//
-// Eventually, we will move threads to separate per-cpu queues and perhaps
-// do a smarter search for ones with the required constraints
-//
+// Reanimation is a specialized reaping pass over exited threads.  We
+// look first in our own shard, waiting for it if needed, and then
+// opportunistically in other shards, skipping any that are busy.
 //
 struct nk_thread *nk_sched_reanimate(nk_stack_size_t min_stack_size,
 				     int             placement_cpu)
 {
+    struct sys_info *sys = per_cpu_get(system);
+    int cpu, me = my_cpu_id();
+    rt_thread *rt = 0;
+
     DEBUG("Reanimation request for a thread of stack minimum size %lu for CPU %d\n",
 	 min_stack_size, placement_cpu);
     
-    GLOBAL_LOCK_CONF;
-
     if (in_interrupt_context()) {
 	DEBUG("Reanimation request while in interrupt context ignored\n");
 	return 0;
     }
 
-    // We are currently overloaded with reaping, so we will wait until
-    // we are the sole "reaper"
-    while (!__sync_bool_compare_and_swap(&global_sched_state.reaping,0,1)) {
-    }
-    DEBUG("Reanimation search begins (%lu threads)\n", global_sched_state.num_threads);
+    for (cpu=0;cpu<sys->num_cpus && !rt;cpu++) {
+	int which = (me + cpu) % sys->num_cpus;
+	struct nk_sched_thread_shard *sh;
 
-    GLOBAL_LOCK();
+	if (!sys->cpus[which]->sched_state) {
+	    continue;
+	}
 
-    // start search from the oldest thread
-    rt_node *cur = global_sched_state.thread_list->head;
+	sh = get_shard(which);
 
-    uint64_t count = 0;
-    
-    while (cur &&
-	   !(cur->thread->status == REAPABLE &&
-	     cur->thread->thread->status==NK_THR_EXITED &&
-	     !cur->thread->thread->refcount &&
-	     cur->thread->thread->stack_size >= min_stack_size &&
-	     (placement_cpu<0 || cur->thread->thread->placement_cpu==placement_cpu))) {
-	
-	//DEBUG("Skipping thread %p (%lu) \"%s\"\n", cur->thread->thread, cur->thread->thread->tid,
-	//      cur->thread->thread->is_idle ? "*idle*" ::q!
-	//      cur->thread->thread->name[0] ? cur->thread->thread->name : "(no name)");
-	cur=cur->next;
-	count++;
-    }
-    
-    
-    rt_thread *rt = 0;
-    
-    
-    if (cur) {
-	rt = rt_list_remove(global_sched_state.thread_list, cur);
-	global_sched_state.num_threads--;
-	DEBUG("Examined %lu threads before finding a matching one\n", count+1); 
-    } else {
-	DEBUG("Examined %lu threads without finding a matching one\n", count);
-    }
-    
-    GLOBAL_UNLOCK();
+	if (!sh->num_exited) {
+	    continue;
+	}
 
-    // done with "reaping" - another core can now go
-    __sync_fetch_and_and(&global_sched_state.reaping,0);
+	if (which==me) {
+	    // We are currently overloaded with reaping, so we will wait until
+	    // we are the sole "reaper"
+	    while (!__sync_bool_compare_and_swap(&sh->reaping,0,1)) {
+	    }
+	} else if (!__sync_bool_compare_and_swap(&sh->reaping,0,1)) {
+	    // not worth waiting for someone else's shard
+	    continue;
+	}
+
+	rt = reanimate_from_shard(sh,min_stack_size,placement_cpu);
+
+	// done with "reaping" - another core can now go
+	__sync_fetch_and_and(&sh->reaping,0);
+    }
     
     if (rt) {
 	DEBUG("Reanimation successful - returning thread %p (sched state %p name \"%s\")\n", rt->thread, rt, rt->thread->name);
@@ -1184,6 +1495,10 @@ struct nk_sched_thread_state *nk_sched_thread_state_init(struct nk_thread *threa
 
     ZERO(t);
 
+    INIT_LIST_HEAD(&t->shard_node);
+    INIT_LIST_HEAD(&t->q_node);
+    INIT_LIST_HEAD(&t->sp_node);
+
     if (!constraints) { 
 	constraints = &default_constraints;
     }
@@ -1210,61 +1525,157 @@ struct nk_sched_thread_state *nk_sched_thread_state_init(struct nk_thread *threa
     return t;
 }
 
+static cpu_level cpu_distance(int a, int b)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    struct cpu *ca = sys->cpus[a];
+    struct cpu *cb = sys->cpus[b];
+
+    if (a==b) {
+	return LEVEL_SMT;
+    }
+
+    if (ca->coord && cb->coord) {
+	if (nk_topo_cpus_share_phys_core(ca,cb)) {
+	    return LEVEL_SMT;
+	}
+	if (nk_topo_cpus_share_socket(ca,cb)) {
+	    return LEVEL_SOCKET;
+	}
+    }
+
+    if (ca->domain && cb->domain && ca->domain->id==cb->domain->id) {
+	return LEVEL_SOCKET;
+    }
+
+    return LEVEL_REMOTE;
+}
+
+// assumes the local lock is held
+static inline void update_load(rt_scheduler *s, uint64_t now)
+{
+    uint64_t sample;
+
+    if ((now - s->load_sample_time) < LOAD_SAMPLE_NS) {
+	return;
+    }
+
+    // the idle thread stands in for the current thread
+    sample = (SIZE_APERIODIC(s) + s->runnable.size) << LOAD_SHIFT;
+
+    s->load = s->load - (s->load >> LOAD_EWMA_SHIFT) + (sample >> LOAD_EWMA_SHIFT);
+    s->load_sample_time = now;
+}
+
+// lockless - the average lags, so a sudden increase in
+// queue length is also taken into account
+static inline uint64_t cpu_load(rt_scheduler *s)
+{
+    uint64_t inst = ((uint64_t)SIZE_APERIODIC(s) + s->runnable.size) << LOAD_SHIFT;
+    uint64_t avg = *(volatile uint64_t *)&s->load;
+
+    return MAX(avg,inst);
+}
+
+//
+// Place a new thread near its creator (the current cpu), moving 
+// to a more distant cpu only if it is lighter by a full thread
+//
 int nk_sched_initial_placement()
 {
     struct sys_info * sys = per_cpu_get(system);
-    return (int)(get_random() % sys->num_cpus);
+    int me = my_cpu_id();
+    int start = (int)(get_random() % sys->num_cpus);
+    int best = -1;
+    uint64_t best_load = -1ULL;
+    cpu_level level;
+    int i, cpu;
+
+    for (level=LEVEL_SMT; level<NUM_LEVELS; level++) {
+	int lbest = -1;
+	uint64_t lbest_load = -1ULL;
+	
+	// random start so that ties are spread out
+	for (i=0;i<sys->num_cpus;i++) {
+	    cpu = (start + i) % sys->num_cpus;
+	    if (!sys->cpus[cpu]->sched_state || cpu_distance(me,cpu)!=level) {
+		continue;
+	    }
+	    uint64_t l = cpu_load(sys->cpus[cpu]->sched_state);
+	    if (l < lbest_load) {
+		lbest = cpu;
+		lbest_load = l;
+	    }
+	}
+
+	if (lbest>=0 && (best<0 || lbest_load + LOAD_IMBALANCE <= best_load)) {
+	    best = lbest;
+	    best_load = lbest_load;
+	}
+
+	// nearby and not even one thread's worth of load - stop looking
+	if (best>=0 && best_load < LOAD_ONE) {
+	    break;
+	}
+    }
+
+    if (best<0) {
+	// no schedulers yet
+	return (int)(get_random() % sys->num_cpus);
+    }
+
+    __sync_fetch_and_add(&sys->cpus[best]->sched_state->num_placements,1);
+
+    return best;
 }
 
 int nk_sched_thread_post_create(nk_thread_t * t)
 {
-    GLOBAL_LOCK_CONF;
+    SHARD_LOCK_CONF;
+    struct nk_sched_thread_shard *sh;
 
     nk_sched_reap(0); // conditional reap to make room for new thread
 
     // the caller is expected to have already set current_cpu!
 
-    // we allocate the new thread node here because a malloc inside
-    // of the global list enqueue could itself trigger a reap
-    // in which case we would deadlock, since reaping also acquires the
-    // global scheduler lock
+    // the shard list link is embedded in the thread's scheduler
+    // state, so nothing here allocates, and thus no reap can
+    // be triggered while we hold the shard lock
 
-    rt_node *n = rt_node_init(t->sched_state); 
-    
-    DEBUG("create: node %p for thread %p (%lu)\n",n,t->sched_state,t->sched_state->thread->tid);
-    
-    if (!n) {
-    	ERROR("Failed to allocate rt_node in post create\n");
-    	return 0;
-    }
-    
-    // now we can safely acquire the lock and put the new thread
-    // on the global thread list
-    
-    GLOBAL_LOCK();
-
-    if (global_sched_state.num_threads >= MAX_QUEUE) {
+    // the thread limit is enforced on the global count, which
+    // we maintain atomically so creations on different cpus
+    // do not serialize
+    if (__sync_fetch_and_add(&global_sched_state.num_threads,1) >= MAX_QUEUE) {
+	__sync_fetch_and_sub(&global_sched_state.num_threads,1);
 	DEBUG("Scheduler vetos thread creation as there are %lu active threads in system\n", global_sched_state.num_threads);
 	DEBUG("You can increase the maximum of %lu active threads using NAUT_CONFIG_MAX_THREADS\n", NAUT_CONFIG_MAX_THREADS);
-	GLOBAL_UNLOCK();
-	rt_node_deinit(n);
 	return -1;
     }
-    
-    // this enqueue avoids any malloc and thus no reap should be
-    // triggered by it
-    if (_rt_list_enqueue(global_sched_state.thread_list, t->sched_state, n)) {
-	ERROR("Failed to add new thread to global thread list\n");
-	GLOBAL_UNLOCK();
+
+    if (tid_table_insert(t)) {
+	ERROR("Failed to add new thread to tid table\n");
+	__sync_fetch_and_sub(&global_sched_state.num_threads,1);
 	return -1;
     }
-    global_sched_state.num_threads++;
+    
+    // now we can safely acquire the lock and put the new thread
+    // on our shard's thread list
+    
+    t->sched_state->shard = my_cpu_id();
+    t->sched_state->exited = 0;
+
+    sh = get_shard(t->sched_state->shard);
+
+    SHARD_LOCK(sh);
+
+    list_add_tail(&t->sched_state->shard_node,&sh->threads);
+    sh->num_threads++;
+
+    SHARD_UNLOCK(sh);
 
     DEBUG("Post Create of thread %p (%d) [numthreads=%d]\n",
 	  t, t->tid, global_sched_state.num_threads);
     
-    GLOBAL_UNLOCK();
-
     return 0;
 }
 
@@ -1272,20 +1683,29 @@ int nk_sched_thread_post_create(nk_thread_t * t)
 
 int nk_sched_thread_pre_destroy(nk_thread_t * t)
 {
-    rt_thread *r;
-    GLOBAL_LOCK_CONF;
+    SHARD_LOCK_CONF;
+    rt_thread *r = t->sched_state;
+    struct nk_sched_thread_shard *sh = get_shard(r->shard);
+
+    tid_table_remove(t);
     
-    GLOBAL_LOCK();
+    SHARD_LOCK(sh);
 
-    if (!(r=rt_list_remove(global_sched_state.thread_list,t->sched_state->list))) {
-	ERROR("Failed to remove thread from global list....\n");
-	GLOBAL_UNLOCK();
+    if (list_empty(&r->shard_node)) {
+	ERROR("Failed to remove thread from shard list....\n");
+	SHARD_UNLOCK(sh);
 	return -1;
     }
 
-    global_sched_state.num_threads--;
+    list_del_init(&r->shard_node);
+    if (r->exited) {
+	sh->num_exited--;
+    }
+    sh->num_threads--;
     
-    GLOBAL_UNLOCK();
+    SHARD_UNLOCK(sh);
+
+    __sync_fetch_and_sub(&global_sched_state.num_threads,1);
     
     return 0;
 }
@@ -1302,7 +1722,7 @@ static inline rt_thread *round_robin_get_next_aperiodic(rt_scheduler *s)
     rt_thread *r = rt_queue_dequeue(&s->aperiodic);
 
     // skip idle thread if possible
-    if (r->thread->is_idle && s->aperiodic.size>=1) {
+    if (r && r->thread->is_idle && s->aperiodic.size>=1) {
 	rt_queue_enqueue(&s->aperiodic,r); 
 	r = rt_queue_dequeue(&s->aperiodic);
     }
@@ -1345,8 +1765,6 @@ static inline rt_thread *lottery_get_next_aperiodic(rt_scheduler *s)
 {
     // this is the dumb, obvious algorithm (linear in # threads in queue)
     rt_thread *t=NULL;
-    uint64_t cur;
-    uint64_t pos;
     rt_queue *q=&s->aperiodic;
     uint64_t target_prob;
     uint64_t cum_prob;
@@ -1356,61 +1774,35 @@ static inline rt_thread *lottery_get_next_aperiodic(rt_scheduler *s)
 
     target_prob = get_random() % s->total_prob;
 
-    for (cur=0, cum_prob=0;
-	 cur<q->size;
-	 cur++) {
-	pos = (q->tail + cur) % MAX_QUEUE;
-	cum_prob += q->threads[pos]->constraints.aperiodic.priority;
+    cum_prob = 0;
+    list_for_each_entry(t,&q->threads,q_node) {
+	cum_prob += t->constraints.aperiodic.priority;
 	if (cum_prob>=target_prob) {
-	    // don't pick the idle thread if it can be avoided
-	    if (q->threads[pos]->thread->is_idle && q->size>1) { 
-		// there is at least one other thread
-		if (cur<(q->size-1)) {
-		    // pick the very next one if possible
-		    cur++;
-		} else {
-		    // pick the previous one if not
-		    // cur must be >0
-		    cur--;
-		}
-		// update position
-		pos = (q->tail + cur) % MAX_QUEUE;
-	    }
 	    break;
 	}
     }
 
-    if (cur==q->size) { 
+    if (&t->q_node == &q->threads) { 
 	panic("Cannot find thread in lottery scheduler\n");
 	return 0;
     }
 
-    // grab the thread we will return
-    t = q->threads[pos];
-
-
-    // cur => position within the queue (0=oldest, ...)
-    // pos => position within the array
-    // We now need to "copy down" everything above this position
-
-    uint64_t i, p, n;
-    for (i=cur;
-	 i<(q->size-1);
-	 i++) {
-	
-	p = (q->tail + i) % MAX_QUEUE;
-	n = (q->tail + i + 1 ) % MAX_QUEUE;
-	q->threads[p] = q->threads[n];
+    // don't pick the idle thread if it can be avoided
+    if (t->thread->is_idle && q->size>1) { 
+	// there is at least one other thread
+	if (t->q_node.next != &q->threads) {
+	    // pick the very next one if possible
+	    t = list_entry(t->q_node.next,rt_thread,q_node);
+	} else {
+	    // pick the previous one if not
+	    t = list_entry(t->q_node.prev,rt_thread,q_node);
+	}
     }
 
-    // decrement head
-    q->head = (q->head + MAX_QUEUE - 1) % MAX_QUEUE;
-    
-    q->size--;
+    rt_queue_remove(q,t);
 
     s->total_prob -= t->constraints.aperiodic.priority;
 
-
     return t;
 }
 
@@ -1434,265 +1826,96 @@ static int    _sched_make_runnable(struct nk_thread *thread, int cpu, int admit,
     rt_thread *t = thread->sched_state;
     rt_scheduler *s;
 
-    if (unlikely(cpu <= CPU_ANY || 
-        cpu >= sys->num_cpus)) {
-        s = per_cpu_get(sched_state);
-    } else {
-        s = sys->cpus[cpu]->sched_state;
-    }
-
-    if (!s) {
-	return -1;
-    }
-
-    if (!have_lock) {
-	LOCAL_LOCK(s);
-    }
-
-    if (admit) {
-	if (rt_thread_admit(s,t,cur_time())) { 
-	    DEBUG("Failed to admit thread\n");
-	    goto out_bad;
-	} else {
-	    DEBUG("Admitted thread %p (tid=%d)\n",thread,thread->tid);
-	}
-    }
-
-    // Admission will have reset the thread state and stats
-
-    switch (t->constraints.type) {
-    case APERIODIC:
-	if (PUT_APERIODIC(s,t)) { 
-	    ERROR("Failed to make non-RT thread runnable (%llu)\n",s->aperiodic.size);
-	    //	    ERROR("queue has %llu entries\n", s->aperiodic->size);
-	    goto out_bad;
-	} else {
-	    thread->status = NK_THR_SUSPENDED;
-	    thread->sched_state->status = ADMITTED;	    
-
-	    DUMP_APERIODIC(s, "aperiodic after make runnable");
-	    goto out_good;
-	}
-	break;
-    case SPORADIC:
-    case PERIODIC:
-	if (PUT_RT_PENDING(s,t)) {
-	    ERROR("Failed to make RT thread pending\n");
-	    goto out_bad;
-	} else {
-	    thread->status = NK_THR_SUSPENDED;
-	    thread->sched_state->status = ADMITTED;
-	    DUMP_RT_PENDING(s, "pending after make runnable");
-	    goto out_good;
-	}
-	break;
-    }
-
- out_bad:
-    if (!have_lock) {
-	LOCAL_UNLOCK(s);
-    }
-    return -1;
- out_good:
-    if (!have_lock) { 
-	LOCAL_UNLOCK(s);
-    }
-    return 0;
-}
-
-int nk_sched_make_runnable(struct nk_thread *thread, int cpu, int admit)
-{
-    return _sched_make_runnable(thread,cpu,admit,0);
-}
-
-
-void nk_sched_exit(spinlock_t *lock_to_release)
-{
-    handle_special_switch(EXITING,0,0,lock_to_release ? (void (*)(void*))spin_unlock : 0 ,(void*)lock_to_release);
-    // we should not come back!
-    panic("Returned to finished thread!\n");
-}
-
-
-static rt_list* rt_list_init() 
-{
-    rt_list *list = (rt_list *)MALLOC(sizeof(rt_list));
-    if (list) { 
-	list->head = NULL;
-	list->tail = NULL;
-    }
-    return list;
-}
-
-static void rt_list_deinit(rt_list *l) 
-{
-    rt_node *cur = l->head;
-    rt_node *next = l->head;
-
-    while (cur) { 
-	next = cur->next;
-	rt_node_deinit(cur);
-	cur = next;
-    }
-    FREE(l);
-}
-
-
- 
-// node setup without allocation
-static void _rt_node_init(rt_node *node, rt_thread *t)
-{
-    ASSERT(t);
-    node->thread = t;
-    node->next = NULL;
-    node->prev = NULL;
-}
-
-// node setup with allocation
-static rt_node* rt_node_init(rt_thread *t) 
-{
-    rt_node *node = (rt_node *)MALLOC_SPECIFIC(sizeof(rt_node),t->thread->current_cpu);
-    if (node) { 
-	_rt_node_init(node,t);
-    }
-    return node;
-}
-
-static void rt_node_deinit(rt_node *n)
-{
-    n->next = SCHEDULER_POISON;
-    n->prev = SCHEDULER_POISON;
-    n->thread = SCHEDULER_POISON;
-    FREE(n);
-}
-
-static int rt_list_empty(rt_list *l) 
-{
-    return (l->head == NULL);
-}
-
-// insert with pre-allocated node structure
-// no memory allocation
-static int _rt_list_enqueue(rt_list *l, rt_thread *t, rt_node *newnode)
-{
-    if (l == NULL) {
-        ERROR("RT_LIST IS UNINITIALIZED.\n");
-        return -1;
-    }
-
-    _rt_node_init(newnode,t);
-
-    if (l->head == NULL) {
-        l->head = newnode;
-	l->tail = l->head;
-	t->list = l->head;
-	return 0;
-    }
-
-    rt_node *n = l->tail;
-
-    l->tail = newnode;
-    l->tail->prev = n;
-    n->next = l->tail;
-    t->list = l->tail;
-
-    return 0;
-}
-
-
-static int rt_list_enqueue(rt_list *l, rt_thread *t)
-{
-    rt_node *n = rt_node_init(t);
-    
-    if (!n) {
-	ERROR("Failed to allocate node for rt list enqueue\n");
-	return -1;
+    if (unlikely(cpu <= CPU_ANY || 
+        cpu >= sys->num_cpus)) {
+        s = per_cpu_get(sched_state);
     } else {
-	return _rt_list_enqueue(l,t,n);
+        s = sys->cpus[cpu]->sched_state;
     }
-}
 
+    if (!s) {
+	return -1;
+    }
 
-static rt_thread* rt_list_dequeue(rt_list *l) 
-{
-    if (l == NULL) {
-        ERROR("RT_LIST IS UNINITIALIZED.\n");
-        return NULL;
+    if (!have_lock) {
+	LOCAL_LOCK(s);
     }
 
-    if (l->head == NULL) {
-        return NULL;
+    if (admit) {
+	if (rt_thread_admit(s,t,cur_time())) { 
+	    DEBUG("Failed to admit thread\n");
+	    goto out_bad;
+	} else {
+	    DEBUG("Admitted thread %p (tid=%d)\n",thread,thread->tid);
+	}
     }
 
-    rt_node *n = l->head;
-    rt_thread *t= n->thread;
+    // Admission will have reset the thread state and stats
 
-    l->head = n->next;
-    l->head->prev = NULL;
-    n->next = NULL;
-    n->prev = NULL;
-    rt_node_deinit(n);
-    t->list = SCHEDULER_POISON;
-    return t;
-}
+    switch (t->constraints.type) {
+    case APERIODIC:
+	if (PUT_APERIODIC(s,t)) { 
+	    ERROR("Failed to make non-RT thread runnable (%llu)\n",s->aperiodic.size);
+	    //	    ERROR("queue has %llu entries\n", s->aperiodic->size);
+	    goto out_bad;
+	} else {
+	    thread->status = NK_THR_SUSPENDED;
+	    thread->sched_state->status = ADMITTED;	    
 
-static void rt_list_map(rt_list *l, void (func)(rt_thread *t, void *priv), void *priv)  
-{
-    ASSERT(l);
-    rt_node *n = l->head;
-    while (n != NULL) {
-	//DEBUG("scan: node %p for thread %p\n",n, n->thread);
-	//DEBUG("      (%lu)\n", n->thread->thread->tid);
-	func(n->thread,priv);
-        n = n->next;
+	    DUMP_APERIODIC(s, "aperiodic after make runnable");
+	    goto out_good;
+	}
+	break;
+    case SPORADIC:
+    case PERIODIC:
+	if (PUT_RT_PENDING(s,t)) {
+	    ERROR("Failed to make RT thread pending\n");
+	    goto out_bad;
+	} else {
+	    thread->status = NK_THR_SUSPENDED;
+	    thread->sched_state->status = ADMITTED;
+	    DUMP_RT_PENDING(s, "pending after make runnable");
+	    goto out_good;
+	}
+	break;
     }
-}
 
-static rt_thread* rt_list_remove(rt_list *l, rt_node *n) 
-{
-    rt_node *tmp = n->next;
-    rt_thread *f;
-
-    if (n->next != NULL) {
-	n->next->prev = n->prev;
-    } else {
-	l->tail = n->prev;
+ out_bad:
+    if (!have_lock) {
+	LOCAL_UNLOCK(s);
     }
-    if (n->prev != NULL) {
-	n->prev->next = tmp;
-    } else {
-	l->head = tmp;
+    return -1;
+ out_good:
+    if (!have_lock) { 
+	LOCAL_UNLOCK(s);
     }
-    n->next = NULL;
-    n->prev = NULL;
-    f = n->thread;
-    rt_node_deinit(n);
-    return f;
+    return 0;
 }
 
-
-static rt_thread* rt_list_remove_search(rt_list *l, rt_thread *t) 
+int nk_sched_make_runnable(struct nk_thread *thread, int cpu, int admit)
 {
-    rt_node *n = l->head;
-    while (n != NULL) {
-        if (n->thread == t) {
-	    return rt_list_remove(l,n);
-        }
-        n = n->next;
-    }
-    return NULL;
+    return _sched_make_runnable(thread,cpu,admit,0);
 }
 
 
+void nk_sched_exit(spinlock_t *lock_to_release)
+{
+    // from here on, only the reaper or reanimation should find us
+    shard_thread_exit(get_cur_thread()->sched_state);
+    handle_special_switch(EXITING,0,0,lock_to_release ? (void (*)(void*))spin_unlock : 0 ,(void*)lock_to_release);
+    // we should not come back!
+    panic("Returned to finished thread!\n");
+}
 
 
 static int        rt_queue_enqueue(rt_queue *queue, rt_thread *thread)
 {
-    if (queue->size==MAX_QUEUE) {
+    if (thread->queue) {
+	ERROR("Thread %lu is already on a queue\n", thread->thread->tid);
 	return -1;
     } else {
-	queue->threads[queue->head] = thread;
-	queue->head = (queue->head + 1 ) % MAX_QUEUE;
+	list_add_tail(&thread->q_node,&queue->threads);
+	thread->queue = queue;
 	queue->size++;
 	return 0;
     }
@@ -1700,60 +1923,29 @@ static int        rt_queue_enqueue(rt_queue *queue, rt_thread *thread)
 	
 static rt_thread* rt_queue_dequeue(rt_queue *queue)
 {
-    if (queue->size==0) { 
-	return 0;
-    } else {
-	rt_thread *r = queue->threads[queue->tail];
-	queue->tail = (queue->tail+1) % MAX_QUEUE;
+    rt_thread *r = list_first_entry(&queue->threads,rt_thread,q_node);
+
+    if (r) { 
+	list_del_init(&r->q_node);
+	r->queue = 0;
 	queue->size--;
-	return r;
     }
+    return r;
 }
 
 static rt_thread* rt_queue_remove(rt_queue *queue, rt_thread *thread)
 {
-    if (queue->size==0) { 
+    if (thread->queue != queue) { 
+	// not found
 	return 0;
     } else {
-	uint64_t now, cur, next;
-
-	for (now=0;now<queue->size;now++) { 
-	    cur = (queue->tail + now) % MAX_QUEUE;
-	    if (queue->threads[cur] == thread) { 
-		break;
-	    }
-	}
-
-	if (now==queue->size) {
-	    // not found
-	    return 0;
-	}
-
-	// copy down
-	for (;now<queue->size-1;now++) {
-	    cur = (queue->tail + now) % MAX_QUEUE;
-	    next = (queue->tail + now + 1) % MAX_QUEUE;
-	    queue->threads[cur] = queue->threads[next];
-	}
-	
-	// decrement head
-	queue->head = (queue->head + MAX_QUEUE - 1) % MAX_QUEUE;
-    
+	list_del_init(&thread->q_node);
+	thread->queue = 0;
 	queue->size--;
-	
 	return thread;
     }
 }
 
-static rt_thread *rt_queue_peek(rt_queue *queue, uint64_t pos)
-{
-    if (pos>=queue->size) { 
-	return 0;
-    } else {
-	return queue->threads[(queue->tail+pos)%MAX_QUEUE];
-    }
-}
-
 static int        rt_queue_empty(rt_queue *queue)
 {
     return queue->size==0;
@@ -1761,14 +1953,12 @@ static int        rt_queue_empty(rt_queue *queue)
 
 static void rt_queue_dump(rt_queue *queue, char *pre)
 {
-    int now;
-    int cur;
+    rt_thread *t;
     DEBUG("======%s==BEGIN=====\n",pre);
-    for (now=0;now<queue->size;now++) { 
-	cur = (queue->tail + now) % MAX_QUEUE;
-	DEBUG("   %llu %s (%llu)\n",queue->threads[cur]->thread->tid,
-	      queue->threads[cur]->thread->is_idle ? "*idle*" : 
-	      queue->threads[cur]->thread->name[0] ? queue->threads[cur]->thread->name : "(no name)" ,queue->threads[cur]->deadline);
+    list_for_each_entry(t,&queue->threads,q_node) {
+	DEBUG("   %llu %s (%llu)\n",t->thread->tid,
+	      t->thread->is_idle ? "*idle*" : 
+	      t->thread->name[0] ? t->thread->name : "(no name)" ,t->deadline);
     }
     DEBUG("======%s==END=====\n",pre);
 }
@@ -1795,6 +1985,71 @@ static void rt_priority_queue_dump(rt_priority_queue *queue, char *pre)
     DEBUG("======%s==END=====\n",pre);
 }
 
+static inline void rt_priority_queue_set(rt_priority_queue *queue, uint64_t pos, rt_thread *thread)
+{
+    queue->threads[pos] = thread;
+    thread->heap_pos = pos;
+}
+
+static void rt_priority_queue_sift_up(rt_priority_queue *queue, uint64_t pos)
+{
+    rt_thread *thread = queue->threads[pos];
+
+    while (pos && queue->threads[parent(pos)]->deadline > thread->deadline) {
+	rt_priority_queue_set(queue,pos,queue->threads[parent(pos)]);
+	pos = parent(pos);
+    }
+
+    rt_priority_queue_set(queue,pos,thread);
+}
+
+static void rt_priority_queue_sift_down(rt_priority_queue *queue, uint64_t pos)
+{
+    rt_thread *thread = queue->threads[pos];
+    uint64_t child;
+
+    while (left_child(pos) < queue->size) {
+	child = left_child(pos);
+	if (right_child(pos) < queue->size &&
+	    queue->threads[right_child(pos)]->deadline < queue->threads[child]->deadline) {
+	    child = right_child(pos);
+	}
+	if (thread->deadline > queue->threads[child]->deadline) {
+	    rt_priority_queue_set(queue,pos,queue->threads[child]);
+	    pos = child;
+	} else {
+	    break;
+	}
+    }
+
+    rt_priority_queue_set(queue,pos,thread);
+}
+
+// maintain the admission control totals as threads come and go
+static void rt_priority_queue_account(rt_priority_queue *queue, rt_thread *thread, int add)
+{
+    if (thread->constraints.type == PERIODIC) {
+	uint64_t util = (thread->constraints.periodic.slice * UTIL_ONE) / thread->constraints.periodic.period;
+	if (add) {
+	    queue->periodic_count++;
+	    queue->periodic_util += util;
+	    queue->periodic_period_sum += thread->constraints.periodic.period;
+	} else {
+	    queue->periodic_count--;
+	    queue->periodic_util -= util;
+	    queue->periodic_period_sum -= thread->constraints.periodic.period;
+	}
+    } else if (thread->constraints.type == SPORADIC) {
+	if (add) {
+	    queue->sporadic_count++;
+	    list_add_tail(&thread->sp_node,&queue->sporadic);
+	} else {
+	    queue->sporadic_count--;
+	    list_del_init(&thread->sp_node);
+	}
+    }
+}
+
 static int rt_priority_queue_enqueue(rt_priority_queue *queue, rt_thread *thread)
 {
     if (queue->size == MAX_QUEUE)        {
@@ -1805,24 +2060,46 @@ static int rt_priority_queue_enqueue(rt_priority_queue *queue, rt_thread *thread
 	      
 	return -1;
     }
-        
-    uint64_t pos = queue->size++;
-    queue->threads[pos] = thread;
 
-    // update heap
-    while (queue->threads[parent(pos)]->deadline > thread->deadline 
-	   && pos != parent(pos))  {
-	queue->threads[pos] = queue->threads[parent(pos)];
-	pos = parent(pos);
+    if (thread->pqueue) {
+	ERROR("Thread %llu is already on a priority queue\n", thread->thread->tid);
+	return -1;
     }
+        
+    uint64_t pos = queue->size++;
 
-    thread->q_type = queue->type;
     queue->threads[pos] = thread;
+    rt_priority_queue_sift_up(queue,pos);
 
+    thread->q_type = queue->type;
+    thread->pqueue = queue;
+    rt_priority_queue_account(queue,thread,1);
 
     return 0;
 }
 
+//
+// Take the thread at pos out of the heap
+//
+static rt_thread* rt_priority_queue_extract(rt_priority_queue *queue, uint64_t pos)
+{
+    rt_thread *thread = queue->threads[pos];
+    rt_thread *last = queue->threads[--queue->size];
+
+    if (pos != queue->size) {
+	rt_priority_queue_set(queue,pos,last);
+	if (pos && queue->threads[parent(pos)]->deadline > last->deadline) {
+	    rt_priority_queue_sift_up(queue,pos);
+	} else {
+	    rt_priority_queue_sift_down(queue,pos);
+	}
+    }
+
+    rt_priority_queue_account(queue,thread,0);
+    thread->pqueue = 0;
+
+    return thread;
+}
 
 //
 // Get highest priority thread from the queue
@@ -1846,63 +2123,19 @@ static rt_thread* rt_priority_queue_dequeue(rt_priority_queue *queue)
 	ERROR("%s QUEUE EMPTY! CAN'T DEQUEUE!\n", qstr);
 	return NULL;
     }
-    
-    rt_thread *min, *last;
-    int now, child;
-    
-    // Get the entry we are about to remove (min)
-    min = queue->threads[0];
-    last = queue->threads[--queue->size];
-        
-    // update the heap
-    for (now = 0; left_child(now) < queue->size; now = child) {
-	
-	child = left_child(now);
-
-	if (child < queue->size && 
-	    queue->threads[right_child(now)]->deadline < queue->threads[left_child(now)]->deadline)  {
-	    
-	    child = right_child(now);
-	}
-            
-	if (last->deadline > queue->threads[child]->deadline) {
-	    queue->threads[now] = queue->threads[child];
-	} else {
-	    break;
-	}
-    }
-        
-    queue->threads[now] = last;
-        
-    return min;
 
+    return rt_priority_queue_extract(queue,0);
 }
 
 static rt_thread* rt_priority_queue_remove(rt_priority_queue *queue, rt_thread *thread)
 {
-    // this is currently hideous beyond belief
-
-    rt_priority_queue temp = *queue;
-    rt_thread *cur;
-    int found=0;
-
-    queue->size=0;
-
-    while (!rt_priority_queue_empty(&temp)) {
-	cur=rt_priority_queue_dequeue(&temp);
-	if (cur && cur!=thread) {
-	    if (rt_priority_queue_enqueue(queue,cur)) { 
-		ERROR("Failed to re-enqueue in removal process...\n");
-	    } 
-	} else {
-	    found = 1;
-	}
-    }
-    if (!found) { 
+    if (thread->pqueue != queue ||
+	thread->heap_pos >= queue->size ||
+	queue->threads[thread->heap_pos] != thread) {
 	return 0;
-    } else {
-	return thread;
     }
+
+    return rt_priority_queue_extract(queue,thread->heap_pos);
 }
 
 static rt_thread *rt_priority_queue_peek(rt_priority_queue *queue, uint64_t pos)
@@ -2199,6 +2432,9 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 	    NK_GPIO_OUTPUT_MASK(~0x4,GPIO_AND);
 	    return 0;
 	}
+    } else {
+	// no RCU reader can be running on this cpu
+	nk_rcu_quiescent();
     }
 
     INST_SCHED_IN();
@@ -2220,6 +2456,8 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 
     scheduler->tsc.end_time = now;
 
+    update_load(scheduler,now);
+
     rt_c->run_time += now - rt_c->start_time;
 
     rt_c->cur_run_time += now - rt_c->start_time;
@@ -2991,23 +3229,47 @@ int nk_sched_thread_move(struct nk_thread *t, int new_cpu, int block)
 }
 
 
-static int select_victim(int new_cpu)
+//
+// Pick the cpu to steal from, looking first at SMT siblings, then
+// the socket, then remote cpus, and taking the most loaded cpu at
+// the nearest level that is sufficiently more loaded than us.
+// Returns -1 if there is no one worth stealing from
+//
+static int select_victim(int new_cpu, cpu_level *levelp)
 {
-    int a,b;
     struct sys_info *sys = per_cpu_get(system);
- 
-    // power of two random choices selection
-
-    // pick two, return the one with the most threads
-
-    do {
-	a = (int)(get_random() % sys->num_cpus);
-	b = (int)(get_random() % sys->num_cpus);
-    } while (a==new_cpu || b==new_cpu);
+    rt_scheduler *ns = sys->cpus[new_cpu]->sched_state;
+    uint64_t my_load = cpu_load(ns);
+    int start = (int)(get_random() % sys->num_cpus);
+    cpu_level level;
+    int i, cpu;
+
+    for (level=LEVEL_SMT; level<NUM_LEVELS; level++) {
+	int best = -1;
+	uint64_t best_load = 0;
+
+	for (i=0;i<sys->num_cpus;i++) {
+	    cpu = (start + i) % sys->num_cpus;
+	    if (cpu==new_cpu || 
+		!sys->cpus[cpu]->sched_state || 
+		cpu_distance(new_cpu,cpu)!=level) {
+		continue;
+	    }
+	    rt_scheduler *os = sys->cpus[cpu]->sched_state;
+	    uint64_t l = cpu_load(os);
+	    if (l > best_load && SIZE_APERIODIC(os) > SIZE_APERIODIC(ns)) {
+		best = cpu;
+		best_load = l;
+	    }
+	}
 
-    return (sys->cpus[a]->sched_state->aperiodic.size  >
-	    sys->cpus[b]->sched_state->aperiodic.size) ? a : b;
+	if (best>=0 && best_load >= my_load + LOAD_IMBALANCE) {
+	    *levelp = level;
+	    return best;
+	}
+    }
 
+    return -1;
 }
 
 uint64_t nk_sched_get_runtime(struct nk_thread *t)
@@ -3026,12 +3288,23 @@ int nk_sched_cpu_mug(int old_cpu, uint64_t maxcount, uint64_t *actualcount)
     uint64_t count=0;
     uint64_t cur, pos;
     int rc=-1;
+    cpu_level level;
 
 
     *actualcount = 0;
 
     if (old_cpu==-1) { 
-	old_cpu = select_victim(new_cpu);
+	old_cpu = select_victim(new_cpu,&level);
+	if (old_cpu<0) {
+	    DEBUG("Work stealing: no cpu is worth stealing from\n");
+	    return 0;
+	}
+    } else {
+	if (old_cpu>=sys->num_cpus) { 
+	    ERROR("Cannot steal from cpu %d (out of range)\n", old_cpu);
+	    return -1;
+	}
+	level = cpu_distance(new_cpu,old_cpu);
     }
 
     if (old_cpu==new_cpu) {
@@ -3042,12 +3315,7 @@ int nk_sched_cpu_mug(int old_cpu, uint64_t maxcount, uint64_t *actualcount)
 
     os = sys->cpus[old_cpu]->sched_state;
  
-    DEBUG("Work stealing: selected victim is %d\n",old_cpu);
-
-    if (old_cpu>=sys->num_cpus) { 
-	ERROR("Cannot steal from cpu %d (out of range)\n", old_cpu);
-	return -1;
-    }
+    DEBUG("Work stealing: selected victim is %d (level %d)\n",old_cpu,level);
 
     if (SIZE_APERIODIC(os) <= SIZE_APERIODIC(ns)) { 
 	DEBUG("Avoiding theft from insufficiently rich CPU\n");
@@ -3060,8 +3328,8 @@ int nk_sched_cpu_mug(int old_cpu, uint64_t maxcount, uint64_t *actualcount)
 
     count=0;
 
-    for (cur=0;cur<SIZE_APERIODIC(os);cur++) {
-	rt_thread *t = PEEK_APERIODIC(os,cur);
+    rt_thread *t;
+    FOR_EACH_APERIODIC(os,t,cur) {
 	// do not steal the idle thread, interrupt thread, task thread, or any bound thread
 	if (t && !t->thread->is_idle && !t->is_intr && !t->is_task && t->thread->bound_cpu<0 ) { 
 	    DEBUG("Found thread %llu %s\n",t->thread->tid,t->thread->name);
@@ -3093,6 +3361,7 @@ int nk_sched_cpu_mug(int old_cpu, uint64_t maxcount, uint64_t *actualcount)
     }
     
     ns->num_thefts += *actualcount;
+    ns->num_level_thefts[level] += *actualcount;
     
     DEBUG("Thread theft complete\n");
 
@@ -3100,6 +3369,29 @@ int nk_sched_cpu_mug(int old_cpu, uint64_t maxcount, uint64_t *actualcount)
 
 }
 
+int nk_sched_balance(uint64_t *actualcount)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    rt_scheduler *s = sys->cpus[my_cpu_id()]->sched_state;
+    uint64_t now = cur_time();
+    int rc;
+
+    *actualcount = 0;
+
+    if ((now - s->last_balance_time) < BALANCE_INTERVAL_NS) {
+	return 0;
+    }
+
+    s->last_balance_time = now;
+    s->num_balances++;
+
+    preempt_disable();
+    rc = nk_sched_cpu_mug(-1,BALANCE_AMOUNT,actualcount);
+    preempt_enable();
+
+    return rc;
+}
+
 
 void    nk_sched_kick_cpu(int cpu)
 {
@@ -3459,59 +3751,34 @@ static inline uint64_t get_periodic_util_rms_limit(uint64_t count)
 
 static inline void get_periodic_util(rt_scheduler *sched, uint64_t *util, uint64_t *count)
 {
-    rt_priority_queue *pending = &sched->pending;
-    rt_priority_queue *runnable = &sched->runnable;
-    int i;
-
-    *util=0;
-    *count=0;
-
-    for (i = 0; i < runnable->size; i++) {
-        rt_thread *thread = runnable->threads[i];
-        if (thread->constraints.type == PERIODIC) {
-	    (*count)++;
-            *util += (thread->constraints.periodic.slice * UTIL_ONE) / thread->constraints.periodic.period;
-        }
-    }
-    
-    for (i = 0; i < pending->size; i++) {
-        rt_thread *thread = pending->threads[i];
-        if (thread->constraints.type == PERIODIC) {
-	    (*count)++;
-            *util += (thread->constraints.periodic.slice * UTIL_ONE) / thread->constraints.periodic.period;
-        }
-    }
-    
+    *util = sched->runnable.periodic_util + sched->pending.periodic_util;
+    *count = sched->runnable.periodic_count + sched->pending.periodic_count;
 }
 
 static inline void get_sporadic_util(rt_scheduler *sched, uint64_t now, uint64_t *util, uint64_t *count)
 {
     rt_priority_queue *pending = &sched->pending;
     rt_priority_queue *runnable = &sched->runnable;
-    int i;
+    rt_thread *thread;
+
+    // sporadic utilization depends on the current time, so it
+    // cannot be kept as a running sum, but only the sporadic
+    // threads themselves need to be visited
 
     *util=0;
-    *count=0;
+    *count = runnable->sporadic_count + pending->sporadic_count;
 
-    for (i = 0; i < runnable->size; i++) {
-        rt_thread *thread = runnable->threads[i];
-        if (thread->constraints.type == SPORADIC) {
-	    (*count)++;
-	    // runnable task measured based on its remaining time
-	    // and its current deadline (phase is now zero since
-	    // has arrived)
-            *util += ((thread->constraints.sporadic.size - thread->run_time) * UTIL_ONE) / (thread->constraints.sporadic.deadline - now);
-        }
+    list_for_each_entry(thread, &runnable->sporadic, sp_node) {
+	// runnable task measured based on its remaining time
+	// and its current deadline (phase is now zero since
+	// has arrived)
+	*util += ((thread->constraints.sporadic.size - thread->run_time) * UTIL_ONE) / (thread->constraints.sporadic.deadline - now);
     }
     
-    for (i = 0; i < pending->size; i++) {
-        rt_thread *thread = pending->threads[i];
-        if (thread->constraints.type == SPORADIC) {
-	    (*count)++;
-	    // runnable task measured based on its total size
-	    // and expected deadline relative to now
-            *util += (thread->constraints.sporadic.size * UTIL_ONE) / (thread->constraints.sporadic.deadline - now - thread->constraints.sporadic.phase);
-        }
+    list_for_each_entry(thread, &pending->sporadic, sp_node) {
+	// runnable task measured based on its total size
+	// and expected deadline relative to now
+	*util += (thread->constraints.sporadic.size * UTIL_ONE) / (thread->constraints.sporadic.deadline - now - thread->constraints.sporadic.phase);
     }
     
 }
@@ -3662,27 +3929,8 @@ int nk_sched_thread_get_constraints(struct nk_thread *t, struct nk_sched_constra
 
 static inline uint64_t get_avg_per(rt_priority_queue *runnable, rt_priority_queue *pending, rt_thread *new_thread)
 {
-    uint64_t sum_period = 0;
-    uint64_t num_periodic = 0;
-    int i;
-    
-    for (i = 0; i < runnable->size; i++)
-    {
-        rt_thread *thread = runnable->threads[i];
-        if (thread->constraints.type == PERIODIC) {
-            sum_period += thread->constraints.periodic.period;
-            num_periodic++;
-        }
-    }
-    
-    for (i = 0; i < pending->size; i++)
-    {
-        rt_thread *thread = pending->threads[i];
-        if (thread->constraints.type == PERIODIC) {
-            sum_period += thread->constraints.periodic.period;
-            num_periodic++;
-        }
-    }
+    uint64_t sum_period = runnable->periodic_period_sum + pending->periodic_period_sum;
+    uint64_t num_periodic = runnable->periodic_count + pending->periodic_count;
     
     if (new_thread->constraints.type == PERIODIC)
     {
@@ -3950,10 +4198,23 @@ static struct nk_sched_percpu_state *init_local_state(struct nk_sched_config *cf
         state->pending.type = PENDING_QUEUE;
         state->aperiodic.type = APERIODIC_QUEUE;
 
+	INIT_LIST_HEAD(&state->runnable.sporadic);
+	INIT_LIST_HEAD(&state->pending.sporadic);
+
     }
     
     spinlock_init(&state->lock);
 
+    spinlock_init(&state->shard.lock);
+    INIT_LIST_HEAD(&state->shard.threads);
+    INIT_LIST_HEAD(&state->shard.exited);
+
+#if NAUT_CONFIG_APERIODIC_ROUND_ROBIN || NAUT_CONFIG_APERIODIC_LOTTERY
+    INIT_LIST_HEAD(&state->aperiodic.threads);
+#else
+    INIT_LIST_HEAD(&state->aperiodic.sporadic);
+#endif
+
     spinlock_init(&state->tasks.lock);
     INIT_LIST_HEAD(&state->tasks.sized_queue);
     INIT_LIST_HEAD(&state->tasks.unsized_queue);
@@ -4000,6 +4261,11 @@ static void interrupt(void *in, void **out)
 	if (!irqs_enabled()) { 
 	    panic("Interrupt thread running with interrupts off!");
 	}
+#if NAUT_CONFIG_WORK_STEALING
+	uint64_t numstolen;
+	// periodic balancing (rate limited within)
+	nk_sched_balance(&numstolen);
+#endif
 	DEBUG("Interrupt thread halting\n");
 	// we will be woken from this halt at least by the 
 	// timer interrupt at the end of our current slice
@@ -4207,13 +4473,6 @@ static int shared_init(struct cpu *my_cpu, struct nk_sched_config *cfg)
 static int init_global_state()
 {
     ZERO(&global_sched_state);
-    global_sched_state.thread_list = rt_list_init();
-    if (!global_sched_state.thread_list) { 
-	ERROR("Cannot allocate global thread list\n");
-	return -1;
-    }
-
-    spinlock_init(&global_sched_state.lock);
 
     nk_counting_barrier_init(&stop_barrier,nk_get_num_cpus());
 
@@ -4268,20 +4527,21 @@ static void reaper(void *in, void **out)
 	DEBUG("Reaper sleeping\n");
 	nk_sleep(NAUT_CONFIG_AUTO_REAP_PERIOD_MS*1000000ULL);	
 	DEBUG("Reaping threads\n");
-	nk_sched_reap(1); // unconditional reap
+	// each reaper only handles the threads created on its own cpu
+	nk_sched_reap_cpu(my_cpu_id(),0);
     }
 }
 
-static int start_reaper()
+static int start_reaper_for_this_cpu()
 {
   nk_thread_id_t tid;
 
-  if (nk_thread_start(reaper, 0, 0, 1, REAPER_THREAD_STACK_SIZE, &tid, 0)) {
+  if (nk_thread_start(reaper, 0, 0, 1, REAPER_THREAD_STACK_SIZE, &tid, my_cpu_id())) {
       ERROR("Failed to start reaper thread\n");
       return -1;
   }
 
-  DEBUG("Reaper launched on cpu 0 as %p\n",tid);
+  DEBUG("Reaper launched on cpu %d as %p\n",my_cpu_id(),tid);
   return 0;
 
 }
@@ -4334,13 +4594,11 @@ void nk_sched_start()
     // must not do in creating any of the ancilary threads
 
 #ifdef NAUT_CONFIG_AUTO_REAP
-    if (my_cpu->is_bsp) { 
-	DEBUG("Starting reaper thread\n");
-	if (start_reaper()) { 
-	    ERROR("Cannot start reaper thread\n");
-	    panic("Cannot start reaper thread\n");
-	    return;
-	}
+    DEBUG("Starting reaper thread for CPU %d\n",my_cpu->id);
+    if (start_reaper_for_this_cpu()) { 
+	ERROR("Cannot start reaper thread for CPU!\n");
+	panic("Cannot start reaper thread for CPU!\n");
+	return;
     }
 #endif
 
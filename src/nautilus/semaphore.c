@@ -28,6 +28,7 @@
 #include <nautilus/scheduler.h>
 #include <nautilus/semaphore.h>
 #include <nautilus/shell.h>
+#include <nautilus/rcu.h>
 
 // This is a trival implementation of classic semaphores for threads ONLY
 // interrupts can use the try functions only
@@ -51,6 +52,7 @@
 
 
 static uint64_t   count=0;
+// writers to sem_list serialize on state_lock; find is an RCU reader
 static spinlock_t state_lock;
 static struct list_head sem_list;
 
@@ -68,7 +70,8 @@ static struct list_head sem_list;
 struct nk_semaphore {
     spinlock_t         lock;
     struct list_head   node; // for global list of named semaphores
-    uint64_t           refcount;
+    volatile uint64_t  refcount; // atomic; zero means the semaphore is dying
+    struct nk_rcu_head rcu;
     char               name[NK_SEMAPHORE_NAME_LEN];
 
     // count>0  =>  normal operation (down will not wait)
@@ -117,7 +120,7 @@ struct nk_semaphore *nk_semaphore_create(char *name,
     }
 
     STATE_LOCK();
-    list_add_tail(&s->node,&sem_list);
+    list_add_tail_rcu(&s->node,&sem_list);
     STATE_UNLOCK();
 
     DEBUG("created %s count=%d\n",s->name,s->count);
@@ -128,62 +131,76 @@ struct nk_semaphore *nk_semaphore_create(char *name,
 
 void nk_semaphore_attach(struct nk_semaphore *s)
 {
-    SEMAPHORE_LOCK_CONF;
     DEBUG("attach to semaphore %s\n",s->name);
-    SEMAPHORE_LOCK(s);
-    s->refcount++;
-    SEMAPHORE_UNLOCK(s);
+    __sync_fetch_and_add(&s->refcount,1);
     DEBUG("attach to semaphore %s end\n",s->name);
 }
 
+// attach unless the last reference is already gone
+static int try_attach(struct nk_semaphore *s)
+{
+    uint64_t r;
+
+    while ((r = s->refcount)) {
+	if (__sync_bool_compare_and_swap(&s->refcount,r,r+1)) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
 struct nk_semaphore *nk_semaphore_find(char *name)
 {
     struct list_head *cur;
-    struct nk_semaphore *target=0;
+    struct nk_semaphore *s, *target=0;
 
     DEBUG("find semaphore with name %s\n",name);
-    STATE_LOCK_CONF;
-    STATE_LOCK();
-    list_for_each(cur,&sem_list) {
-	if (!strncasecmp(list_entry(cur,struct nk_semaphore,node)->name,name,NK_SEMAPHORE_NAME_LEN)) { 
-	    target = list_entry(cur,struct nk_semaphore, node);
+    nk_rcu_read_lock();
+    list_for_each_rcu(cur,&sem_list) {
+	s = list_entry(cur,struct nk_semaphore, node);
+	if (!strncasecmp(s->name,name,NK_SEMAPHORE_NAME_LEN) && try_attach(s)) {
+	    target = s;
 	    break;
 	}
     }
-    STATE_UNLOCK();
+    nk_rcu_read_unlock();
     if (target) {
 	DEBUG("find semaphore with name %s succeeded and attached\n",name);
-	nk_semaphore_attach(target);
     } else {
 	DEBUG("find semaphore with name %s failed\n",name);
     }
     return target;
 }
 
+static void semaphore_free_rcu(struct nk_rcu_head *h)
+{
+    free(container_of(h, struct nk_semaphore, rcu));
+}
+
 void nk_semaphore_release(struct nk_semaphore *s)
 {
     SEMAPHORE_LOCK_CONF;
     
     DEBUG("release semaphore with name %s\n",s->name);
 
-    SEMAPHORE_LOCK(s);
-    s->refcount--;
-    if (s->refcount>0) {
-	SEMAPHORE_UNLOCK(s);
+    if (__sync_sub_and_fetch(&s->refcount,1)>0) {
 	DEBUG("release semaphore with name %s - simple release\n",s->name);
 	return;
     } else {
+	// we dropped the last reference, so find can no longer attach
 	STATE_LOCK_CONF;
 
 	STATE_LOCK();
-	list_del_init(&s->node);
+	list_del_rcu(&s->node);
 	STATE_UNLOCK();
     
+	SEMAPHORE_LOCK(s);
 	nk_wait_queue_wake_all(s->wait_queue);
 	nk_wait_queue_destroy(s->wait_queue);
 	SEMAPHORE_UNLOCK(s);
-	free(s);
 	DEBUG("release semaphore with name %s - complex release\n",s->name);
+	// a concurrent find may still be looking at the name
+	nk_call_rcu(&s->rcu, semaphore_free_rcu);
     }
 }
 
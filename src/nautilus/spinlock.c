@@ -39,17 +39,13 @@ spinlock_deinit (volatile spinlock_t * lock)
 void
 spin_lock_nopause (volatile spinlock_t * lock)
 {
-    while (__sync_lock_test_and_set(lock, 1)) {
-        /* nothing */
-    }
+    NK_LOCKSTAT_ACQUIRE_AT(lock, NK_LOCKSTAT_CALLER(), __spin_try(lock), __spin_wait(lock));
 }
 
 uint8_t
 spin_lock_irq_save_nopause (volatile spinlock_t * lock)
 {
     uint8_t flags = irq_disable_save();
-    while (__sync_lock_test_and_set(lock, 1)) {
-        /* nothing */
-    }
+    NK_LOCKSTAT_ACQUIRE_AT(lock, NK_LOCKSTAT_CALLER(), __spin_try(lock), __spin_wait(lock));
     return flags;
 }
@@ -620,6 +620,14 @@ void nk_thread_exit (void * retval)
 }
 
 
+static void thread_free_rcu(struct nk_rcu_head *h)
+{
+    nk_thread_t *t = container_of(h, nk_thread_t, rcu);
+
+    free(t->stack);
+    free(t);
+}
+
 /*
  * nk_thread_destroy
  *
@@ -660,8 +668,8 @@ nk_thread_destroy (nk_thread_id_t t)
     nk_gc_bdwgc_thread_state_deinit(thethread);
 #endif
 
-    free(thethread->stack);
-    free(thethread);
+    // nk_find_thread_by_tid() readers may still hold a pointer
+    nk_call_rcu(&thethread->rcu, thread_free_rcu);
     
     preempt_enable();
 }
@@ -340,8 +340,9 @@ static void recv_callback(nk_net_dev_status_t status,
     AGENT_LOCK_CONF;
     
     if (status!=NK_NET_DEV_STATUS_SUCCESS) {
-	// uhoh
+	// uhoh - e.g., a bad checksum caught by the device
 	ERROR("Receive failure for packet %p\n", p);
+	nk_net_ethernet_release_packet(p);
     } else {
 
 	AGENT_LOCK(a);
@@ -385,7 +386,10 @@ static void send_callback(nk_net_dev_status_t status,
     // The network op is not in any list at this point
 
     if (o->interface==BUFFER) {
-	nk_net_ethernet_release_packet(p);
+	// zero-copy scatter-gather sends have no bounce packet
+	if (p) {
+	    nk_net_ethernet_release_packet(p);
+	}
 	if (o->callback) {
 	    o->callback(status,o->context);
 	}
@@ -398,6 +402,8 @@ static void send_callback(nk_net_dev_status_t status,
 	    nk_net_ethernet_release_packet(p);
 	}
     }
+
+    free_op(o);
 }
 
 
@@ -483,6 +489,81 @@ static int post_receive(void *state, uint8_t *dest, uint64_t len, void (*callbac
 }
 
 
+// Scatter-gather sends go straight to the underlying device when it can
+// gather itself, otherwise the fragments are gathered into a bounce packet
+static int post_send_sg(void *state, struct nk_net_dev_sg *frags, uint32_t num, struct nk_net_dev_tx_offload *offload, void (*callback)(nk_net_dev_status_t status, void *context), void *context)
+{
+    struct nk_net_ethernet_agent_net_dev *d =  (struct nk_net_ethernet_agent_net_dev *) state;
+    void *dev_state = d->agent->netdev->dev.state;
+    struct nk_net_dev_int *dev_int = (struct nk_net_dev_int *) d->agent->netdev->dev.interface;
+    struct netdev_op *o;
+    uint64_t len;
+    uint32_t i;
+
+    if (!num || num>NK_NET_DEV_MAX_SG) {
+	ERROR("Invalid fragment count %u\n",num);
+	return -1;
+    }
+
+    o = alloc_op();
+
+    if (!o) {
+	return -1;
+    }
+
+    o->interface = BUFFER;
+    o->type = SEND;
+    o->buf = 0;
+    o->len = 0;
+    o->packet = 0;
+    o->callback=callback;
+    o->callback_packet=0;
+    o->context = context;
+
+    if (dev_int->post_send_sg) {
+	if (dev_int->post_send_sg(dev_state, frags, num, offload, send_callback, o)) {
+	    free_op(o);
+	    return -1;
+	}
+	return 0;
+    }
+
+    // a device that cannot gather advertises no offloads
+    if (offload && offload->flags) {
+	ERROR("Offload requested from device without scatter-gather\n");
+	free_op(o);
+	return -1;
+    }
+
+    o->packet = nk_net_ethernet_alloc_packet(-1);
+    if (!o->packet) {
+	free_op(o);
+	return -1;
+    }
+
+    for (len=0, i=0;i<num;i++) {
+	if (len+frags[i].len > MAX_ETHERNET_PACKET_LEN) {
+	    ERROR("Scatter-gather packet too large\n");
+	    goto out_bad;
+	}
+	memcpy(o->packet->raw+len,frags[i].addr,frags[i].len);
+	len += frags[i].len;
+    }
+    o->packet->len = len;
+
+    if (dev_int->post_send(dev_state, o->packet->raw, o->packet->len, send_callback, o)) {
+	goto out_bad;
+    }
+
+    return 0;
+
+ out_bad:
+    nk_net_ethernet_release_packet(o->packet);
+    free_op(o);
+    return -1;
+}
+
+
 static inline int post_send_recv_packet(void *state, nk_ethernet_packet_t *packet, void (*callback)(nk_net_dev_status_t status, nk_ethernet_packet_t *packet, void *context), void *context, int recv)
 {
     DEV_LOCK_CONF;
@@ -563,7 +644,8 @@ static struct nk_net_ethernet_agent_net_dev_int ops = {
     .netdev_int = {
 	.get_characteristics = get_characteristics,
 	.post_receive = post_receive,
-	.post_send = post_send
+	.post_send = post_send,
+	.post_send_sg = post_send_sg
     },
     .post_receive_packet = post_receive_packet,
     .post_send_packet = post_send_packet
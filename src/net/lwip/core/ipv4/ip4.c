@@ -952,7 +952,9 @@ ip4_output_if_opt_src(struct pbuf *p, const ip4_addr_t *src, const ip4_addr_t *d
 #endif /* ENABLE_LOOPBACK */
 #if IP_FRAG
   /* don't fragment if interface has mtu set to 0 [loopif] */
-  if (netif->mtu && (p->tot_len > netif->mtu)) {
+  /* or if this is a TCP segment the interface will segment itself */
+  if (netif->mtu && (p->tot_len > netif->mtu) &&
+      !(NETIF_TSO_MSS(netif) && (proto == IP_PROTO_TCP))) {
     return ip4_frag(p, netif, dest);
   }
 #endif /* IP_FRAG */
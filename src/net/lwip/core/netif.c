@@ -322,6 +322,7 @@ netif_add(struct netif *netif,
   netif->input = input;
 
   NETIF_SET_HWADDRHINT(netif, NULL);
+  NETIF_SET_TSO_MSS(netif, 0);
 #if ENABLE_LOOPBACK && LWIP_LOOPBACK_MAX_PBUFS
   netif->loop_cnt_current = 0;
 #endif /* ENABLE_LOOPBACK && LWIP_LOOPBACK_MAX_PBUFS */
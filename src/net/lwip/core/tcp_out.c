@@ -390,6 +390,16 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
   /* don't allocate segments bigger than half the maximum window we ever received */
   u16_t mss_local = LWIP_MIN(pcb->mss, TCPWND_MIN16(pcb->snd_wnd_max/2));
   mss_local = mss_local ? mss_local : pcb->mss;
+#if LWIP_TCP_TSO
+  {
+    /* the netif will cut large segments into pcb->mss sized frames, so only
+       the window limits the segment size */
+    struct netif *tso_netif = ip_route(&pcb->local_ip, &pcb->remote_ip);
+    if ((tso_netif != NULL) && (tso_netif->flags & NETIF_FLAG_TSO)) {
+      mss_local = LWIP_MAX(pcb->mss, LWIP_MIN(TCP_TSO_MAX_SIZE, TCPWND_MIN16(pcb->snd_wnd_max/2)));
+    }
+  }
+#endif /* LWIP_TCP_TSO */
 
 #if LWIP_NETIF_TX_SINGLE_PBUF
   /* Always copy to try to create single pbufs for TX */
@@ -452,6 +462,10 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
 
     /* Usable space at the end of the last unsent segment */
     unsent_optlen = LWIP_TCP_OPT_LENGTH(last_unsent->flags);
+#if LWIP_TCP_TSO
+    /* the route may have lost TSO since the last segment was built */
+    mss_local = LWIP_MAX(mss_local, last_unsent->len + unsent_optlen);
+#endif /* LWIP_TCP_TSO */
     LWIP_ASSERT("mss_local is too small", mss_local >= last_unsent->len + unsent_optlen);
     space = mss_local - (last_unsent->len + unsent_optlen);
 
@@ -981,6 +995,27 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
   return err;
 }
 
+/** Checks whether the segment may be sent within the window 'wnd'.
+ * A TSO segment can be larger than the congestion window; it would never
+ * be sent, so it goes out on its own when nothing is in flight as long
+ * as the receiver's window allows it.
+ */
+static u8_t
+tcp_output_seg_fits(struct tcp_pcb *pcb, struct tcp_seg *seg, u32_t wnd)
+{
+  u32_t end = lwip_ntohl(seg->tcphdr->seqno) - pcb->lastack + seg->len;
+
+  if (end <= wnd) {
+    return 1;
+  }
+#if LWIP_TCP_TSO
+  if ((seg->len > pcb->mss) && (pcb->unacked == NULL) && (end <= pcb->snd_wnd)) {
+    return 1;
+  }
+#endif /* LWIP_TCP_TSO */
+  return 0;
+}
+
 /**
  * @ingroup tcp_raw
  * Find out what we can send and send it
@@ -1023,8 +1058,7 @@ tcp_output(struct tcp_pcb *pcb)
    * If data is to be sent, we will just piggyback the ACK (see below).
    */
   if (pcb->flags & TF_ACK_NOW &&
-     (seg == NULL ||
-      lwip_ntohl(seg->tcphdr->seqno) - pcb->lastack + seg->len > wnd)) {
+     (seg == NULL || !tcp_output_seg_fits(pcb, seg, wnd))) {
      return tcp_send_empty_ack(pcb);
   }
 
@@ -1078,7 +1112,7 @@ tcp_output(struct tcp_pcb *pcb)
    * we avoid splitting the unsent segment and treat the window as already zero.
    */
   if (seg != NULL &&
-      lwip_ntohl(seg->tcphdr->seqno) - pcb->lastack + seg->len > wnd &&
+      !tcp_output_seg_fits(pcb, seg, wnd) &&
       wnd > 0 && wnd == pcb->snd_wnd && pcb->unacked == NULL) {
     /* Start the persist timer */
     if (pcb->persist_backoff == 0) {
@@ -1088,8 +1122,7 @@ tcp_output(struct tcp_pcb *pcb)
     goto output_done;
   }
   /* data available and window allows it to be sent? */
-  while (seg != NULL &&
-         lwip_ntohl(seg->tcphdr->seqno) - pcb->lastack + seg->len <= wnd) {
+  while (seg != NULL && tcp_output_seg_fits(pcb, seg, wnd)) {
     LWIP_ASSERT("RST not expected here!",
                 (TCPH_FLAGS(seg->tcphdr) & TCP_RST) == 0);
     /* Stop sending if the nagle algorithm would prevent it
@@ -1314,8 +1347,18 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb, struct netif *netif
   TCP_STATS_INC(tcp.xmit);
 
   NETIF_SET_HWADDRHINT(netif, &(pcb->addr_hint));
+#if LWIP_TCP_TSO
+  if ((netif->flags & NETIF_FLAG_TSO) &&
+      seg->len + LWIP_TCP_OPT_LENGTH(seg->flags) > pcb->mss) {
+    /* each frame carries the same options, so they come out of the mss.
+       a segment built for a TSO netif may leave through one without it
+       after a route change, and then IP has to fragment it instead */
+    NETIF_SET_TSO_MSS(netif, pcb->mss - LWIP_TCP_OPT_LENGTH(seg->flags));
+  }
+#endif /* LWIP_TCP_TSO */
   err = ip_output_if(seg->p, &pcb->local_ip, &pcb->remote_ip, pcb->ttl,
     pcb->tos, IP_PROTO_TCP, netif);
+  NETIF_SET_TSO_MSS(netif, 0);
   NETIF_SET_HWADDRHINT(netif, NULL);
   return err;
 }
@@ -56,6 +56,8 @@
 #include "lwip/snmp.h"
 #include "lwip/ethip6.h"
 #include "lwip/etharp.h"
+#include "lwip/memp.h"
+#include "lwip/tcpip.h"
 #include "netif/ppp/pppoe.h"
 
 /* Define those to better describe your network interface. */
@@ -64,6 +66,19 @@
 #define SEND_QUEUE_SIZE 15
 #define RECEIVE_QUEUE_SIZE 15
 
+/* Received packets are handed to lwIP without copying by wrapping the
+   agent's packet in a custom pbuf; the packet is released when lwIP
+   frees the pbuf.  If the wrapper pool runs dry, we fall back to copying
+   into a PBUF_POOL chain. */
+#define RX_PBUF_POOL_SIZE 256
+
+struct ethernetif_rx_pbuf {
+    struct pbuf_custom     pc;
+    nk_ethernet_packet_t  *pk;
+};
+
+LWIP_MEMPOOL_DECLARE(ETHERNETIF_RX_PBUF, RX_PBUF_POOL_SIZE, sizeof(struct ethernetif_rx_pbuf), "ethernetif rx pbufs");
+
 
 /**
  * Helper struct to hold private data used to operate your ethernet interface.
@@ -76,6 +91,8 @@ struct ethernetif {
     struct nk_net_dev* device;
     /* Add whatever per-interface state that is needed here. */
     char *name;
+    uint64_t offloads;  /* NK_NET_DEV_OFFLOAD_* of the NIC */
+    int gathers;        /* NIC gathers fragments itself (asynchronously) */
 };
 
 /* Forward declarations. */
@@ -94,7 +111,7 @@ static void parse_packet(nk_ethernet_packet_t *packet){
 	packet->len=42;
     }
     else if(type0==0x08 && type1==0x00){
-	u8_t l = data[16]*256;
+	u16_t l = data[16]*256;
 	l += data[17];
 	packet->len = l+14;
     }
@@ -124,8 +141,8 @@ static void recv_callback(nk_net_dev_status_t status,
 	goto launch_receive;
     }
     //DEBUG("recv callback ipdev: %p\n", ethernetif->device);	
+    // input takes ownership of the packet
     ethernetif_input(netif, packet);
-    nk_net_ethernet_release_packet(packet);//realse packet
 
 launch_receive:
 
@@ -155,8 +172,16 @@ low_level_init(struct netif *netif)
     char *name = ethernetif->name;
     char agent_name[32];
 
+    static int rx_pool_inited = 0;
+
     snprintf(agent_name,32,"%s-agent-lwip",name);
 
+    /* the wrapper pool is shared by all interfaces */
+    if (!rx_pool_inited) {
+	LWIP_MEMPOOL_INIT(ETHERNETIF_RX_PBUF);
+	rx_pool_inited = 1;
+    }
+
     //printk("Looking for device named %s which will get agent %s\n", name, agent_name);
     
     netDevice = nk_net_dev_find(name);
@@ -181,6 +206,23 @@ low_level_init(struct netif *netif)
     /* don't set NETIF_FLAG_ETHARP if this device is not an ethernet one */
     netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP;
 
+    /* let the NIC do whatever checksumming and segmentation it can */
+    ethernetif->offloads = c.offloads;
+    ethernetif->gathers = nk_net_dev_supports_sg(netDevice);
+    {
+      u16_t chksum_flags = NETIF_CHECKSUM_ENABLE_ALL;
+      if (c.offloads & NK_NET_DEV_OFFLOAD_TX_CSUM) {
+        chksum_flags &= ~(NETIF_CHECKSUM_GEN_TCP | NETIF_CHECKSUM_GEN_UDP);
+      }
+      if (c.offloads & NK_NET_DEV_OFFLOAD_RX_CSUM) {
+        chksum_flags &= ~(NETIF_CHECKSUM_CHECK_TCP | NETIF_CHECKSUM_CHECK_UDP);
+      }
+      NETIF_SET_CHECKSUM_CTRL(netif, chksum_flags);
+    }
+    if ((c.offloads & NK_NET_DEV_OFFLOAD_TSO4) && (c.offloads & NK_NET_DEV_OFFLOAD_TX_CSUM)) {
+      netif->flags |= NETIF_FLAG_TSO;
+    }
+
 #if LWIP_IPV6 && LWIP_IPV6_MLD
     /*
      * For hardware/netifs that implement MAC filtering.
@@ -221,36 +263,105 @@ low_level_init(struct netif *netif)
  *       dropped because of memory failure (except for the TCP timers).
  */
 
+/* lwIP only guarantees that RAM, POOL, and ROM pbufs stay intact while we
+   hold a reference, so only those are sent in place by a NIC that gathers
+   asynchronously.  REF pbufs point at memory the caller may reuse as soon
+   as we return, which is fine only when the send path copies right away. */
+static int
+pbuf_can_send_in_place(struct ethernetif *ethernetif, struct pbuf *p)
+{
+  struct pbuf *q;
+  u32_t n = 0;
+
+  for (q = p; q != NULL; q = q->next) {
+    if (q->type == PBUF_REF && ethernetif->gathers) {
+      return 0;
+    }
+    if (q->len) {
+      n++;
+    }
+  }
+
+  return n > 0 && n <= NK_NET_DEV_MAX_SG;
+}
+
+static void
+send_sg_callback(nk_net_dev_status_t status, void *context)
+{
+  struct pbuf *p = (struct pbuf *)context;
+
+  if (status) {
+    ERROR("Scatter-gather send failed\n");
+  }
+
+  /* we are typically in interrupt context here, so hand the final free
+     to the tcpip thread when we can */
+  if (pbuf_free_callback(p) != ERR_OK) {
+    pbuf_free(p);
+  }
+}
+
 static err_t
 low_level_output(struct netif *netif, struct pbuf *p)
 {
     struct ethernetif *ethernetif = netif->state;
     struct nk_net_dev *netDevice = ethernetif -> device;
-    struct pbuf *q;
+    struct nk_net_dev_sg frags[NK_NET_DEV_MAX_SG];
+    struct nk_net_dev_tx_offload offload;
+    struct pbuf *q, *sp;
+    u32_t num;
   DEBUG("low_level_output\n");
   //initiate transfer();
 
 #if ETH_PAD_SIZE
   pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
 #endif
-  
-    nk_ethernet_packet_t *pk = nk_net_ethernet_alloc_packet(-1);
-    u32_t len = 0;
-    
-  for (q = p; q != NULL; q = q->next) {
-    /* Send the data from the pbuf to the interface, one pbuf at a
-       time. The size of the data in each pbuf is kept in the ->len
-       variable. */
-    //send data from(q->payload, q->len);
-      memcpy(pk->raw+len, q->payload, q->len);
-      len+=q->len;
+
+  if (pbuf_can_send_in_place(ethernetif, p)) {
+    /* zero-copy: the device gathers straight from the pbuf chain, and
+       we hold a reference until the send completes */
+    pbuf_ref(p);
+    sp = p;
+  } else {
+    /* otherwise flatten into a single pbuf we own */
+    sp = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
+    if (!sp || pbuf_copy(sp, p) != ERR_OK) {
+      ERROR("Fail to allocate a packet\n");
+      if (sp) {
+        pbuf_free(sp);
+      }
+#if ETH_PAD_SIZE
+      pbuf_header(p, ETH_PAD_SIZE);
+#endif
+      return ERR_MEM;
+    }
   }
-    pk->len = len;
 
-    if(nk_net_ethernet_agent_device_send_packet(ethernetif->device, pk, NK_DEV_REQ_NONBLOCKING, 0, 0)){
-	ERROR("Fail to send a packet\n");
-    	return ERR_MEM;	
+  num = 0;
+  for (q = sp; q != NULL; q = q->next) {
+    if (q->len) {
+      frags[num].addr = q->payload;
+      frags[num].len = q->len;
+      num++;
     }
+  }
+
+  /* the stack left TCP/UDP checksums to the device if it can do them,
+     and TCP tells us when a segment needs cutting into frames */
+  offload.flags = ethernetif->offloads & NK_NET_DEV_OFFLOAD_TX_CSUM;
+  offload.mss = NETIF_TSO_MSS(netif);
+  if (offload.mss) {
+    offload.flags |= ethernetif->offloads & NK_NET_DEV_OFFLOAD_TSO4;
+  }
+
+  if (nk_net_dev_send_packet_sg(netDevice, frags, num, &offload, NK_DEV_REQ_CALLBACK, send_sg_callback, sp)) {
+    ERROR("Fail to send a packet\n");
+    pbuf_free(sp);
+#if ETH_PAD_SIZE
+    pbuf_header(p, ETH_PAD_SIZE);
+#endif
+    return ERR_MEM;
+  }
 
   //signal that packet should be sent();
   MIB2_STATS_NETIF_ADD(netif, ifoutoctets, p->tot_len);
@@ -280,11 +391,27 @@ low_level_output(struct netif *netif, struct pbuf *p)
  * @return a pbuf filled with the received packet (including MAC header)
  *         NULL on memory error
  */
+static void
+rx_pbuf_free(struct pbuf *p)
+{
+  struct ethernetif_rx_pbuf *w = (struct ethernetif_rx_pbuf *)p;
+
+  nk_net_ethernet_release_packet(w->pk);
+  LWIP_MEMPOOL_FREE(ETHERNETIF_RX_PBUF, w);
+}
+
+/**
+ * Wraps the received packet in a pbuf, taking ownership of the packet
+ * (it is released when the pbuf is freed, or here on failure).
+ *
+ * @param netif the lwip network interface structure for this ethernetif
+ * @return a pbuf filled with the received packet (including MAC header)
+ *         NULL on memory error
+ */
 static struct pbuf *
 low_level_input(struct netif *netif, nk_ethernet_packet_t *pk)
 {
-  struct ethernetif *ethernetif = netif->state;
-  struct nk_net_dev *netDevice = ethernetif -> device;
+  struct ethernetif_rx_pbuf *w;
   struct pbuf *p, *q;
   u32_t len, now_index;
   now_index=0;
@@ -292,17 +419,27 @@ low_level_input(struct netif *netif, nk_ethernet_packet_t *pk)
      variable. */
 
   len = pk->len;
-  /*u32_t i;
-  DEBUG("\n");
-  for (i=0; i<len; i++){
-      DEBUG("%c ",pk->raw[i]);
+  if (len > MAX_ETHERNET_PACKET_LEN) {
+    len = MAX_ETHERNET_PACKET_LEN;
   }
-  DEBUG("\n");*/
-#if ETH_PAD_SIZE
+
+#if ETH_PAD_SIZE == 0
+  /* zero-copy: the pbuf points straight at the packet the NIC DMAed into */
+  w = (struct ethernetif_rx_pbuf *)LWIP_MEMPOOL_ALLOC(ETHERNETIF_RX_PBUF);
+  if (w) {
+    w->pk = pk;
+    w->pc.custom_free_function = rx_pbuf_free;
+    p = pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &w->pc, pk->raw, MAX_ETHERNET_PACKET_LEN);
+    if (p) {
+      goto out_stats;
+    }
+    LWIP_MEMPOOL_FREE(ETHERNETIF_RX_PBUF, w);
+  }
+#else
   len += ETH_PAD_SIZE; /* allow room for Ethernet padding */
 #endif
-  //len += 42;
-  /* We allocate a pbuf chain of pbufs from the pool. */
+
+  /* Otherwise, we allocate a pbuf chain of pbufs from the pool and copy. */
   p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
 
   if (p != NULL) {
@@ -314,23 +451,18 @@ low_level_input(struct netif *netif, nk_ethernet_packet_t *pk)
     /* We iterate over the pbuf chain until we have read the entire
      * packet into the pbuf. */
     for (q = p; q != NULL; q = q->next) {
-      /* Read enough bytes to fill this pbuf in the chain. The
-       * available data in the pbuf is given by the q->len
-       * variable.
-       * This does not necessarily have to be a memcpy, you can also preallocate
-       * pbufs for a DMA-enabled MAC and after receiving truncate it to the
-       * actually received size. In this case, ensure the tot_len member of the
-       * pbuf is the sum of the chained pbuf len members.
-       */
       //read data into(q->payload, q->len);
         memcpy(q->payload, pk->raw+now_index, q->len);
         now_index+=q->len;
     }
-      
-    
-    nk_net_ethernet_release_packet(pk);      
 
+#if ETH_PAD_SIZE
+    pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
+#endif
+
+    nk_net_ethernet_release_packet(pk);      
 
+  out_stats:
     MIB2_STATS_NETIF_ADD(netif, ifinoctets, p->tot_len);
     if (((u8_t*)p->payload)[0] & 1) {
       /* broadcast or multicast packet*/
@@ -339,13 +471,11 @@ low_level_input(struct netif *netif, nk_ethernet_packet_t *pk)
       /* unicast packet*/
       MIB2_STATS_NETIF_INC(netif, ifinucastpkts);
     }
-#if ETH_PAD_SIZE
-    pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
-#endif
 
     LINK_STATS_INC(link.recv);
   } else {
     //drop packet();
+    nk_net_ethernet_release_packet(pk);
     LINK_STATS_INC(link.memerr);
     LINK_STATS_INC(link.drop);
     MIB2_STATS_NETIF_INC(netif, ifindiscards);
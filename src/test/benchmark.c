@@ -46,11 +46,16 @@
 #include <nautilus/thread.h>
 #include <nautilus/condvar.h>
 #include <nautilus/spinlock.h>
+#include <nautilus/ticketlock.h>
+#include <nautilus/qspinlock.h>
 #include <nautilus/percpu.h>
 #include <nautilus/numa.h>
 #include <nautilus/nemo.h>
 #include <nautilus/pmc.h>
 #include <nautilus/shell.h>
+#include <nautilus/waitqueue.h>
+#include <nautilus/mm.h>
+#include <nautilus/msg_queue.h>
 
 #endif
 
@@ -387,6 +392,109 @@ void time_condvar (void) {
 
 }
 
+#ifndef __USER
+/*
+ * lock contention: 1, 2, 4, ... threads on different cores hammer one
+ * lock, for each of a test-and-set lock, a ticket lock, and a queued
+ * spinlock, and we report cycles per acquisition
+ */
+#define CONTEND_ACQUIRES 100000
+
+enum { CONTEND_TAS=0, CONTEND_TICKET, CONTEND_QSPIN, CONTEND_KINDS };
+static const char *contend_name[CONTEND_KINDS] = { "tas", "ticket", "qspin" };
+
+static struct {
+    volatile uint32_t tas;
+    nk_ticket_lock_t  ticket;
+    nk_qspinlock_t    qspin;
+    uint64_t          count;
+} contend_locks __attribute__((aligned(64)));
+
+static volatile int contend_kind;
+static volatile int contend_ready, contend_done, contend_go;
+
+static FUNC_TYPE
+thread_contend_func FUNC_HDR
+{
+	int i;
+
+	__sync_fetch_and_add(&contend_ready, 1);
+
+	while (!contend_go) { }
+
+	for (i = 0; i < CONTEND_ACQUIRES; i++) {
+		switch (contend_kind) {
+		case CONTEND_TAS:
+			while (__sync_lock_test_and_set(&contend_locks.tas, 1)) { }
+			contend_locks.count++;
+			__sync_lock_release(&contend_locks.tas);
+			break;
+		case CONTEND_TICKET:
+			nk_ticket_lock(&contend_locks.ticket);
+			contend_locks.count++;
+			nk_ticket_unlock(&contend_locks.ticket);
+			break;
+		case CONTEND_QSPIN:
+			nk_qspin_lock(&contend_locks.qspin);
+			contend_locks.count++;
+			nk_qspin_unlock(&contend_locks.qspin);
+			break;
+		}
+	}
+
+	__sync_fetch_and_add(&contend_done, 1);
+
+	RETURN;
+}
+
+void time_spinlock_contended (void);
+void time_spinlock_contended (void)
+{
+	THREAD_T t[NUM_THREADS];
+	int num_cpus = nk_get_num_cpus();
+	int self = my_cpu_id();
+	int kind, n, i;
+	uint64_t start, end;
+
+	// we spin timing the run, so the workers go on the other CPUs
+	if (num_cpus < 2) {
+		PRINT("contended spinlock timing needs at least 2 CPUs\n");
+		return;
+	}
+
+	for (kind = 0; kind < CONTEND_KINDS; kind++) {
+		for (n = 1; n < num_cpus && n <= NUM_THREADS; n *= 2) {
+
+			memset(&contend_locks, 0, sizeof(contend_locks));
+			contend_kind = kind;
+			contend_ready = 0;
+			contend_done = 0;
+			contend_go = 0;
+
+			for (i = 0; i < n; i++) {
+				nk_thread_start(thread_contend_func, NULL, NULL, 0, TSTACK_DEFAULT, &t[i], (self + 1 + i) % num_cpus);
+			}
+
+			while (contend_ready < n) { YIELD(); }
+
+			rdtscll(start);
+			contend_go = 1;
+			while (contend_done < n) { }
+			rdtscll(end);
+
+			PRINT("%-6s %2d threads: %llu cycles/acquire%s\n",
+			      contend_name[kind], n,
+			      (end - start) / ((uint64_t)n * CONTEND_ACQUIRES),
+			      contend_locks.count == (uint64_t)n * CONTEND_ACQUIRES ? "" : " (COUNT MISMATCH)");
+
+			for (i = 0; i < n; i++) {
+				JOIN_FUNC(t[i], NULL);
+			}
+		}
+	}
+}
+#endif
+
 void time_spinlock (void);
 void time_spinlock (void)
 {
@@ -498,6 +606,11 @@ void time_spinlock (void)
             avg,
             min,
             max);
+
+#ifndef __USER
+    PRINT("\nContended lock/unlock\n");
+    time_spinlock_contended();
+#endif
 }
 
 
@@ -787,6 +900,215 @@ time_ctx_switch (void)
 	}
 }
 
+#ifndef __USER
+/* 
+ * wakeup latency: two threads on the same core take turns waking
+ * each other through wait queues, so every round is a sleep, a
+ * wakeup, and a context switch.  The scheduler queues are intrusive,
+ * so none of this should involve the allocator, which we check by
+ * comparing kmem's free bytes across the timed region
+ */
+#define WAKEUP_ROUNDS 1000
+
+static nk_wait_queue_t * wakeup_wq[2];
+static volatile uint64_t wakeup_turn;
+
+static int
+wakeup_my_turn (void * state)
+{
+	return (wakeup_turn & 1) == (uint64_t)state;
+}
+
+static FUNC_TYPE
+thread_wakeup_func FUNC_HDR
+{
+	uint64_t id = (uint64_t)in;
+	int i;
+
+	ready[id] = 1;
+
+	while (!go) { YIELD(); }
+
+	for (i = 0; i < WAKEUP_ROUNDS; i++) {
+		nk_wait_queue_sleep_extended(wakeup_wq[id], wakeup_my_turn, (void*)id);
+		__sync_fetch_and_add(&wakeup_turn, 1);
+		nk_wait_queue_wake_one(wakeup_wq[!id]);
+	}
+
+	done[id] = 1;
+
+	RETURN;
+}
+
+static uint64_t
+kmem_bytes_free (void)
+{
+	struct kmem_stats s;
+
+	s.max_pools = 0;
+	kmem_stats(&s);
+
+	return s.total_bytes_free;
+}
+
+void time_wakeup(void);
+void
+time_wakeup (void)
+{
+	THREAD_T t[2];
+	uint64_t start, end, free_before, free_after;
+	int i;
+
+	// both threads go on CPU 1 and we spin on CPU 0 timing them
+	if (nk_get_num_cpus() < 2) {
+		PRINT("wakeup timing needs at least 2 CPUs\n");
+		return;
+	}
+
+	wakeup_wq[0] = nk_wait_queue_create("bench-wakeup-0");
+	wakeup_wq[1] = nk_wait_queue_create("bench-wakeup-1");
+
+	if (!wakeup_wq[0] || !wakeup_wq[1]) {
+		PRINT("Failed to allocate wait queues\n");
+		goto out;
+	}
+
+	for (i = 0; i < CTX_SWITCH_TRIALS; i++) {
+
+		wakeup_turn = 0;
+
+		nk_thread_start(thread_wakeup_func, (void*)0, NULL, 0, TSTACK_DEFAULT, &t[0], 1);
+		nk_thread_start(thread_wakeup_func, (void*)1, NULL, 0, TSTACK_DEFAULT, &t[1], 1);
+
+		while ( !(ready[0] && ready[1]) );
+
+		free_before = kmem_bytes_free();
+
+		go = 1;
+
+		rdtscll(start);
+		while ( !(done[0] && done[1]) );
+		rdtscll(end);
+
+		free_after = kmem_bytes_free();
+
+		PRINT("TRIAL %u %llu cycles/wakeup (kmem free delta %lld bytes)\n", i, 
+		      (end-start)/(WAKEUP_ROUNDS*2), (long long)(free_after - free_before));
+
+		JOIN_FUNC(t[0], NULL);
+		JOIN_FUNC(t[1], NULL);
+
+		done[0] = 0;
+		done[1] = 0;
+		ready[0] = 0;
+		ready[1] = 0;
+		go = 0;
+	}
+
+ out:
+	if (wakeup_wq[0]) { 
+		nk_wait_queue_destroy(wakeup_wq[0]);
+	}
+	if (wakeup_wq[1]) { 
+		nk_wait_queue_destroy(wakeup_wq[1]);
+	}
+}
+
+/*
+ * message queue throughput: a producer and a consumer on different
+ * cores stream MQ_MSGS messages through a message queue, first one
+ * at a time and then in batches of MQ_BATCH
+ */
+#define MQ_MSGS  100000
+#define MQ_SIZE  256
+#define MQ_BATCH 16
+
+static struct nk_msg_queue * mq;
+static volatile uint64_t mq_batch;
+
+static FUNC_TYPE
+thread_mq_func FUNC_HDR
+{
+	uint64_t id = (uint64_t)in;
+	void *msgs[MQ_BATCH];
+	uint64_t i, j, n = mq_batch;
+
+	for (j = 0; j < n; j++) {
+		msgs[j] = (void*)j;
+	}
+
+	ready[id] = 1;
+
+	while (!go) { YIELD(); }
+
+	for (i = 0; i < MQ_MSGS; i += n) {
+		if (n == 1) {
+			if (id) {
+				nk_msg_queue_pull(mq, msgs);
+			} else {
+				nk_msg_queue_push(mq, msgs[0]);
+			}
+		} else {
+			if (id) {
+				nk_msg_queue_pull_n(mq, msgs, n);
+			} else {
+				nk_msg_queue_push_n(mq, msgs, n);
+			}
+		}
+	}
+
+	done[id] = 1;
+
+	RETURN;
+}
+
+void time_msg_queue(void);
+void
+time_msg_queue (void)
+{
+	THREAD_T t[2];
+	uint64_t start, end;
+	int cons_cpu = nk_get_num_cpus() > 2 ? 2 : 1;
+	int i;
+
+	mq = nk_msg_queue_create("bench-mq", MQ_SIZE, NK_MSG_QUEUE_DEFAULT, 0);
+
+	if (!mq) {
+		PRINT("Failed to allocate message queue\n");
+		return;
+	}
+
+	for (i = 0; i < 2; i++) {
+
+		mq_batch = i ? MQ_BATCH : 1;
+
+		nk_thread_start(thread_mq_func, (void*)0, NULL, 0, TSTACK_DEFAULT, &t[0], 1);
+		nk_thread_start(thread_mq_func, (void*)1, NULL, 0, TSTACK_DEFAULT, &t[1], cons_cpu);
+
+		while ( !(ready[0] && ready[1]) );
+
+		go = 1;
+
+		rdtscll(start);
+		while ( !(done[0] && done[1]) );
+		rdtscll(end);
+
+		PRINT("BATCH %lu %llu cycles/msg\n", mq_batch, (end-start)/MQ_MSGS);
+
+		JOIN_FUNC(t[0], NULL);
+		JOIN_FUNC(t[1], NULL);
+
+		done[0] = 0;
+		done[1] = 0;
+		ready[0] = 0;
+		ready[1] = 0;
+		go = 0;
+	}
+
+	nk_msg_queue_release(mq);
+}
+#endif
+
 void time_ipi_send (void);
 void
 time_ipi_send(void)
@@ -1143,16 +1465,42 @@ int main () {
     return 0;
 }
 
+#else
+
 static int
 handle_bench (char * buf, void * priv)
 {
+    char what[32];
+
+    if (sscanf(buf, "bench %31s", what) == 1 && !strcmp(what, "sched")) {
+        PRINT("Thread run latency\n");
+        time_thread_run();
+        PRINT("Context switch latency\n");
+        time_ctx_switch();
+        PRINT("Wakeup latency\n");
+        time_wakeup();
+        return 0;
+    }
+
+    if (sscanf(buf, "bench %31s", what) == 1 && !strcmp(what, "lock")) {
+        PRINT("Spinlock latency\n");
+        time_spinlock();
+        return 0;
+    }
+
+    if (sscanf(buf, "bench %31s", what) == 1 && !strcmp(what, "mq")) {
+        PRINT("Message queue throughput\n");
+        time_msg_queue();
+        return 0;
+    }
+
     run_benchmarks();
     return 0;
 }
 
 static struct shell_cmd_impl bench_impl = {
     .cmd      = "bench",
-    .help_str = "bench",
+    .help_str = "bench [sched|lock|mq]",
     .handler  = handle_bench,
 };
 nk_register_shell_cmd(bench_impl);